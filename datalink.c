@@ -6,9 +6,12 @@
 
 #include "postgres.h"
 #include "fmgr.h"
+#include "miscadmin.h"
 #include "libpq/pqformat.h"
 #include "string.h"
+#include <ctype.h>
 #include "catalog/pg_type.h"
+#include "utils/array.h"
 #include "utils/builtins.h"
 #include "storage/fd.h"
 #include "utils/memutils.h"
@@ -18,11 +21,43 @@
 #include "utils/snapmgr.h"
 #include "utils/varlena.h"
 #include "utils/guc.h"
+#include "utils/uuid.h"
+#if PG_VERSION_NUM >= 140000
+#include "common/hmac.h"
+#endif
+#include "common/sha2.h"
+#include "lib/stringinfo.h"
 
 #include "datalink.h"
 
-static bytea * read_binary_file(const char *filename, int64 seek_offset,
-		int64 bytes_to_read, bool missing_ok);
+static bool token_xact_in_progress(TransactionId txid);
+static void write_token_file(const char *token_str, const char *type_str,
+				const char *dlpath, TransactionId topxid,
+				char *out_fnamebuf, size_t size);
+static char *verify_token(const char *token_str, bool haswrite,
+				const char *path);
+static char *get_token_secret(void);
+static int get_token_expiry(void);
+static void compute_token_mac(const unsigned char *token, const char *path,
+		const char *secret, unsigned char *mac);
+static bool is_signed_token(const unsigned char *token);
+static bool is_signed_token_str(const char *token_str);
+static char *verify_signed_token(const unsigned char *token,
+		const char *token_str, bool haswrite, const char *path,
+		const char *secret);
+static char *add_token_to_path(const char *path, const char *token_str);
+static bool use_hashed_layout(void);
+static void token_file_path(char *buf, size_t size, const char *token_dir,
+		const char *token_str, bool hashed);
+static void make_fanout_dirs(const char *path);
+static bool is_token_name(const char *name, bool tokendir);
+static char *canonical_token_path(const char *dir, const char *name,
+		bool tokendir, bool hashed);
+static void strip_fanout_dir(char *dir);
+static void remove_empty_fanout_dirs(const char *fandir, bool remove_root);
+static List *list_fanout_dirs(const char *dir);
+static void collect_directory_entries(const char *dir, List **files,
+		List **links);
  
 PG_MODULE_MAGIC;
 
@@ -40,25 +75,124 @@ Datum		datalink_register_token(PG_FUNCTION_ARGS);
 Datum		datalink_verify_token(PG_FUNCTION_ARGS);
 Datum		datalink_is_symlink(PG_FUNCTION_ARGS);
 Datum		datalink_symlink_target(PG_FUNCTION_ARGS);
+Datum		datalink_generate_token(PG_FUNCTION_ARGS);
+Datum		datalink_add_token(PG_FUNCTION_ARGS);
+Datum		datalink_migrate_layout(PG_FUNCTION_ARGS);
+Datum		datalink_token_files(PG_FUNCTION_ARGS);
+Datum		datalink_add_xact_link(PG_FUNCTION_ARGS);
+Datum		datalink_verify_xact_link(PG_FUNCTION_ARGS);
 
 
+/*
+ * Open a new file that replaces path once written, see
+ * datalink_install_replacement(). The name of the temporary file, in the
+ * same directory, is returned into tmppath. When fd_like is an open file,
+ * the file being replaced in general, the new file gets its mode and owner.
+ */
+int
+datalink_open_replacement(const char *path, int fd_like, char *tmppath,
+						  size_t size)
+{
+	mode_t  oumask;
+	int     fd;
+	struct stat st;
+
+	if (snprintf(tmppath, size, "%s.%d", path, MyProcPid) >= size)
+		ereport(ERROR,
+				(errcode(ERRCODE_NAME_TOO_LONG),
+				 errmsg("path \"%s\" is too long", path)));
+
+	if (fd_like >= 0 && fstat(fd_like, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+
+	oumask = umask(S_IWGRP | S_IWOTH);
+	fd = OpenTransientFilePerm(tmppath, O_CREAT | O_TRUNC | O_WRONLY | PG_BINARY,
+						S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+	umask(oumask);
+	if (fd < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create server file \"%s\": %m", tmppath)));
+
+	if (fd_like >= 0)
+	{
+		/* Do not leave the temporary file if the mode can not be kept */
+		if (fchmod(fd, st.st_mode & 07777) < 0 ||
+			((st.st_uid != geteuid() || st.st_gid != getegid()) &&
+			 fchown(fd, st.st_uid, st.st_gid) < 0))
+		{
+			int     save_errno = errno;
+
+			CloseTransientFile(fd);
+			unlink(tmppath);
+			errno = save_errno;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not keep the mode and owner of file \"%s\": %m",
+							path)));
+		}
+	}
+
+	return fd;
+}
+
+/*
+ * Close the file written by datalink_open_replacement() and rename it over
+ * path. An external file is never modified in place, a new content is a new
+ * file, so the hard links of dl_snapshot_create() keep the content of the
+ * file at the time of the snapshot and a reader never sees a partial file.
+ */
+void
+datalink_install_replacement(int fd, const char *tmppath, const char *path)
+{
+	if (CloseTransientFile(fd))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", tmppath)));
+	if (rename(tmppath, path) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not rename file \"%s\" to \"%s\": %m",
+						tmppath, path)));
+	datalink_fdcache_forget(path);
+}
+
 PG_FUNCTION_INFO_V1(datalink_copy_localfile);
 Datum
 datalink_copy_localfile(PG_FUNCTION_ARGS)
 {
 	text    *src = PG_GETARG_TEXT_PP(0);
 	text    *dst = PG_GETARG_TEXT_PP(1);
-	int     fd_in, fd_out;
+	int     fd_in, fd_out, fd_old;
 	int     inbytes, outbytes;
-	long    total_bytes;
+	long    total_bytes = 0;
 	char    buf[BUFFER_SIZE];
 	char    in_fnamebuf[MAXPGPATH];
 	char    out_fnamebuf[MAXPGPATH];
-	mode_t  oumask;
+	char    tmp_fnamebuf[MAXPGPATH];
 	struct flock flin;
 	struct flock flout;
+	int     fds[2];
+	const char *paths[2];
+	bool    exclusive[2] = {false, true};
+	int     rbase, wbase;
+	int64   size;
 
 	text_to_cstring_buffer(src, in_fnamebuf, sizeof(in_fnamebuf));
+	text_to_cstring_buffer(dst, out_fnamebuf, sizeof(out_fnamebuf));
+
+	/* The copy must fit in the quotas of the base directory */
+	size = datalink_usage_size(in_fnamebuf);
+	datalink_usage_check(out_fnamebuf, size, 1);
+
+	/* Charge the opening of the files before taking any lock */
+	rbase = datalink_throttle_base(in_fnamebuf);
+	wbase = datalink_throttle_base(out_fnamebuf);
+	datalink_throttle(rbase, 0, 1);
+	datalink_throttle(wbase, 0, 1);
+
 	fd_in = OpenTransientFile(in_fnamebuf, O_RDONLY | PG_BINARY);
 	if (fd_in < 0) {
 		ereport(ERROR,
@@ -67,6 +201,23 @@ datalink_copy_localfile(PG_FUNCTION_ARGS)
 						in_fnamebuf)));
 	}
 
+	/* An existing output file is only locked, it is replaced by a new one */
+	make_fanout_dirs(out_fnamebuf);
+	fd_old = OpenTransientFile(out_fnamebuf, O_WRONLY | PG_BINARY);
+	if (fd_old < 0 && errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open server file \"%s\": %m",
+						out_fnamebuf)));
+
+	/* Wait for the locks of concurrent backends */
+	fds[0] = fd_in;
+	fds[1] = fd_old;
+	paths[0] = in_fnamebuf;
+	paths[1] = out_fnamebuf;
+	datalink_lock_files((fd_old >= 0) ? 2 : 1, fds, paths, exclusive);
+	datalink_objcache_invalidate(out_fnamebuf);
+
 	/* Lock file for share or return false if it can't e acquired */
 	flin.l_type = F_RDLCK;
 	flin.l_whence = SEEK_SET;
@@ -77,21 +228,12 @@ datalink_copy_localfile(PG_FUNCTION_ARGS)
 		ereport(WARNING,
 				(errcode_for_file_access(),
 				 errmsg("can not lock file for reading \"%s\": %m",
-						in_fnamebuf)));
-		PG_RETURN_BOOL(false);
-	}
-
-	/* Open the new output file */
-	text_to_cstring_buffer(dst, out_fnamebuf, sizeof(out_fnamebuf));
-	oumask = umask(S_IWGRP | S_IWOTH);
-	fd_out = OpenTransientFilePerm(out_fnamebuf, O_CREAT | O_WRONLY | O_TRUNC | PG_BINARY,
-						S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-	umask(oumask);
-	if (fd_out < 0) {
-		ereport(ERROR,
-				(errcode_for_file_access(),
-				 errmsg("could not create server file \"%s\": %m",
-						out_fnamebuf)));
+						in_fnamebuf),
+				 datalink_lock_hint()));
+		CloseTransientFile(fd_in);
+		if (fd_old >= 0)
+			CloseTransientFile(fd_old);
+		datalink_unlock_files();
 		PG_RETURN_BOOL(false);
 	}
 
@@ -100,47 +242,71 @@ datalink_copy_localfile(PG_FUNCTION_ARGS)
 	flout.l_whence = SEEK_SET;
 	flout.l_start = 0;
 	flout.l_len = 0;
-	if (fcntl(fd_out, F_SETLK, &flout) == -1)
+	if (fd_old >= 0 && fcntl(fd_old, F_SETLK, &flout) == -1)
 	{
 		ereport(WARNING,
 				(errcode_for_file_access(),
 				 errmsg("can not lock file for writing \"%s\": %m",
-						out_fnamebuf)));
+						out_fnamebuf),
+				 datalink_lock_hint()));
+		CloseTransientFile(fd_in);
+		CloseTransientFile(fd_old);
+		datalink_unlock_files();
 		PG_RETURN_BOOL(false);
 	}
 
-        while ((inbytes = read(fd_in, buf, BUFFER_SIZE)) > 0)
-        {
-                outbytes = write(fd_out, buf, inbytes);
-		if (outbytes < 0) {
+	/* Stop now if this is a copy worker whose copy has been canceled */
+	datalink_copy_progress(0);
+
+	fd_out = datalink_open_replacement(out_fnamebuf, fd_old, tmp_fnamebuf,
+									   sizeof(tmp_fnamebuf));
+	PG_TRY();
+	{
+		while ((inbytes = read(fd_in, buf, BUFFER_SIZE)) > 0)
+		{
+			datalink_throttle(rbase, inbytes, 0);
+			datalink_throttle(wbase, inbytes, 0);
+			outbytes = write(fd_out, buf, inbytes);
+			if (outbytes < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not write server file \"%s\": %m",
+								tmp_fnamebuf)));
+
+			total_bytes += inbytes;
+			datalink_copy_progress(inbytes);
+		}
+
+		/* Check that we have read something */
+		if (inbytes < 0)
 			ereport(ERROR,
 					(errcode_for_file_access(),
-					 errmsg("could not write server file \"%s\": %m",
-							out_fnamebuf)));
-			PG_RETURN_BOOL(false);
-		}
+					 errmsg("could not read server file \"%s\": %m",
+							in_fnamebuf)));
 
-		total_bytes += inbytes;
-        }
+		datalink_install_replacement(fd_out, tmp_fnamebuf, out_fnamebuf);
+	}
+	PG_CATCH();
+	{
+		/* Never leave a partial copy */
+		unlink(tmp_fnamebuf);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
 
 	/* Close the files and release the locks */
 	if (CloseTransientFile(fd_in))
 		 ereport(ERROR,
 				 (errcode_for_file_access(),
 				  errmsg("could not close file \"%s\": %m", in_fnamebuf)));
-	if (CloseTransientFile(fd_out))
+	if (fd_old >= 0 && CloseTransientFile(fd_old))
 		 ereport(ERROR,
 				 (errcode_for_file_access(),
 				  errmsg("could not close file \"%s\": %m", out_fnamebuf)));
+	datalink_unlock_files();
 
-	/* Check that we have read something */
-        if (inbytes < 0) {
-                ereport(ERROR,
-                                (errcode_for_file_access(),
-                                 errmsg("could not read server file \"%s\": %m",
-                                                in_fnamebuf)));
-		PG_RETURN_BOOL(false);
-	}
+	datalink_track_sync(out_fnamebuf, true);
+	datalink_usage_add(out_fnamebuf, DL_USAGE_PENDING, total_bytes, 1);
 
 	PG_RETURN_BOOL(true);
 }
@@ -151,8 +317,12 @@ datalink_unlink_localfile(PG_FUNCTION_ARGS)
 {
 	text    *filename = PG_GETARG_TEXT_PP(0);
 	char    in_fnamebuf[MAXPGPATH];
+	int64   size;
 
 	text_to_cstring_buffer(filename, in_fnamebuf, sizeof(in_fnamebuf));
+	datalink_objcache_invalidate(in_fnamebuf);
+	datalink_fdcache_forget(in_fnamebuf);
+	size = datalink_usage_size(in_fnamebuf);
         if (unlink(in_fnamebuf) < 0)
         {
                 ereport(WARNING,
@@ -161,6 +331,8 @@ datalink_unlink_localfile(PG_FUNCTION_ARGS)
 
                 PG_RETURN_BOOL(false);
         }
+	datalink_track_sync(in_fnamebuf, false);
+	datalink_usage_unlinked(in_fnamebuf, size);
 
         PG_RETURN_BOOL(true);
 }
@@ -180,35 +352,48 @@ datalink_read_localfile(PG_FUNCTION_ARGS)
 
 	if (bytes_to_read < 0)
 	{
-		/* Read full file content, get file size */
+		/* Read full file content, get file size, symlinks are followed */
 		struct stat    statbuf;
-		char          *dstpath;
 
-		dstpath = realpath(in_fnamebuf, NULL);
-		if (dstpath == NULL)
+		if (stat(in_fnamebuf, &statbuf) < 0)
 		{
 			if (errno != ENOENT)
 				ereport(ERROR, (
-					errmsg("could not get real path of file \"%s\": %s",
+					errmsg("could not stat file \"%s\": %s",
 							in_fnamebuf, strerror(errno))));
 			PG_RETURN_NULL();
 		}
-		if (stat(dstpath, &statbuf) < 0)
+
+		/* Small files are served from the shared memory cache */
+		if (seek_offset == 0 && datalink_objcache_enabled(statbuf.st_size))
 		{
-			free(dstpath);
-			if (errno != ENOENT)
-				ereport(ERROR, (
-					errmsg("could not stat file \"%s\": %s",
-							in_fnamebuf, strerror(errno))));
-			PG_RETURN_NULL();
+			result = datalink_objcache_lookup(&statbuf);
+			if (result == NULL)
+			{
+				struct stat readbuf;
+
+				result = read_binary_file(in_fnamebuf, 0, statbuf.st_size,
+										missing_ok, &readbuf);
+				/*
+				 * The file may have been replaced or modified since the
+				 * stat, the content is only cached with the stat of the
+				 * descriptor read when it has not changed meanwhile.
+				 */
+				if (result != NULL && readbuf.st_dev == statbuf.st_dev &&
+					readbuf.st_ino == statbuf.st_ino &&
+					readbuf.st_size == statbuf.st_size &&
+					readbuf.st_mtim.tv_sec == statbuf.st_mtim.tv_sec &&
+					readbuf.st_mtim.tv_nsec == statbuf.st_mtim.tv_nsec)
+					datalink_objcache_store(&readbuf, result);
+			}
+			PG_RETURN_BYTEA_P(result);
 		}
 
 		bytes_to_read = statbuf.st_size;
-		free(dstpath);
 	}
 
 	result = read_binary_file(in_fnamebuf, seek_offset,
-						bytes_to_read, missing_ok);
+						bytes_to_read, missing_ok, NULL);
 	if (result)
 		PG_RETURN_BYTEA_P(result);
 	else
@@ -221,66 +406,107 @@ datalink_write_localfile(PG_FUNCTION_ARGS)
 {
 	text       *filename = PG_GETARG_TEXT_PP(0);
 	bytea      *wbuf = PG_GETARG_BYTEA_PP(1);
-        int        fd;
-        char       in_fnamebuf[MAXPGPATH];
-        mode_t     oumask;
-        int64      totalwritten;
-        struct flock fl;
-
+	int        fd, fd_old;
+	char       in_fnamebuf[MAXPGPATH];
+	char       tmp_fnamebuf[MAXPGPATH];
+	int64      totalwritten;
+	struct flock fl;
+	const char *lockpath = in_fnamebuf;
+	bool       exclusive = true;
+	int        base;
+	char       *data = VARDATA_ANY(wbuf);
+	int64      len = VARSIZE_ANY_EXHDR(wbuf);
+	int64      oldsize;
 
 	text_to_cstring_buffer(filename, in_fnamebuf, sizeof(in_fnamebuf));
-	oumask = umask(S_IWGRP | S_IWOTH);
-	fd = OpenTransientFile(in_fnamebuf, O_CREAT | O_WRONLY | O_TRUNC | PG_BINARY);
-	umask(oumask);
-	if (fd < 0) {
+
+	/* The new content replaces the old one in the quotas */
+	oldsize = datalink_usage_size(in_fnamebuf);
+	datalink_usage_check(in_fnamebuf, len - Max(oldsize, 0), (oldsize < 0) ? 1 : 0);
+
+	base = datalink_throttle_base(in_fnamebuf);
+	datalink_throttle(base, 0, 1);
+
+	/* An existing file is only locked, the new content is a new file */
+	fd_old = OpenTransientFile(in_fnamebuf, O_WRONLY | PG_BINARY);
+	if (fd_old < 0 && errno != ENOENT)
 		ereport(ERROR,
 				(errcode_for_file_access(),
-				 errmsg("could not create server file \"%s\": %m",
+				 errmsg("could not open server file \"%s\": %m",
 						in_fnamebuf)));
-                PG_RETURN_BOOL(false);
-        }
-	/* Exclusive lock file for writing or return false if it can't e acquired */
-	fl.l_type = F_WRLCK;
-	fl.l_whence = SEEK_SET;
-	fl.l_start = 0;
-	fl.l_len = 0;
-	if (fcntl(fd, F_SETLK, &fl) == -1)
+	if (fd_old >= 0)
 	{
-		ereport(WARNING,
-				(errcode_for_file_access(),
-				 errmsg("can not lock file for reading \"%s\": %m",
-						in_fnamebuf)));
-		PG_RETURN_BOOL(false);
+		/* Wait for the locks of concurrent backends */
+		datalink_lock_files(1, &fd_old, &lockpath, &exclusive);
+
+		/* Exclusive lock file for writing or return false if it can't e acquired */
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = 0;
+		fl.l_len = 0;
+		if (fcntl(fd_old, F_SETLK, &fl) == -1)
+		{
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("can not lock file for writing \"%s\": %m",
+							in_fnamebuf),
+					 datalink_lock_hint()));
+			CloseTransientFile(fd_old);
+			datalink_unlock_files();
+			PG_RETURN_BOOL(false);
+		}
 	}
+	datalink_objcache_invalidate(in_fnamebuf);
 
 	/*
-	 * write to the filesystem
+	 * write to the filesystem, by chunks charged against the I/O limits
 	 */
-	totalwritten = write(fd, VARDATA_ANY(wbuf), VARSIZE_ANY_EXHDR(wbuf));
-	if (totalwritten < 0) {
-		ereport(ERROR,
-				(errcode_for_file_access(),
-				 errmsg("could not write server file \"%s\": %m",
-						in_fnamebuf)));
-                PG_RETURN_BOOL(false);
-	} else if (totalwritten != VARSIZE_ANY_EXHDR(wbuf)) {
+	fd = datalink_open_replacement(in_fnamebuf, fd_old, tmp_fnamebuf,
+								   sizeof(tmp_fnamebuf));
+	PG_TRY();
+	{
+		totalwritten = 0;
+		while (totalwritten < len)
+		{
+			int64   chunk = Min(len - totalwritten, DATALINK_THROTTLE_CHUNK_SIZE);
+			ssize_t nwritten;
+
+			datalink_throttle(base, chunk, 0);
+			nwritten = write(fd, data + totalwritten, chunk);
+			if (nwritten < 0) {
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not write server file \"%s\": %m",
+								tmp_fnamebuf)));
+			} else if (nwritten == 0) {
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("error when writting to server file \"%s\": %m",
+								tmp_fnamebuf)));
+			}
+			totalwritten += nwritten;
+		}
+		datalink_install_replacement(fd, tmp_fnamebuf, in_fnamebuf);
+	}
+	PG_CATCH();
+	{
+		unlink(tmp_fnamebuf);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (fd_old >= 0 && CloseTransientFile(fd_old))
 		ereport(ERROR,
 				(errcode_for_file_access(),
-				 errmsg("error when writting to server file \"%s\": %m",
-						in_fnamebuf)));
-                PG_RETURN_BOOL(false);
-        }
-	if (pg_fsync(fd) != 0)
-		ereport(data_sync_elevel(ERROR),
-				(errcode_for_file_access(),
-				 errmsg("could not fsync file \"%s\": %m", in_fnamebuf)));
+				 errmsg("could not close file \"%s\": %m", in_fnamebuf)));
+	datalink_unlock_files();
 
-	if (CloseTransientFile(fd))
-		 ereport(ERROR,
-				 (errcode_for_file_access(),
-				  errmsg("could not close file \"%s\": %m", in_fnamebuf)));
+	/* The file is flushed with the others at commit */
+	datalink_track_sync(in_fnamebuf, true);
+	datalink_usage_add(in_fnamebuf, DL_USAGE_PENDING, len - Max(oldsize, 0),
+					   (oldsize < 0) ? 1 : 0);
 
-        PG_RETURN_BOOL(true);
+	PG_RETURN_BOOL(true);
 }
 
 PG_FUNCTION_INFO_V1(datalink_rename_localfile);
@@ -291,9 +517,17 @@ datalink_rename_localfile(PG_FUNCTION_ARGS)
 	text    *dst = PG_GETARG_TEXT_PP(1);
 	char    in_fnamebuf[MAXPGPATH];
 	char    out_fnamebuf[MAXPGPATH];
+	int64   size;
+	int64   replaced;
 
 	text_to_cstring_buffer(src, in_fnamebuf, sizeof(in_fnamebuf));
 	text_to_cstring_buffer(dst, out_fnamebuf, sizeof(out_fnamebuf));
+	make_fanout_dirs(out_fnamebuf);
+	datalink_objcache_invalidate(out_fnamebuf);
+	datalink_fdcache_forget(in_fnamebuf);
+	datalink_fdcache_forget(out_fnamebuf);
+	size = datalink_usage_size(in_fnamebuf);
+	replaced = datalink_usage_size(out_fnamebuf);
 
 	if (rename(in_fnamebuf, out_fnamebuf) < 0) {
 		ereport(LOG,
@@ -302,6 +536,8 @@ datalink_rename_localfile(PG_FUNCTION_ARGS)
 						in_fnamebuf, out_fnamebuf)));
 		PG_RETURN_BOOL(false);
 	}
+	datalink_track_rename(in_fnamebuf, out_fnamebuf);
+	datalink_usage_renamed(in_fnamebuf, out_fnamebuf, size, replaced);
 
 	PG_RETURN_INT32(true);
 }
@@ -318,6 +554,7 @@ datalink_createlink_localfile(PG_FUNCTION_ARGS)
 
 	text_to_cstring_buffer(src, in_fnamebuf, sizeof(in_fnamebuf));
 	text_to_cstring_buffer(dst, out_fnamebuf, sizeof(out_fnamebuf));
+	make_fanout_dirs(in_fnamebuf);
 
 	/* Create a symlink to the new file using origin filename */
 	if (symlink(out_fnamebuf, in_fnamebuf) == -1)
@@ -325,6 +562,7 @@ datalink_createlink_localfile(PG_FUNCTION_ARGS)
 				(errcode_for_file_access(),
 				  errmsg("could not symlink \"%s\" to renamed file \"%s\": %m",
 						in_fnamebuf, out_fnamebuf)));
+	datalink_track_sync(in_fnamebuf, false);
 
 	PG_RETURN_INT32(true);
 }
@@ -355,47 +593,111 @@ datalink_relink_localfile(PG_FUNCTION_ARGS)
 				(errcode_for_file_access(),
 				  errmsg("could not symlink \"%s\" to renamed file \"%s\": %m",
 						src_fnamebuf, dst_fnamebuf)));
+	datalink_track_sync(src_fnamebuf, false);
 
 	PG_RETURN_INT32(true);
 }
 
+/* Function used to test if a file is a symlink */
+PG_FUNCTION_INFO_V1(datalink_is_symlink);
+Datum
+datalink_is_symlink(PG_FUNCTION_ARGS)
+{
+	text    *src = PG_GETARG_TEXT_PP(0);
+	char    src_fnamebuf[MAXPGPATH];
+	struct stat buf;
+
+	text_to_cstring_buffer(src, src_fnamebuf, sizeof(src_fnamebuf));
+
+	if (lstat(src_fnamebuf, &buf) < 0)
+	{
+		if (errno != ENOENT)
+			ereport(ERROR, (
+				errmsg("could not stat file \"%s\": %s",
+						src_fnamebuf, strerror(errno))));
+		PG_RETURN_INT32(false);
+	}
+
+	if (S_ISLNK(buf.st_mode))
+		PG_RETURN_INT32(true);
+
+	PG_RETURN_INT32(false);
+}
+
+/* Return the target file path of a symlink */
+PG_FUNCTION_INFO_V1(datalink_symlink_target);
+Datum
+datalink_symlink_target(PG_FUNCTION_ARGS)
+{
+	text    *src = PG_GETARG_TEXT_PP(0);
+	char    src_fnamebuf[MAXPGPATH];
+	char    target[MAXPGPATH];
+	struct stat buf;
+
+	text_to_cstring_buffer(src, src_fnamebuf, sizeof(src_fnamebuf));
+
+	if (lstat(src_fnamebuf, &buf) < 0)
+	{
+		if (errno != ENOENT)
+			ereport(ERROR, (
+				errmsg("could not stat file \"%s\": %s",
+						src_fnamebuf, strerror(errno))));
+		PG_RETURN_NULL();
+	}
+
+	/* Get target file path */
+	if (S_ISLNK(buf.st_mode))
+	{
+		ssize_t len;
+		len = readlink(src_fnamebuf, target, sizeof(target)-1);
+		if (len == -1)
+			ereport(ERROR, (
+				errmsg("could not get target file path for \"%s\": %s",
+						src_fnamebuf, strerror(errno))));
+		target[len] = '\0';
+		PG_RETURN_TEXT_P(cstring_to_text(target));
+	}
+
+	PG_RETURN_NULL();
+}
+
 /*
  * Read a section of a file, returning it as bytea
  * Caller is responsible for all permissions checking.
  * We read the whole of the file when bytes_to_read is negative.
+ * When st is not NULL it receives the stat of the descriptor read, taken
+ * once the content has been read.
  * Taken from src/backend/utils/adt/genfile.c and redefined here
  * to be used with non superuser roles.
  */
-static bytea *
+bytea *
 read_binary_file(const char *filename, int64 seek_offset, int64 bytes_to_read,
-                                 bool missing_ok)
+                                 bool missing_ok, struct stat *st)
 {
 	bytea       *buf;
 	size_t       nbytes;
-	FILE        *file;
 	int          fd;
+	struct stat  fst;
         struct flock fl;
+	bool         exclusive = false;
+	int          base;
+	off_t        offset;
+
+	/*
+	 * The file stays open for the next reads of the transaction, the stat
+	 * returned is the one of the file opened.
+	 */
+	base = datalink_throttle_base(filename);
+	fd = datalink_fdcache_open(filename, &fst, missing_ok, base);
+	if (fd < 0)
+		return NULL;
 
 	if (bytes_to_read < 0)
 	{
 		if (seek_offset < 0)
 			bytes_to_read = -seek_offset;
 		else
-		{
-			struct stat fst;
-
-			if (stat(filename, &fst) < 0)
-			{
-				if (missing_ok && errno == ENOENT)
-					return NULL;
-				else
-					ereport(ERROR,
-							(errcode_for_file_access(),
-							 errmsg("could not stat file \"%s\": %m", filename)));
-			}
-
 			bytes_to_read = fst.st_size - seek_offset;
-		}
 	}
 
 	/* not sure why anyone thought that int64 length was a good idea */
@@ -404,17 +706,7 @@ read_binary_file(const char *filename, int64 seek_offset, int64 bytes_to_read,
 				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
 				 errmsg("requested length too large")));
 
-	if ((file = AllocateFile(filename, PG_BINARY_R)) == NULL)
-	{
-		if (missing_ok && errno == ENOENT)
-			return NULL;
-		else
-			ereport(ERROR,
-					(errcode_for_file_access(),
-					 errmsg("could not open file \"%s\" for reading: %m",
-							filename)));
-	}
-	fd = fileno(file);
+	datalink_lock_files(1, &fd, &filename, &exclusive);
 	/* Lock file for share or return false if it can't e acquired */
 	fl.l_type = F_RDLCK;
 	fl.l_whence = SEEK_SET;
@@ -425,27 +717,52 @@ read_binary_file(const char *filename, int64 seek_offset, int64 bytes_to_read,
 		ereport(ERROR,
 				(errcode_for_file_access(),
 				 errmsg("can not lock file for reading \"%s\": %m",
-						filename)));
+						filename),
+				 datalink_lock_hint()));
 	}
 
-	if (fseeko(file, (off_t) seek_offset,
-			   (seek_offset >= 0) ? SEEK_SET : SEEK_END) != 0)
+	/* A negative offset is relative to the end of the file */
+	offset = (seek_offset >= 0) ? (off_t) seek_offset : fst.st_size + seek_offset;
+	if (offset < 0)
+	{
+		errno = EINVAL;
 		ereport(ERROR,
 				(errcode_for_file_access(),
 				 errmsg("could not seek in file \"%s\": %m", filename)));
+	}
 
 	buf = (bytea *) palloc((Size) bytes_to_read + VARHDRSZ);
 
-	nbytes = fread(VARDATA(buf), 1, (size_t) bytes_to_read, file);
+	/* Read by chunks charged against the I/O limits */
+	nbytes = 0;
+	while (nbytes < (size_t) bytes_to_read)
+	{
+		size_t  chunk = Min((size_t) bytes_to_read - nbytes, DATALINK_THROTTLE_CHUNK_SIZE);
+		ssize_t nread;
 
-	if (ferror(file))
-		ereport(ERROR,
-				(errcode_for_file_access(),
-				 errmsg("could not read file \"%s\": %m", filename)));
+		datalink_throttle(base, chunk, 0);
+		nread = pread(fd, VARDATA(buf) + nbytes, chunk, offset + nbytes);
+		if (nread < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not read file \"%s\": %m", filename)));
+		nbytes += nread;
+		if ((size_t) nread < chunk)
+			break;
+	}
 
 	SET_VARSIZE(buf, nbytes + VARHDRSZ);
 
-	FreeFile(file);
+	if (st != NULL && fstat(fd, st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", filename)));
+
+	/* The file may stay open, its fcntl() lock is released now */
+	fl.l_type = F_UNLCK;
+	(void) fcntl(fd, F_SETLK, &fl);
+	datalink_fdcache_release(fd, filename);
+	datalink_unlock_files();
 
 	return buf;
 }
@@ -458,14 +775,10 @@ datalink_register_token(PG_FUNCTION_ARGS)
 	text    *type = PG_GETARG_TEXT_PP(1);
 	text    *path = PG_GETARG_TEXT_PP(2);
 	char    *token_str = text_to_cstring(token);
-	FILE    *fd_out;
-	int     nwrite;
+	char    *type_str = text_to_cstring(type);
+	char    *dlpath = text_to_cstring(path);
 	char    out_fnamebuf[MAXPGPATH];
-	mode_t  oumask;
-	struct flock flout;
 	TransactionId   topxid = GetTopTransactionId();
-	char	   *dl_token_path;
-	struct token_data itoken;
 
 	/* Token access control can only be used in a transaction */
 	if (topxid == InvalidTransactionId)
@@ -473,16 +786,54 @@ datalink_register_token(PG_FUNCTION_ARGS)
 				(errcode(ERRCODE_NO_ACTIVE_SQL_TRANSACTION),
 				 errmsg("Datalink token access control can only be used in transactions")));
 
+	/*
+	 * A signed read token holds all information required to verify it, it
+	 * is not registered. Just keep track of the symlink created for this
+	 * token to remove it at end of transaction.
+	 */
+	if (strcmp(type_str, "R") == 0 && is_signed_token_str(token_str))
+	{
+		datalink_track_token('R', NULL, dlpath);
+		PG_RETURN_BOOL(true);
+	}
+
+	write_token_file(token_str, type_str, dlpath, topxid,
+						out_fnamebuf, sizeof(out_fnamebuf));
+
+	/* Remove the token and its files as soon as the transaction ends */
+	datalink_track_token(type_str[0], out_fnamebuf, dlpath);
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Write the file of a token into the token directory, its path is returned
+ * into out_fnamebuf.
+ */
+static void
+write_token_file(const char *token_str, const char *type_str,
+				const char *dlpath, TransactionId topxid,
+				char *out_fnamebuf, size_t size)
+{
+	FILE    *fd_out;
+	int     nwrite;
+	mode_t  oumask;
+	struct flock flout;
+	char	   *dl_token_path;
+	struct token_data itoken;
+
 	/* Set binary struct for token information */
-	strncpy(itoken.mode, text_to_cstring(type), sizeof(itoken.mode));
+	strncpy(itoken.mode, type_str, sizeof(itoken.mode));
 	itoken.txid = topxid; 
-	strncpy(itoken.dlpath, text_to_cstring(path), sizeof(itoken.dlpath));
+	strncpy(itoken.dlpath, dlpath, sizeof(itoken.dlpath));
 
 	/* Get value of the datalink.dl_token_path GUC */
 	dl_token_path = GetConfigOptionByName("datalink.dl_token_path", NULL, false);
 
 	/* Open the token file */
-	snprintf(out_fnamebuf, sizeof(out_fnamebuf), "%s/%s", dl_token_path, token_str);
+	token_file_path(out_fnamebuf, size, dl_token_path,
+						token_str, use_hashed_layout());
+	make_fanout_dirs(out_fnamebuf);
 	oumask = umask(S_IWGRP | S_IWOTH);
 	fd_out = fopen(out_fnamebuf, "w");
 	umask(oumask);
@@ -524,17 +875,30 @@ datalink_register_token(PG_FUNCTION_ARGS)
 				 errmsg("could not write to file \"%s\": %m",
 						out_fnamebuf)));
 	}
-
-	PG_RETURN_BOOL(true);
 }
 
 PG_FUNCTION_INFO_V1(datalink_verify_token);
 Datum
 datalink_verify_token(PG_FUNCTION_ARGS)
 {
-	text    *token = PG_GETARG_TEXT_PP(0);
-	char    *token_str = text_to_cstring(token);
-	bool    haswrite = PG_GETARG_BOOL(1);
+	char    *dlpath;
+
+	dlpath = verify_token(text_to_cstring(PG_GETARG_TEXT_PP(0)),
+						PG_GETARG_BOOL(1),
+						text_to_cstring(PG_GETARG_TEXT_PP(2)));
+	if (dlpath == NULL)
+		PG_RETURN_NULL();
+
+	PG_RETURN_TEXT_P(cstring_to_text(dlpath));
+}
+
+/*
+ * Verify a token for reading or writing the file at path. Returns the path
+ * stored with the token, NULL when the access is not allowed.
+ */
+static char *
+verify_token(const char *token_str, bool haswrite, const char *path)
+{
 	FILE    *fd_in;
 	int     nread;
 	char    in_fnamebuf[MAXPGPATH];
@@ -545,15 +909,40 @@ datalink_verify_token(PG_FUNCTION_ARGS)
 	const char *status;
 	char	   *dl_token_path;
 	char	   *dl_token_expiry;
+	char	   *secret;
+	bool        hashed;
 	struct token_data itoken;
 
+	/* Signed tokens are verified in memory without looking at a token file */
+	secret = get_token_secret();
+	if (secret != NULL)
+	{
+		pg_uuid_t  *uuid;
+
+		uuid = DatumGetUUIDP(DirectFunctionCall1(uuid_in,
+										CStringGetDatum(token_str)));
+		if (is_signed_token(uuid->data))
+		{
+			return verify_signed_token(uuid->data, token_str, haswrite,
+							path, secret);
+		}
+	}
+
 	/* Get value of the datalink.dl_token_path GUC */
 	dl_token_path = GetConfigOptionByName("datalink.dl_token_path", NULL, false);
 	/* Get value of the datalink.dl_token_expire_after GUC */
 	dl_token_expiry = GetConfigOptionByName("datalink.dl_token_expiry", NULL, false);
 
-	/* Open the token file */
-	snprintf(in_fnamebuf, sizeof(in_fnamebuf), "%s/%s", dl_token_path, token_str);
+	/*
+	 * Open the token file, it may have been registered with the other layout
+	 * if datalink.dl_token_layout has just been changed.
+	 */
+	hashed = use_hashed_layout();
+	token_file_path(in_fnamebuf, sizeof(in_fnamebuf), dl_token_path,
+						token_str, hashed);
+	if (stat(in_fnamebuf, &fst) == -1 && errno == ENOENT)
+		token_file_path(in_fnamebuf, sizeof(in_fnamebuf), dl_token_path,
+						token_str, !hashed);
 
 	/* First verify that the token has not expired */
 	if (stat(in_fnamebuf, &fst) == -1)
@@ -628,95 +1017,860 @@ datalink_verify_token(PG_FUNCTION_ARGS)
                 elog(WARNING,
 			 "attempt to access file \"%s\" for %s without a valid token \"%s\", mode was %s",
 					in_fnamebuf, status, itoken.dlpath, itoken.mode);
-		PG_RETURN_NULL();
+		return NULL;
 	}
 
 	/* check that this is a transaction in progess */
-	if (itoken.txid != InvalidTransactionId)
+	if (!token_xact_in_progress(itoken.txid))
+		return NULL;
+
+	return pstrdup(itoken.dlpath);
+}
+
+/*
+ * Return true when the transaction that has registered a token is still in
+ * progress or when the token is not attached to a transaction.
+ */
+static bool
+token_xact_in_progress(TransactionId txid)
+{
+	const char *status;
+
+	if (txid == InvalidTransactionId)
+		return true;
+
+	status = NULL;
+	LWLockAcquire(CLogTruncationLock, LW_SHARED);
+	if (TransactionIdIsCurrentTransactionId(txid))
+		status = "in progress";
+	else if (TransactionIdDidCommit(txid))
+		status = "committed";
+	else if (TransactionIdDidAbort(txid))
+		status = "aborted";
+	else
 	{
-		status = NULL;
-		LWLockAcquire(CLogTruncationLock, LW_SHARED);
-		if (TransactionIdIsCurrentTransactionId(itoken.txid))
-			status = "in progress";
-		else if (TransactionIdDidCommit(itoken.txid))
-			status = "committed";
-		else if (TransactionIdDidAbort(itoken.txid))
+		if (TransactionIdPrecedes(txid, GetActiveSnapshot()->xmin))
 			status = "aborted";
 		else
+			status = "in progress";
+	}
+	LWLockRelease(CLogTruncationLock);
+
+	return (strcmp(status, "in progress") == 0);
+}
+
+/*
+ * Function used to generate a new access control token for a file, the mode
+ * is R for a read token and W for a write token. When datalink.dl_token_secret
+ * is set the token is signed, otherwise this is a random uuid version 4 that
+ * must be registered in the token directory.
+ */
+PG_FUNCTION_INFO_V1(datalink_generate_token);
+Datum
+datalink_generate_token(PG_FUNCTION_ARGS)
+{
+	char       *mode = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char       *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	pg_uuid_t  *token = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
+	unsigned char *data = token->data;
+	char       *secret;
+
+	if (strcmp(mode, "R") != 0 && strcmp(mode, "W") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid token mode \"%s\", must be R or W", mode)));
+
+	secret = get_token_secret();
+	if (secret == NULL)
+	{
+		if (!pg_strong_random(data, TOKEN_SIZE))
+			ereport(ERROR,
+					(errcode(ERRCODE_INTERNAL_ERROR),
+					 errmsg("could not generate random token")));
+		/* Set version 4 and variant bits */
+		data[6] = (data[6] & 0x0F) | 0x40;
+		data[8] = (data[8] & 0x3F) | 0x80;
+	}
+	else
+	{
+		TransactionId   topxid = GetTopTransactionId();
+		uint32          expiry = (uint32) time(NULL) + get_token_expiry();
+		unsigned char   mac[PG_SHA256_DIGEST_LENGTH];
+
+		data[0] = (unsigned char) (topxid >> 24);
+		data[1] = (unsigned char) (topxid >> 16);
+		data[2] = (unsigned char) (topxid >> 8);
+		data[3] = (unsigned char) topxid;
+		data[4] = (unsigned char) (expiry >> 24);
+		data[5] = (unsigned char) (expiry >> 16);
+		data[6] = SIGNED_TOKEN_VERSION;
+		if (strcmp(mode, "W") == 0)
+			data[6] |= SIGNED_TOKEN_MODE_WRITE;
+		data[7] = (unsigned char) (expiry >> 8);
+		data[8] = SIGNED_TOKEN_VARIANT;
+		data[9] = (unsigned char) expiry;
+		memset(data + 10, 0, TOKEN_SIZE - 10);
+
+		/* Now store the MAC into the remaining bits */
+		compute_token_mac(data, path, secret, mac);
+		data[8] |= (mac[0] & 0x3F);
+		memcpy(data + 10, mac + 1, TOKEN_SIZE - 10);
+	}
+
+	PG_RETURN_UUID_P(token);
+}
+
+/*
+ * Return the value of the datalink.dl_token_secret GUC or NULL when
+ * signed tokens are not enabled.
+ */
+static char *
+get_token_secret(void)
+{
+	const char *secret;
+
+	/*
+	 * The GUC is defined by _PG_init() whether the library is preloaded or
+	 * not, so it is always known once a function of this file is called.
+	 */
+	secret = GetConfigOption("datalink.dl_token_secret", true, false);
+	if (secret == NULL || *secret == '\0')
+		return NULL;
+
+	return pstrdup(secret);
+}
+
+/* Return the validity period of a token in seconds */
+static int
+get_token_expiry(void)
+{
+	const char *expiry;
+
+	expiry = GetConfigOption("datalink.dl_token_expiry", true, false);
+	if (expiry == NULL)
+		return DATALINK_TOKEN_EXPIRY;
+
+	return atoi(expiry);
+}
+
+/*
+ * Compute the HMAC-SHA256 of a signed token and of the path of the file it
+ * gives access to. The bits of the token used to store the MAC are zeroed
+ * before computing it. The mac buffer must be PG_SHA256_DIGEST_LENGTH long.
+ */
+static void
+compute_token_mac(const unsigned char *token, const char *path,
+				const char *secret, unsigned char *mac)
+{
+	unsigned char   msg[TOKEN_SIZE];
+#if PG_VERSION_NUM >= 140000
+	pg_hmac_ctx    *ctx;
+
+	memcpy(msg, token, TOKEN_SIZE);
+	msg[8] &= 0xC0;
+	memset(msg + 10, 0, TOKEN_SIZE - 10);
+
+	ctx = pg_hmac_create(PG_SHA256);
+	if (ctx == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+	if (pg_hmac_init(ctx, (const uint8 *) secret, strlen(secret)) < 0 ||
+		pg_hmac_update(ctx, msg, TOKEN_SIZE) < 0 ||
+		pg_hmac_update(ctx, (const uint8 *) path, strlen(path)) < 0 ||
+		pg_hmac_final(ctx, mac, PG_SHA256_DIGEST_LENGTH) < 0)
+	{
+		pg_hmac_free(ctx);
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("could not compute the signature of a token")));
+	}
+	pg_hmac_free(ctx);
+#else
+	pg_sha256_ctx   ctx;
+	unsigned char   key[PG_SHA256_BLOCK_LENGTH];
+	unsigned char   pad[PG_SHA256_BLOCK_LENGTH];
+	unsigned char   inner[PG_SHA256_DIGEST_LENGTH];
+	size_t          keylen = strlen(secret);
+	int             i;
+
+	memcpy(msg, token, TOKEN_SIZE);
+	msg[8] &= 0xC0;
+	memset(msg + 10, 0, TOKEN_SIZE - 10);
+
+	/*
+	 * common/hmac.h only exists since PostgreSQL 14, before that the HMAC
+	 * of RFC 2104 is built on top of SHA256.
+	 */
+	memset(key, 0, sizeof(key));
+	if (keylen > PG_SHA256_BLOCK_LENGTH)
+	{
+		pg_sha256_init(&ctx);
+		pg_sha256_update(&ctx, (const uint8 *) secret, keylen);
+		pg_sha256_final(&ctx, key);
+	}
+	else
+		memcpy(key, secret, keylen);
+
+	for (i = 0; i < PG_SHA256_BLOCK_LENGTH; i++)
+		pad[i] = key[i] ^ 0x36;
+	pg_sha256_init(&ctx);
+	pg_sha256_update(&ctx, pad, PG_SHA256_BLOCK_LENGTH);
+	pg_sha256_update(&ctx, msg, TOKEN_SIZE);
+	pg_sha256_update(&ctx, (const uint8 *) path, strlen(path));
+	pg_sha256_final(&ctx, inner);
+
+	for (i = 0; i < PG_SHA256_BLOCK_LENGTH; i++)
+		pad[i] = key[i] ^ 0x5c;
+	pg_sha256_init(&ctx);
+	pg_sha256_update(&ctx, pad, PG_SHA256_BLOCK_LENGTH);
+	pg_sha256_update(&ctx, inner, PG_SHA256_DIGEST_LENGTH);
+	pg_sha256_final(&ctx, mac);
+#endif
+}
+
+/* Return true if the binary token has the version of a signed token */
+static bool
+is_signed_token(const unsigned char *token)
+{
+	return ((token[6] & 0xF0) == SIGNED_TOKEN_VERSION &&
+			(token[8] & 0xC0) == SIGNED_TOKEN_VARIANT);
+}
+
+/* Same as above but from the text representation of the token */
+static bool
+is_signed_token_str(const char *token_str)
+{
+	pg_uuid_t  *uuid;
+
+	if (get_token_secret() == NULL)
+		return false;
+
+	uuid = DatumGetUUIDP(DirectFunctionCall1(uuid_in,
+									CStringGetDatum(token_str)));
+
+	return is_signed_token(uuid->data);
+}
+
+/*
+ * Verify a signed token: the MAC, the access mode, the expiry time and the
+ * state of the transaction that has generated it. Returns the path of the
+ * file with the token like it is stored in a token file, NULL when the
+ * access is not allowed.
+ */
+static char *
+verify_signed_token(const unsigned char *token, const char *token_str,
+				bool haswrite, const char *path, const char *secret)
+{
+	unsigned char   mac[PG_SHA256_DIGEST_LENGTH];
+	unsigned char   diff;
+	TransactionId   txid;
+	uint32          expiry;
+	uint32          curtime;
+	bool            writemode;
+	int             i;
+
+	/* Compare the MAC in constant time */
+	compute_token_mac(token, path, secret, mac);
+	diff = token[8] ^ (SIGNED_TOKEN_VARIANT | (mac[0] & 0x3F));
+	for (i = 10; i < TOKEN_SIZE; i++)
+		diff |= token[i] ^ mac[i - 9];
+	if (diff != 0)
+	{
+		elog(WARNING, "invalid signature of token \"%s\" to access file \"%s\"",
+					token_str, path);
+		return NULL;
+	}
+
+	writemode = ((token[6] & SIGNED_TOKEN_MODE_WRITE) != 0);
+	if (writemode != haswrite)
+	{
+		elog(WARNING,
+			 "attempt to access file \"%s\" for %s without a valid token \"%s\", mode was %s",
+				path, (haswrite) ? "writing" : "reading", token_str,
+				(writemode) ? "W" : "R");
+		return NULL;
+	}
+
+	expiry = ((uint32) token[4] << 24) | ((uint32) token[5] << 16) |
+				((uint32) token[7] << 8) | (uint32) token[9];
+	curtime = (uint32) time(NULL);
+	if (curtime > expiry)
+	{
+		ereport(WARNING,
+				(errmsg("token \"%s\" to file \"%s\" has expired %u seconds ago.",
+						token_str, path, curtime - expiry)));
+		return NULL;
+	}
+
+	txid = ((TransactionId) token[0] << 24) | ((TransactionId) token[1] << 16) |
+				((TransactionId) token[2] << 8) | (TransactionId) token[3];
+	if (!token_xact_in_progress(txid))
+		return NULL;
+
+	return add_token_to_path(path, token_str);
+}
+
+/*
+ * Insert a token before the file name of a path or of an URL. With the
+ * hashed layout the fan-out subdirectories are inserted before it too.
+ */
+static char *
+add_token_to_path(const char *path, const char *token_str)
+{
+	const char     *filename = strrchr(path, '/');
+	int             dirlen = 0;
+	StringInfoData  buf;
+
+	if (filename == NULL)
+		filename = path;
+	else
+	{
+		filename++;
+		dirlen = filename - path;
+	}
+
+	initStringInfo(&buf);
+	if (use_hashed_layout())
+	{
+		if (strlen(token_str) != UUID_LEN * 2 + 4)
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("invalid token \"%s\"", token_str)));
+		appendStringInfo(&buf, "%.*s%s/%.2s/%.2s/%s;%s", dirlen, path,
+						DATALINK_FANOUT_DIR, token_str + 32, token_str + 34,
+						token_str, filename);
+	}
+	else
+		appendStringInfo(&buf, "%.*s%s;%s", dirlen, path, token_str, filename);
+
+	return buf.data;
+}
+
+/* SQL callable version of add_token_to_path() used by add_token_to_url() */
+PG_FUNCTION_INFO_V1(datalink_add_token);
+Datum
+datalink_add_token(PG_FUNCTION_ARGS)
+{
+	char    *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char    *token_str = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+	PG_RETURN_TEXT_P(cstring_to_text(add_token_to_path(path, token_str)));
+}
+
+/*
+ * Generate the read token shared by the files linked by the current
+ * transaction and register it. The path of its token file is returned into
+ * token_file, an empty string for a signed token. The token is bound to the
+ * name of the link directories instead of a file.
+ */
+char *
+datalink_new_xact_token(char *token_file, size_t size)
+{
+	TransactionId   topxid = GetTopTransactionId();
+	Datum           token;
+	char           *token_str;
+
+	token = DirectFunctionCall2(datalink_generate_token,
+								CStringGetTextDatum("R"),
+								CStringGetTextDatum(DATALINK_XACT_LINK_DIR));
+	token_str = DatumGetCString(DirectFunctionCall1(uuid_out, token));
+
+	token_file[0] = '\0';
+	if (!is_signed_token_str(token_str))
+		write_token_file(token_str, "R",
+						add_token_to_path(DATALINK_XACT_LINK_DIR, token_str),
+						topxid, token_file, size);
+
+	return token_str;
+}
+
+/*
+ * Insert the link directory of a transaction scoped read token before the
+ * file name of a path or of an URL: dir/.dlxact/token/filename.
+ */
+PG_FUNCTION_INFO_V1(datalink_add_xact_link);
+Datum
+datalink_add_xact_link(PG_FUNCTION_ARGS)
+{
+	char       *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char       *token_str = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	const char *filename = strrchr(path, '/');
+	int         dirlen = 0;
+
+	if (filename == NULL)
+		filename = path;
+	else
+	{
+		filename++;
+		dirlen = filename - path;
+	}
+
+	PG_RETURN_TEXT_P(cstring_to_text(psprintf("%.*s%s/%s/%s", dirlen, path,
+							DATALINK_XACT_LINK_DIR, token_str, filename)));
+}
+
+/*
+ * Verify a transaction scoped read token used to access a link of its link
+ * directory. Only the files linked by the transaction can be read with it.
+ */
+PG_FUNCTION_INFO_V1(datalink_verify_xact_link);
+Datum
+datalink_verify_xact_link(PG_FUNCTION_ARGS)
+{
+	char       *token_str = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char       *link = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char       *dir;
+	char       *suffix;
+	char       *dlpath;
+	struct stat st;
+
+	/* The link must be in the link directory named after the token */
+	dir = pstrdup(link);
+	get_parent_directory(dir);
+	suffix = psprintf("/%s/%s", DATALINK_XACT_LINK_DIR, token_str);
+	if (strlen(dir) < strlen(suffix) ||
+		strcmp(dir + strlen(dir) - strlen(suffix), suffix) != 0)
+		PG_RETURN_BOOL(false);
+
+	dlpath = verify_token(token_str, false, DATALINK_XACT_LINK_DIR);
+	if (dlpath == NULL ||
+		strcmp(dlpath, add_token_to_path(DATALINK_XACT_LINK_DIR, token_str)) != 0)
+		PG_RETURN_BOOL(false);
+
+	/* Links of the current transaction may still be waiting for creation */
+	datalink_flush_xact_links();
+	if (lstat(link, &st) != 0 || !S_ISLNK(st.st_mode))
+	{
+		elog(WARNING, "file \"%s\" has not been linked with token \"%s\"",
+				link, token_str);
+		PG_RETURN_BOOL(false);
+	}
+
+	PG_RETURN_BOOL(true);
+}
+
+/* Return true when datalink.dl_token_layout is set to hashed */
+static bool
+use_hashed_layout(void)
+{
+	const char *layout;
+
+	layout = GetConfigOption("datalink.dl_token_layout", true, false);
+
+	return (layout != NULL && strcmp(layout, "hashed") == 0);
+}
+
+/* Build the path of a token file following the layout */
+static void
+token_file_path(char *buf, size_t size, const char *token_dir,
+				const char *token_str, bool hashed)
+{
+	if (hashed && strlen(token_str) == UUID_LEN * 2 + 4)
+		snprintf(buf, size, "%s/%.2s/%.2s/%s", token_dir, token_str + 32,
+						token_str + 34, token_str);
+	else
+		snprintf(buf, size, "%s/%s", token_dir, token_str);
+}
+
+/*
+ * Create the fan-out subdirectories of a file named with a token or of a
+ * token file when they do not exist. Nothing is done with the flat layout.
+ */
+static void
+make_fanout_dirs(const char *path)
+{
+	char    dir[MAXPGPATH];
+	char   *p;
+
+	if (!use_hashed_layout())
+		return;
+
+	strlcpy(dir, path, sizeof(dir));
+	p = strrchr(dir, '/');
+	if (p == NULL || p == dir)
+		return;
+	*p = '\0';
+
+	if (pg_mkdir_p(dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", dir)));
+}
+
+/*
+ * Return true if a file name is a token (token directory) or a file name
+ * prefixed with a token.
+ */
+static bool
+is_token_name(const char *name, bool tokendir)
+{
+	int     i;
+
+	for (i = 0; i < 36; i++)
+	{
+		if (i == 8 || i == 13 || i == 18 || i == 23)
 		{
-			if (TransactionIdPrecedes(itoken.txid, GetActiveSnapshot()->xmin))
-				status = "aborted";
-			else
-				status = "in progress";
+			if (name[i] != '-')
+				return false;
 		}
-		LWLockRelease(CLogTruncationLock);
+		else if (!isxdigit((unsigned char) name[i]))
+			return false;
+	}
 
-		/* Check that there is a transaction in progress */
-		if (strcmp(status, "in progress") != 0)
-			PG_RETURN_NULL();
+	if (tokendir)
+		return (name[36] == '\0');
+
+	return (name[36] == ';' && name[37] != '\0' && strchr(name + 37, '/') == NULL);
+}
+
+/*
+ * Return the path where a file named with a token, or a token file, must
+ * be stored in a directory following the layout.
+ */
+static char *
+canonical_token_path(const char *dir, const char *name, bool tokendir,
+					bool hashed)
+{
+	if (!hashed)
+		return psprintf("%s/%s", dir, name);
+	if (tokendir)
+		return psprintf("%s/%.2s/%.2s/%s", dir, name + 32, name + 34, name);
+
+	return psprintf("%s/%s/%.2s/%.2s/%s", dir, DATALINK_FANOUT_DIR,
+						name + 32, name + 34, name);
+}
+
+/* Remove the trailing fan-out subdirectories from a directory path */
+static void
+strip_fanout_dir(char *dir)
+{
+	size_t  len = strlen(dir);
+	size_t  fanlen = strlen("/" DATALINK_FANOUT_DIR "/ab/cd");
+
+	if (len > fanlen && dir[len - 6] == '/' && dir[len - 3] == '/' &&
+		strncmp(dir + len - fanlen, "/" DATALINK_FANOUT_DIR "/",
+				strlen("/" DATALINK_FANOUT_DIR "/")) == 0)
+		dir[len - fanlen] = '\0';
+}
+
+/*
+ * Remove the fan-out subdirectories xx/yy of a directory left empty once
+ * their files have been moved back to the flat layout. The directory itself
+ * is removed too when remove_root is true and nothing is left in it. A
+ * directory that is not empty is kept.
+ */
+static void
+remove_empty_fanout_dirs(const char *fandir, bool remove_root)
+{
+	List       *level1;
+	List       *dirs = NIL;
+	ListCell   *lc;
+
+	/* Subdirectories are removed before their parent */
+	level1 = list_fanout_dirs(fandir);
+	foreach(lc, level1)
+		dirs = list_concat(dirs, list_fanout_dirs((char *) lfirst(lc)));
+	dirs = list_concat(dirs, level1);
+	if (remove_root)
+		dirs = lappend(dirs, pstrdup(fandir));
+
+	foreach(lc, dirs)
+	{
+		char   *dir = (char *) lfirst(lc);
+
+		if (rmdir(dir) < 0 && errno != ENOTEMPTY && errno != EEXIST &&
+			errno != ENOENT)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not remove directory \"%s\": %m", dir)));
 	}
+}
 
-	PG_RETURN_TEXT_P(cstring_to_text(itoken.dlpath));
+/* Return the path of the subdirectories of a directory named like xx */
+static List *
+list_fanout_dirs(const char *dir)
+{
+	DIR            *d;
+	struct dirent  *de;
+	List           *dirs = NIL;
+
+	d = AllocateDir(dir);
+	while ((de = ReadDir(d, dir)) != NULL)
+	{
+		char        *path;
+		struct stat  st;
+
+		if (strlen(de->d_name) != 2 ||
+			!isxdigit((unsigned char) de->d_name[0]) ||
+			!isxdigit((unsigned char) de->d_name[1]))
+			continue;
+		path = psprintf("%s/%s", dir, de->d_name);
+		if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+			dirs = lappend(dirs, path);
+	}
+	FreeDir(d);
+
+	return dirs;
 }
 
-/* Function used to test if a file is a symlink */
-PG_FUNCTION_INFO_V1(datalink_is_symlink);
+/*
+ * Collect recursively the path of all files and symlinks of a directory.
+ * Entries are read before descending into subdirectories to not keep too
+ * many directories opened.
+ */
+static void
+collect_directory_entries(const char *dir, List **files, List **links)
+{
+	DIR            *d;
+	struct dirent  *de;
+	List           *subdirs = NIL;
+	ListCell       *lc;
+
+	d = AllocateDir(dir);
+	while ((de = ReadDir(d, dir)) != NULL)
+	{
+		char        *path;
+		struct stat  st;
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+
+		path = psprintf("%s/%s", dir, de->d_name);
+		if (lstat(path, &st) < 0)
+		{
+			if (errno == ENOENT)
+				continue;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not stat file \"%s\": %m", path)));
+		}
+
+		/*
+		 * The hard links of the snapshots and the links of the transaction
+		 * scoped read tokens are not files of the directory.
+		 */
+		if (S_ISDIR(st.st_mode) && strcmp(de->d_name, DATALINK_SNAPSHOT_DIR) != 0
+			&& strcmp(de->d_name, DATALINK_XACT_LINK_DIR) != 0)
+			subdirs = lappend(subdirs, path);
+		else if (S_ISLNK(st.st_mode))
+			*links = lappend(*links, path);
+		else if (S_ISREG(st.st_mode))
+			*files = lappend(*files, path);
+	}
+	FreeDir(d);
+
+	foreach(lc, subdirs)
+		collect_directory_entries((char *) lfirst(lc), files, links);
+}
+
+/*
+ * Return the path of the regular files named with a token found in a base
+ * directory and its fan-out subdirectories. Used by dl_audit() to find the
+ * copies that are no more referenced by any datalink. A copy created or
+ * renamed since less than the token expiry, or whose token is still
+ * registered, may belong to a transaction in progress and is skipped.
+ */
+PG_FUNCTION_INFO_V1(datalink_token_files);
 Datum
-datalink_is_symlink(PG_FUNCTION_ARGS)
+datalink_token_files(PG_FUNCTION_ARGS)
 {
-	text    *src = PG_GETARG_TEXT_PP(0);
-	char    src_fnamebuf[MAXPGPATH];
-	struct stat buf;
+	char       *rootdir = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	List       *files = NIL;
+	List       *links = NIL;
+	ListCell   *lc;
+	Datum      *elems;
+	int         nelems = 0;
+	struct stat st;
+	char       *dl_token_path;
+	time_t      oldest;
+
+	if (stat(rootdir, &st) < 0 || !S_ISDIR(st.st_mode))
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(TEXTOID));
 
-	text_to_cstring_buffer(src, src_fnamebuf, sizeof(src_fnamebuf));
+	dl_token_path = GetConfigOptionByName("datalink.dl_token_path", NULL, false);
+	oldest = time(NULL) - get_token_expiry();
 
-	if (lstat(src_fnamebuf, &buf) < 0)
+	collect_directory_entries(rootdir, &files, &links);
+
+	elems = (Datum *) palloc(Max(list_length(files), 1) * sizeof(Datum));
+	foreach(lc, files)
 	{
-		if (errno != ENOENT)
-			ereport(ERROR, (
-				errmsg("could not stat file \"%s\": %s",
-						src_fnamebuf, strerror(errno))));
+		char    *path = (char *) lfirst(lc);
+		char    *name = strrchr(path, '/') + 1;
+		char    *token_str;
+		char     tokenbuf[MAXPGPATH];
+
+		if (!is_token_name(name, false))
+			continue;
+
+		/* Removed or renamed since the directory has been read */
+		if (lstat(path, &st) < 0 || st.st_ctime > oldest)
+			continue;
+
+		/* The token file may have been written with the other layout */
+		token_str = pnstrdup(name, 36);
+		token_file_path(tokenbuf, sizeof(tokenbuf), dl_token_path, token_str, true);
+		if (stat(tokenbuf, &st) == 0)
+			continue;
+		token_file_path(tokenbuf, sizeof(tokenbuf), dl_token_path, token_str, false);
+		if (stat(tokenbuf, &st) == 0)
+			continue;
+
+		elems[nelems++] = CStringGetTextDatum(path);
 	}
 
-	if (S_ISLNK(buf.st_mode))
-		PG_RETURN_INT32(true);
-
-	PG_RETURN_INT32(false);
+	PG_RETURN_ARRAYTYPE_P(construct_array(elems, nelems, TEXTOID, -1, false, 'i'));
 }
 
-/* Return the target file path of a symlink */
-PG_FUNCTION_INFO_V1(datalink_symlink_target);
+/*
+ * Move token files or files named with a token of a directory to the
+ * location they must have with the given layout. When this is a base
+ * directory, symlinks to moved files are recreated with the new target.
+ * Returns the number of files moved.
+ */
+PG_FUNCTION_INFO_V1(datalink_migrate_layout);
 Datum
-datalink_symlink_target(PG_FUNCTION_ARGS)
+datalink_migrate_layout(PG_FUNCTION_ARGS)
 {
-	text    *src = PG_GETARG_TEXT_PP(0);
-	char    src_fnamebuf[MAXPGPATH];
-	char    target[MAXPGPATH];
-	struct stat buf;
+	char       *rootdir = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	bool        hashed = PG_GETARG_BOOL(1);
+	bool        tokendir = PG_GETARG_BOOL(2);
+	List       *files = NIL;
+	List       *links = NIL;
+	List       *fandirs = NIL;
+	ListCell   *lc;
+	int64       count = 0;
+	struct stat st;
+
+	if (stat(rootdir, &st) < 0 || !S_ISDIR(st.st_mode))
+	{
+		ereport(WARNING,
+				(errmsg("directory \"%s\" does not exist, nothing to migrate",
+						rootdir)));
+		PG_RETURN_INT64(0);
+	}
 
-	text_to_cstring_buffer(src, src_fnamebuf, sizeof(src_fnamebuf));
+	collect_directory_entries(rootdir, &files, &links);
 
-	if (lstat(src_fnamebuf, &buf) < 0)
+	/* Symlinks named with a token are moved like regular files */
+	if (!tokendir)
+		files = list_concat(files, list_copy(links));
+
+	foreach(lc, files)
 	{
-		if (errno != ENOENT)
-			ereport(ERROR, (
-				errmsg("could not stat file \"%s\": %s",
-						src_fnamebuf, strerror(errno))));
+		char    *path = (char *) lfirst(lc);
+		char    *name = strrchr(path, '/') + 1;
+		char    *dir;
+		char    *newpath;
+
+		if (!is_token_name(name, tokendir))
+			continue;
+
+		/* Token files are all stored relatively to the token directory */
+		if (tokendir)
+			dir = rootdir;
+		else
+		{
+			dir = pnstrdup(path, name - path - 1);
+			strip_fanout_dir(dir);
+		}
+
+		newpath = canonical_token_path(dir, name, tokendir, hashed);
+		if (strcmp(newpath, path) == 0)
+			continue;
+
+		if (hashed)
+		{
+			char *parent = pnstrdup(newpath, strrchr(newpath, '/') - newpath);
+
+			if (pg_mkdir_p(parent, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH) != 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not create directory \"%s\": %m", parent)));
+		}
+		if (rename(path, newpath) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not rename file \"%s\" to \"%s\": %m",
+							path, newpath)));
+		count++;
+
+		/* Remember the fan-out directories emptied by the flat layout */
+		if (!hashed && !tokendir)
+		{
+			char       *fandir = psprintf("%s/%s", dir, DATALINK_FANOUT_DIR);
+			ListCell   *lc2;
+			bool        found = false;
+
+			foreach(lc2, fandirs)
+			{
+				if (strcmp((char *) lfirst(lc2), fandir) == 0)
+				{
+					found = true;
+					break;
+				}
+			}
+			if (!found)
+				fandirs = lappend(fandirs, fandir);
+		}
 	}
 
-	/* Get target file path */
-	if (S_ISLNK(buf.st_mode))
+	/* Nothing is left in the fan-out directories with the flat layout */
+	if (!hashed)
 	{
-		ssize_t len;
-		len = readlink(src_fnamebuf, target, sizeof(target)-1);
-		if (len == -1)
-			ereport(ERROR, (
-				errmsg("could not get target file path for \"%s\": %s",
-						src_fnamebuf, strerror(errno))));
+		if (tokendir)
+			remove_empty_fanout_dirs(rootdir, false);
+		foreach(lc, fandirs)
+			remove_empty_fanout_dirs((char *) lfirst(lc), true);
+	}
+
+	if (tokendir)
+		PG_RETURN_INT64(count);
+
+	/*
+	 * Symlinks may still point to the old location of a file named with a
+	 * token, read them again as they may have been moved themselves.
+	 */
+	files = NIL;
+	links = NIL;
+	collect_directory_entries(rootdir, &files, &links);
+	foreach(lc, links)
+	{
+		char       *path = (char *) lfirst(lc);
+		char        target[MAXPGPATH];
+		char       *name;
+		char       *dir;
+		char       *newtarget;
+		ssize_t     len;
+
+		len = readlink(path, target, sizeof(target) - 1);
+		if (len < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not get target file path for \"%s\": %m", path)));
 		target[len] = '\0';
-		PG_RETURN_TEXT_P(cstring_to_text(target));
+
+		name = strrchr(target, '/');
+		if (target[0] != '/' || name == NULL || !is_token_name(name + 1, false))
+			continue;
+
+		dir = pnstrdup(target, name - target);
+		strip_fanout_dir(dir);
+		newtarget = canonical_token_path(dir, name + 1, false, hashed);
+		if (strcmp(newtarget, target) == 0 || lstat(newtarget, &st) < 0)
+			continue;
+
+		if (unlink(path) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not unlink symlink \"%s\": %m", path)));
+		if (symlink(newtarget, path) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not symlink \"%s\" to renamed file \"%s\": %m",
+							path, newtarget)));
 	}
 
-	PG_RETURN_NULL();
+	PG_RETURN_INT64(count);
 }
-
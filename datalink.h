@@ -67,8 +67,267 @@
  */
 #define DATALINK_KEEP_MAX_COPIES  5
 
+/*
+ * GUC datalink.dl_token_secret
+ * Server secret used to sign access control tokens. When it is set, the
+ * tokens returned by DLURLCOMPLETE(), DLURLPATH() and their write variants
+ * are self describing: the access mode, the top level transaction id and
+ * the expiry time are packed into the uuid together with a truncated
+ * HMAC-SHA256 computed over the token and the path of the file. These
+ * tokens are verified in memory and no token file is ever created for
+ * read tokens. Default is empty, tokens are random uuid registered in the
+ * token directory.
+ */
+#define DATALINK_TOKEN_SECRET  ""
+
+/*
+ * GUC datalink.dl_token_layout
+ * Layout of the token directory and of the files named with a token in the
+ * base directories. With the flat layout, the default, they are all stored
+ * in the same directory: token_path/uuid and dir/uuid;filename. With the
+ * hashed layout they are spread into subdirectories named after the last
+ * four hexadecimal digits of the token: token_path/ab/cd/uuid and
+ * dir/.dl/ab/cd/uuid;filename. Function dl_migrate_token_layout() must be
+ * called to move existing files after this setting has been changed.
+ */
+typedef enum
+{
+	DL_LAYOUT_FLAT,
+	DL_LAYOUT_HASHED
+} DatalinkLayout;
+
+#define DATALINK_TOKEN_LAYOUT  DL_LAYOUT_FLAT
+#define DATALINK_FANOUT_DIR    ".dl"
+
+/*
+ * Subdirectory of the base directories holding the hard links of the files
+ * taken by dl_snapshot_create(), one subdirectory per snapshot label.
+ */
+#define DATALINK_SNAPSHOT_DIR  ".dlsnapshot"
+
+/*
+ * GUC datalink.dl_read_token_scope
+ * Scope of the read tokens returned by DLURLCOMPLETE() and DLURLPATH(). With
+ * file, the default, each call generates a token and creates a symlink
+ * named token;filename next to the file. With transaction all the files
+ * handed out by a transaction share one read token and are linked into a
+ * link directory named after it, dir/.dlxact/token/filename, created in
+ * batches and removed as a whole when the transaction ends.
+ */
+typedef enum
+{
+	DL_TOKEN_SCOPE_FILE,
+	DL_TOKEN_SCOPE_TRANSACTION
+} DatalinkTokenScope;
+
+#define DATALINK_READ_TOKEN_SCOPE  DL_TOKEN_SCOPE_FILE
+#define DATALINK_XACT_LINK_DIR     ".dlxact"
+
+/* Number of links of a transaction scoped read token created at once */
+#define DATALINK_XACT_LINK_BATCH   64
+
 #define BUFFER_SIZE 8192
 
+/*
+ * Binary layout of a signed token, it has the size of an uuid and is
+ * formatted as an uuid version 8 (custom format) so that it is not
+ * distinguishable from a random token in an URL:
+ *
+ *   bytes 0-3   top level transaction id
+ *   bytes 4-5   expiry time, bits 31 to 16
+ *   byte  6     uuid version 8 in the high nibble, access mode in the low one
+ *   byte  7     expiry time, bits 15 to 8
+ *   byte  8     uuid variant in the two high bits, MAC bits in the others
+ *   byte  9     expiry time, bits 7 to 0
+ *   bytes 10-15 MAC
+ */
+#define TOKEN_SIZE              16
+#define SIGNED_TOKEN_VERSION    0x80
+#define SIGNED_TOKEN_MODE_WRITE 0x01
+#define SIGNED_TOKEN_VARIANT    0x80
+
+/*
+ * GUC datalink.dl_remote_cache_size
+ * Maximum number of remote URLs whose metadata (size, ETag, Last-Modified)
+ * are kept in the shared memory cache. The cache is only available when
+ * the extension is loaded with shared_preload_libraries, 0 disables it.
+ */
+#define DATALINK_REMOTE_CACHE_SIZE  10000
+
+/*
+ * GUC datalink.dl_remote_cache_ttl
+ * Time in seconds during which cached metadata of a remote URL are used
+ * without sending a new HEAD request to the remote server.
+ */
+#define DATALINK_REMOTE_CACHE_TTL   300
+
+/*
+ * GUC datalink.dl_remote_max_connections and dl_remote_max_host_connections
+ * Maximum number of concurrent requests sent to remote servers by a backend
+ * and maximum number of them to the same host. Connections are kept alive
+ * and reused between requests.
+ */
+#define DATALINK_REMOTE_MAX_CONNECTIONS       16
+#define DATALINK_REMOTE_MAX_HOST_CONNECTIONS  4
+
+/*
+ * GUC datalink.dl_remote_timeout
+ * Timeout in seconds of a request to a remote server.
+ */
+#define DATALINK_REMOTE_TIMEOUT  10
+
+/*
+ * GUC datalink.dl_remote_cache_directory
+ * Directory where the content of the remote files read through the datalinks
+ * is cached. Entries are revalidated with the remote server when they are
+ * older than datalink.dl_remote_cache_ttl.
+ */
+#define DATALINK_REMOTE_CACHE_DIRECTORY  "/tmp/test_datalink/pg_remote_cache"
+
+/*
+ * GUC datalink.dl_remote_cache_max_size
+ * Maximum size in kB of the remote content cache, least recently used
+ * entries are removed when it is exceeded. 0 disables the cache.
+ */
+#define DATALINK_REMOTE_CACHE_MAX_SIZE  (1024 * 1024)
+
+/*
+ * GUC datalink.dl_io_threads
+ * Number of threads used by dl_audit() to check the files of the datalinks,
+ * by dl_changes() to crawl the base directories, by dl_snapshot_create() to
+ * link the files and by dl_process_unlinks() to restore or remove the files
+ * of the tables truncated or dropped, the backend itself included. Only a
+ * superuser can change it, up to DATALINK_IO_THREADS_MAX.
+ */
+#define DATALINK_IO_THREADS  4
+#define DATALINK_IO_THREADS_MAX  16
+
+/* Number of consecutive files restored or removed by a thread at once */
+#define DATALINK_UNLINK_CHUNK  32
+
+/*
+ * GUC datalink.dl_lock_table_size
+ * Maximum number of external files locked at the same time and of backends
+ * waiting for a file lock. Requires shared_preload_libraries.
+ */
+#define DATALINK_LOCK_TABLE_SIZE  1024
+
+/*
+ * GUC datalink.dl_object_cache_size
+ * Size in kB of the shared memory cache of small external files, 0 disables
+ * it. Requires shared_preload_libraries.
+ */
+#define DATALINK_OBJECT_CACHE_SIZE  (16 * 1024)
+
+/*
+ * GUC datalink.dl_object_cache_max_object
+ * Size in kB of the largest file kept in the object cache, this is also the
+ * size of a slot of the cache.
+ */
+#define DATALINK_OBJECT_CACHE_MAX_OBJECT  64
+
+/*
+ * GUC datalink.dl_copy_workers
+ * Maximum number of background workers doing the copies of the files for
+ * dlurlcompletewrite(), 0 makes the copies synchronous.
+ */
+#define DATALINK_COPY_WORKERS  0
+
+/*
+ * GUC datalink.dl_copy_queue_size
+ * Maximum number of copies queued or in progress. Requires
+ * shared_preload_libraries.
+ */
+#define DATALINK_COPY_QUEUE_SIZE  64
+
+/*
+ * GUC datalink.dl_access_table_size
+ * Maximum number of files whose accesses are recorded between two flushes
+ * by dl_access_flush(). Requires shared_preload_libraries.
+ */
+#define DATALINK_ACCESS_TABLE_SIZE  4096
+
+/*
+ * GUC datalink.dl_tier_database
+ * Database where the tiering worker runs dl_tier_migrate(), no worker is
+ * started when it is empty. Requires shared_preload_libraries.
+ */
+#define DATALINK_TIER_DATABASE  ""
+
+/*
+ * GUC datalink.dl_tier_naptime
+ * Number of seconds between two runs of dl_tier_migrate() by the tiering
+ * worker.
+ */
+#define DATALINK_TIER_NAPTIME  600
+
+/*
+ * GUC datalink.dl_usage_flush_interval
+ * Number of seconds after which the changes of the space used by the base
+ * directories are written to table pg_datalink_usage, 0 disables the
+ * periodic flush. Requires shared_preload_libraries.
+ */
+#define DATALINK_USAGE_FLUSH_INTERVAL  60
+
+/*
+ * GUC datalink.dl_fd_cache_size
+ * Maximum number of external files kept open by a session between two reads
+ * of the same transaction, 0 disables it.
+ */
+#define DATALINK_FD_CACHE_SIZE  8
+
+/* Upper bound of datalink.dl_fd_cache_size, files are transient files */
+#define DL_FD_CACHE_MAX  32
+
+/* Size of the chunks of the archives built by dl_export() */
+#define DATALINK_EXPORT_CHUNK_SIZE  (1024 * 1024)
+
+/* Size of the chunks of I/O charged against the limits of a base directory */
+#define DATALINK_THROTTLE_CHUNK_SIZE  (256 * 1024)
+
+/* Maximum number of base directories with I/O limits */
+#define DL_THROTTLE_MAX_BASES  128
+
+/* Maximum number of base directories whose space used is counted */
+#define DL_USAGE_MAX_BASES  256
+
+/*
+ * Local id of the current transaction, used to reload the settings of the
+ * base directories once per transaction. Needs storage/proc.h.
+ */
+#if PG_VERSION_NUM >= 170000
+#define DL_CURRENT_LXID  (MyProc->vxid.lxid)
+#else
+#define DL_CURRENT_LXID  (MyProc->lxid)
+#endif
+
+/* Kinds of files counted in the space used by a base directory */
+typedef enum DatalinkUsageKind
+{
+	DL_USAGE_NONE = -1,
+	DL_USAGE_LIVE,         /* files referenced by the datalinks */
+	DL_USAGE_COPY,         /* previous versions kept for dlpreviouscopy() */
+	DL_USAGE_PENDING       /* copies not validated yet or no more referenced */
+} DatalinkUsageKind;
+
+#define DL_USAGE_NKINDS  3
+
+/* Maximum length of the error message of a failed asynchronous copy */
+#define DL_COPY_ERROR_LEN  256
+
+/* Maximum length of the URLs and ETags kept in the remote metadata cache */
+#define DL_REMOTE_URL_LEN   1024
+#define DL_REMOTE_ETAG_LEN  128
+
+/* Metadata of a remote file */
+typedef struct DatalinkRemoteMeta
+{
+	bool        valid;         /* false when the request has failed */
+	int64       size;          /* Content-Length, -1 when unknown */
+	time_t      last_modified; /* Last-Modified, -1 when unknown */
+	char        etag[DL_REMOTE_ETAG_LEN];
+} DatalinkRemoteMeta;
+
 /* Struct used to srore information about token */
 typedef struct token_data {
 	char mode[1];
@@ -76,3 +335,113 @@ typedef struct token_data {
 	char dlpath[4096];
 } token_data;
 
+
+/* datalink.c */
+extern bytea *read_binary_file(const char *filename, int64 seek_offset,
+		int64 bytes_to_read, bool missing_ok, struct stat *st);
+extern Datum datalink_copy_localfile(PG_FUNCTION_ARGS);
+extern int  datalink_open_replacement(const char *path, int fd_like,
+		char *tmppath, size_t size);
+extern void datalink_install_replacement(int fd, const char *tmppath,
+		const char *path);
+extern char *datalink_new_xact_token(char *token_file, size_t size);
+
+/* datalink_lock.c */
+extern void datalink_lock_shmem_request(int table_size);
+extern void datalink_lock_shmem_init(int table_size);
+extern void datalink_lock_files(int nfiles, const int *fds, const char **paths,
+		const bool *exclusive);
+extern void datalink_unlock_files(void);
+extern int	datalink_lock_hint(void);
+
+/* datalink_objcache.c */
+extern void datalink_objcache_shmem_request(int cache_size, int max_object);
+extern void datalink_objcache_shmem_init(int cache_size, int max_object);
+extern bool datalink_objcache_enabled(off_t size);
+extern bytea *datalink_objcache_lookup(const struct stat *st);
+extern void datalink_objcache_store(const struct stat *st, bytea *content);
+extern void datalink_objcache_invalidate(const char *path);
+
+/* datalink_command.c */
+extern void datalink_command_init(void);
+
+/* datalink_copy.c */
+extern void datalink_copy_shmem_request(int queue_size);
+extern void datalink_copy_shmem_init(int queue_size);
+extern void datalink_copy_progress(int64 bytes);
+extern void datalink_cancel_copies(void);
+extern void datalink_reset_copies(void);
+
+/* datalink_tier.c */
+extern void datalink_access_shmem_request(int table_size);
+extern void datalink_access_shmem_init(int table_size);
+
+/* datalink_unlink.c */
+extern void datalink_launch_unlink_worker(void);
+
+/* datalink_throttle.c */
+extern void datalink_throttle_shmem_request(void);
+extern void datalink_throttle_shmem_init(void);
+extern int  datalink_throttle_base(const char *path);
+extern void datalink_throttle(int base, int64 bytes, int ops);
+
+/* datalink_fdcache.c */
+extern int  datalink_fdcache_open(const char *path, struct stat *st,
+		bool missing_ok, int base);
+extern void datalink_fdcache_release(int fd, const char *path);
+extern void datalink_fdcache_forget(const char *path);
+
+/* datalink_usage.c */
+extern void datalink_usage_shmem_request(void);
+extern void datalink_usage_shmem_init(void);
+extern int64 datalink_usage_size(const char *path);
+extern void datalink_usage_add(const char *path, DatalinkUsageKind kind,
+		int64 bytes, int64 files);
+extern void datalink_usage_unlinked(const char *path, int64 size);
+extern void datalink_usage_renamed(const char *src, const char *dst,
+		int64 size, int64 replaced);
+extern void datalink_usage_check(const char *path, int64 bytes, int64 files);
+extern void datalink_usage_xact_end(bool commit);
+extern void datalink_usage_subxact_end(bool commit, int nestlevel);
+extern void datalink_usage_launch_flush(int interval);
+
+/* datalink_remote.c */
+extern void datalink_remote_shmem_request(int cache_size);
+extern void datalink_remote_shmem_init(int cache_size);
+extern void datalink_remote_head(int nurls, char **urls,
+		DatalinkRemoteMeta *meta);
+
+/* datalink_xact.c */
+extern void datalink_track_token(char mode, const char *token_file,
+		const char *dlpath);
+extern void datalink_track_sync(const char *path, bool data);
+extern void datalink_track_rename(const char *src, const char *dst);
+extern void datalink_track_copies(void);
+extern void datalink_track_usage(void);
+extern void datalink_flush_xact_links(void);
+extern void datalink_track_bulk_unlinks(void);
+
+/*
+ * On disk representation of the native DATALINK data type. The header only
+ * holds the id of the base directory and flags telling which fields are
+ * present, they are followed in dl_data by the current token and the
+ * previous token (UUID_LEN bytes each) then by the NUL terminated path,
+ * relative to the base directory, and comment. Absent fields take no space.
+ */
+typedef struct Datalink
+{
+	int32       vl_len_;       /* varlena header (do not touch directly!) */
+	int32       dl_base;       /* id of the base directory */
+	uint8       dl_flags;      /* DL_HAS_* flags */
+	char        dl_data[FLEXIBLE_ARRAY_MEMBER];
+} Datalink;
+
+#define DL_HAS_BASE        0x01
+#define DL_HAS_PATH        0x02
+#define DL_HAS_COMMENT     0x04
+#define DL_HAS_TOKEN       0x08
+#define DL_HAS_PREV_TOKEN  0x10
+
+#define DatumGetDatalinkP(X)   ((Datalink *) PG_DETOAST_DATUM(X))
+#define PG_GETARG_DATALINK_P(n) DatumGetDatalinkP(PG_GETARG_DATUM(n))
+#define PG_RETURN_DATALINK_P(x) PG_RETURN_POINTER(x)
@@ -0,0 +1,234 @@
+/*
+ * datalink_audit.c
+ *
+ * Filesystem checks used by dl_audit() to find the datalinks whose file has
+ * vanished or changed of size behind the database's back. The paths of a
+ * batch of datalinks are checked by a pool of datalink.dl_io_threads threads
+ * so that the latency of the stat() calls, high on network filesystems, is
+ * overlapped.
+ *
+ * The threads only call lstat() and stat() on the paths and store a status
+ * in a preallocated array, they never call any PostgreSQL function. Signals
+ * are blocked while they are running so that they are always handled by the
+ * backend itself.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+
+#include "datalink.h"
+
+/* Result of the check of a datalink */
+typedef enum DatalinkAuditStatus
+{
+	DL_AUDIT_OK = 0,
+	DL_AUDIT_MISSING,          /* the file does not exist */
+	DL_AUDIT_DANGLING,         /* the path is a symlink to nothing */
+	DL_AUDIT_SIZE              /* the size differs from the expected one */
+} DatalinkAuditStatus;
+
+static const char *const audit_status_names[] = {
+	NULL,
+	"missing",
+	"dangling_symlink",
+	"size_changed"
+};
+
+/* Work shared by the threads of the pool */
+typedef struct DatalinkAuditWork
+{
+	int                 npaths;
+	char              **paths;
+	char              **token_paths;   /* entries can be NULL */
+	int64              *sizes;         /* expected sizes, -1 when unknown */
+	DatalinkAuditStatus *status;
+	pg_atomic_uint32    next;          /* next path to check */
+} DatalinkAuditWork;
+
+Datum		datalink_check_paths(PG_FUNCTION_ARGS);
+
+static DatalinkAuditStatus check_path(const char *path, const char *token_path,
+									  int64 size);
+static void *audit_worker(void *arg);
+static void run_audit_workers(DatalinkAuditWork *work, int nworkers);
+
+/*
+ * Check the path of a datalink. When the file has been renamed with its
+ * token the path itself may not exist or be the symlink of a read token,
+ * the size is the one of the file renamed.
+ */
+static DatalinkAuditStatus
+check_path(const char *path, const char *token_path, int64 size)
+{
+	struct stat st;
+	struct stat data;
+
+	if (token_path != NULL && lstat(token_path, &data) < 0)
+		return DL_AUDIT_MISSING;
+	if (lstat(path, &st) < 0)
+	{
+		if (token_path == NULL)
+			return DL_AUDIT_MISSING;
+	}
+	else if (S_ISLNK(st.st_mode) && stat(path, &st) < 0)
+		return DL_AUDIT_DANGLING;
+	else if (token_path == NULL)
+		data = st;
+
+	if (size >= 0 && (int64) data.st_size != size)
+		return DL_AUDIT_SIZE;
+
+	return DL_AUDIT_OK;
+}
+
+/* Thread of the pool, checks paths until there is none left */
+static void *
+audit_worker(void *arg)
+{
+	DatalinkAuditWork *work = (DatalinkAuditWork *) arg;
+	uint32      i;
+
+	while ((i = pg_atomic_fetch_add_u32(&work->next, 1)) < (uint32) work->npaths)
+		work->status[i] = check_path(work->paths[i], work->token_paths[i],
+									 work->sizes[i]);
+
+	return NULL;
+}
+
+/*
+ * Check all the paths of the work with nworkers threads. The backend checks
+ * the paths itself when no thread can be started.
+ */
+static void
+run_audit_workers(DatalinkAuditWork *work, int nworkers)
+{
+	pthread_t  *threads;
+	sigset_t    blocked;
+	sigset_t    saved;
+	int         nstarted = 0;
+	int         i;
+
+	threads = (pthread_t *) palloc(nworkers * sizeof(pthread_t));
+
+	/* Threads inherit the signal mask, they must not receive any signal */
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_SETMASK, &blocked, &saved);
+	for (i = 0; i < nworkers; i++)
+	{
+		if (pthread_create(&threads[i], NULL, audit_worker, work) != 0)
+			break;
+		nstarted++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	/* Take part in the work, this also handles a failure to start threads */
+	audit_worker(work);
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+
+	pfree(threads);
+}
+
+/*
+ * Check the paths of the datalinks with link control given in the first
+ * array, the second array holds the path of the files renamed with their
+ * token or NULL and the third one the expected size of the files or NULL
+ * when it is unknown. Returns an array of the same size holding NULL for
+ * valid datalinks or the problem found: missing, dangling_symlink or
+ * size_changed.
+ */
+PG_FUNCTION_INFO_V1(datalink_check_paths);
+Datum
+datalink_check_paths(PG_FUNCTION_ARGS)
+{
+	ArrayType          *paths = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType          *token_paths = PG_GETARG_ARRAYTYPE_P(1);
+	ArrayType          *sizes = PG_GETARG_ARRAYTYPE_P(2);
+	Datum              *path_elems;
+	Datum              *token_elems;
+	Datum              *size_elems;
+	bool               *path_nulls;
+	bool               *token_nulls;
+	bool               *size_nulls;
+	int                 npaths;
+	int                 ntokens;
+	int                 nsizes;
+	Datum              *result;
+	bool               *result_nulls;
+	DatalinkAuditWork   work;
+	const char         *setting;
+	int                 nworkers = DATALINK_IO_THREADS;
+	int                 dims[1];
+	int                 lbs[1];
+	int                 i;
+
+	deconstruct_array(paths, TEXTOID, -1, false, 'i',
+						&path_elems, &path_nulls, &npaths);
+	deconstruct_array(token_paths, TEXTOID, -1, false, 'i',
+						&token_elems, &token_nulls, &ntokens);
+	deconstruct_array(sizes, INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd',
+						&size_elems, &size_nulls, &nsizes);
+	if (npaths != ntokens || npaths != nsizes)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("arrays of paths, token paths and sizes must have the same size")));
+	if (npaths == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(TEXTOID));
+
+	work.npaths = npaths;
+	work.paths = (char **) palloc(npaths * sizeof(char *));
+	work.token_paths = (char **) palloc(npaths * sizeof(char *));
+	work.sizes = (int64 *) palloc(npaths * sizeof(int64));
+	work.status = (DatalinkAuditStatus *) palloc0(npaths * sizeof(DatalinkAuditStatus));
+	pg_atomic_init_u32(&work.next, 0);
+	for (i = 0; i < npaths; i++)
+	{
+		if (path_nulls[i])
+			ereport(ERROR,
+					(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+					 errmsg("path of a datalink to check can not be NULL")));
+		work.paths[i] = TextDatumGetCString(path_elems[i]);
+		work.token_paths[i] = token_nulls[i] ? NULL : TextDatumGetCString(token_elems[i]);
+		work.sizes[i] = size_nulls[i] ? -1 : DatumGetInt64(size_elems[i]);
+	}
+
+	setting = GetConfigOption("datalink.dl_io_threads", true, false);
+	if (setting != NULL)
+		nworkers = atoi(setting);
+	/* The backend is one of the workers */
+	nworkers = Min(nworkers, npaths) - 1;
+
+	run_audit_workers(&work, Max(nworkers, 0));
+	CHECK_FOR_INTERRUPTS();
+
+	result = (Datum *) palloc(npaths * sizeof(Datum));
+	result_nulls = (bool *) palloc(npaths * sizeof(bool));
+	for (i = 0; i < npaths; i++)
+	{
+		result_nulls[i] = (work.status[i] == DL_AUDIT_OK);
+		result[i] = result_nulls[i] ? (Datum) 0 :
+				CStringGetTextDatum(audit_status_names[work.status[i]]);
+	}
+
+	dims[0] = npaths;
+	lbs[0] = 1;
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(result, result_nulls, 1, dims, lbs,
+								TEXTOID, -1, false, 'i'));
+}
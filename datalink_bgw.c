@@ -38,6 +38,8 @@
 #include "access/htup_details.h"
 #include "utils/memutils.h"
 #include "utils/varlena.h"
+#include "utils/guc.h"
+#include <ctype.h>
 
 #include "datalink.h"
 
@@ -47,10 +49,52 @@ static int   dl_max_copies;
 static int   dl_naptime;
 static char *dl_token_path;
 static int   dl_token_expiry;
+static char *dl_token_secret;
+static int   dl_token_layout;
+static int   dl_read_token_scope;
+static int   dl_remote_cache_size;
+static int   dl_remote_cache_ttl;
+static int   dl_remote_max_connections;
+static int   dl_remote_max_host_connections;
+static int   dl_remote_timeout;
+static char *dl_remote_cache_directory;
+static int   dl_remote_cache_max_size;
+static int   dl_io_threads;
+static int   dl_lock_table_size;
+static int   dl_object_cache_size;
+static int   dl_object_cache_max_object;
+static int   dl_copy_workers;
+static int   dl_copy_queue_size;
+static int   dl_access_table_size;
+static char *dl_tier_database;
+static int   dl_tier_naptime;
+static int   dl_usage_flush_interval;
+static int   dl_fd_cache_size;
+
+/* Saved hook values in case of unload */
+#if PG_VERSION_NUM >= 150000
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+#endif
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+
+static const struct config_enum_entry dl_token_layout_options[] = {
+	{"flat", DL_LAYOUT_FLAT, false},
+	{"hashed", DL_LAYOUT_HASHED, false},
+	{NULL, 0, false}
+};
+
+static const struct config_enum_entry dl_read_token_scope_options[] = {
+	{"file", DL_TOKEN_SCOPE_FILE, false},
+	{"transaction", DL_TOKEN_SCOPE_TRANSACTION, false},
+	{NULL, 0, false}
+};
 
 void _PG_init(void);
 void datalink_bgw_main(Datum main_arg) ;
-bool process_expired_token(char *token_str);
+static void datalink_shmem_request(void);
+static void datalink_shmem_startup(void);
+bool process_expired_token(const char *dirpath, char *token_str);
+static void scan_token_directory(const char *dirpath, int depth);
 
 /* flags set by signal handlers */
 static volatile sig_atomic_t got_sighup = false;
@@ -152,6 +196,41 @@ _PG_init(void)
 				NULL,
 				NULL);
 
+	DefineCustomStringVariable("datalink.dl_token_secret",
+				"Server secret used to sign access control tokens, signed tokens are verified without token file.",
+				NULL,
+				&dl_token_secret,
+				DATALINK_TOKEN_SECRET,
+				PGC_SIGHUP,
+				GUC_SUPERUSER_ONLY,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomEnumVariable("datalink.dl_token_layout",
+				"Layout of the token files and of the files named with a token, flat or hashed into subdirectories.",
+				NULL,
+				&dl_token_layout,
+				DATALINK_TOKEN_LAYOUT,
+				dl_token_layout_options,
+				PGC_SIGHUP,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomEnumVariable("datalink.dl_read_token_scope",
+				"Scope of the read tokens, one per file or one shared by the files handed out by a transaction.",
+				NULL,
+				&dl_read_token_scope,
+				DATALINK_READ_TOKEN_SCOPE,
+				dl_read_token_scope_options,
+				PGC_USERSET,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
 	DefineCustomIntVariable("datalink.dl_keep_max_copies",
 				"This configuration directive set the maximum number of copies to keep in the base directories before bein removed.",
 				NULL,
@@ -165,20 +244,317 @@ _PG_init(void)
 				NULL,
 				NULL);
 
+	DefineCustomIntVariable("datalink.dl_remote_cache_size",
+				"Maximum number of remote URLs whose metadata are kept in shared memory.",
+				NULL,
+				&dl_remote_cache_size,
+				DATALINK_REMOTE_CACHE_SIZE,
+				0,
+				INT_MAX / 2,
+				PGC_POSTMASTER,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_remote_cache_ttl",
+				"Time in seconds during which cached metadata of a remote URL are used.",
+				NULL,
+				&dl_remote_cache_ttl,
+				DATALINK_REMOTE_CACHE_TTL,
+				0,
+				INT_MAX / 1000,
+				PGC_SIGHUP,
+				GUC_UNIT_S,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_remote_max_connections",
+				"Maximum number of concurrent requests to remote servers.",
+				NULL,
+				&dl_remote_max_connections,
+				DATALINK_REMOTE_MAX_CONNECTIONS,
+				1,
+				1024,
+				PGC_USERSET,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_remote_max_host_connections",
+				"Maximum number of concurrent requests to the same remote host.",
+				NULL,
+				&dl_remote_max_host_connections,
+				DATALINK_REMOTE_MAX_HOST_CONNECTIONS,
+				1,
+				1024,
+				PGC_USERSET,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_remote_timeout",
+				"Timeout in seconds of a request to a remote server.",
+				NULL,
+				&dl_remote_timeout,
+				DATALINK_REMOTE_TIMEOUT,
+				1,
+				3600,
+				PGC_USERSET,
+				GUC_UNIT_S,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomStringVariable("datalink.dl_remote_cache_directory",
+				"Directory where the content of remote files is cached.",
+				NULL,
+				&dl_remote_cache_directory,
+				DATALINK_REMOTE_CACHE_DIRECTORY,
+				PGC_SIGHUP,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_remote_cache_max_size",
+				"Maximum size of the cache of remote file content, 0 disables the cache.",
+				NULL,
+				&dl_remote_cache_max_size,
+				DATALINK_REMOTE_CACHE_MAX_SIZE,
+				0,
+				INT_MAX,
+				PGC_SIGHUP,
+				GUC_UNIT_KB,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_lock_table_size",
+				"Maximum number of external files locked at the same time.",
+				NULL,
+				&dl_lock_table_size,
+				DATALINK_LOCK_TABLE_SIZE,
+				0,
+				INT_MAX / 2,
+				PGC_POSTMASTER,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_object_cache_size",
+				"Size of the shared memory cache of small external files, 0 disables it.",
+				NULL,
+				&dl_object_cache_size,
+				DATALINK_OBJECT_CACHE_SIZE,
+				0,
+				INT_MAX / 2,
+				PGC_POSTMASTER,
+				GUC_UNIT_KB,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_object_cache_max_object",
+				"Size of the largest external file kept in the object cache.",
+				NULL,
+				&dl_object_cache_max_object,
+				DATALINK_OBJECT_CACHE_MAX_OBJECT,
+				1,
+				1024 * 1024,
+				PGC_POSTMASTER,
+				GUC_UNIT_KB,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_io_threads",
+				"Number of threads of a backend calling the filesystem for dl_audit(), dl_changes(), dl_snapshot_create() and dl_process_unlinks().",
+				NULL,
+				&dl_io_threads,
+				DATALINK_IO_THREADS,
+				1,
+				DATALINK_IO_THREADS_MAX,
+				PGC_SUSET,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_copy_workers",
+				"Maximum number of background workers copying files for dlurlcompletewrite(), 0 for synchronous copies.",
+				NULL,
+				&dl_copy_workers,
+				DATALINK_COPY_WORKERS,
+				0,
+				64,
+				PGC_SIGHUP,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_copy_queue_size",
+				"Maximum number of asynchronous copies queued or in progress.",
+				NULL,
+				&dl_copy_queue_size,
+				DATALINK_COPY_QUEUE_SIZE,
+				0,
+				INT_MAX / 2,
+				PGC_POSTMASTER,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_access_table_size",
+				"Maximum number of files whose accesses are recorded between two flushes.",
+				NULL,
+				&dl_access_table_size,
+				DATALINK_ACCESS_TABLE_SIZE,
+				0,
+				INT_MAX / 2,
+				PGC_POSTMASTER,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomStringVariable("datalink.dl_tier_database",
+				"Database where the cold files are moved to the tier directories, empty disables the tiering worker.",
+				NULL,
+				&dl_tier_database,
+				DATALINK_TIER_DATABASE,
+				PGC_POSTMASTER,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_tier_naptime",
+				"How often the cold files are moved to the tier directories (in seconds).",
+				NULL,
+				&dl_tier_naptime,
+				DATALINK_TIER_NAPTIME,
+				1,
+				INT_MAX / 1000,
+				PGC_SIGHUP,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_usage_flush_interval",
+				"How often the space used by the base directories is written to pg_datalink_usage (in seconds), 0 disables it.",
+				NULL,
+				&dl_usage_flush_interval,
+				DATALINK_USAGE_FLUSH_INTERVAL,
+				0,
+				INT_MAX / 1000,
+				PGC_SIGHUP,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	DefineCustomIntVariable("datalink.dl_fd_cache_size",
+				"Maximum number of external files kept open by a session between two reads, 0 disables it.",
+				NULL,
+				&dl_fd_cache_size,
+				DATALINK_FD_CACHE_SIZE,
+				0,
+				DL_FD_CACHE_MAX,
+				PGC_USERSET,
+				0,
+				NULL,
+				NULL,
+				NULL);
+
+	/* Command type of the statements calling the datalink functions */
+	datalink_command_init();
+
 	if (!process_shared_preload_libraries_in_progress)
 		return;
 
+	/* Shared memory used by the caches */
+#if PG_VERSION_NUM >= 150000
+	prev_shmem_request_hook = shmem_request_hook;
+	shmem_request_hook = datalink_shmem_request;
+#else
+	datalink_shmem_request();
+#endif
+	prev_shmem_startup_hook = shmem_startup_hook;
+	shmem_startup_hook = datalink_shmem_startup;
+
 	/* Start when database starts */
 	sprintf(worker.bgw_name, "Datalink background worker");
 	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
 	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
 	worker.bgw_restart_time = 600; /* Restart after 10min in case of crash */
-	sprintf(worker.bgw_library_name, "datalink_bgw");
+	sprintf(worker.bgw_library_name, "datalink");
 	sprintf(worker.bgw_function_name, "datalink_bgw_main");
 	worker.bgw_main_arg = (Datum) 0;
 	worker.bgw_notify_pid = 0;
 	RegisterBackgroundWorker(&worker);
 
+	/* Move the cold files to the tier directories */
+	if (dl_tier_database[0] != '\0')
+	{
+		memset(&worker, 0, sizeof(worker));
+		sprintf(worker.bgw_name, "Datalink tiering worker");
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = 60;
+		sprintf(worker.bgw_library_name, "datalink");
+		sprintf(worker.bgw_function_name, "datalink_tier_worker_main");
+		worker.bgw_main_arg = (Datum) 0;
+		worker.bgw_notify_pid = 0;
+		RegisterBackgroundWorker(&worker);
+	}
+}
+
+/*
+ * Request the shared memory and the locks used by the extension
+ */
+static void
+datalink_shmem_request(void)
+{
+#if PG_VERSION_NUM >= 150000
+	if (prev_shmem_request_hook)
+		prev_shmem_request_hook();
+#endif
+
+	datalink_remote_shmem_request(dl_remote_cache_size);
+	datalink_lock_shmem_request(dl_lock_table_size);
+	datalink_objcache_shmem_request(dl_object_cache_size, dl_object_cache_max_object);
+	datalink_throttle_shmem_request();
+	datalink_copy_shmem_request(dl_copy_queue_size);
+	datalink_access_shmem_request(dl_access_table_size);
+	datalink_usage_shmem_request();
+}
+
+/*
+ * Allocate or attach to the shared memory used by the extension
+ */
+static void
+datalink_shmem_startup(void)
+{
+	if (prev_shmem_startup_hook)
+		prev_shmem_startup_hook();
+
+	LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+	datalink_remote_shmem_init(dl_remote_cache_size);
+	datalink_lock_shmem_init(dl_lock_table_size);
+	datalink_objcache_shmem_init(dl_object_cache_size, dl_object_cache_max_object);
+	datalink_throttle_shmem_init();
+	datalink_copy_shmem_init(dl_copy_queue_size);
+	datalink_access_shmem_init(dl_access_table_size);
+	datalink_usage_shmem_init();
+	LWLockRelease(AddinShmemInitLock);
 }
 
 void
@@ -201,8 +577,6 @@ datalink_bgw_main(Datum main_arg)
 	 */
 	while (!got_sigterm)
 	{
-		DIR *d;
-		struct dirent *dir;
 		int             rc;
 
 		/* Using Latch loop method suggested in latch.h
@@ -218,25 +592,15 @@ datalink_bgw_main(Datum main_arg)
 			ProcessConfigFile(PGC_SIGHUP);
 		}
 
-		/* Get the list of token files to check */
-		d = opendir(dl_token_path);
-		if (d)
-		{
-			while ((dir = readdir(d)) != NULL)
-			{
-				if (dir->d_type == DT_REG)
-				{
-					/*
-					 * Check for validity of the token.
-					 * If delta creation time is > dl_token_expiry th token can be removed
-					 * only if the transaction is not in progress.
-					 */
-					if (process_expired_token(dir->d_name))
-						elog(LOG, "token file %s has expired", dir->d_name);
-				}
-			}
-			closedir(d);
-		}
+		/*
+		 * Get the list of token files to check, the fan-out subdirectories
+		 * are always looked at so that tokens are found whatever the layout
+		 * they have been registered with.
+		 */
+		scan_token_directory(dl_token_path, 0);
+
+		/* Write the space used by the base directories to their database */
+		datalink_usage_launch_flush(dl_usage_flush_interval);
 
 		iteration++;
 
@@ -257,6 +621,46 @@ datalink_bgw_main(Datum main_arg)
 	} /* End of main loop */
 }
 
+/*
+ * Look for expired tokens in a directory of token files. With the hashed
+ * layout token files are stored two levels below into subdirectories named
+ * with two hexadecimal digits.
+ */
+static void
+scan_token_directory(const char *dirpath, int depth)
+{
+	DIR *d;
+	struct dirent *dir;
+	char subdir[MAXPGPATH];
+
+	d = opendir(dirpath);
+	if (!d)
+		return;
+
+	while ((dir = readdir(d)) != NULL)
+	{
+		if (dir->d_type == DT_REG)
+		{
+			/*
+			 * Check for validity of the token.
+			 * If delta creation time is > dl_token_expiry th token can be removed
+			 * only if the transaction is not in progress.
+			 */
+			if (process_expired_token(dirpath, dir->d_name))
+				elog(LOG, "token file %s has expired", dir->d_name);
+		}
+		else if (dir->d_type == DT_DIR && depth < 2
+				&& strlen(dir->d_name) == 2
+				&& isxdigit((unsigned char) dir->d_name[0])
+				&& isxdigit((unsigned char) dir->d_name[1]))
+		{
+			snprintf(subdir, sizeof(subdir), "%s/%s", dirpath, dir->d_name);
+			scan_token_directory(subdir, depth + 1);
+		}
+	}
+	closedir(d);
+}
+
 /*
  * Check for validity of the token and remove files if required.
  * If delta creation time is > dl_token_expiry the token can be removed only
@@ -267,7 +671,7 @@ datalink_bgw_main(Datum main_arg)
  * nothing have been done.
  */
 bool
-process_expired_token(char *token_str)
+process_expired_token(const char *dirpath, char *token_str)
 {
 	FILE    *fd_in;
 	int     nread;
@@ -279,13 +683,20 @@ process_expired_token(char *token_str)
 	struct token_data token;
 
 	/* Open the token file */
-	snprintf(in_fnamebuf, sizeof(in_fnamebuf), "%s/%s", dl_token_path, token_str);
+	snprintf(in_fnamebuf, sizeof(in_fnamebuf), "%s/%s", dirpath, token_str);
 
-	/* First check if the token has expired */
+	/*
+	 * First check if the token has expired. The token file may have been
+	 * removed at end of its transaction since the directory was read.
+	 */
 	if (stat(in_fnamebuf, &fst) == -1)
+	{
+		if (errno == ENOENT)
+			return false;
 		ereport(ERROR,
 				(errcode_for_file_access(),
 				 errmsg("can not stat file \"%s\": %m", in_fnamebuf)));
+	}
 	curtime = time(NULL);
 	/*
 	 * When it is still valid there is nothing more to do even if the transaction
@@ -297,6 +708,8 @@ process_expired_token(char *token_str)
 	/* Look at file content to extract the transaction id and the path to the external file */
 	fd_in = fopen(in_fnamebuf, "r");
 	if (!fd_in) {
+		if (errno == ENOENT)
+			return false;
 		ereport(ERROR,
 				(errcode_for_file_access(),
 				 errmsg("could not open server file \"%s\": %m",
@@ -353,11 +766,15 @@ process_expired_token(char *token_str)
 		 */
 		if (write_token && strcmp(status, "aborted") == 0)
 		{
+			int64   size = datalink_usage_size(token.dlpath);
+
 			/* Remove external file */
 			if (unlink(token.dlpath) != 0 && errno != ENOENT)
 				ereport(ERROR,
 						(errcode_for_file_access(),
 						 errmsg("could not remove external file \"%s\": %m", token.dlpath)));
+			if (size >= 0)
+				datalink_usage_add(token.dlpath, DL_USAGE_PENDING, -size, -1);
 		}
 		/* For a read token we remove the symlink whatever is the transation state */
 		if (!write_token)
@@ -0,0 +1,256 @@
+/*
+ * datalink_command.c
+ *
+ * Command type of the statements in which the datalink functions are
+ * called. dlvalue(), dlnewcopy() and dlpreviouscopy() are only allowed in
+ * an INSERT or an UPDATE statement. The executor hooks push the command
+ * type of a statement each time it is run or finished and pop it when it
+ * returns, so that datalink_current_command() only has to look at the
+ * enclosing statements instead of parsing the query text for each row.
+ * The type is pushed by ExecutorRun() and not recorded at ExecutorStart():
+ * the portals of a session, cursors for instance, can be started and then
+ * run interleaved.
+ *
+ * The command returned is the one of the innermost statement running, the
+ * one calling the function. The checks of the PL/pgSQL functions are simple
+ * expressions evaluated without the executor so they do not hide it. NULL
+ * is returned when it is not known, because the extension has been loaded
+ * during the current statement or the function is not called from the
+ * executor. A MERGE statement can both insert and update, the functions
+ * allowed in either of them are allowed in a MERGE.
+ *
+ * The rows of the outermost statement are sent through a receiver that
+ * first creates the links of the transaction scoped read token still
+ * queued, so that a client never receives the URL of a link that does not
+ * exist yet, even when it fetches the rows of a cursor one by one.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "executor/executor.h"
+#include "tcop/dest.h"
+#include "fmgr.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "datalink.h"
+
+/* Saved hook values in case of unload */
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
+static ExecutorFinish_hook_type prev_ExecutorFinish = NULL;
+
+/* Command type of the statements by nesting level */
+static CmdType *command_stack = NULL;
+static int  command_stack_size = 0;
+static int  command_level = 0;
+
+/* Statement during which the hooks have been installed */
+static TimestampTz command_load_stmt = 0;
+
+/* Receiver of the outermost statement creating the links before each row */
+typedef struct LinkReceiver
+{
+	DestReceiver    pub;
+	DestReceiver   *dest;          /* receiver of the statement */
+} LinkReceiver;
+
+#if PG_VERSION_NUM >= 180000
+static void datalink_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+								 uint64 count);
+#else
+static void datalink_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction,
+								 uint64 count, bool execute_once);
+#endif
+static void datalink_ExecutorFinish(QueryDesc *queryDesc);
+static void command_push(CmdType operation);
+static bool link_receive(TupleTableSlot *slot, DestReceiver *self);
+static void link_startup(DestReceiver *self, int operation, TupleDesc typeinfo);
+static void link_shutdown(DestReceiver *self);
+static void link_destroy(DestReceiver *self);
+static const char *command_name(CmdType operation);
+
+/* Install the executor hooks, called from _PG_init() */
+void
+datalink_command_init(void)
+{
+	if (IsTransactionState())
+		command_load_stmt = GetCurrentStatementStartTimestamp();
+
+	prev_ExecutorRun = ExecutorRun_hook;
+	ExecutorRun_hook = datalink_ExecutorRun;
+	prev_ExecutorFinish = ExecutorFinish_hook;
+	ExecutorFinish_hook = datalink_ExecutorFinish;
+}
+
+/* Enter a statement of the given command type */
+static void
+command_push(CmdType operation)
+{
+	if (command_level >= command_stack_size)
+	{
+		int     newsize = Max(command_stack_size * 2, 16);
+
+		if (command_stack == NULL)
+			command_stack = (CmdType *) MemoryContextAlloc(TopMemoryContext,
+												newsize * sizeof(CmdType));
+		else
+			command_stack = (CmdType *) repalloc(command_stack,
+												newsize * sizeof(CmdType));
+		command_stack_size = newsize;
+	}
+	command_stack[command_level++] = operation;
+}
+
+/* Create the links still queued before the row is sent */
+static bool
+link_receive(TupleTableSlot *slot, DestReceiver *self)
+{
+	LinkReceiver   *receiver = (LinkReceiver *) self;
+
+	datalink_flush_xact_links();
+
+	return receiver->dest->receiveSlot(slot, receiver->dest);
+}
+
+static void
+link_startup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+	LinkReceiver   *receiver = (LinkReceiver *) self;
+
+	receiver->dest->rStartup(receiver->dest, operation, typeinfo);
+}
+
+static void
+link_shutdown(DestReceiver *self)
+{
+	LinkReceiver   *receiver = (LinkReceiver *) self;
+
+	receiver->dest->rShutdown(receiver->dest);
+}
+
+/* The receiver of the statement is destroyed by its owner */
+static void
+link_destroy(DestReceiver *self)
+{
+}
+
+#if PG_VERSION_NUM >= 180000
+static void
+datalink_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count)
+#else
+static void
+datalink_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
+					 bool execute_once)
+#endif
+{
+	DestReceiver   *dest = queryDesc->dest;
+	LinkReceiver    receiver;
+
+	/* Only the rows sent by the outermost statement can reach the client */
+	if (command_level == 0)
+	{
+		receiver.pub.receiveSlot = link_receive;
+		receiver.pub.rStartup = link_startup;
+		receiver.pub.rShutdown = link_shutdown;
+		receiver.pub.rDestroy = link_destroy;
+		receiver.pub.mydest = dest->mydest;
+		receiver.dest = dest;
+		queryDesc->dest = &receiver.pub;
+	}
+
+	command_push(queryDesc->operation);
+	PG_TRY();
+	{
+#if PG_VERSION_NUM >= 180000
+		if (prev_ExecutorRun)
+			prev_ExecutorRun(queryDesc, direction, count);
+		else
+			standard_ExecutorRun(queryDesc, direction, count);
+#else
+		if (prev_ExecutorRun)
+			prev_ExecutorRun(queryDesc, direction, count, execute_once);
+		else
+			standard_ExecutorRun(queryDesc, direction, count, execute_once);
+#endif
+	}
+	PG_CATCH();
+	{
+		command_level--;
+		queryDesc->dest = dest;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	command_level--;
+	queryDesc->dest = dest;
+}
+
+/*
+ * The AFTER triggers are fired here, they belong to the statement too. When
+ * the outermost statement finishes the links of the transaction scoped read
+ * token still queued are created, the client may use them from now.
+ */
+static void
+datalink_ExecutorFinish(QueryDesc *queryDesc)
+{
+	command_push(queryDesc->operation);
+	PG_TRY();
+	{
+		if (prev_ExecutorFinish)
+			prev_ExecutorFinish(queryDesc);
+		else
+			standard_ExecutorFinish(queryDesc);
+	}
+	PG_CATCH();
+	{
+		command_level--;
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	command_level--;
+
+	if (command_level == 0)
+		datalink_flush_xact_links();
+}
+
+static const char *
+command_name(CmdType operation)
+{
+	switch (operation)
+	{
+		case CMD_SELECT:
+			return "SELECT";
+		case CMD_INSERT:
+			return "INSERT";
+		case CMD_UPDATE:
+			return "UPDATE";
+		case CMD_DELETE:
+			return "DELETE";
+#if PG_VERSION_NUM >= 150000
+		case CMD_MERGE:
+			return "MERGE";
+#endif
+		default:
+			return "OTHER";
+	}
+}
+
+/*
+ * Return the command of the innermost statement running or NULL when it is
+ * not known.
+ */
+PG_FUNCTION_INFO_V1(datalink_current_command);
+Datum
+datalink_current_command(PG_FUNCTION_ARGS)
+{
+	if (command_level == 0 ||
+		GetCurrentStatementStartTimestamp() == command_load_stmt)
+		PG_RETURN_NULL();
+
+	PG_RETURN_TEXT_P(cstring_to_text(command_name(command_stack[command_level - 1])));
+}
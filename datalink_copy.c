@@ -0,0 +1,815 @@
+/*
+ * datalink_copy.c
+ *
+ * Asynchronous copies of the external files done for the write tokens of
+ * dlurlcompletewrite(). When datalink.dl_copy_workers is set, the copy is
+ * queued in shared memory and done by a pool of dynamic background workers,
+ * the URL with the write token is returned at once. dlwritefile() and
+ * dlnewcopy() wait on a condition variable for the copy of the file they
+ * work on when it is not finished yet. The copies in progress are shown by
+ * view pg_datalink_copies.
+ *
+ * A worker is started for a database when a copy is queued and less than
+ * datalink.dl_copy_workers workers are running. It connects to the database
+ * so that the copy is done in a transaction with the same locks, throttling
+ * and flush to disk as a synchronous one, then processes the queued copies
+ * of its database until there is none left. When it exits it starts a worker
+ * for another database whose copies are waiting for a free worker.
+ *
+ * Queued and running copies of a transaction that aborts are canceled and
+ * the partial copy is removed. The copy is done synchronously when the queue
+ * is not available, is full or no worker can be started. A backend waiting
+ * for a copy still queued while no worker is running or starting takes it
+ * back and does it itself. A failed copy keeps its slot until its error has
+ * been reported to a waiter, or until the write token has expired. The queue
+ * is only available when the extension is loaded with shared_preload_libraries.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/condition_variable.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 170000
+#include "utils/wait_event.h"
+#endif
+
+#include "datalink.h"
+
+/* State of a slot of the copy queue */
+typedef enum DatalinkCopyState
+{
+	DL_COPY_FREE = 0,
+	DL_COPY_QUEUED,
+	DL_COPY_RUNNING,
+	DL_COPY_DONE,
+	DL_COPY_FAILED
+} DatalinkCopyState;
+
+static const char *const copy_state_names[] = {
+	"free",
+	"queued",
+	"running",
+	"done",
+	"failed"
+};
+
+/* Copy of a file, queued by a backend and done by a worker */
+typedef struct DatalinkCopySlot
+{
+	DatalinkCopyState state;
+	bool        canceled;      /* the transaction of the backend has aborted */
+	Oid         dboid;
+	int         pid;           /* backend that has queued the copy */
+	int         worker_pid;
+	uint64      seq;           /* queue order */
+	TimestampTz queued_at;
+	int64       bytes_total;
+	pg_atomic_uint64 bytes_done;
+	ConditionVariable cv;      /* signaled when the copy is done or failed */
+	char        src[MAXPGPATH];
+	char        dst[MAXPGPATH];
+	char        error[DL_COPY_ERROR_LEN];
+} DatalinkCopySlot;
+
+typedef struct DatalinkCopyShared
+{
+	LWLock     *lock;
+	int         nworkers;      /* workers attached and not exited */
+	int         nstarting;     /* workers registered and not started yet */
+	uint64      next_seq;
+	int         nslots;
+	DatalinkCopySlot slots[FLEXIBLE_ARRAY_MEMBER];
+} DatalinkCopyShared;
+
+static DatalinkCopyShared *copy_shared = NULL;
+
+/* Slot copied by this process when it is a copy worker */
+static DatalinkCopySlot *copy_current = NULL;
+/* Whether this worker is still counted in nworkers */
+static bool copy_counted = false;
+/* Whether this backend has queued copies in the current transaction */
+static bool copy_queued = false;
+
+static uint32 copy_wait_event = 0;
+
+Datum		datalink_queue_copy(PG_FUNCTION_ARGS);
+Datum		datalink_wait_copy(PG_FUNCTION_ARGS);
+Datum		datalink_copy_status(PG_FUNCTION_ARGS);
+PGDLLEXPORT void datalink_copy_worker_main(Datum main_arg);
+
+static int  copy_max_workers(void);
+static bool copy_launch_worker(Oid dboid);
+static void copy_wake_stranded(void);
+static bool copy_slot_reusable(DatalinkCopySlot *slot, TimestampTz now);
+static int  copy_claim(Oid dboid, Oid *relaunch);
+static void copy_run(DatalinkCopySlot *slot);
+static void copy_worker_exit(int code, Datum arg);
+static bool copy_sync(text *src, text *dst);
+
+/* Reserve shared memory for the queue, called from _PG_init() */
+void
+datalink_copy_shmem_request(int queue_size)
+{
+	if (queue_size <= 0)
+		return;
+
+	RequestAddinShmemSpace(MAXALIGN(offsetof(DatalinkCopyShared, slots) +
+								queue_size * sizeof(DatalinkCopySlot)));
+	RequestNamedLWLockTranche("datalink_copy", 1);
+}
+
+/* Attach to the shared copy queue, AddinShmemInitLock is held */
+void
+datalink_copy_shmem_init(int queue_size)
+{
+	bool        found;
+	int         i;
+
+	if (queue_size <= 0)
+		return;
+
+	copy_shared = ShmemInitStruct("datalink copy queue",
+							offsetof(DatalinkCopyShared, slots) +
+							queue_size * sizeof(DatalinkCopySlot), &found);
+	if (!found)
+	{
+		copy_shared->lock = &(GetNamedLWLockTranche("datalink_copy"))->lock;
+		copy_shared->nworkers = 0;
+		copy_shared->nstarting = 0;
+		copy_shared->next_seq = 0;
+		copy_shared->nslots = queue_size;
+		for (i = 0; i < queue_size; i++)
+		{
+			DatalinkCopySlot *slot = &copy_shared->slots[i];
+
+			memset(slot, 0, sizeof(DatalinkCopySlot));
+			pg_atomic_init_u64(&slot->bytes_done, 0);
+			ConditionVariableInit(&slot->cv);
+		}
+	}
+}
+
+/* Maximum number of copy workers, 0 when copies are synchronous */
+static int
+copy_max_workers(void)
+{
+	const char *setting = GetConfigOption("datalink.dl_copy_workers", true, false);
+
+	return (setting != NULL) ? atoi(setting) : DATALINK_COPY_WORKERS;
+}
+
+/*
+ * Start a copy worker for a database and wait for the postmaster to start
+ * it, it is counted as starting meanwhile. Returns false when it can not be
+ * started.
+ */
+static bool
+copy_launch_worker(Oid dboid)
+{
+	BackgroundWorker        worker;
+	BackgroundWorkerHandle *handle;
+	BgwHandleStatus         status;
+	pid_t                   pid;
+	bool                    started;
+
+	memset(&worker, 0, sizeof(worker));
+	snprintf(worker.bgw_name, BGW_MAXLEN, "Datalink copy worker");
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "datalink copy worker");
+#endif
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "datalink");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "datalink_copy_worker_main");
+	worker.bgw_main_arg = ObjectIdGetDatum(dboid);
+	worker.bgw_notify_pid = MyProcPid;
+
+	LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+	copy_shared->nstarting++;
+	LWLockRelease(copy_shared->lock);
+
+	PG_TRY();
+	{
+		started = RegisterDynamicBackgroundWorker(&worker, &handle);
+		if (started)
+		{
+			status = WaitForBackgroundWorkerStartup(handle, &pid);
+			started = (status == BGWH_STARTED);
+		}
+	}
+	PG_CATCH();
+	{
+		LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+		copy_shared->nstarting--;
+		copy_wake_stranded();
+		LWLockRelease(copy_shared->lock);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	/* A started worker counts itself as running */
+	LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+	copy_shared->nstarting--;
+	if (!started)
+		copy_wake_stranded();
+	LWLockRelease(copy_shared->lock);
+
+	return started;
+}
+
+/*
+ * Wake up the backends waiting for queued copies when no worker is running
+ * or starting anymore, they take back the copies and do them themselves.
+ * The lock of the queue must be held.
+ */
+static void
+copy_wake_stranded(void)
+{
+	int     i;
+
+	if (copy_shared->nworkers + copy_shared->nstarting > 0)
+		return;
+
+	for (i = 0; i < copy_shared->nslots; i++)
+	{
+		if (copy_shared->slots[i].state == DL_COPY_QUEUED)
+			ConditionVariableBroadcast(&copy_shared->slots[i].cv);
+	}
+}
+
+/*
+ * Whether a slot can be taken for a new copy. The error of a failed copy
+ * is kept for the waiter until the write token of the copy has expired.
+ */
+static bool
+copy_slot_reusable(DatalinkCopySlot *slot, TimestampTz now)
+{
+	const char *expiry;
+
+	if (slot->state == DL_COPY_FREE || slot->state == DL_COPY_DONE)
+		return true;
+	if (slot->state != DL_COPY_FAILED)
+		return false;
+
+	expiry = GetConfigOption("datalink.dl_token_expiry", true, false);
+	return TimestampDifferenceExceeds(slot->queued_at, now,
+					1000 * ((expiry != NULL) ? atoi(expiry) : DATALINK_TOKEN_EXPIRY));
+}
+
+/* Copy a file in the calling backend */
+static bool
+copy_sync(text *src, text *dst)
+{
+	return DatumGetBool(DirectFunctionCall2(datalink_copy_localfile,
+											PointerGetDatum(src),
+											PointerGetDatum(dst)));
+}
+
+/*
+ * Queue the copy of a file for a copy worker, or copy it at once when the
+ * copy can not be done asynchronously. Returns false when the synchronous
+ * copy has failed.
+ */
+PG_FUNCTION_INFO_V1(datalink_queue_copy);
+Datum
+datalink_queue_copy(PG_FUNCTION_ARGS)
+{
+	text               *src = PG_GETARG_TEXT_PP(0);
+	text               *dst = PG_GETARG_TEXT_PP(1);
+	char               *src_path = text_to_cstring(src);
+	char               *dst_path = text_to_cstring(dst);
+	int                 max_workers = copy_max_workers();
+	DatalinkCopySlot   *slot = NULL;
+	TimestampTz         now = GetCurrentTimestamp();
+	bool                launch;
+	struct stat         st;
+	int                 i;
+
+	if (copy_shared == NULL || max_workers <= 0
+		|| strlen(src_path) >= MAXPGPATH || strlen(dst_path) >= MAXPGPATH)
+		PG_RETURN_BOOL(copy_sync(src, dst));
+
+	/* Errors on the source file are reported to the caller */
+	if (stat(src_path, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", src_path)));
+
+	/* A copy over the quotas is refused now, not by the copy worker */
+	datalink_usage_check(dst_path, st.st_size, 1);
+
+	LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+	/* Take a free slot or the one of a finished copy */
+	for (i = 0; i < copy_shared->nslots; i++)
+	{
+		if (copy_slot_reusable(&copy_shared->slots[i], now))
+		{
+			slot = &copy_shared->slots[i];
+			break;
+		}
+	}
+	if (slot == NULL)
+	{
+		LWLockRelease(copy_shared->lock);
+		PG_RETURN_BOOL(copy_sync(src, dst));
+	}
+	slot->state = DL_COPY_QUEUED;
+	slot->canceled = false;
+	slot->dboid = MyDatabaseId;
+	slot->pid = MyProcPid;
+	slot->worker_pid = 0;
+	slot->seq = copy_shared->next_seq++;
+	slot->queued_at = now;
+	slot->bytes_total = st.st_size;
+	pg_atomic_write_u64(&slot->bytes_done, 0);
+	strlcpy(slot->src, src_path, MAXPGPATH);
+	strlcpy(slot->dst, dst_path, MAXPGPATH);
+	slot->error[0] = '\0';
+	launch = (copy_shared->nworkers + copy_shared->nstarting < max_workers);
+	LWLockRelease(copy_shared->lock);
+
+	copy_queued = true;
+	datalink_track_copies();
+
+	/*
+	 * Without a worker running nobody would process the copy, take it back
+	 * if it is still queued and do it now.
+	 */
+	if (launch && !copy_launch_worker(MyDatabaseId))
+	{
+		bool    take_back = false;
+
+		LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+		if (copy_shared->nworkers + copy_shared->nstarting == 0
+			&& slot->state == DL_COPY_QUEUED && slot->pid == MyProcPid)
+		{
+			slot->state = DL_COPY_FREE;
+			take_back = true;
+		}
+		LWLockRelease(copy_shared->lock);
+
+		if (take_back)
+			PG_RETURN_BOOL(copy_sync(src, dst));
+	}
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Wait for the copy of a file to be done when it has been queued. Raises
+ * an error when the copy has failed. A copy still queued while no worker is
+ * running or starting is done by the calling backend.
+ */
+PG_FUNCTION_INFO_V1(datalink_wait_copy);
+Datum
+datalink_wait_copy(PG_FUNCTION_ARGS)
+{
+	char               *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	DatalinkCopySlot   *slot = NULL;
+	char                error[DL_COPY_ERROR_LEN];
+	char                src[MAXPGPATH];
+	bool                failed = false;
+	bool                take_back = false;
+	int                 i;
+
+	if (copy_shared == NULL)
+		PG_RETURN_BOOL(true);
+
+#if PG_VERSION_NUM >= 170000
+	if (copy_wait_event == 0)
+		copy_wait_event = WaitEventExtensionNew("DatalinkCopyWait");
+#else
+	copy_wait_event = PG_WAIT_EXTENSION;
+#endif
+
+	LWLockAcquire(copy_shared->lock, LW_SHARED);
+	for (i = 0; i < copy_shared->nslots; i++)
+	{
+		DatalinkCopySlot *s = &copy_shared->slots[i];
+
+		if (s->state != DL_COPY_FREE && strcmp(s->dst, path) == 0)
+		{
+			slot = s;
+			break;
+		}
+	}
+	LWLockRelease(copy_shared->lock);
+
+	if (slot == NULL)
+		PG_RETURN_BOOL(true);
+
+	for (;;)
+	{
+		bool    finished;
+
+		LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+		if (slot->state == DL_COPY_FREE || strcmp(slot->dst, path) != 0)
+			finished = true;    /* reused by another copy, ours is done */
+		else if (slot->state == DL_COPY_DONE || slot->state == DL_COPY_FAILED)
+		{
+			failed = (slot->state == DL_COPY_FAILED);
+			strlcpy(error, slot->error, sizeof(error));
+			slot->state = DL_COPY_FREE;
+			finished = true;
+		}
+		else if (slot->state == DL_COPY_QUEUED
+				 && copy_shared->nworkers + copy_shared->nstarting == 0)
+		{
+			/* nobody would ever process it */
+			strlcpy(src, slot->src, MAXPGPATH);
+			slot->state = DL_COPY_RUNNING;
+			slot->worker_pid = MyProcPid;
+			take_back = true;
+			finished = true;
+		}
+		else if (slot->state == DL_COPY_RUNNING && slot->worker_pid != 0
+				 && kill(slot->worker_pid, 0) < 0 && errno == ESRCH)
+		{
+			/* the process doing the copy has died without reporting */
+			failed = true;
+			strlcpy(error, "the copy worker has exited", sizeof(error));
+			slot->state = DL_COPY_FREE;
+			finished = true;
+		}
+		else
+			finished = false;
+		LWLockRelease(copy_shared->lock);
+
+		if (finished)
+			break;
+#if PG_VERSION_NUM >= 130000
+		/* the timeout covers a worker that could not be started */
+		(void) ConditionVariableTimedSleep(&slot->cv, 1000L, copy_wait_event);
+#else
+		ConditionVariableSleep(&slot->cv, copy_wait_event);
+#endif
+	}
+	ConditionVariableCancelSleep();
+
+	if (take_back)
+	{
+		volatile bool   copied = false;
+
+		PG_TRY();
+		{
+			copied = copy_sync(cstring_to_text(src), cstring_to_text(path));
+		}
+		PG_CATCH();
+		{
+			LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+			slot->worker_pid = 0;
+			slot->state = DL_COPY_FREE;
+			LWLockRelease(copy_shared->lock);
+			ConditionVariableBroadcast(&slot->cv);
+			PG_RE_THROW();
+		}
+		PG_END_TRY();
+
+		LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+		slot->worker_pid = 0;
+		slot->state = DL_COPY_FREE;
+		LWLockRelease(copy_shared->lock);
+		ConditionVariableBroadcast(&slot->cv);
+
+		if (!copied)
+			ereport(ERROR,
+					(errcode(ERRCODE_IO_ERROR),
+					 errmsg("could not copy file \"%s\" into \"%s\"", src, path)));
+		PG_RETURN_BOOL(true);
+	}
+
+	if (failed)
+		ereport(ERROR,
+				(errcode(ERRCODE_IO_ERROR),
+				 errmsg("copy of file \"%s\" has failed: %s", path, error)));
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Cancel the copies queued by the backend, called when its transaction
+ * aborts. Copies that are running are stopped by their worker.
+ */
+void
+datalink_cancel_copies(void)
+{
+	int     i;
+
+	if (copy_shared == NULL || !copy_queued)
+		return;
+
+	LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < copy_shared->nslots; i++)
+	{
+		DatalinkCopySlot *slot = &copy_shared->slots[i];
+
+		if (slot->pid != MyProcPid)
+			continue;
+		if (slot->state == DL_COPY_QUEUED)
+			slot->state = DL_COPY_FREE;
+		else if (slot->state == DL_COPY_RUNNING)
+			slot->canceled = true;
+	}
+	LWLockRelease(copy_shared->lock);
+
+	copy_queued = false;
+}
+
+/* Forget the copies of the transaction at commit, they keep running */
+void
+datalink_reset_copies(void)
+{
+	copy_queued = false;
+}
+
+/*
+ * Called by the copy loop of datalink_copy_localfile() with the number of
+ * bytes copied. In a copy worker the progress is published and the copy is
+ * stopped when it has been canceled.
+ */
+void
+datalink_copy_progress(int64 bytes)
+{
+	if (copy_current == NULL)
+		return;
+
+	CHECK_FOR_INTERRUPTS();
+	pg_atomic_fetch_add_u64(&copy_current->bytes_done, bytes);
+	if (copy_current->canceled)
+		ereport(ERROR,
+				(errcode(ERRCODE_QUERY_CANCELED),
+				 errmsg("copy of file \"%s\" has been canceled",
+						copy_current->src)));
+}
+
+/*
+ * Take the oldest copy queued for a database. When there is none the worker
+ * is no more counted as running and the database of another queued copy is
+ * returned in relaunch, or InvalidOid.
+ */
+static int
+copy_claim(Oid dboid, Oid *relaunch)
+{
+	DatalinkCopySlot   *found = NULL;
+	int                 i;
+
+	*relaunch = InvalidOid;
+
+	LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < copy_shared->nslots; i++)
+	{
+		DatalinkCopySlot *slot = &copy_shared->slots[i];
+
+		if (slot->state != DL_COPY_QUEUED)
+			continue;
+		if (slot->dboid != dboid)
+		{
+			*relaunch = slot->dboid;
+			continue;
+		}
+		if (found == NULL || slot->seq < found->seq)
+			found = slot;
+	}
+	if (found != NULL)
+	{
+		found->state = DL_COPY_RUNNING;
+		found->worker_pid = MyProcPid;
+		*relaunch = InvalidOid;
+	}
+	else
+	{
+		copy_shared->nworkers--;
+		copy_counted = false;
+	}
+	LWLockRelease(copy_shared->lock);
+
+	return (found != NULL) ? (int) (found - copy_shared->slots) : -1;
+}
+
+/* Do a copy in its own transaction and publish the result */
+static void
+copy_run(DatalinkCopySlot *slot)
+{
+	MemoryContext   oldcontext = CurrentMemoryContext;
+	volatile bool   copied = false;
+	char            error[DL_COPY_ERROR_LEN];
+	char            src[MAXPGPATH];
+	char            dst[MAXPGPATH];
+
+	/* the paths can not change while the slot is running */
+	strlcpy(src, slot->src, MAXPGPATH);
+	strlcpy(dst, slot->dst, MAXPGPATH);
+	strlcpy(error, "could not lock the files to copy", sizeof(error));
+
+	pgstat_report_activity(STATE_RUNNING, dst);
+	copy_current = slot;
+	PG_TRY();
+	{
+		StartTransactionCommand();
+		PushActiveSnapshot(GetTransactionSnapshot());
+		copied = copy_sync(cstring_to_text(src), cstring_to_text(dst));
+		PopActiveSnapshot();
+		CommitTransactionCommand();
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		HOLD_INTERRUPTS();
+		MemoryContextSwitchTo(oldcontext);
+		EmitErrorReport();
+		edata = CopyErrorData();
+		FlushErrorState();
+		AbortCurrentTransaction();
+		RESUME_INTERRUPTS();
+
+		strlcpy(error, edata->message, sizeof(error));
+		FreeErrorData(edata);
+		copied = false;
+	}
+	PG_END_TRY();
+	copy_current = NULL;
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	/* Never leave a partial copy */
+	if (!copied && unlink(dst) < 0 && errno != ENOENT)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not remove partial copy \"%s\": %m", dst)));
+
+	LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+	slot->worker_pid = 0;
+	if (slot->canceled)
+		slot->state = DL_COPY_FREE;
+	else if (copied)
+		slot->state = DL_COPY_DONE;
+	else
+	{
+		slot->state = DL_COPY_FAILED;
+		strlcpy(slot->error, error, DL_COPY_ERROR_LEN);
+	}
+	LWLockRelease(copy_shared->lock);
+
+	ConditionVariableBroadcast(&slot->cv);
+}
+
+/*
+ * Exit callback of a copy worker, the copy it was doing fails and it is no
+ * more counted as running.
+ */
+static void
+copy_worker_exit(int code, Datum arg)
+{
+	int     i;
+
+	LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+	if (copy_counted)
+		copy_shared->nworkers--;
+	copy_counted = false;
+	for (i = 0; i < copy_shared->nslots; i++)
+	{
+		DatalinkCopySlot *slot = &copy_shared->slots[i];
+
+		if (slot->state == DL_COPY_RUNNING && slot->worker_pid == MyProcPid)
+		{
+			slot->state = DL_COPY_FAILED;
+			slot->worker_pid = 0;
+			strlcpy(slot->error, "the copy worker has exited", DL_COPY_ERROR_LEN);
+			ConditionVariableBroadcast(&slot->cv);
+		}
+	}
+	copy_wake_stranded();
+	LWLockRelease(copy_shared->lock);
+}
+
+/* Main function of a copy worker, the argument is the database oid */
+void
+datalink_copy_worker_main(Datum main_arg)
+{
+	Oid     dboid = DatumGetObjectId(main_arg);
+	Oid     relaunch = InvalidOid;
+	int     slotno;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	before_shmem_exit(copy_worker_exit, (Datum) 0);
+	LWLockAcquire(copy_shared->lock, LW_EXCLUSIVE);
+	copy_shared->nworkers++;
+	copy_counted = true;
+	LWLockRelease(copy_shared->lock);
+
+	/* Connect as superuser, the backends have checked the permissions */
+	BackgroundWorkerInitializeConnectionByOid(dboid, InvalidOid, 0);
+
+	while ((slotno = copy_claim(dboid, &relaunch)) >= 0)
+		copy_run(&copy_shared->slots[slotno]);
+
+	/* Copies of another database may be waiting for a free worker */
+	if (OidIsValid(relaunch))
+		(void) copy_launch_worker(relaunch);
+
+	proc_exit(0);
+}
+
+/*
+ * Return the copies of the queue: backend pid, source and destination
+ * files, state, size of the file, bytes copied, queue time and error.
+ */
+PG_FUNCTION_INFO_V1(datalink_copy_status);
+Datum
+datalink_copy_status(PG_FUNCTION_ARGS)
+{
+	FuncCallContext    *funcctx;
+	DatalinkCopySlot   *slots;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext   oldcontext;
+		TupleDesc       tupdesc;
+		int             n = 0;
+		int             i;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* Copy the slots in use so that the lock is not held between calls */
+		if (copy_shared != NULL)
+		{
+			slots = (DatalinkCopySlot *) palloc(copy_shared->nslots * sizeof(DatalinkCopySlot));
+			LWLockAcquire(copy_shared->lock, LW_SHARED);
+			for (i = 0; i < copy_shared->nslots; i++)
+			{
+				if (copy_shared->slots[i].state != DL_COPY_FREE)
+				{
+					memcpy(&slots[n], &copy_shared->slots[i], sizeof(DatalinkCopySlot));
+					pg_atomic_init_u64(&slots[n].bytes_done,
+									   pg_atomic_read_u64(&copy_shared->slots[i].bytes_done));
+					n++;
+				}
+			}
+			LWLockRelease(copy_shared->lock);
+			funcctx->user_fctx = slots;
+		}
+		funcctx->max_calls = n;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	slots = (DatalinkCopySlot *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		DatalinkCopySlot   *slot = &slots[funcctx->call_cntr];
+		Datum               values[8];
+		bool                nulls[8] = {false, false, false, false, false, false, false, false};
+		HeapTuple           tuple;
+
+		values[0] = Int32GetDatum(slot->pid);
+		values[1] = CStringGetTextDatum(slot->src);
+		values[2] = CStringGetTextDatum(slot->dst);
+		values[3] = CStringGetTextDatum(copy_state_names[slot->state]);
+		values[4] = Int64GetDatum(slot->bytes_total);
+		values[5] = Int64GetDatum((int64) pg_atomic_read_u64(&slot->bytes_done));
+		values[6] = TimestampTzGetDatum(slot->queued_at);
+		if (slot->state == DL_COPY_FAILED)
+			values[7] = CStringGetTextDatum(slot->error);
+		else
+			nulls[7] = true;
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
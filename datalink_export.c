@@ -0,0 +1,550 @@
+/*
+ * datalink_export.c
+ *
+ * Export of the external files referenced by the datalinks returned by a
+ * query as a tar archive, optionally compressed with zstd when PostgreSQL
+ * has been built with it. The archive is either returned to the client as
+ * a set of bytea chunks to concatenate, or written to a server file.
+ *
+ * Files are read sequentially, one at a time, by chunks of
+ * DATALINK_EXPORT_CHUNK_SIZE bytes, so only the list of the paths and one
+ * chunk are held in memory whatever the size of the files.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <sys/stat.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "executor/spi.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "lib/stringinfo.h"
+#include "miscadmin.h"
+#include "storage/fd.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "datalink.h"
+
+/* Size of the tar blocks */
+#define TAR_BLOCK_SIZE  512
+
+/* File of the archive */
+typedef struct ExportFile
+{
+	char       *name;          /* name in the archive */
+	char       *path;          /* file to read */
+} ExportFile;
+
+/* State of an export between two chunks */
+typedef struct ExportState
+{
+	ExportFile *files;
+	int         nfiles;
+	int         next;          /* next file to archive */
+	int         fd;            /* file being archived or -1 */
+	char       *path;
+	int         base;          /* base directory of the file for throttling */
+	int64       remaining;     /* bytes of the file still to read */
+	int         padding;       /* zeros to add after the file */
+	bool        finished;      /* end of archive written */
+	bool        compress;
+#ifdef USE_ZSTD
+	ZSTD_CCtx  *cctx;
+	StringInfo  raw;           /* uncompressed chunk */
+	bool        flushed;       /* end of the zstd frame written */
+#endif
+} ExportState;
+
+Datum		datalink_export(PG_FUNCTION_ARGS);
+Datum		datalink_export_file(PG_FUNCTION_ARGS);
+
+static void export_init(ExportState *st, const char *query,
+		const char *compression);
+static void tar_octal(char *dst, int len, uint64 value);
+static const char *tar_name_split(const char *name);
+static void tar_header(StringInfo out, const char *name, int64 size,
+		mode_t mode, time_t mtime, char type);
+static void tar_add_header(StringInfo out, const char *name,
+		const struct stat *st);
+static bool export_next_raw(ExportState *st, StringInfo out);
+static bool export_next(ExportState *st, StringInfo out);
+#ifdef USE_ZSTD
+static void export_free_cctx(void *arg);
+#endif
+
+/*
+ * Collect the files of the datalinks returned by the query, the datalink
+ * must be its first column. Files of datalinks with FILE LINK CONTROL that
+ * have been renamed with their token are read under that name.
+ */
+static void
+export_init(ExportState *st, const char *query, const char *compression)
+{
+	StringInfoData  sql;
+	uint64          i;
+	int             ret;
+
+	memset(st, 0, sizeof(ExportState));
+	st->fd = -1;
+
+	if (strcmp(compression, "zstd") == 0)
+	{
+#ifdef USE_ZSTD
+		st->compress = true;
+		st->cctx = ZSTD_createCCtx();
+		if (st->cctx == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("could not create a zstd compression context")));
+		st->raw = makeStringInfo();
+#else
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("zstd compression is not supported by this build")));
+#endif
+	}
+	else if (strcmp(compression, "none") != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid compression method \"%s\"", compression),
+				 errhint("Valid methods are \"none\" and \"zstd\".")));
+
+	initStringInfo(&sql);
+	appendStringInfo(&sql,
+			"SELECT p.path, CASE WHEN p.linkcontrol AND p.dl_token IS NOT NULL"
+			" THEN add_token_to_url(p.path, p.dl_token::text) ELSE p.path END"
+			" FROM (SELECT uri_get_path(dl_url_rebase((q.d).dl_path, (q.d).dl_base)) AS path,"
+			" (q.d).dl_token AS dl_token, b.linkcontrol"
+			" FROM (%s) AS q(d) JOIN pg_datalink_bases b ON (b.dirid = (q.d).dl_base)"
+			" WHERE (q.d).dl_path::text != '' AND uri_get_scheme(b.base) = 'file') p",
+			query);
+
+	if ((ret = SPI_connect()) != SPI_OK_CONNECT)
+		elog(ERROR, "SPI_connect failed: %s", SPI_result_code_string(ret));
+	if ((ret = SPI_execute(sql.data, true, 0)) != SPI_OK_SELECT)
+		elog(ERROR, "SPI_execute failed: %s", SPI_result_code_string(ret));
+
+	/* The list is allocated in the caller's context */
+	st->nfiles = (int) SPI_processed;
+	st->files = (ExportFile *) SPI_palloc(Max(st->nfiles, 1) * sizeof(ExportFile));
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple   tuple = SPI_tuptable->vals[i];
+		TupleDesc   tupdesc = SPI_tuptable->tupdesc;
+		char       *name = SPI_getvalue(tuple, tupdesc, 1);
+		char       *path = SPI_getvalue(tuple, tupdesc, 2);
+
+		/* members of the archive have relative names */
+		while (*name == '/')
+			name++;
+		st->files[i].name = SPI_palloc(strlen(name) + 1);
+		strcpy(st->files[i].name, name);
+		st->files[i].path = SPI_palloc(strlen(path) + 1);
+		strcpy(st->files[i].path, path);
+	}
+	SPI_finish();
+}
+
+/* Write a number in octal in a field of a tar header */
+static void
+tar_octal(char *dst, int len, uint64 value)
+{
+	snprintf(dst, len, "%0*llo", len - 1, (unsigned long long) value);
+}
+
+/*
+ * Return the slash where a name longer than 100 bytes can be split in the
+ * prefix and name fields of a ustar header, NULL if it can not.
+ */
+static const char *
+tar_name_split(const char *name)
+{
+	size_t      len = strlen(name);
+	const char *p;
+
+	for (p = name + len - 1; p > name; p--)
+	{
+		if (*p == '/' && (size_t) (p - name) <= 155 && len - (p - name) - 1 <= 100)
+			return p;
+	}
+
+	return NULL;
+}
+
+/* Append a ustar header block */
+static void
+tar_header(StringInfo out, const char *name, int64 size, mode_t mode,
+		   time_t mtime, char type)
+{
+	char        h[TAR_BLOCK_SIZE];
+	const char *slash = NULL;
+	unsigned int sum = 0;
+	int         i;
+
+	memset(h, 0, sizeof(h));
+
+	/* names longer than 100 bytes are split in a prefix and a name */
+	if (strlen(name) > 100)
+		slash = tar_name_split(name);
+	if (slash != NULL)
+	{
+		memcpy(h + 345, name, slash - name);
+		strncpy(h, slash + 1, 100);
+	}
+	else
+		strncpy(h, name, 100);
+
+	tar_octal(h + 100, 8, mode & 07777);
+	tar_octal(h + 108, 8, 0);
+	tar_octal(h + 116, 8, 0);
+	tar_octal(h + 124, 12, (uint64) size);
+	tar_octal(h + 136, 12, (uint64) mtime);
+	h[156] = type;
+	memcpy(h + 257, "ustar", 6);
+	memcpy(h + 263, "00", 2);
+
+	/* checksum is computed with its own field filled with spaces */
+	memset(h + 148, ' ', 8);
+	for (i = 0; i < TAR_BLOCK_SIZE; i++)
+		sum += (unsigned char) h[i];
+	snprintf(h + 148, 8, "%06o", sum);
+	h[155] = ' ';
+
+	appendBinaryStringInfo(out, h, TAR_BLOCK_SIZE);
+}
+
+/*
+ * Append the header of a file. A pax extended header holds its name when
+ * it does not fit in the ustar fields.
+ */
+static void
+tar_add_header(StringInfo out, const char *name, const struct stat *st)
+{
+	size_t      len = strlen(name);
+
+	/* the size field has 11 octal digits */
+	if (st->st_size > INT64CONST(077777777777))
+		ereport(ERROR,
+				(errcode(ERRCODE_PROGRAM_LIMIT_EXCEEDED),
+				 errmsg("file \"%s\" is too large to be exported", name)));
+
+	if (len > 100 && tar_name_split(name) == NULL)
+	{
+		StringInfoData  rec;
+		int             reclen;
+		int             digits;
+		int             pad;
+
+		/* the length of a record includes its own digits */
+		reclen = len + strlen(" path=\n");
+		digits = snprintf(NULL, 0, "%d", reclen);
+		while (snprintf(NULL, 0, "%d", reclen + digits) != digits)
+			digits++;
+		reclen += digits;
+
+		initStringInfo(&rec);
+		appendStringInfo(&rec, "%d path=%s\n", reclen, name);
+		tar_header(out, "././@PaxHeader", rec.len, 0644, st->st_mtime, 'x');
+		appendBinaryStringInfo(out, rec.data, rec.len);
+		pad = (TAR_BLOCK_SIZE - rec.len % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+		appendStringInfoSpaces(out, pad);
+		memset(out->data + out->len - pad, 0, pad);
+		pfree(rec.data);
+
+		/* the ustar name is only used by old tools */
+		name += len - 100;
+	}
+
+	tar_header(out, name, st->st_size, st->st_mode, st->st_mtime, '0');
+}
+
+/*
+ * Append the next part of the uncompressed archive to out: a file header,
+ * a chunk of a file or the end of the archive. Returns false when the
+ * whole archive has been produced.
+ */
+static bool
+export_next_raw(ExportState *st, StringInfo out)
+{
+	for (;;)
+	{
+		CHECK_FOR_INTERRUPTS();
+
+		/* Next chunk of the current file */
+		if (st->fd >= 0)
+		{
+			int     len = (int) Min(st->remaining, DATALINK_EXPORT_CHUNK_SIZE);
+			int     nread = 0;
+
+			datalink_throttle(st->base, len, 0);
+			enlargeStringInfo(out, len + st->padding);
+			while (nread < len)
+			{
+				int     r = read(st->fd, out->data + out->len + nread, len - nread);
+
+				if (r < 0)
+					ereport(ERROR,
+							(errcode_for_file_access(),
+							 errmsg("could not read file \"%s\": %m", st->path)));
+				if (r == 0)
+				{
+					/* the size is in the header, the file has shrunk */
+					ereport(WARNING,
+							(errmsg("file \"%s\" has been truncated during the export",
+									st->path)));
+					memset(out->data + out->len + nread, 0, len - nread);
+					nread = len;
+					break;
+				}
+				nread += r;
+			}
+			out->len += len;
+			st->remaining -= len;
+			if (st->remaining == 0)
+			{
+				memset(out->data + out->len, 0, st->padding);
+				out->len += st->padding;
+				out->data[out->len] = '\0';
+				CloseTransientFile(st->fd);
+				st->fd = -1;
+			}
+			return true;
+		}
+
+		/* Header of the next file */
+		if (st->next < st->nfiles)
+		{
+			ExportFile *file = &st->files[st->next++];
+			struct stat fst;
+
+			st->path = file->path;
+			if (stat(file->path, &fst) < 0 || !S_ISREG(fst.st_mode))
+			{
+				ereport(WARNING,
+						(errcode_for_file_access(),
+						 errmsg("could not export file \"%s\", it is skipped",
+								file->path)));
+				continue;
+			}
+
+			st->base = datalink_throttle_base(file->path);
+			datalink_throttle(st->base, 0, 1);
+			st->fd = OpenTransientFile(file->path, O_RDONLY | PG_BINARY);
+			if (st->fd < 0)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not open file \"%s\" for reading: %m",
+								file->path)));
+			tar_add_header(out, file->name, &fst);
+			st->remaining = fst.st_size;
+			st->padding = (TAR_BLOCK_SIZE - fst.st_size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+			if (st->remaining == 0)
+			{
+				CloseTransientFile(st->fd);
+				st->fd = -1;
+			}
+			return true;
+		}
+
+		/* End of archive, two empty blocks */
+		if (!st->finished)
+		{
+			appendStringInfoSpaces(out, 2 * TAR_BLOCK_SIZE);
+			memset(out->data + out->len - 2 * TAR_BLOCK_SIZE, 0, 2 * TAR_BLOCK_SIZE);
+			st->finished = true;
+			return true;
+		}
+
+		return false;
+	}
+}
+
+/* Append the next part of the archive, compressed if requested */
+static bool
+export_next(ExportState *st, StringInfo out)
+{
+#ifdef USE_ZSTD
+	if (st->compress)
+	{
+		for (;;)
+		{
+			ZSTD_inBuffer       in;
+			ZSTD_EndDirective   mode;
+			size_t              left;
+			bool                more;
+
+			if (st->flushed)
+				return false;
+
+			resetStringInfo(st->raw);
+			more = export_next_raw(st, st->raw);
+			mode = more ? ZSTD_e_continue : ZSTD_e_end;
+			in.src = st->raw->data;
+			in.size = st->raw->len;
+			in.pos = 0;
+			do
+			{
+				ZSTD_outBuffer  zout;
+
+				enlargeStringInfo(out, ZSTD_CStreamOutSize());
+				zout.dst = out->data + out->len;
+				zout.size = out->maxlen - out->len - 1;
+				zout.pos = 0;
+				left = ZSTD_compressStream2(st->cctx, &zout, &in, mode);
+				if (ZSTD_isError(left))
+					ereport(ERROR,
+							(errmsg("could not compress the archive: %s",
+									ZSTD_getErrorName(left))));
+				out->len += zout.pos;
+			} while (mode == ZSTD_e_end ? left != 0 : in.pos < in.size);
+
+			if (!more)
+				st->flushed = true;
+			if (out->len > VARHDRSZ)
+				return true;
+		}
+	}
+#endif
+
+	return export_next_raw(st, out);
+}
+
+#ifdef USE_ZSTD
+/* Free the compression context with the memory of the export */
+static void
+export_free_cctx(void *arg)
+{
+	ExportState *st = (ExportState *) arg;
+
+	if (st->cctx != NULL)
+		ZSTD_freeCCtx(st->cctx);
+	st->cctx = NULL;
+}
+#endif
+
+/*
+ * Return the archive of the files referenced by the datalinks of a query
+ * as a set of bytea chunks. It must be called in the target list to not
+ * have the whole archive materialized by the executor.
+ */
+PG_FUNCTION_INFO_V1(datalink_export);
+Datum
+datalink_export(PG_FUNCTION_ARGS)
+{
+	FuncCallContext *funcctx;
+	ExportState     *st;
+	StringInfoData   out;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext   oldcxt;
+		char           *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		char           *compression = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcxt = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+		st = (ExportState *) palloc(sizeof(ExportState));
+		export_init(st, query, compression);
+#ifdef USE_ZSTD
+		if (st->compress)
+		{
+			MemoryContextCallback *cb = palloc(sizeof(MemoryContextCallback));
+
+			cb->func = export_free_cctx;
+			cb->arg = st;
+			MemoryContextRegisterResetCallback(funcctx->multi_call_memory_ctx, cb);
+		}
+#endif
+		funcctx->user_fctx = st;
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	st = (ExportState *) funcctx->user_fctx;
+
+	/* The chunk is built in place of the returned bytea */
+	initStringInfo(&out);
+	appendStringInfoSpaces(&out, VARHDRSZ);
+	if (export_next(st, &out))
+	{
+		SET_VARSIZE(out.data, out.len);
+		SRF_RETURN_NEXT(funcctx, PointerGetDatum(out.data));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Write the archive of the files referenced by the datalinks of a query
+ * to a server file. Returns the size of the archive.
+ */
+PG_FUNCTION_INFO_V1(datalink_export_file);
+Datum
+datalink_export_file(PG_FUNCTION_ARGS)
+{
+	char           *query = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char           *path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char           *compression = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	ExportState     st;
+	StringInfoData  out;
+	FILE           *file;
+	int64           total = 0;
+
+	if (!is_absolute_path(path))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("archive path must be absolute")));
+
+	export_init(&st, query, compression);
+
+	if ((file = AllocateFile(path, PG_BINARY_W)) == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for writing: %m", path)));
+
+	PG_TRY();
+	{
+		initStringInfo(&out);
+		for (;;)
+		{
+			resetStringInfo(&out);
+			appendStringInfoSpaces(&out, VARHDRSZ);
+			if (!export_next(&st, &out))
+				break;
+			if (fwrite(out.data + VARHDRSZ, 1, out.len - VARHDRSZ, file) !=
+				(size_t) (out.len - VARHDRSZ))
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not write file \"%s\": %m", path)));
+			total += out.len - VARHDRSZ;
+		}
+	}
+	PG_CATCH();
+	{
+#ifdef USE_ZSTD
+		export_free_cctx(&st);
+#endif
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+#ifdef USE_ZSTD
+	export_free_cctx(&st);
+#endif
+
+	if (FreeFile(file) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", path)));
+	datalink_track_sync(path, true);
+
+	PG_RETURN_INT64(total);
+}
@@ -0,0 +1,270 @@
+/*
+ * datalink_fdcache.c
+ *
+ * Per backend cache of the external files opened for reading. A session
+ * reading a file by ranges, or the same file several times, keeps it open
+ * between the calls of the file functions instead of opening it each time:
+ * a cached read only has to check that the path still names the same file
+ * and to read the range at its offset. At most datalink.dl_fd_cache_size
+ * files are kept open, the least recently used one is closed to open a new
+ * one.
+ *
+ * The files are opened with OpenTransientFile() and are all closed at the
+ * end of the transaction, or when a subtransaction aborts, so a file is
+ * never kept open by an idle session. A file renamed over or removed since
+ * it has been opened is seen at the next lookup, that reopens the new one.
+ * The locks of the file are not cached, they are taken for each read like
+ * before so that the writers are not blocked by a transaction that has read
+ * the file earlier.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "access/xact.h"
+#include "storage/fd.h"
+#include "utils/guc.h"
+#include "utils/memutils.h"
+
+#include "datalink.h"
+
+/* File kept open by the backend */
+typedef struct FdCacheEntry
+{
+	int         fd;
+	char       *path;          /* path used to open it */
+	dev_t       dev;           /* identity of the file opened */
+	ino_t       ino;
+	uint64      lastused;      /* for the LRU */
+} FdCacheEntry;
+
+static FdCacheEntry fd_cache[DL_FD_CACHE_MAX];
+static int  nfd_cache = 0;
+static uint64 fd_cache_clock = 0;
+static bool callbacks_registered = false;
+
+static int  fdcache_size(void);
+static FdCacheEntry *fdcache_find(const char *path);
+static FdCacheEntry *fdcache_find_fd(int fd);
+static void fdcache_remove(FdCacheEntry *entry);
+static void fdcache_reset(void);
+static void datalink_fdcache_xact_callback(XactEvent event, void *arg);
+static void datalink_fdcache_subxact_callback(SubXactEvent event,
+		SubTransactionId mySubid, SubTransactionId parentSubid, void *arg);
+
+/* Maximum number of files kept open, 0 when the cache is disabled */
+static int
+fdcache_size(void)
+{
+	const char *value = GetConfigOption("datalink.dl_fd_cache_size", true, false);
+
+	if (value == NULL || *value == '\0')
+		return DATALINK_FD_CACHE_SIZE;
+
+	return Min(Max(atoi(value), 0), DL_FD_CACHE_MAX);
+}
+
+static FdCacheEntry *
+fdcache_find(const char *path)
+{
+	int     i;
+
+	for (i = 0; i < nfd_cache; i++)
+	{
+		if (strcmp(fd_cache[i].path, path) == 0)
+			return &fd_cache[i];
+	}
+
+	return NULL;
+}
+
+static FdCacheEntry *
+fdcache_find_fd(int fd)
+{
+	int     i;
+
+	for (i = 0; i < nfd_cache; i++)
+	{
+		if (fd_cache[i].fd == fd)
+			return &fd_cache[i];
+	}
+
+	return NULL;
+}
+
+/* Close a cached file, the last entry takes its slot */
+static void
+fdcache_remove(FdCacheEntry *entry)
+{
+	if (CloseTransientFile(entry->fd) != 0)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", entry->path)));
+	pfree(entry->path);
+	*entry = fd_cache[--nfd_cache];
+}
+
+/*
+ * Open a file for reading, or return the descriptor of the file already
+ * opened with this path when it still names the same file. The stat of the
+ * file, symlinks followed, is returned into st. When the file does not
+ * exist -1 is returned if missing_ok is true. An open is charged against the
+ * I/O limits of the base directory, a cached descriptor is not. The
+ * descriptor must be given back with datalink_fdcache_release().
+ */
+int
+datalink_fdcache_open(const char *path, struct stat *st, bool missing_ok,
+					  int base)
+{
+	FdCacheEntry   *entry;
+	int             maxsize = fdcache_size();
+	int             fd;
+	int             i;
+
+	if (stat(path, st) < 0)
+	{
+		if (missing_ok && errno == ENOENT)
+			return -1;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+	}
+
+	entry = fdcache_find(path);
+	if (entry != NULL)
+	{
+		if (entry->dev == st->st_dev && entry->ino == st->st_ino)
+		{
+			entry->lastused = ++fd_cache_clock;
+			return entry->fd;
+		}
+		/* replaced since it has been opened */
+		fdcache_remove(entry);
+	}
+
+	datalink_throttle(base, 0, 1);
+	fd = OpenTransientFile(path, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		if (missing_ok && errno == ENOENT)
+			return -1;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for reading: %m", path)));
+	}
+	if (maxsize == 0)
+		return fd;
+
+	/* The file opened is the one described by st */
+	if (fstat(fd, st) < 0)
+	{
+		int     save_errno = errno;
+
+		CloseTransientFile(fd);
+		errno = save_errno;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+	}
+
+	if (!callbacks_registered)
+	{
+		RegisterXactCallback(datalink_fdcache_xact_callback, NULL);
+		RegisterSubXactCallback(datalink_fdcache_subxact_callback, NULL);
+		callbacks_registered = true;
+	}
+
+	/* Make room, closing the least recently used files */
+	while (nfd_cache >= maxsize)
+	{
+		FdCacheEntry   *oldest = &fd_cache[0];
+
+		for (i = 1; i < nfd_cache; i++)
+		{
+			if (fd_cache[i].lastused < oldest->lastused)
+				oldest = &fd_cache[i];
+		}
+		fdcache_remove(oldest);
+	}
+
+	entry = &fd_cache[nfd_cache++];
+	entry->fd = fd;
+	entry->path = MemoryContextStrdup(TopMemoryContext, path);
+	entry->dev = st->st_dev;
+	entry->ino = st->st_ino;
+	entry->lastused = ++fd_cache_clock;
+
+	return entry->fd;
+}
+
+/* Give back a descriptor of datalink_fdcache_open(), closed if not cached */
+void
+datalink_fdcache_release(int fd, const char *path)
+{
+	if (fdcache_find_fd(fd) != NULL)
+		return;
+
+	if (CloseTransientFile(fd) != 0)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", path)));
+}
+
+/*
+ * Close a cached file, called when the extension renames or removes it so
+ * that its space is not held until the end of the transaction.
+ */
+void
+datalink_fdcache_forget(const char *path)
+{
+	FdCacheEntry   *entry = fdcache_find(path);
+
+	if (entry != NULL)
+		fdcache_remove(entry);
+}
+
+/* Close all the cached files */
+static void
+fdcache_reset(void)
+{
+	while (nfd_cache > 0)
+		fdcache_remove(&fd_cache[nfd_cache - 1]);
+}
+
+static void
+datalink_fdcache_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			fdcache_reset();
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * The files opened by an aborted subtransaction are about to be closed by
+ * fd.c and an error during a read may have left the fcntl() lock of a file
+ * opened before, everything is closed.
+ */
+static void
+datalink_fdcache_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+							SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		fdcache_reset();
+}
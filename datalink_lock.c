@@ -0,0 +1,544 @@
+/*
+ * datalink_lock.c
+ *
+ * Locks on the external files taken by the file functions of the datalink
+ * extension. A lock table in shared memory keyed by the device and inode of
+ * the file gives shared and exclusive locks: a backend that can not get the
+ * lock immediately is queued and sleeps on its latch until it is granted,
+ * in arrival order, instead of failing like fcntl(F_SETLK) does. The wait is
+ * bounded by lock_timeout and reported with a wait event. Each lock links
+ * the slots of its own waiters and the free slots are kept in a list, so
+ * the work done under the LWLock does not grow with the size of the table.
+ *
+ * Locks are only held during the call of a file function. When a function
+ * needs several files they are all locked at once, ordered by key, so that
+ * two backends can never wait for each other. Locks left by an error are
+ * released when the transaction aborts.
+ *
+ * The lock table is only available when the extension is loaded with
+ * shared_preload_libraries, fcntl() locks are used alone otherwise. They
+ * are still taken after the lock of the table to protect the files against
+ * other programs.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <sys/stat.h>
+
+#include "access/xact.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 170000
+#include "utils/wait_event.h"
+#endif
+
+#include "datalink.h"
+
+/* Key of a lock, the file identity */
+typedef struct DatalinkLockKey
+{
+	dev_t       dev;
+	ino_t       ino;
+} DatalinkLockKey;
+
+/* Lock on a file */
+typedef struct DatalinkLockEntry
+{
+	DatalinkLockKey key;
+	int         nshared;       /* number of shared holders */
+	bool        exclusive;     /* held in exclusive mode */
+	int         nwaiters;      /* number of backends waiting for it */
+	int         head;          /* queue of the waiters with a slot, */
+	int         tail;          /* in arrival order, -1 when empty */
+} DatalinkLockEntry;
+
+/* Backend waiting for a lock */
+typedef struct DatalinkLockWaiter
+{
+	bool            exclusive;
+	int             next;      /* next in the queue or in the free list */
+	Latch          *latch;
+} DatalinkLockWaiter;
+
+typedef struct DatalinkLockShared
+{
+	LWLock     *lock;
+	int         freelist;      /* first free slot, -1 when none */
+	int         nwaiters;      /* size of the waiters array */
+	DatalinkLockWaiter waiters[FLEXIBLE_ARRAY_MEMBER];
+} DatalinkLockShared;
+
+/* Lock held by this backend */
+typedef struct DatalinkHeldLock
+{
+	DatalinkLockKey key;
+	bool        exclusive;
+} DatalinkHeldLock;
+
+#define DL_MAX_HELD_LOCKS  4
+
+static DatalinkLockShared *lock_shared = NULL;
+static HTAB *lock_table = NULL;
+
+static DatalinkHeldLock held_locks[DL_MAX_HELD_LOCKS];
+static int  nheld_locks = 0;
+static bool callbacks_registered = false;
+static uint32 lock_wait_event = 0;
+
+static void lock_key(int fd, const char *path, DatalinkLockKey *key);
+static int  lock_key_cmp(const void *a, const void *b);
+static bool lock_compatible(DatalinkLockEntry *entry, bool exclusive);
+static bool lock_can_grant(DatalinkLockEntry *entry, int slot);
+static void lock_grant(DatalinkLockEntry *entry, bool exclusive);
+static void lock_dequeue(DatalinkLockEntry *entry, int slot);
+static void lock_wakeup(DatalinkLockEntry *entry);
+static void lock_forget_entry(DatalinkLockEntry *entry);
+static void acquire_file_lock(const DatalinkLockKey *key, bool exclusive,
+		const char *path);
+static void release_file_lock(const DatalinkHeldLock *held);
+static void datalink_lock_xact_callback(XactEvent event, void *arg);
+static void datalink_lock_subxact_callback(SubXactEvent event,
+		SubTransactionId mySubid, SubTransactionId parentSubid, void *arg);
+
+/* Reserve shared memory for the lock table, called from _PG_init() */
+void
+datalink_lock_shmem_request(int table_size)
+{
+	if (table_size <= 0)
+		return;
+
+	RequestAddinShmemSpace(MAXALIGN(offsetof(DatalinkLockShared, waiters) +
+								table_size * sizeof(DatalinkLockWaiter)));
+	RequestAddinShmemSpace(hash_estimate_size(table_size,
+								sizeof(DatalinkLockEntry)));
+	RequestNamedLWLockTranche("datalink_lock", 1);
+}
+
+/* Attach to the shared lock table, AddinShmemInitLock is held */
+void
+datalink_lock_shmem_init(int table_size)
+{
+	bool        found;
+	HASHCTL     info;
+
+	if (table_size <= 0)
+		return;
+
+	lock_shared = ShmemInitStruct("datalink lock table",
+							offsetof(DatalinkLockShared, waiters) +
+							table_size * sizeof(DatalinkLockWaiter), &found);
+	if (!found)
+	{
+		int     i;
+
+		lock_shared->lock = &(GetNamedLWLockTranche("datalink_lock"))->lock;
+		lock_shared->nwaiters = table_size;
+		memset(lock_shared->waiters, 0, table_size * sizeof(DatalinkLockWaiter));
+		for (i = 0; i < table_size; i++)
+			lock_shared->waiters[i].next = (i + 1 < table_size) ? i + 1 : -1;
+		lock_shared->freelist = 0;
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(DatalinkLockKey);
+	info.entrysize = sizeof(DatalinkLockEntry);
+	lock_table = ShmemInitHash("datalink lock table hash",
+								table_size, table_size,
+								&info, HASH_ELEM | HASH_BLOBS);
+}
+
+/* Build the key of the lock of an opened file */
+static void
+lock_key(int fd, const char *path, DatalinkLockKey *key)
+{
+	struct stat st;
+
+	if (fstat(fd, &st) < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+
+	/* clear padding, the key is hashed as a blob */
+	memset(key, 0, sizeof(DatalinkLockKey));
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+}
+
+static int
+lock_key_cmp(const void *a, const void *b)
+{
+	const DatalinkLockKey *ka = (const DatalinkLockKey *) a;
+	const DatalinkLockKey *kb = (const DatalinkLockKey *) b;
+
+	if (ka->dev != kb->dev)
+		return (ka->dev < kb->dev) ? -1 : 1;
+	if (ka->ino != kb->ino)
+		return (ka->ino < kb->ino) ? -1 : 1;
+
+	return 0;
+}
+
+/* Whether the lock can be held in the given mode with its current holders */
+static bool
+lock_compatible(DatalinkLockEntry *entry, bool exclusive)
+{
+	if (entry->exclusive)
+		return false;
+
+	return (!exclusive || entry->nshared == 0);
+}
+
+/*
+ * Whether the lock can be granted to a queued backend: no backend queued
+ * before it must be waiting for a conflicting mode.
+ */
+static bool
+lock_can_grant(DatalinkLockEntry *entry, int slot)
+{
+	DatalinkLockWaiter *me = &lock_shared->waiters[slot];
+	int         i;
+
+	if (!lock_compatible(entry, me->exclusive))
+		return false;
+
+	for (i = entry->head; i != slot && i >= 0; i = lock_shared->waiters[i].next)
+	{
+		if (lock_shared->waiters[i].exclusive || me->exclusive)
+			return false;
+	}
+
+	return true;
+}
+
+static void
+lock_grant(DatalinkLockEntry *entry, bool exclusive)
+{
+	if (exclusive)
+		entry->exclusive = true;
+	else
+		entry->nshared++;
+}
+
+/* Remove a slot from the queue of a lock and free it, the LWLock is held */
+static void
+lock_dequeue(DatalinkLockEntry *entry, int slot)
+{
+	int         prev = -1;
+	int         i;
+
+	for (i = entry->head; i >= 0 && i != slot; i = lock_shared->waiters[i].next)
+		prev = i;
+	Assert(i == slot);
+
+	if (prev < 0)
+		entry->head = lock_shared->waiters[slot].next;
+	else
+		lock_shared->waiters[prev].next = lock_shared->waiters[slot].next;
+	if (entry->tail == slot)
+		entry->tail = prev;
+
+	lock_shared->waiters[slot].next = lock_shared->freelist;
+	lock_shared->freelist = slot;
+}
+
+/*
+ * Wake up the backends queued for a lock, the LWLock is held. The ones
+ * without a slot poll the lock.
+ */
+static void
+lock_wakeup(DatalinkLockEntry *entry)
+{
+	int         i;
+
+	for (i = entry->head; i >= 0; i = lock_shared->waiters[i].next)
+		SetLatch(lock_shared->waiters[i].latch);
+}
+
+/* Remove a lock nobody holds or waits for, the LWLock is held */
+static void
+lock_forget_entry(DatalinkLockEntry *entry)
+{
+	if (entry->nshared == 0 && !entry->exclusive && entry->nwaiters == 0)
+		hash_search(lock_table, &entry->key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Acquire a lock of the table, waiting in the queue of the lock when it is
+ * held in a conflicting mode. A backend that finds no free slot in the
+ * queue polls the lock instead.
+ */
+static void
+acquire_file_lock(const DatalinkLockKey *key, bool exclusive, const char *path)
+{
+	DatalinkLockEntry  *entry;
+	bool                found;
+	int                 slot;
+	TimestampTz         start;
+
+	LWLockAcquire(lock_shared->lock, LW_EXCLUSIVE);
+	entry = (DatalinkLockEntry *) hash_search(lock_table, key, HASH_ENTER_NULL, &found);
+	if (entry == NULL)
+	{
+		LWLockRelease(lock_shared->lock);
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of shared memory for datalink file locks"),
+				 errhint("You might need to increase datalink.dl_lock_table_size.")));
+	}
+	if (!found)
+	{
+		entry->nshared = 0;
+		entry->exclusive = false;
+		entry->nwaiters = 0;
+		entry->head = -1;
+		entry->tail = -1;
+	}
+
+	/* Fast path, nobody is queued before us */
+	if (entry->nwaiters == 0 && lock_compatible(entry, exclusive))
+	{
+		lock_grant(entry, exclusive);
+		LWLockRelease(lock_shared->lock);
+		return;
+	}
+
+	/* Join the queue */
+	slot = lock_shared->freelist;
+	if (slot >= 0)
+	{
+		DatalinkLockWaiter *me = &lock_shared->waiters[slot];
+
+		lock_shared->freelist = me->next;
+		me->exclusive = exclusive;
+		me->latch = MyLatch;
+		me->next = -1;
+		if (entry->tail < 0)
+			entry->head = slot;
+		else
+			lock_shared->waiters[entry->tail].next = slot;
+		entry->tail = slot;
+	}
+	entry->nwaiters++;
+	LWLockRelease(lock_shared->lock);
+
+#if PG_VERSION_NUM >= 170000
+	if (lock_wait_event == 0)
+		lock_wait_event = WaitEventExtensionNew("DatalinkFileLock");
+#else
+	lock_wait_event = PG_WAIT_EXTENSION;
+#endif
+
+	start = GetCurrentTimestamp();
+	PG_TRY();
+	{
+		for (;;)
+		{
+			bool    granted;
+			long    timeout = -1;
+			int     events = WL_LATCH_SET | WL_EXIT_ON_PM_DEATH;
+
+			ResetLatch(MyLatch);
+
+			LWLockAcquire(lock_shared->lock, LW_EXCLUSIVE);
+			entry = (DatalinkLockEntry *) hash_search(lock_table, key, HASH_FIND, NULL);
+			Assert(entry != NULL);
+			if (slot >= 0)
+				granted = lock_can_grant(entry, slot);
+			else
+				granted = lock_compatible(entry, exclusive);
+			if (granted)
+			{
+				lock_grant(entry, exclusive);
+				entry->nwaiters--;
+				if (slot >= 0)
+				{
+					lock_dequeue(entry, slot);
+					/* shared waiters queued behind us may go too */
+					if (!exclusive)
+						lock_wakeup(entry);
+				}
+			}
+			LWLockRelease(lock_shared->lock);
+			if (granted)
+				break;
+
+			if (LockTimeout > 0)
+			{
+				long    secs;
+				int     usecs;
+
+				TimestampDifference(start, GetCurrentTimestamp(), &secs, &usecs);
+				timeout = LockTimeout - (secs * 1000 + usecs / 1000);
+				if (timeout <= 0)
+					ereport(ERROR,
+							(errcode(ERRCODE_LOCK_NOT_AVAILABLE),
+							 errmsg("could not obtain lock on file \"%s\"", path)));
+			}
+			/* without a queue slot nobody wakes us up */
+			if (slot < 0)
+				timeout = (timeout < 0) ? 10 : Min(timeout, 10);
+			if (timeout >= 0)
+				events |= WL_TIMEOUT;
+
+			(void) WaitLatch(MyLatch, events, timeout, lock_wait_event);
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+	PG_CATCH();
+	{
+		/* Leave the queue, backends queued behind us may go now */
+		LWLockAcquire(lock_shared->lock, LW_EXCLUSIVE);
+		entry = (DatalinkLockEntry *) hash_search(lock_table, key, HASH_FIND, NULL);
+		if (entry != NULL)
+		{
+			entry->nwaiters--;
+			if (slot >= 0)
+				lock_dequeue(entry, slot);
+			lock_wakeup(entry);
+			lock_forget_entry(entry);
+		}
+		LWLockRelease(lock_shared->lock);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+}
+
+/* Release a lock of the table and wake up the backends waiting for it */
+static void
+release_file_lock(const DatalinkHeldLock *held)
+{
+	DatalinkLockEntry  *entry;
+
+	LWLockAcquire(lock_shared->lock, LW_EXCLUSIVE);
+	entry = (DatalinkLockEntry *) hash_search(lock_table, &held->key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		if (held->exclusive)
+			entry->exclusive = false;
+		else if (entry->nshared > 0)
+			entry->nshared--;
+		if (entry->nwaiters > 0)
+			lock_wakeup(entry);
+		lock_forget_entry(entry);
+	}
+	LWLockRelease(lock_shared->lock);
+}
+
+/*
+ * Lock opened files, in shared or exclusive mode. Files are locked in the
+ * order of their key so that concurrent calls can not deadlock. The locks
+ * must be released with datalink_unlock_files().
+ */
+void
+datalink_lock_files(int nfiles, const int *fds, const char **paths,
+					const bool *exclusive)
+{
+	DatalinkHeldLock    locks[DL_MAX_HELD_LOCKS];
+	const char         *lock_paths[DL_MAX_HELD_LOCKS];
+	int                 i;
+	int                 j;
+
+	if (lock_table == NULL)
+		return;
+	if (nheld_locks + nfiles > DL_MAX_HELD_LOCKS)
+		elog(ERROR, "too many datalink file locks");
+
+	if (!callbacks_registered)
+	{
+		RegisterXactCallback(datalink_lock_xact_callback, NULL);
+		RegisterSubXactCallback(datalink_lock_subxact_callback, NULL);
+		callbacks_registered = true;
+	}
+
+	/* insertion sort by key, there is only a few files */
+	for (i = 0; i < nfiles; i++)
+	{
+		lock_key(fds[i], paths[i], &locks[i].key);
+		locks[i].exclusive = exclusive[i];
+		lock_paths[i] = paths[i];
+		for (j = i; j > 0 && lock_key_cmp(&locks[j - 1].key, &locks[j].key) > 0; j--)
+		{
+			DatalinkHeldLock    tmp = locks[j];
+			const char         *tmppath = lock_paths[j];
+
+			locks[j] = locks[j - 1];
+			lock_paths[j] = lock_paths[j - 1];
+			locks[j - 1] = tmp;
+			lock_paths[j - 1] = tmppath;
+		}
+	}
+
+	for (i = 0; i < nfiles; i++)
+	{
+		/* the same file twice is locked once in the strongest mode */
+		if (i > 0 && lock_key_cmp(&locks[i - 1].key, &locks[i].key) == 0)
+			continue;
+		if (i + 1 < nfiles && lock_key_cmp(&locks[i].key, &locks[i + 1].key) == 0)
+			locks[i].exclusive |= locks[i + 1].exclusive;
+
+		acquire_file_lock(&locks[i].key, locks[i].exclusive, lock_paths[i]);
+		held_locks[nheld_locks++] = locks[i];
+	}
+}
+
+/* Release all the file locks held by the backend */
+void
+datalink_unlock_files(void)
+{
+	while (nheld_locks > 0)
+		release_file_lock(&held_locks[--nheld_locks]);
+}
+
+/*
+ * Hint of the error reported when a fcntl() lock can not be taken: without
+ * the lock table the concurrent sessions are not waited for.
+ */
+int
+datalink_lock_hint(void)
+{
+	if (lock_table != NULL)
+		return 0;
+	return errhint("Load the datalink library with shared_preload_libraries to wait for the sessions using the file.");
+}
+
+/* Release the locks left by an error */
+static void
+datalink_lock_xact_callback(XactEvent event, void *arg)
+{
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+		case XACT_EVENT_PREPARE:
+			datalink_unlock_files();
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Locks are only held during the call of a file function, those still held
+ * when a subtransaction aborts have been left by an error of the call.
+ */
+static void
+datalink_lock_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+							SubTransactionId parentSubid, void *arg)
+{
+	if (event == SUBXACT_EVENT_ABORT_SUB)
+		datalink_unlock_files();
+}
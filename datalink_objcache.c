@@ -0,0 +1,296 @@
+/*
+ * datalink_objcache.c
+ *
+ * Shared memory cache of the content of small external files read through
+ * datalinks. The cache is made of fixed size slots, one per file, of
+ * datalink.dl_object_cache_max_object kB each, found by the device and inode
+ * of the file. An entry is only used when the modification time and the
+ * size of the file are unchanged, so a hit costs a stat() and a memcpy.
+ * Slots are reused following a CLOCK sweep. Entries are also invalidated
+ * when the file functions of the extension write, rename or remove a file.
+ *
+ * The cache is only available when the extension is loaded with
+ * shared_preload_libraries.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <sys/stat.h>
+
+#include "port/atomics.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/hsearch.h"
+
+#include "datalink.h"
+
+/* Key of a cache entry, the file identity */
+typedef struct ObjCacheKey
+{
+	dev_t       dev;
+	ino_t       ino;
+} ObjCacheKey;
+
+/* Hash entry, gives the slot of a file */
+typedef struct ObjCacheEntry
+{
+	ObjCacheKey key;
+	int         slot;
+} ObjCacheEntry;
+
+/* Slot holding the content of a file */
+typedef struct ObjCacheSlot
+{
+	bool        valid;
+	ObjCacheKey key;
+	time_t      mtime_sec;
+	long        mtime_nsec;
+	off_t       size;
+	pg_atomic_uint32 usage;    /* CLOCK usage count */
+} ObjCacheSlot;
+
+typedef struct ObjCacheShared
+{
+	LWLock     *lock;
+	int         nslots;
+	Size        slot_size;
+	int         clock_hand;
+	ObjCacheSlot slots[FLEXIBLE_ARRAY_MEMBER];
+} ObjCacheShared;
+
+/* Maximum usage count of a slot */
+#define OBJCACHE_MAX_USAGE  5
+
+static ObjCacheShared *objcache_shared = NULL;
+static HTAB *objcache_hash = NULL;
+static char *objcache_data = NULL;
+
+static int  objcache_nslots(int cache_size, int max_object);
+static void objcache_key(const struct stat *st, ObjCacheKey *key);
+static bool objcache_slot_matches(ObjCacheSlot *slot, const struct stat *st);
+static int  objcache_victim(void);
+
+/* Number of slots of the cache, sizes are in kB */
+static int
+objcache_nslots(int cache_size, int max_object)
+{
+	if (cache_size <= 0 || max_object <= 0)
+		return 0;
+
+	return cache_size / max_object;
+}
+
+/* Reserve shared memory for the cache, called from _PG_init() */
+void
+datalink_objcache_shmem_request(int cache_size, int max_object)
+{
+	int     nslots = objcache_nslots(cache_size, max_object);
+
+	if (nslots == 0)
+		return;
+
+	RequestAddinShmemSpace(MAXALIGN(offsetof(ObjCacheShared, slots) +
+								nslots * sizeof(ObjCacheSlot)));
+	RequestAddinShmemSpace((Size) nslots * max_object * 1024);
+	RequestAddinShmemSpace(hash_estimate_size(nslots, sizeof(ObjCacheEntry)));
+	RequestNamedLWLockTranche("datalink_objcache", 1);
+}
+
+/* Attach to the shared memory cache, AddinShmemInitLock is held */
+void
+datalink_objcache_shmem_init(int cache_size, int max_object)
+{
+	int         nslots = objcache_nslots(cache_size, max_object);
+	bool        found;
+	int         i;
+	HASHCTL     info;
+
+	if (nslots == 0)
+		return;
+
+	objcache_shared = ShmemInitStruct("datalink object cache",
+							offsetof(ObjCacheShared, slots) +
+							nslots * sizeof(ObjCacheSlot), &found);
+	if (!found)
+	{
+		objcache_shared->lock = &(GetNamedLWLockTranche("datalink_objcache"))->lock;
+		objcache_shared->nslots = nslots;
+		objcache_shared->slot_size = (Size) max_object * 1024;
+		objcache_shared->clock_hand = 0;
+		for (i = 0; i < nslots; i++)
+		{
+			objcache_shared->slots[i].valid = false;
+			pg_atomic_init_u32(&objcache_shared->slots[i].usage, 0);
+		}
+	}
+	objcache_data = ShmemInitStruct("datalink object cache data",
+							(Size) nslots * max_object * 1024, &found);
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(ObjCacheKey);
+	info.entrysize = sizeof(ObjCacheEntry);
+	objcache_hash = ShmemInitHash("datalink object cache hash",
+								nslots, nslots,
+								&info, HASH_ELEM | HASH_BLOBS);
+}
+
+static void
+objcache_key(const struct stat *st, ObjCacheKey *key)
+{
+	/* clear padding, the key is hashed as a blob */
+	memset(key, 0, sizeof(ObjCacheKey));
+	key->dev = st->st_dev;
+	key->ino = st->st_ino;
+}
+
+/* Whether the content of a slot is the one of the file */
+static bool
+objcache_slot_matches(ObjCacheSlot *slot, const struct stat *st)
+{
+	return (slot->valid && slot->size == st->st_size &&
+			slot->mtime_sec == st->st_mtim.tv_sec &&
+			slot->mtime_nsec == st->st_mtim.tv_nsec);
+}
+
+/* Whether a file is small enough to be cached */
+bool
+datalink_objcache_enabled(off_t size)
+{
+	return (objcache_shared != NULL && size <= (off_t) objcache_shared->slot_size);
+}
+
+/*
+ * Look for the content of a file in the cache, st is the result of stat()
+ * on the file. Returns NULL when it is not found or has changed.
+ */
+bytea *
+datalink_objcache_lookup(const struct stat *st)
+{
+	ObjCacheKey     key;
+	ObjCacheEntry  *entry;
+	ObjCacheSlot   *slot;
+	bytea          *result = NULL;
+
+	if (!datalink_objcache_enabled(st->st_size))
+		return NULL;
+
+	objcache_key(st, &key);
+	LWLockAcquire(objcache_shared->lock, LW_SHARED);
+	entry = (ObjCacheEntry *) hash_search(objcache_hash, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		slot = &objcache_shared->slots[entry->slot];
+		if (objcache_slot_matches(slot, st))
+		{
+			result = (bytea *) palloc(st->st_size + VARHDRSZ);
+			memcpy(VARDATA(result),
+				   objcache_data + (Size) entry->slot * objcache_shared->slot_size,
+				   st->st_size);
+			SET_VARSIZE(result, st->st_size + VARHDRSZ);
+			if (pg_atomic_read_u32(&slot->usage) < OBJCACHE_MAX_USAGE)
+				pg_atomic_fetch_add_u32(&slot->usage, 1);
+		}
+	}
+	LWLockRelease(objcache_shared->lock);
+
+	return result;
+}
+
+/*
+ * Find a slot to reuse with the CLOCK sweep, the lock is held in exclusive
+ * mode. The entry of its previous file is removed.
+ */
+static int
+objcache_victim(void)
+{
+	for (;;)
+	{
+		int             victim = objcache_shared->clock_hand;
+		ObjCacheSlot   *slot = &objcache_shared->slots[victim];
+
+		objcache_shared->clock_hand = (victim + 1) % objcache_shared->nslots;
+		if (slot->valid && pg_atomic_read_u32(&slot->usage) > 0)
+		{
+			pg_atomic_fetch_sub_u32(&slot->usage, 1);
+			continue;
+		}
+
+		if (slot->valid)
+			hash_search(objcache_hash, &slot->key, HASH_REMOVE, NULL);
+		slot->valid = false;
+
+		return victim;
+	}
+}
+
+/*
+ * Store the content of a file read after st has been taken. If the file
+ * has changed meanwhile, its modification time differs from the one of the
+ * slot and the entry will never be used.
+ */
+void
+datalink_objcache_store(const struct stat *st, bytea *content)
+{
+	ObjCacheKey     key;
+	ObjCacheEntry  *entry;
+	ObjCacheSlot   *slot;
+	bool            found;
+	Size            len = VARSIZE_ANY_EXHDR(content);
+
+	if (!datalink_objcache_enabled(st->st_size) || len != (Size) st->st_size)
+		return;
+
+	objcache_key(st, &key);
+	LWLockAcquire(objcache_shared->lock, LW_EXCLUSIVE);
+	entry = (ObjCacheEntry *) hash_search(objcache_hash, &key, HASH_ENTER_NULL, &found);
+	if (entry == NULL)
+	{
+		/* should not happen, the hash table is sized for all the slots */
+		LWLockRelease(objcache_shared->lock);
+		return;
+	}
+	if (!found)
+		entry->slot = objcache_victim();
+
+	slot = &objcache_shared->slots[entry->slot];
+	slot->key = key;
+	slot->size = st->st_size;
+	slot->mtime_sec = st->st_mtim.tv_sec;
+	slot->mtime_nsec = st->st_mtim.tv_nsec;
+	memcpy(objcache_data + (Size) entry->slot * objcache_shared->slot_size,
+		   VARDATA_ANY(content), len);
+	pg_atomic_write_u32(&slot->usage, 1);
+	slot->valid = true;
+	LWLockRelease(objcache_shared->lock);
+}
+
+/*
+ * Remove the entry of a file that is about to be modified, renamed over or
+ * removed. Nothing is done if the file does not exist.
+ */
+void
+datalink_objcache_invalidate(const char *path)
+{
+	struct stat     st;
+	ObjCacheKey     key;
+	ObjCacheEntry  *entry;
+
+	if (objcache_shared == NULL || stat(path, &st) < 0)
+		return;
+
+	objcache_key(&st, &key);
+	LWLockAcquire(objcache_shared->lock, LW_EXCLUSIVE);
+	entry = (ObjCacheEntry *) hash_search(objcache_hash, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		objcache_shared->slots[entry->slot].valid = false;
+		pg_atomic_write_u32(&objcache_shared->slots[entry->slot].usage, 0);
+		hash_search(objcache_hash, &key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(objcache_shared->lock);
+}
@@ -0,0 +1,1077 @@
+/*
+ * datalink_remote.c
+ *
+ * Metadata of the remote files referenced by URL datalinks. HEAD requests
+ * are sent concurrently with the libcurl multi interface, connections are
+ * kept alive and reused between calls and the number of concurrent requests
+ * to the same host is bounded. Sizes, ETags and Last-Modified dates are kept
+ * in a shared memory cache for datalink.dl_remote_cache_ttl seconds when the
+ * extension is loaded with shared_preload_libraries.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <ctype.h>
+#include <curl/curl.h>
+
+#include "catalog/pg_type.h"
+#if PG_VERSION_NUM >= 140000
+#include "common/cryptohash.h"
+#endif
+#include "common/sha2.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/condition_variable.h"
+#include "storage/fd.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 170000
+#include "utils/wait_event.h"
+#endif
+
+#include "datalink.h"
+
+#if PG_VERSION_NUM >= 140000
+#define REMOTE_HASH_FLAGS (HASH_ELEM | HASH_STRINGS)
+#else
+#define REMOTE_HASH_FLAGS HASH_ELEM
+#endif
+
+/* Entry of the shared memory cache, the URL is the key */
+typedef struct RemoteCacheEntry
+{
+	char                url[DL_REMOTE_URL_LEN];
+	TimestampTz         fetched;
+	DatalinkRemoteMeta  meta;
+} RemoteCacheEntry;
+
+typedef struct RemoteCacheShared
+{
+	LWLock     *lock;
+	ConditionVariable content_cv;  /* broadcast when a content entry is unlocked */
+} RemoteCacheShared;
+
+/* HEAD request in progress */
+typedef struct RemoteRequest
+{
+	CURL               *easy;
+	DatalinkRemoteMeta *meta;
+} RemoteRequest;
+
+static RemoteCacheShared *remote_shared = NULL;
+static HTAB *remote_cache = NULL;
+
+/* Multi handle kept during the whole session to reuse connections */
+static CURLM *remote_multi = NULL;
+
+Datum		datalink_url_size(PG_FUNCTION_ARGS);
+
+static int  get_int_setting(const char *name, int defval);
+static bool remote_cache_lookup(const char *url, DatalinkRemoteMeta *meta);
+static void remote_cache_store(const char *url, const DatalinkRemoteMeta *meta);
+static void remote_cache_evict(TimestampTz now, int ttl);
+static CURLM *get_multi_handle(int max_connections);
+static CURL *start_request(const char *url, RemoteRequest *req);
+static void finish_request(RemoteRequest *req, CURLcode result,
+		const char *url);
+static size_t header_callback(char *buffer, size_t size, size_t nitems,
+		void *userdata);
+
+/* Reserve shared memory for the cache, called from _PG_init() */
+void
+datalink_remote_shmem_request(int cache_size)
+{
+	if (cache_size <= 0)
+		return;
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(RemoteCacheShared)));
+	RequestAddinShmemSpace(hash_estimate_size(cache_size,
+								sizeof(RemoteCacheEntry)));
+	RequestNamedLWLockTranche("datalink_remote", 1);
+}
+
+/* Attach to the shared memory cache, AddinShmemInitLock is held */
+void
+datalink_remote_shmem_init(int cache_size)
+{
+	bool        found;
+	HASHCTL     info;
+
+	if (cache_size <= 0)
+		return;
+
+	remote_shared = ShmemInitStruct("datalink remote cache",
+									sizeof(RemoteCacheShared), &found);
+	if (!found)
+	{
+		remote_shared->lock = &(GetNamedLWLockTranche("datalink_remote"))->lock;
+		ConditionVariableInit(&remote_shared->content_cv);
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = DL_REMOTE_URL_LEN;
+	info.entrysize = sizeof(RemoteCacheEntry);
+	remote_cache = ShmemInitHash("datalink remote cache hash",
+								cache_size, cache_size,
+								&info, REMOTE_HASH_FLAGS);
+}
+
+/* Get the value of an integer GUC */
+static int
+get_int_setting(const char *name, int defval)
+{
+	const char *value = GetConfigOption(name, true, false);
+
+	if (value == NULL || *value == '\0')
+		return defval;
+
+	return atoi(value);
+}
+
+/* Look for fresh metadata of an URL into the cache */
+static bool
+remote_cache_lookup(const char *url, DatalinkRemoteMeta *meta)
+{
+	RemoteCacheEntry   *entry;
+	bool                found = false;
+	int                 ttl;
+
+	if (remote_cache == NULL || strlen(url) >= DL_REMOTE_URL_LEN)
+		return false;
+
+	ttl = get_int_setting("datalink.dl_remote_cache_ttl", DATALINK_REMOTE_CACHE_TTL);
+
+	LWLockAcquire(remote_shared->lock, LW_SHARED);
+	entry = (RemoteCacheEntry *) hash_search(remote_cache, url, HASH_FIND, NULL);
+	if (entry != NULL && !TimestampDifferenceExceeds(entry->fetched,
+								GetCurrentTimestamp(), ttl * 1000))
+	{
+		memcpy(meta, &entry->meta, sizeof(DatalinkRemoteMeta));
+		found = true;
+	}
+	LWLockRelease(remote_shared->lock);
+
+	return found;
+}
+
+/* Store metadata of an URL into the cache, evicting entries if it is full */
+static void
+remote_cache_store(const char *url, const DatalinkRemoteMeta *meta)
+{
+	RemoteCacheEntry   *entry;
+	TimestampTz         now = GetCurrentTimestamp();
+	int                 ttl;
+
+	if (remote_cache == NULL || strlen(url) >= DL_REMOTE_URL_LEN)
+		return;
+
+	ttl = get_int_setting("datalink.dl_remote_cache_ttl", DATALINK_REMOTE_CACHE_TTL);
+
+	LWLockAcquire(remote_shared->lock, LW_EXCLUSIVE);
+	entry = (RemoteCacheEntry *) hash_search(remote_cache, url, HASH_ENTER_NULL, NULL);
+	if (entry == NULL)
+	{
+		remote_cache_evict(now, ttl);
+		entry = (RemoteCacheEntry *) hash_search(remote_cache, url, HASH_ENTER_NULL, NULL);
+	}
+	if (entry != NULL)
+	{
+		entry->fetched = now;
+		memcpy(&entry->meta, meta, sizeof(DatalinkRemoteMeta));
+	}
+	LWLockRelease(remote_shared->lock);
+}
+
+/*
+ * Remove the expired entries from the cache, or the oldest one if none has
+ * expired. The lock must be held in exclusive mode.
+ */
+static void
+remote_cache_evict(TimestampTz now, int ttl)
+{
+	HASH_SEQ_STATUS     status;
+	RemoteCacheEntry   *entry;
+	RemoteCacheEntry   *oldest = NULL;
+	int                 removed = 0;
+
+	hash_seq_init(&status, remote_cache);
+	while ((entry = (RemoteCacheEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (TimestampDifferenceExceeds(entry->fetched, now, ttl * 1000))
+		{
+			hash_search(remote_cache, entry->url, HASH_REMOVE, NULL);
+			removed++;
+		}
+		else if (oldest == NULL || entry->fetched < oldest->fetched)
+			oldest = entry;
+	}
+
+	if (removed == 0 && oldest != NULL)
+		hash_search(remote_cache, oldest->url, HASH_REMOVE, NULL);
+}
+
+/* Get the multi handle of the session, connections are reused with it */
+static CURLM *
+get_multi_handle(int max_connections)
+{
+	int     max_host;
+
+	if (remote_multi == NULL)
+	{
+		if (curl_global_init(CURL_GLOBAL_ALL) != 0)
+			ereport(ERROR,
+					(errmsg("could not initialize libcurl")));
+		remote_multi = curl_multi_init();
+		if (remote_multi == NULL)
+			ereport(ERROR,
+					(errmsg("could not create a libcurl multi handle")));
+	}
+
+	max_host = get_int_setting("datalink.dl_remote_max_host_connections",
+								DATALINK_REMOTE_MAX_HOST_CONNECTIONS);
+	curl_multi_setopt(remote_multi, CURLMOPT_MAX_HOST_CONNECTIONS, (long) max_host);
+	curl_multi_setopt(remote_multi, CURLMOPT_MAX_TOTAL_CONNECTIONS, (long) max_connections);
+	curl_multi_setopt(remote_multi, CURLMOPT_MAXCONNECTS, (long) max_connections);
+
+	return remote_multi;
+}
+
+/* Keep the ETag of the last response, redirections included */
+static size_t
+header_callback(char *buffer, size_t size, size_t nitems, void *userdata)
+{
+	RemoteRequest  *req = (RemoteRequest *) userdata;
+	size_t          len = size * nitems;
+	const char     *p;
+	size_t          n;
+
+	if (len >= 5 && strncmp(buffer, "HTTP/", 5) == 0)
+		req->meta->etag[0] = '\0';
+	else if (len > 5 && pg_strncasecmp(buffer, "ETag:", 5) == 0)
+	{
+		p = buffer + 5;
+		n = len - 5;
+		while (n > 0 && isspace((unsigned char) *p))
+		{
+			p++;
+			n--;
+		}
+		while (n > 0 && isspace((unsigned char) p[n - 1]))
+			n--;
+		if (n >= DL_REMOTE_ETAG_LEN)
+			n = DL_REMOTE_ETAG_LEN - 1;
+		memcpy(req->meta->etag, p, n);
+		req->meta->etag[n] = '\0';
+	}
+
+	return len;
+}
+
+/* Prepare a HEAD request */
+static CURL *
+start_request(const char *url, RemoteRequest *req)
+{
+	CURL   *easy = curl_easy_init();
+	int     timeout;
+
+	if (easy == NULL)
+		ereport(ERROR,
+				(errmsg("could not create a libcurl handle")));
+
+	timeout = get_int_setting("datalink.dl_remote_timeout", DATALINK_REMOTE_TIMEOUT);
+	curl_easy_setopt(easy, CURLOPT_URL, url);
+	curl_easy_setopt(easy, CURLOPT_NOBODY, 1L);
+	curl_easy_setopt(easy, CURLOPT_FILETIME, 1L);
+	curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(easy, CURLOPT_TIMEOUT, (long) timeout);
+	curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, header_callback);
+	curl_easy_setopt(easy, CURLOPT_HEADERDATA, req);
+	curl_easy_setopt(easy, CURLOPT_PRIVATE, req);
+
+	req->easy = easy;
+	req->meta->valid = false;
+	req->meta->size = -1;
+	req->meta->last_modified = -1;
+	req->meta->etag[0] = '\0';
+
+	return easy;
+}
+
+/* Get the metadata from a completed request */
+static void
+finish_request(RemoteRequest *req, CURLcode result, const char *url)
+{
+	long        code = 0;
+	long        filetime = -1;
+	curl_off_t  length = -1;
+
+	if (result != CURLE_OK)
+	{
+		ereport(DEBUG1,
+				(errmsg("HEAD request to \"%s\" failed: %s", url,
+						curl_easy_strerror(result))));
+		return;
+	}
+
+	curl_easy_getinfo(req->easy, CURLINFO_RESPONSE_CODE, &code);
+	if (code >= 400)
+	{
+		ereport(DEBUG1,
+				(errmsg("HEAD request to \"%s\" returned HTTP status %ld", url, code)));
+		return;
+	}
+
+	curl_easy_getinfo(req->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+	curl_easy_getinfo(req->easy, CURLINFO_FILETIME, &filetime);
+
+	req->meta->valid = true;
+	req->meta->size = (int64) length;
+	req->meta->last_modified = (time_t) filetime;
+}
+
+/*
+ * Get the metadata of a list of remote URLs. Fresh entries of the cache are
+ * used, the other URLs are requested concurrently. meta must have room for
+ * nurls entries, meta[i].valid is false when the request has failed.
+ */
+void
+datalink_remote_head(int nurls, char **urls, DatalinkRemoteMeta *meta)
+{
+	CURLM          *multi;
+	RemoteRequest  *reqs;
+	int            *missing;
+	int             nmissing = 0;
+	int             max_connections;
+	volatile int    next = 0;
+	int             inflight = 0;
+	int             i;
+
+	missing = (int *) palloc(nurls * sizeof(int));
+	for (i = 0; i < nurls; i++)
+	{
+		if (!remote_cache_lookup(urls[i], &meta[i]))
+			missing[nmissing++] = i;
+	}
+	if (nmissing == 0)
+		return;
+
+	max_connections = get_int_setting("datalink.dl_remote_max_connections",
+								DATALINK_REMOTE_MAX_CONNECTIONS);
+	if (max_connections < 1)
+		max_connections = 1;
+	multi = get_multi_handle(max_connections);
+	reqs = (RemoteRequest *) palloc0(nmissing * sizeof(RemoteRequest));
+
+	PG_TRY();
+	{
+		while (next < nmissing || inflight > 0)
+		{
+			CURLMsg    *msg;
+			int         running;
+			int         nmsgs;
+
+			/* Keep at most max_connections requests in progress */
+			while (next < nmissing && inflight < max_connections)
+			{
+				reqs[next].meta = &meta[missing[next]];
+				curl_multi_add_handle(multi, start_request(urls[missing[next]], &reqs[next]));
+				next++;
+				inflight++;
+			}
+
+			curl_multi_perform(multi, &running);
+			while ((msg = curl_multi_info_read(multi, &nmsgs)) != NULL)
+			{
+				RemoteRequest  *req;
+				char           *url;
+
+				if (msg->msg != CURLMSG_DONE)
+					continue;
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **) &req);
+				curl_easy_getinfo(msg->easy_handle, CURLINFO_EFFECTIVE_URL, &url);
+				finish_request(req, msg->data.result, url);
+				curl_multi_remove_handle(multi, req->easy);
+				curl_easy_cleanup(req->easy);
+				req->easy = NULL;
+				inflight--;
+			}
+
+			if (inflight > 0)
+				curl_multi_wait(multi, NULL, 0, 1000, NULL);
+
+			CHECK_FOR_INTERRUPTS();
+		}
+	}
+	PG_CATCH();
+	{
+		for (i = 0; i < next; i++)
+		{
+			if (reqs[i].easy != NULL)
+			{
+				curl_multi_remove_handle(multi, reqs[i].easy);
+				curl_easy_cleanup(reqs[i].easy);
+			}
+		}
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	for (i = 0; i < nmissing; i++)
+	{
+		if (meta[missing[i]].valid)
+			remote_cache_store(urls[missing[i]], &meta[missing[i]]);
+	}
+
+	pfree(reqs);
+	pfree(missing);
+}
+
+/*
+ * Return the sizes of the files referenced by an array of URLs. Local files
+ * are looked at with stat(), remote files are requested concurrently. The
+ * size is NULL when it can not be found, when the second argument is true
+ * an error is raised instead if it is the one of a remote file.
+ */
+PG_FUNCTION_INFO_V1(datalink_url_size);
+Datum
+datalink_url_size(PG_FUNCTION_ARGS)
+{
+	ArrayType          *urls = PG_GETARG_ARRAYTYPE_P(0);
+	bool                strict = PG_GETARG_BOOL(1);
+	Datum              *elems;
+	bool               *nulls;
+	int                 nelems;
+	Datum              *sizes;
+	char              **remote_urls;
+	int                *remote_idx;
+	int                 nremote = 0;
+	int                 nfailed = 0;
+	DatalinkRemoteMeta *meta;
+	int                 dims[1];
+	int                 lbs[1];
+	int                 i;
+
+	deconstruct_array(urls, TEXTOID, -1, false, 'i', &elems, &nulls, &nelems);
+	if (nelems == 0)
+		PG_RETURN_ARRAYTYPE_P(construct_empty_array(INT8OID));
+
+	sizes = (Datum *) palloc(nelems * sizeof(Datum));
+	remote_urls = (char **) palloc(nelems * sizeof(char *));
+	remote_idx = (int *) palloc(nelems * sizeof(int));
+	for (i = 0; i < nelems; i++)
+	{
+		char        *url;
+		struct stat  st;
+
+		if (nulls[i])
+			continue;
+
+		url = TextDatumGetCString(elems[i]);
+		if (strstr(url, "://") != NULL && strncmp(url, "file://", 7) != 0)
+		{
+			remote_idx[nremote] = i;
+			remote_urls[nremote++] = url;
+			continue;
+		}
+
+		if (strncmp(url, "file://", 7) == 0)
+			url += 7;
+		if (stat(url, &st) == 0)
+			sizes[i] = Int64GetDatum((int64) st.st_size);
+		else
+			nulls[i] = true;
+	}
+
+	meta = (DatalinkRemoteMeta *) palloc(Max(nremote, 1) * sizeof(DatalinkRemoteMeta));
+	if (nremote > 0)
+		datalink_remote_head(nremote, remote_urls, meta);
+	for (i = 0; i < nremote; i++)
+	{
+		if (meta[i].valid && meta[i].size >= 0)
+			sizes[remote_idx[i]] = Int64GetDatum(meta[i].size);
+		else if (strict)
+			ereport(ERROR,
+					(errmsg("could not get the size of remote file \"%s\"",
+							remote_urls[i])));
+		else
+		{
+			nulls[remote_idx[i]] = true;
+			nfailed++;
+		}
+	}
+	if (nfailed > 0)
+		ereport(WARNING,
+				(errmsg("could not get the size of %d remote file(s)", nfailed)));
+
+	dims[0] = nelems;
+	lbs[0] = 1;
+	PG_RETURN_ARRAYTYPE_P(construct_md_array(sizes, nulls, 1, dims, lbs,
+								INT8OID, sizeof(int64), FLOAT8PASSBYVAL, 'd'));
+}
+
+/*
+ * Read-through cache of the content of remote files. Each entry is stored
+ * in a subdirectory of datalink.dl_remote_cache_directory named after the
+ * first two hexadecimal digits of the SHA256 of the URL:
+ *
+ *   <hash>       content of the remote file
+ *   <hash>.meta  ETag and Last-Modified date, its mtime is the last access
+ *   <hash>.lock  lock file, concurrent misses for the same URL wait on it
+ *                so that the file is fetched only once
+ *
+ * A backend waiting for the lock of an entry sleeps on a condition variable
+ * broadcast each time an entry is unlocked. The eviction of an entry takes
+ * its lock too and skips the entries in use.
+ */
+
+#define REMOTE_CONTENT_MAGIC 0x444c4331   /* DLC1 */
+
+/* Content of a .meta file */
+typedef struct RemoteContentMeta
+{
+	uint32      magic;
+	time_t      last_modified;
+	char        etag[DL_REMOTE_ETAG_LEN];
+} RemoteContentMeta;
+
+/* Cache entry found while enforcing the size of the cache */
+typedef struct RemoteContentEntry
+{
+	char       *path;          /* path without suffix */
+	off_t       size;
+	time_t      atime;         /* mtime of the .meta file */
+} RemoteContentEntry;
+
+Datum		datalink_read_remotefile(PG_FUNCTION_ARGS);
+
+static uint32 content_wait_event = 0;
+
+static void remote_content_path(const char *dir, const char *url, char *path);
+static bool read_content_meta(const char *path, RemoteContentMeta *meta);
+static void write_content_meta(const char *path, const RemoteContentMeta *meta);
+static int  lock_content_entry(const char *path);
+static int  try_lock_content_entry(const char *path);
+static void unlock_content_entry(int fd);
+static void wait_content_entry(void);
+static long fetch_remote_file(const char *url, const char *tmppath,
+		const RemoteContentMeta *cached, RemoteContentMeta *meta);
+static int  remote_progress_callback(void *clientp, curl_off_t dltotal,
+		curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow);
+static int  content_entry_cmp(const void *a, const void *b);
+static void enforce_content_cache_size(const char *dir, int64 max_size);
+
+/* Build the path of a cache entry, path must be MAXPGPATH long */
+static void
+remote_content_path(const char *dir, const char *url, char *path)
+{
+#if PG_VERSION_NUM >= 140000
+	pg_cryptohash_ctx *ctx;
+#else
+	pg_sha256_ctx   ctx;
+#endif
+	uint8           digest[PG_SHA256_DIGEST_LENGTH];
+	char            hex[PG_SHA256_DIGEST_LENGTH * 2 + 1];
+	char            subdir[MAXPGPATH];
+	int             i;
+
+#if PG_VERSION_NUM >= 140000
+	/* The SHA256 functions are only reachable through cryptohash.h */
+	ctx = pg_cryptohash_create(PG_SHA256);
+	if (ctx == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("out of memory")));
+	if (pg_cryptohash_init(ctx) < 0 ||
+		pg_cryptohash_update(ctx, (const uint8 *) url, strlen(url)) < 0 ||
+		pg_cryptohash_final(ctx, digest, sizeof(digest)) < 0)
+	{
+		pg_cryptohash_free(ctx);
+		ereport(ERROR,
+				(errcode(ERRCODE_INTERNAL_ERROR),
+				 errmsg("could not compute the hash of URL \"%s\"", url)));
+	}
+	pg_cryptohash_free(ctx);
+#else
+	pg_sha256_init(&ctx);
+	pg_sha256_update(&ctx, (const uint8 *) url, strlen(url));
+	pg_sha256_final(&ctx, digest);
+#endif
+	for (i = 0; i < PG_SHA256_DIGEST_LENGTH; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+
+	snprintf(subdir, sizeof(subdir), "%s/%.2s", dir, hex);
+	if (pg_mkdir_p(subdir, S_IRWXU) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", subdir)));
+
+	snprintf(path, MAXPGPATH, "%s/%s", subdir, hex);
+}
+
+/* Read the .meta file of an entry, false if it does not exist */
+static bool
+read_content_meta(const char *path, RemoteContentMeta *meta)
+{
+	char    fname[MAXPGPATH];
+	FILE   *file;
+	size_t  nread;
+
+	snprintf(fname, sizeof(fname), "%s.meta", path);
+	if ((file = AllocateFile(fname, PG_BINARY_R)) == NULL)
+	{
+		if (errno == ENOENT)
+			return false;
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for reading: %m", fname)));
+	}
+	nread = fread(meta, sizeof(RemoteContentMeta), 1, file);
+	FreeFile(file);
+
+	return (nread == 1 && meta->magic == REMOTE_CONTENT_MAGIC);
+}
+
+/* Write the .meta file of an entry, this also marks it as used now */
+static void
+write_content_meta(const char *path, const RemoteContentMeta *meta)
+{
+	char    fname[MAXPGPATH];
+	char    tmpname[MAXPGPATH];
+	FILE   *file;
+
+	snprintf(fname, sizeof(fname), "%s.meta", path);
+	snprintf(tmpname, sizeof(tmpname), "%s.meta.%d", path, MyProcPid);
+	if ((file = AllocateFile(tmpname, PG_BINARY_W)) == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for writing: %m", tmpname)));
+	if (fwrite(meta, sizeof(RemoteContentMeta), 1, file) != 1)
+	{
+		FreeFile(file);
+		unlink(tmpname);
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmpname)));
+	}
+	if (FreeFile(file) != 0 || rename(tmpname, fname) != 0)
+	{
+		unlink(tmpname);
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", fname)));
+	}
+}
+
+/*
+ * Take the lock of an entry, waiting for the backend fetching the same URL
+ * if any. The lock is released with unlock_content_entry().
+ */
+static int
+lock_content_entry(const char *path)
+{
+	char            fname[MAXPGPATH];
+	int             fd;
+	struct flock    fl;
+	struct stat     st;
+	struct stat     fst;
+
+	snprintf(fname, sizeof(fname), "%s.lock", path);
+	for (;;)
+	{
+		fd = OpenTransientFile(fname, O_RDWR | O_CREAT | PG_BINARY);
+		if (fd < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open lock file \"%s\": %m", fname)));
+
+		fl.l_type = F_WRLCK;
+		fl.l_whence = SEEK_SET;
+		fl.l_start = 0;
+		fl.l_len = 0;
+		while (fcntl(fd, F_SETLK, &fl) == -1)
+		{
+			if (errno != EACCES && errno != EAGAIN)
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("can not lock file \"%s\": %m", fname)));
+			wait_content_entry();
+		}
+		if (remote_shared != NULL)
+			ConditionVariableCancelSleep();
+
+		/*
+		 * The entry may have been evicted while we were waiting, the lock is
+		 * then taken again on the lock file of the new entry.
+		 */
+		if (fstat(fd, &fst) == 0 && stat(fname, &st) == 0 &&
+			fst.st_dev == st.st_dev && fst.st_ino == st.st_ino)
+			break;
+		CloseTransientFile(fd);
+	}
+
+	return fd;
+}
+
+/* Take the lock of an entry if nobody holds it, -1 otherwise */
+static int
+try_lock_content_entry(const char *path)
+{
+	char            fname[MAXPGPATH];
+	int             fd;
+	struct flock    fl;
+
+	snprintf(fname, sizeof(fname), "%s.lock", path);
+	fd = OpenTransientFile(fname, O_RDWR | O_CREAT | PG_BINARY);
+	if (fd < 0)
+		return -1;
+
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = 0;
+	fl.l_len = 0;
+	if (fcntl(fd, F_SETLK, &fl) == -1)
+	{
+		CloseTransientFile(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* Release the lock of an entry and wake up the backends waiting for one */
+static void
+unlock_content_entry(int fd)
+{
+	CloseTransientFile(fd);
+	if (remote_shared != NULL)
+		ConditionVariableBroadcast(&remote_shared->content_cv);
+}
+
+/*
+ * Sleep until an entry is unlocked. Without shared memory nobody wakes us
+ * up, the lock is tried again after a short sleep.
+ */
+static void
+wait_content_entry(void)
+{
+#if PG_VERSION_NUM >= 170000
+	if (content_wait_event == 0)
+		content_wait_event = WaitEventExtensionNew("DatalinkRemoteCacheLock");
+#else
+	content_wait_event = PG_WAIT_EXTENSION;
+#endif
+
+#if PG_VERSION_NUM >= 130000
+	if (remote_shared != NULL)
+	{
+		/* the timeout covers a backend that has died holding the lock */
+		(void) ConditionVariableTimedSleep(&remote_shared->content_cv, 1000L,
+										   content_wait_event);
+		return;
+	}
+#endif
+
+	(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+					 10L, content_wait_event);
+	ResetLatch(MyLatch);
+	CHECK_FOR_INTERRUPTS();
+}
+
+/* Abort a transfer when the query is cancelled */
+static int
+remote_progress_callback(void *clientp, curl_off_t dltotal, curl_off_t dlnow,
+						curl_off_t ultotal, curl_off_t ulnow)
+{
+	return (InterruptPending) ? 1 : 0;
+}
+
+/*
+ * Download a remote file into tmppath. When cached is not NULL the request
+ * is conditional. Returns the HTTP status of the response.
+ */
+static long
+fetch_remote_file(const char *url, const char *tmppath,
+				const RemoteContentMeta *cached, RemoteContentMeta *meta)
+{
+	CURL               *easy;
+	FILE               *out;
+	struct curl_slist  *headers = NULL;
+	DatalinkRemoteMeta  rmeta;
+	RemoteRequest       req;
+	CURLcode            res;
+	long                code = 0;
+	long                filetime = -1;
+	int                 timeout;
+
+	if ((out = AllocateFile(tmppath, PG_BINARY_W)) == NULL)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open file \"%s\" for writing: %m", tmppath)));
+
+	easy = curl_easy_init();
+	if (easy == NULL)
+		ereport(ERROR,
+				(errmsg("could not create a libcurl handle")));
+
+	memset(&rmeta, 0, sizeof(rmeta));
+	req.easy = easy;
+	req.meta = &rmeta;
+	timeout = get_int_setting("datalink.dl_remote_timeout", DATALINK_REMOTE_TIMEOUT);
+	curl_easy_setopt(easy, CURLOPT_URL, url);
+	curl_easy_setopt(easy, CURLOPT_WRITEDATA, out);
+	curl_easy_setopt(easy, CURLOPT_FILETIME, 1L);
+	curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+	curl_easy_setopt(easy, CURLOPT_NOSIGNAL, 1L);
+	curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, (long) timeout);
+	curl_easy_setopt(easy, CURLOPT_MAXFILESIZE_LARGE, (curl_off_t) (MaxAllocSize - VARHDRSZ));
+	curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, header_callback);
+	curl_easy_setopt(easy, CURLOPT_HEADERDATA, &req);
+	curl_easy_setopt(easy, CURLOPT_NOPROGRESS, 0L);
+	curl_easy_setopt(easy, CURLOPT_XFERINFOFUNCTION, remote_progress_callback);
+	if (cached != NULL)
+	{
+		if (cached->etag[0] != '\0')
+		{
+			char    header[DL_REMOTE_ETAG_LEN + 32];
+
+			snprintf(header, sizeof(header), "If-None-Match: %s", cached->etag);
+			headers = curl_slist_append(headers, header);
+			curl_easy_setopt(easy, CURLOPT_HTTPHEADER, headers);
+		}
+		if (cached->last_modified > 0)
+		{
+			curl_easy_setopt(easy, CURLOPT_TIMECONDITION, (long) CURL_TIMECOND_IFMODSINCE);
+			curl_easy_setopt(easy, CURLOPT_TIMEVALUE, (long) cached->last_modified);
+		}
+	}
+
+	res = curl_easy_perform(easy);
+	curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &code);
+	curl_easy_getinfo(easy, CURLINFO_FILETIME, &filetime);
+	curl_easy_cleanup(easy);
+	curl_slist_free_all(headers);
+	if (FreeFile(out) != 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not write file \"%s\": %m", tmppath)));
+
+	CHECK_FOR_INTERRUPTS();
+	if (res != CURLE_OK)
+		ereport(ERROR,
+				(errmsg("could not fetch remote file \"%s\": %s", url,
+						curl_easy_strerror(res))));
+
+	meta->magic = REMOTE_CONTENT_MAGIC;
+	meta->last_modified = (time_t) filetime;
+	strlcpy(meta->etag, rmeta.etag, DL_REMOTE_ETAG_LEN);
+
+	return code;
+}
+
+/* Sort cache entries by last access time */
+static int
+content_entry_cmp(const void *a, const void *b)
+{
+	const RemoteContentEntry *ea = (const RemoteContentEntry *) a;
+	const RemoteContentEntry *eb = (const RemoteContentEntry *) b;
+
+	if (ea->atime == eb->atime)
+		return 0;
+
+	return (ea->atime < eb->atime) ? -1 : 1;
+}
+
+/* Remove the least recently used entries while the cache is too large */
+static void
+enforce_content_cache_size(const char *dir, int64 max_size)
+{
+	DIR                *d;
+	struct dirent      *de;
+	RemoteContentEntry *entries;
+	int                 nentries = 0;
+	int                 maxentries = 256;
+	int64               total = 0;
+	int                 i;
+
+	entries = (RemoteContentEntry *) palloc(maxentries * sizeof(RemoteContentEntry));
+	d = AllocateDir(dir);
+	while ((de = ReadDir(d, dir)) != NULL)
+	{
+		char            subdir[MAXPGPATH];
+		DIR            *sd;
+		struct dirent  *sde;
+
+		if (strlen(de->d_name) != 2 || !isxdigit((unsigned char) de->d_name[0]))
+			continue;
+
+		snprintf(subdir, sizeof(subdir), "%s/%s", dir, de->d_name);
+		sd = AllocateDir(subdir);
+		while ((sde = ReadDir(sd, subdir)) != NULL)
+		{
+			char        fname[MAXPGPATH];
+			struct stat dst;
+			struct stat mst;
+			size_t      len = strlen(sde->d_name);
+
+			if (len != PG_SHA256_DIGEST_LENGTH * 2)
+				continue;
+
+			snprintf(fname, sizeof(fname), "%s/%s", subdir, sde->d_name);
+			if (stat(fname, &dst) != 0)
+				continue;
+			strlcat(fname, ".meta", sizeof(fname));
+			if (stat(fname, &mst) != 0)
+				mst.st_mtime = 0;
+
+			if (nentries >= maxentries)
+			{
+				maxentries *= 2;
+				entries = (RemoteContentEntry *) repalloc(entries,
+								maxentries * sizeof(RemoteContentEntry));
+			}
+			entries[nentries].path = psprintf("%s/%s", subdir, sde->d_name);
+			entries[nentries].size = dst.st_size;
+			entries[nentries].atime = mst.st_mtime;
+			nentries++;
+			total += dst.st_size;
+		}
+		FreeDir(sd);
+	}
+	FreeDir(d);
+
+	if (total > max_size)
+	{
+		qsort(entries, nentries, sizeof(RemoteContentEntry), content_entry_cmp);
+		for (i = 0; i < nentries && total > max_size; i++)
+		{
+			char    fname[MAXPGPATH];
+			int     lockfd;
+
+			/* an entry being fetched or read is kept */
+			lockfd = try_lock_content_entry(entries[i].path);
+			if (lockfd < 0)
+				continue;
+
+			snprintf(fname, sizeof(fname), "%s.meta", entries[i].path);
+			unlink(fname);
+			if (unlink(entries[i].path) == 0)
+				total -= entries[i].size;
+			snprintf(fname, sizeof(fname), "%s.lock", entries[i].path);
+			unlink(fname);
+			unlock_content_entry(lockfd);
+		}
+	}
+
+	for (i = 0; i < nentries; i++)
+		pfree(entries[i].path);
+	pfree(entries);
+}
+
+/*
+ * Return the content of a remote file through the cache. Fresh entries are
+ * read from disk, older ones are revalidated with the ETag or Last-Modified
+ * date and downloaded again only when they have changed.
+ */
+PG_FUNCTION_INFO_V1(datalink_read_remotefile);
+Datum
+datalink_read_remotefile(PG_FUNCTION_ARGS)
+{
+	char               *url = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	const char         *dir;
+	int64               max_size;
+	int                 ttl;
+	char                path[MAXPGPATH];
+	char                tmppath[MAXPGPATH];
+	char                fname[MAXPGPATH];
+	RemoteContentMeta   cached;
+	RemoteContentMeta   meta;
+	struct stat         st;
+	bool                have;
+	bool                fetched = false;
+	long                code;
+	int                 lockfd;
+	bytea              *result;
+
+	dir = GetConfigOption("datalink.dl_remote_cache_directory", true, false);
+	if (dir == NULL || *dir == '\0')
+		dir = DATALINK_REMOTE_CACHE_DIRECTORY;
+	max_size = (int64) get_int_setting("datalink.dl_remote_cache_max_size",
+								DATALINK_REMOTE_CACHE_MAX_SIZE) * 1024;
+	ttl = get_int_setting("datalink.dl_remote_cache_ttl", DATALINK_REMOTE_CACHE_TTL);
+
+	remote_content_path(dir, url, path);
+	snprintf(tmppath, sizeof(tmppath), "%s.%d", path, MyProcPid);
+
+	lockfd = lock_content_entry(path);
+	PG_TRY();
+	{
+		have = (max_size > 0 && read_content_meta(path, &cached)
+						&& stat(path, &st) == 0);
+		snprintf(fname, sizeof(fname), "%s.meta", path);
+
+		/* Entries validated less than ttl seconds ago are used as is */
+		if (have && stat(fname, &st) == 0 && time(NULL) - st.st_mtime < ttl)
+		{
+			/* mark the entry as used for the LRU */
+			write_content_meta(path, &cached);
+		}
+		else
+		{
+			code = fetch_remote_file(url, tmppath, have ? &cached : NULL, &meta);
+			if (code == 304 && have)
+			{
+				unlink(tmppath);
+				write_content_meta(path, &cached);
+			}
+			else if (code >= 200 && code < 300)
+			{
+				if (rename(tmppath, path) != 0)
+					ereport(ERROR,
+							(errcode_for_file_access(),
+							 errmsg("could not rename file \"%s\" to \"%s\": %m",
+									tmppath, path)));
+				write_content_meta(path, &meta);
+				fetched = true;
+			}
+			else
+				ereport(ERROR,
+						(errmsg("could not fetch remote file \"%s\": HTTP status %ld",
+								url, code)));
+		}
+
+		result = read_binary_file(path, 0, -1, false, NULL);
+
+		/* The entry is not kept when the cache is disabled */
+		if (max_size <= 0)
+		{
+			unlink(fname);
+			unlink(path);
+		}
+	}
+	PG_CATCH();
+	{
+		unlink(tmppath);
+		unlock_content_entry(lockfd);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	unlock_content_entry(lockfd);
+
+	if (fetched && max_size > 0)
+		enforce_content_cache_size(dir, max_size);
+
+	PG_RETURN_BYTEA_P(result);
+}
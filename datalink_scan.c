@@ -0,0 +1,515 @@
+/*
+ * datalink_scan.c
+ *
+ * Directory crawler used by dl_changes() to build the snapshot of the files
+ * of a base directory. The tree is walked by a pool of
+ * datalink.dl_io_threads threads sharing a stack of the directories left
+ * to read, each one reads a directory and calls fstatat() on its entries so
+ * that the latency of the metadata calls, high on network filesystems, is
+ * overlapped.
+ *
+ * As for dl_audit(), the threads never call any PostgreSQL function, they
+ * only use malloc() and store the result in a shared array that the backend
+ * copies once they have all finished. Signals are blocked while they are
+ * running so that they are always handled by the backend itself.
+ *
+ * A directory that can not be fully read makes the whole scan fail: its
+ * files would otherwise be missing from the result and reported as deleted
+ * by dl_changes().
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+
+#include "datalink.h"
+
+/* A regular file found by the crawler, path is relative to the root */
+typedef struct ScanEntry
+{
+	char       *path;
+	ino_t       ino;
+	off_t       size;
+	struct timespec mtime;
+	struct timespec ctime;
+} ScanEntry;
+
+/* Work shared by the threads of the pool, protected by the mutex */
+typedef struct DatalinkScanWork
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	const char *root;
+	char      **excluded;       /* absolute paths of the skipped directories */
+	int         nexcluded;
+	char      **dirs;           /* stack of the directories left to read */
+	int         ndirs;
+	int         maxdirs;
+	int         nactive;        /* threads reading a directory */
+	ScanEntry  *entries;
+	int         nentries;
+	int         maxentries;
+	int         nerrors;        /* directories that could not be read */
+	char       *error_dir;      /* the first one, relative to the root */
+	bool        oom;
+} DatalinkScanWork;
+
+/* State of the set returning function between two calls */
+typedef struct DatalinkScanState
+{
+	ScanEntry  *entries;
+	int         nentries;
+	int         next;
+} DatalinkScanState;
+
+Datum		datalink_scan_directory(PG_FUNCTION_ARGS);
+
+static bool scan_grow(void **array, int *max, int count, Size elemsize);
+static bool scan_excluded(DatalinkScanWork *work, const char *path);
+static void scan_push_dir(DatalinkScanWork *work, char *dir);
+static void scan_error(DatalinkScanWork *work, const char *dir);
+static void scan_dir(DatalinkScanWork *work, const char *dir);
+static void *scan_worker(void *arg);
+static void run_scan_workers(DatalinkScanWork *work, int nworkers);
+static void scan_free(DatalinkScanWork *work);
+static TimestampTz timespec_to_timestamptz(const struct timespec *ts);
+
+/*
+ * Make room for count more elements in a malloc'ed array, returns false when
+ * out of memory. Called by the threads, this must not use palloc().
+ */
+static bool
+scan_grow(void **array, int *max, int count, Size elemsize)
+{
+	void   *larger;
+	int     newmax;
+
+	if (count <= *max)
+		return true;
+
+	newmax = Max(*max * 2, Max(count, 64));
+	larger = realloc(*array, newmax * elemsize);
+	if (larger == NULL)
+		return false;
+	*array = larger;
+	*max = newmax;
+
+	return true;
+}
+
+/* Whether a directory must not be crawled, the mutex is not needed */
+static bool
+scan_excluded(DatalinkScanWork *work, const char *path)
+{
+	int     i;
+
+	for (i = 0; i < work->nexcluded; i++)
+	{
+		if (strcmp(path, work->excluded[i]) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+/* Add a directory to the stack, the mutex is held */
+static void
+scan_push_dir(DatalinkScanWork *work, char *dir)
+{
+	if (!scan_grow((void **) &work->dirs, &work->maxdirs, work->ndirs + 1,
+				   sizeof(char *)))
+	{
+		work->oom = true;
+		free(dir);
+		return;
+	}
+	work->dirs[work->ndirs++] = dir;
+	pthread_cond_signal(&work->cond);
+}
+
+/* Count a directory that could not be fully read, the mutex is held */
+static void
+scan_error(DatalinkScanWork *work, const char *dir)
+{
+	work->nerrors++;
+	if (work->error_dir == NULL)
+		work->error_dir = strdup(dir);
+}
+
+/*
+ * Read a directory, its subdirectories are pushed on the stack and its
+ * regular files added to the entries. Symbolic links are not followed,
+ * they are the read access links created by the extension.
+ */
+static void
+scan_dir(DatalinkScanWork *work, const char *dir)
+{
+	char            path[MAXPGPATH];
+	DIR            *d;
+	struct dirent  *de;
+	int             fd;
+	ScanEntry      *found = NULL;
+	int             nfound = 0;
+	int             maxfound = 0;
+	char          **subdirs = NULL;
+	int             nsubdirs = 0;
+	int             maxsubdirs = 0;
+	bool            oom = false;
+	bool            failed = false;
+	int             i;
+
+	if (snprintf(path, MAXPGPATH, "%s%s%s", work->root, (*dir) ? "/" : "",
+				 dir) >= MAXPGPATH)
+		fd = -1;
+	else
+		fd = open(path, O_RDONLY | O_DIRECTORY);
+	if (fd < 0 || (d = fdopendir(fd)) == NULL)
+	{
+		if (fd >= 0)
+			close(fd);
+		pthread_mutex_lock(&work->mutex);
+		scan_error(work, dir);
+		pthread_mutex_unlock(&work->mutex);
+		return;
+	}
+
+	while (!oom && (de = readdir(d)) != NULL)
+	{
+		struct stat st;
+		char        relpath[MAXPGPATH];
+
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		if (fstatat(fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+		{
+			/* removed since readdir() */
+			if (errno != ENOENT)
+				failed = true;
+			continue;
+		}
+		if (snprintf(relpath, MAXPGPATH, "%s%s%s", dir, (*dir) ? "/" : "",
+					 de->d_name) >= MAXPGPATH)
+		{
+			failed = true;
+			continue;
+		}
+
+		if (S_ISDIR(st.st_mode))
+		{
+			if (snprintf(path, MAXPGPATH, "%s/%s", work->root, relpath) >= MAXPGPATH)
+			{
+				failed = true;
+				continue;
+			}
+			if (scan_excluded(work, path))
+				continue;
+			if (!scan_grow((void **) &subdirs, &maxsubdirs, nsubdirs + 1, sizeof(char *))
+				|| (subdirs[nsubdirs] = strdup(relpath)) == NULL)
+				oom = true;
+			else
+				nsubdirs++;
+		}
+		else if (S_ISREG(st.st_mode))
+		{
+			ScanEntry  *entry;
+
+			if (!scan_grow((void **) &found, &maxfound, nfound + 1, sizeof(ScanEntry))
+				|| (found[nfound].path = strdup(relpath)) == NULL)
+			{
+				oom = true;
+				continue;
+			}
+			entry = &found[nfound++];
+			entry->ino = st.st_ino;
+			entry->size = st.st_size;
+			entry->mtime = st.st_mtim;
+			entry->ctime = st.st_ctim;
+		}
+	}
+	closedir(d);
+
+	/* Publish what has been found in one go to limit the contention */
+	pthread_mutex_lock(&work->mutex);
+	if (failed)
+		scan_error(work, dir);
+	if (!oom && scan_grow((void **) &work->entries, &work->maxentries,
+						  work->nentries + nfound, sizeof(ScanEntry)))
+	{
+		memcpy(work->entries + work->nentries, found, nfound * sizeof(ScanEntry));
+		work->nentries += nfound;
+		nfound = 0;
+	}
+	else
+		work->oom = true;
+	for (i = 0; i < nsubdirs; i++)
+		scan_push_dir(work, subdirs[i]);
+	pthread_mutex_unlock(&work->mutex);
+
+	for (i = 0; i < nfound; i++)
+		free(found[i].path);
+	free(found);
+	free(subdirs);
+}
+
+/*
+ * Thread of the pool, reads directories until the stack is empty and no
+ * other thread can push a new one.
+ */
+static void *
+scan_worker(void *arg)
+{
+	DatalinkScanWork *work = (DatalinkScanWork *) arg;
+
+	pthread_mutex_lock(&work->mutex);
+	for (;;)
+	{
+		char   *dir;
+
+		if (work->oom)
+			break;
+		if (work->ndirs == 0)
+		{
+			if (work->nactive == 0)
+				break;
+			pthread_cond_wait(&work->cond, &work->mutex);
+			continue;
+		}
+
+		dir = work->dirs[--work->ndirs];
+		work->nactive++;
+		pthread_mutex_unlock(&work->mutex);
+
+		scan_dir(work, dir);
+		free(dir);
+
+		pthread_mutex_lock(&work->mutex);
+		work->nactive--;
+	}
+	/* Wake up the threads waiting for a directory, there will be none */
+	pthread_cond_broadcast(&work->cond);
+	pthread_mutex_unlock(&work->mutex);
+
+	return NULL;
+}
+
+/*
+ * Crawl the tree with nworkers threads. The backend crawls it by itself
+ * when no thread can be started.
+ */
+static void
+run_scan_workers(DatalinkScanWork *work, int nworkers)
+{
+	pthread_t  *threads;
+	sigset_t    blocked;
+	sigset_t    saved;
+	int         nstarted = 0;
+	int         i;
+
+	threads = (pthread_t *) palloc(nworkers * sizeof(pthread_t));
+
+	/* Threads inherit the signal mask, they must not receive any signal */
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_SETMASK, &blocked, &saved);
+	for (i = 0; i < nworkers; i++)
+	{
+		if (pthread_create(&threads[i], NULL, scan_worker, work) != 0)
+			break;
+		nstarted++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	/* Take part in the work, this also handles a failure to start threads */
+	scan_worker(work);
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+
+	pfree(threads);
+}
+
+/* Release the memory allocated by the threads except the entries paths */
+static void
+scan_free(DatalinkScanWork *work)
+{
+	int     i;
+
+	for (i = 0; i < work->ndirs; i++)
+		free(work->dirs[i]);
+	free(work->dirs);
+	free(work->entries);
+	free(work->error_dir);
+	pthread_cond_destroy(&work->cond);
+	pthread_mutex_destroy(&work->mutex);
+}
+
+static TimestampTz
+timespec_to_timestamptz(const struct timespec *ts)
+{
+	return time_t_to_timestamptz(ts->tv_sec) + ts->tv_nsec / 1000;
+}
+
+/*
+ * Return the regular files found under a directory with their path relative
+ * to it, inode number, size, modification and status change times. The
+ * directories whose absolute path is given in the second array are skipped.
+ * Raises an error when a directory of the tree can not be fully read.
+ */
+PG_FUNCTION_INFO_V1(datalink_scan_directory);
+Datum
+datalink_scan_directory(PG_FUNCTION_ARGS)
+{
+	FuncCallContext    *funcctx;
+	DatalinkScanState  *state;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext       oldcontext;
+		DatalinkScanWork    work;
+		char               *root;
+		struct stat         st;
+		Datum              *elems;
+		bool               *nulls;
+		TupleDesc           tupdesc;
+		const char         *setting;
+		int                 nworkers = DATALINK_IO_THREADS;
+		int                 i;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		root = text_to_cstring(PG_GETARG_TEXT_PP(0));
+		if (!is_absolute_path(root))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("directory \"%s\" must be an absolute path", root)));
+		/* Paths of the entries are built as root/relpath */
+		if (strlen(root) > 1 && root[strlen(root) - 1] == '/')
+			root[strlen(root) - 1] = '\0';
+		/*
+		 * An unreachable base directory must not be seen as empty, all its
+		 * files would be reported as deleted.
+		 */
+		if (stat(root, &st) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not stat directory \"%s\": %m", root)));
+		if (!S_ISDIR(st.st_mode))
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+					 errmsg("\"%s\" is not a directory", root)));
+
+		memset(&work, 0, sizeof(work));
+		work.root = root;
+		deconstruct_array(PG_GETARG_ARRAYTYPE_P(1), TEXTOID, -1, false, 'i',
+							&elems, &nulls, &work.nexcluded);
+		work.excluded = (char **) palloc(Max(work.nexcluded, 1) * sizeof(char *));
+		for (i = 0; i < work.nexcluded; i++)
+		{
+			char   *path = nulls[i] ? pstrdup("") : TextDatumGetCString(elems[i]);
+
+			if (strlen(path) > 1 && path[strlen(path) - 1] == '/')
+				path[strlen(path) - 1] = '\0';
+			work.excluded[i] = path;
+		}
+
+		pthread_mutex_init(&work.mutex, NULL);
+		pthread_cond_init(&work.cond, NULL);
+		work.dirs = (char **) malloc(sizeof(char *));
+		if (work.dirs == NULL || (work.dirs[0] = strdup("")) == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of memory")));
+		work.ndirs = work.maxdirs = 1;
+
+		setting = GetConfigOption("datalink.dl_io_threads", true, false);
+		if (setting != NULL)
+			nworkers = atoi(setting);
+		/* The backend is one of the workers */
+		run_scan_workers(&work, Max(nworkers - 1, 0));
+
+		/* Copy the entries to memory that is released with the query */
+		state = (DatalinkScanState *) palloc0(sizeof(DatalinkScanState));
+		if (!work.oom)
+			state->entries = (ScanEntry *) palloc_extended(
+								Max(work.nentries, 1) * sizeof(ScanEntry),
+								MCXT_ALLOC_HUGE | MCXT_ALLOC_NO_OOM);
+		for (i = 0; i < work.nentries; i++)
+		{
+			if (state->entries != NULL)
+			{
+				state->entries[i] = work.entries[i];
+				state->entries[i].path = pstrdup(work.entries[i].path);
+			}
+			free(work.entries[i].path);
+		}
+		state->nentries = work.nentries;
+		if (work.nerrors > 0)
+		{
+			int     nerrors = work.nerrors;
+			char   *error_dir = pstrdup(work.error_dir ? work.error_dir : "");
+
+			scan_free(&work);
+			ereport(ERROR,
+					(errcode(ERRCODE_IO_ERROR),
+					 errmsg("could not read directory \"%s%s%s\"", root,
+							(*error_dir) ? "/" : "", error_dir),
+					 errdetail("%d directories under \"%s\" could not be fully read.",
+							   nerrors, root)));
+		}
+		scan_free(&work);
+		if (state->entries == NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_OUT_OF_MEMORY),
+					 errmsg("out of memory while reading directory \"%s\"", root)));
+
+		funcctx->user_fctx = state;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	CHECK_FOR_INTERRUPTS();
+	funcctx = SRF_PERCALL_SETUP();
+	state = (DatalinkScanState *) funcctx->user_fctx;
+
+	if (state->next < state->nentries)
+	{
+		ScanEntry  *entry = &state->entries[state->next++];
+		Datum       values[5];
+		bool        nulls[5] = {false, false, false, false, false};
+		HeapTuple   tuple;
+
+		values[0] = CStringGetTextDatum(entry->path);
+		values[1] = Int64GetDatum((int64) entry->ino);
+		values[2] = Int64GetDatum((int64) entry->size);
+		values[3] = TimestampTzGetDatum(timespec_to_timestamptz(&entry->mtime));
+		values[4] = TimestampTzGetDatum(timespec_to_timestamptz(&entry->ctime));
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
@@ -0,0 +1,447 @@
+/*
+ * datalink_snapshot.c
+ *
+ * Hard-link farm used by dl_snapshot_create() to take a consistent backup of
+ * the files linked by the datalinks. Each linked file gets a hard link in
+ * the DATALINK_SNAPSHOT_DIR subdirectory of its base directory, so that the
+ * link is on the same filesystem and costs a metadata update instead of a
+ * copy. The files of the extension are never modified in place: dlwritefile(),
+ * the copies of the write tokens and the recall of tiered files write a new
+ * file renamed over the old one, so the hard link keeps the content of the
+ * file at the time of the snapshot. This does not hold for the base
+ * directories with WRITE PERMISSION FS, whose files may be modified in place
+ * by other programs: their files are copied instead.
+ *
+ * A file whose inode, size and modification time are the ones recorded in
+ * the manifest of the previous snapshot is not linked again, the manifest of
+ * the new snapshot refers to the link of the previous one.
+ *
+ * The links are created by a pool of datalink.dl_io_threads threads. As
+ * for dl_audit(), the threads never call any PostgreSQL function and store
+ * their result in a preallocated array. Signals are blocked while they are
+ * running so that they are always handled by the backend itself.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "access/htup_details.h"
+#include "catalog/pg_type.h"
+#include "common/file_perm.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "port/atomics.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/timestamp.h"
+
+#include "datalink.h"
+
+/* Microseconds between the Unix and the PostgreSQL epochs */
+#define SNAPSHOT_EPOCH_DIFF \
+	((int64) (POSTGRES_EPOCH_JDATE - UNIX_EPOCH_JDATE) * SECS_PER_DAY * USECS_PER_SEC)
+
+/* A file to link, the result is filled by the threads */
+typedef struct SnapshotFile
+{
+	char       *src;
+	char       *dst;
+	bool        copy;           /* copied instead of linked */
+	bool        has_prev;       /* recorded in the previous manifest */
+	int64       prev_ino;
+	int64       prev_size;
+	int64       prev_mtime;     /* microseconds since the Unix epoch */
+	int         err;            /* errno of the failure or 0 */
+	bool        missing;
+	bool        linked;
+	int64       ino;
+	int64       size;
+	int64       mtime;
+} SnapshotFile;
+
+/* Work shared by the threads of the pool */
+typedef struct DatalinkSnapshotWork
+{
+	int                 nfiles;
+	SnapshotFile       *files;
+	pg_atomic_uint32    next;          /* next file to link */
+} DatalinkSnapshotWork;
+
+/* State of the set returning function between two calls */
+typedef struct DatalinkSnapshotState
+{
+	DatalinkSnapshotWork work;
+	int         next;
+} DatalinkSnapshotState;
+
+Datum		datalink_link_files(PG_FUNCTION_ARGS);
+
+static int  snapshot_mkdirs(char *path);
+static int  snapshot_copy(const char *src, const char *dst);
+static void snapshot_link(SnapshotFile *file);
+static void *snapshot_worker(void *arg);
+static void run_snapshot_workers(DatalinkSnapshotWork *work, int nworkers);
+static Datum *snapshot_array(ArrayType *array, Oid elemtype, int16 elmlen,
+							 bool elmbyval, char elmalign, bool **nulls, int nelems);
+
+/*
+ * Create the missing parent directories of a file, the path is modified
+ * while they are created. Returns -1 with errno set on failure.
+ */
+static int
+snapshot_mkdirs(char *path)
+{
+	char   *p;
+
+	for (p = strchr(path + 1, '/'); p != NULL; p = strchr(p + 1, '/'))
+	{
+		*p = '\0';
+		if (mkdir(path, pg_dir_create_mode) < 0 && errno != EEXIST)
+		{
+			*p = '/';
+			return -1;
+		}
+		*p = '/';
+	}
+
+	return 0;
+}
+
+/*
+ * Copy a file to the snapshot with the mode of the source. Returns -1 with
+ * errno set on failure, no partial copy is left.
+ */
+static int
+snapshot_copy(const char *src, const char *dst)
+{
+	char        buf[BUFFER_SIZE];
+	struct stat st;
+	int         fd_in;
+	int         fd_out;
+	ssize_t     nread;
+	int         save_errno;
+
+	fd_in = open(src, O_RDONLY | PG_BINARY);
+	if (fd_in < 0)
+		return -1;
+	if (fstat(fd_in, &st) < 0 ||
+		(fd_out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | PG_BINARY,
+					   st.st_mode & 07777)) < 0)
+	{
+		save_errno = errno;
+		close(fd_in);
+		errno = save_errno;
+		return -1;
+	}
+
+	while ((nread = read(fd_in, buf, sizeof(buf))) > 0)
+	{
+		errno = 0;
+		if (write(fd_out, buf, nread) != nread)
+		{
+			if (errno == 0)
+				errno = ENOSPC;
+			nread = -1;
+			break;
+		}
+	}
+	save_errno = errno;
+	close(fd_in);
+	if (close(fd_out) < 0 && nread == 0)
+	{
+		save_errno = errno;
+		nread = -1;
+	}
+	if (nread < 0)
+	{
+		unlink(dst);
+		errno = save_errno;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Link a file in the snapshot unless it has not changed since the previous
+ * one. The source is followed when it is the symlink of a read token.
+ */
+static void
+snapshot_link(SnapshotFile *file)
+{
+	struct stat st;
+	struct stat dst;
+
+	if (stat(file->src, &st) < 0)
+	{
+		if (errno == ENOENT)
+			file->missing = true;
+		else
+			file->err = errno;
+		return;
+	}
+	file->ino = (int64) st.st_ino;
+	file->size = (int64) st.st_size;
+	file->mtime = (int64) st.st_mtim.tv_sec * USECS_PER_SEC + st.st_mtim.tv_nsec / 1000;
+
+	if (file->has_prev && file->prev_ino == file->ino &&
+		file->prev_size == file->size && file->prev_mtime == file->mtime)
+		return;
+
+	if (file->copy)
+	{
+		if (snapshot_copy(file->src, file->dst) < 0 &&
+			(errno != ENOENT || snapshot_mkdirs(file->dst) < 0 ||
+			 snapshot_copy(file->src, file->dst) < 0))
+			file->err = errno;
+		else
+			file->linked = true;
+		return;
+	}
+
+	if (linkat(AT_FDCWD, file->src, AT_FDCWD, file->dst, AT_SYMLINK_FOLLOW) < 0)
+	{
+		if (errno == ENOENT && snapshot_mkdirs(file->dst) == 0)
+		{
+			if (linkat(AT_FDCWD, file->src, AT_FDCWD, file->dst, AT_SYMLINK_FOLLOW) == 0)
+			{
+				file->linked = true;
+				return;
+			}
+		}
+		/* Already linked, by an earlier attempt or another datalink */
+		if (errno == EEXIST && stat(file->dst, &dst) == 0 &&
+			dst.st_ino == st.st_ino && dst.st_dev == st.st_dev)
+		{
+			file->linked = true;
+			return;
+		}
+		file->err = errno;
+		return;
+	}
+	file->linked = true;
+}
+
+/* Thread of the pool, links files until there is none left */
+static void *
+snapshot_worker(void *arg)
+{
+	DatalinkSnapshotWork *work = (DatalinkSnapshotWork *) arg;
+	uint32      i;
+
+	while ((i = pg_atomic_fetch_add_u32(&work->next, 1)) < (uint32) work->nfiles)
+		snapshot_link(&work->files[i]);
+
+	return NULL;
+}
+
+/*
+ * Link all the files of the work with nworkers threads. The backend links
+ * the files itself when no thread can be started.
+ */
+static void
+run_snapshot_workers(DatalinkSnapshotWork *work, int nworkers)
+{
+	pthread_t  *threads;
+	sigset_t    blocked;
+	sigset_t    saved;
+	int         nstarted = 0;
+	int         i;
+
+	threads = (pthread_t *) palloc(Max(nworkers, 1) * sizeof(pthread_t));
+
+	/* Threads inherit the signal mask, they must not receive any signal */
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_SETMASK, &blocked, &saved);
+	for (i = 0; i < nworkers; i++)
+	{
+		if (pthread_create(&threads[i], NULL, snapshot_worker, work) != 0)
+			break;
+		nstarted++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	/* Take part in the work, this also handles a failure to start threads */
+	snapshot_worker(work);
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+
+	pfree(threads);
+}
+
+/* Deconstruct an array argument that must have nelems elements */
+static Datum *
+snapshot_array(ArrayType *array, Oid elemtype, int16 elmlen, bool elmbyval,
+			   char elmalign, bool **nulls, int nelems)
+{
+	Datum  *elems;
+	int     n;
+
+	deconstruct_array(array, elemtype, elmlen, elmbyval, elmalign,
+						&elems, nulls, &n);
+	if (n != nelems)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("arrays of the files to link must have the same size")));
+
+	return elems;
+}
+
+/*
+ * Hard link the files of the first array to the paths of the second one.
+ * The next arrays hold the inode, size and modification time recorded for
+ * the file by the previous snapshot or NULL, the file is not linked again
+ * when they are unchanged. Returns the position in the arrays, inode, size
+ * and modification time of the files found and whether they were linked.
+ * The files whose element of the last array is true are copied instead.
+ */
+PG_FUNCTION_INFO_V1(datalink_link_files);
+Datum
+datalink_link_files(PG_FUNCTION_ARGS)
+{
+	FuncCallContext        *funcctx;
+	DatalinkSnapshotState  *state;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext   oldcontext;
+		TupleDesc       tupdesc;
+		ArrayType      *srcs = PG_GETARG_ARRAYTYPE_P(0);
+		Datum          *src_elems;
+		Datum          *dst_elems;
+		Datum          *ino_elems;
+		Datum          *size_elems;
+		Datum          *mtime_elems;
+		Datum          *copy_elems;
+		bool           *src_nulls;
+		bool           *dst_nulls;
+		bool           *ino_nulls;
+		bool           *size_nulls;
+		bool           *mtime_nulls;
+		bool           *copy_nulls;
+		int             nfiles;
+		int             nmissing = 0;
+		const char     *setting;
+		int             nworkers = DATALINK_IO_THREADS;
+		int             i;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		deconstruct_array(srcs, TEXTOID, -1, false, 'i',
+							&src_elems, &src_nulls, &nfiles);
+		dst_elems = snapshot_array(PG_GETARG_ARRAYTYPE_P(1), TEXTOID, -1, false,
+								   'i', &dst_nulls, nfiles);
+		ino_elems = snapshot_array(PG_GETARG_ARRAYTYPE_P(2), INT8OID, 8,
+								   FLOAT8PASSBYVAL, 'd', &ino_nulls, nfiles);
+		size_elems = snapshot_array(PG_GETARG_ARRAYTYPE_P(3), INT8OID, 8,
+								   FLOAT8PASSBYVAL, 'd', &size_nulls, nfiles);
+		mtime_elems = snapshot_array(PG_GETARG_ARRAYTYPE_P(4), TIMESTAMPTZOID, 8,
+								   FLOAT8PASSBYVAL, 'd', &mtime_nulls, nfiles);
+		copy_elems = snapshot_array(PG_GETARG_ARRAYTYPE_P(5), BOOLOID, 1, true,
+								   'c', &copy_nulls, nfiles);
+
+		state = (DatalinkSnapshotState *) palloc0(sizeof(DatalinkSnapshotState));
+		state->work.nfiles = nfiles;
+		state->work.files = (SnapshotFile *) palloc0(Max(nfiles, 1) * sizeof(SnapshotFile));
+		pg_atomic_init_u32(&state->work.next, 0);
+		for (i = 0; i < nfiles; i++)
+		{
+			SnapshotFile   *file = &state->work.files[i];
+
+			if (src_nulls[i] || dst_nulls[i])
+				ereport(ERROR,
+						(errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+						 errmsg("path of a file to link can not be NULL")));
+			file->src = TextDatumGetCString(src_elems[i]);
+			file->dst = TextDatumGetCString(dst_elems[i]);
+			file->copy = !copy_nulls[i] && DatumGetBool(copy_elems[i]);
+			file->has_prev = !ino_nulls[i] && !size_nulls[i] && !mtime_nulls[i];
+			if (file->has_prev)
+			{
+				file->prev_ino = DatumGetInt64(ino_elems[i]);
+				file->prev_size = DatumGetInt64(size_elems[i]);
+				file->prev_mtime = DatumGetTimestampTz(mtime_elems[i]) + SNAPSHOT_EPOCH_DIFF;
+			}
+		}
+
+		setting = GetConfigOption("datalink.dl_io_threads", true, false);
+		if (setting != NULL)
+			nworkers = atoi(setting);
+		/* The backend is one of the workers */
+		nworkers = Min(nworkers, nfiles) - 1;
+
+		run_snapshot_workers(&state->work, Max(nworkers, 0));
+		CHECK_FOR_INTERRUPTS();
+
+		for (i = 0; i < nfiles; i++)
+		{
+			SnapshotFile   *file = &state->work.files[i];
+
+			if (file->missing)
+				nmissing++;
+			else if (file->err != 0)
+			{
+				errno = file->err;
+				if (file->copy)
+					ereport(ERROR,
+							(errcode_for_file_access(),
+							 errmsg("could not copy file \"%s\" to \"%s\": %m",
+									file->src, file->dst)));
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not link file \"%s\" to \"%s\": %m",
+								file->src, file->dst)));
+			}
+		}
+		if (nmissing > 0)
+			ereport(WARNING,
+					(errmsg("%d linked files do not exist and are not part of the snapshot",
+							nmissing)));
+
+		funcctx->user_fctx = state;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (DatalinkSnapshotState *) funcctx->user_fctx;
+
+	while (state->next < state->work.nfiles)
+	{
+		SnapshotFile   *file = &state->work.files[state->next++];
+		Datum           values[5];
+		bool            nulls[5] = {false, false, false, false, false};
+		HeapTuple       tuple;
+
+		if (file->missing)
+			continue;
+
+		values[0] = Int32GetDatum(state->next);
+		values[1] = Int64GetDatum(file->ino);
+		values[2] = Int64GetDatum(file->size);
+		values[3] = TimestampTzGetDatum(file->mtime - SNAPSHOT_EPOCH_DIFF);
+		values[4] = BoolGetDatum(file->linked);
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
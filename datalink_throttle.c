@@ -0,0 +1,358 @@
+/*
+ * datalink_throttle.c
+ *
+ * I/O throttling of the file functions per base directory. The maximum
+ * number of bytes and of file operations per second of a base directory
+ * are set with the maxbandwidth and maxiops columns of pg_datalink_bases.
+ * A token bucket per base directory is kept in shared memory so that the
+ * limits apply to all backends together. A backend charges the bucket of
+ * the base directory of a file before each chunk of I/O and, when the
+ * bucket is in debt, sleeps until the debt is paid back. The sleep is
+ * reported with a wait event.
+ *
+ * The limits are read once per transaction. The backend reading them
+ * stores them into the buckets of its database, so that a lowered limit
+ * applies at once to the sessions already running, and drops the buckets
+ * of the base directories removed or without limits. Throttling is only
+ * available when the extension is loaded with shared_preload_libraries.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "executor/spi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/timestamp.h"
+#if PG_VERSION_NUM >= 170000
+#include "utils/wait_event.h"
+#endif
+
+#include "datalink.h"
+
+/* Key of a bucket, the base directory ids are local to a database */
+typedef struct ThrottleKey
+{
+	Oid         dbid;
+	int         dirid;
+} ThrottleKey;
+
+/* Token bucket of a base directory */
+typedef struct ThrottleBucket
+{
+	ThrottleKey key;
+	int64       maxbandwidth;  /* limits last read from pg_datalink_bases */
+	int         maxiops;
+	double      bytes;         /* available bytes, negative when in debt */
+	double      ops;           /* available operations */
+	TimestampTz last;          /* last refill */
+} ThrottleBucket;
+
+typedef struct ThrottleShared
+{
+	LWLock     *lock;
+} ThrottleShared;
+
+/* Limits of a base directory as read from pg_datalink_bases */
+typedef struct ThrottleBase
+{
+	int         dirid;
+	char       *path;
+	int         pathlen;
+	int64       maxbandwidth;
+	int         maxiops;
+} ThrottleBase;
+
+static ThrottleShared *throttle_shared = NULL;
+static HTAB *throttle_buckets = NULL;
+
+/* Limits loaded by the backend and the transaction they are valid for */
+static ThrottleBase *throttle_bases = NULL;
+static int  throttle_nbases = 0;
+static LocalTransactionId throttle_lxid = InvalidLocalTransactionId;
+
+static uint32 throttle_wait_event = 0;
+
+static void throttle_load_bases(void);
+static void throttle_sync_buckets(void);
+static double throttle_refill(ThrottleBucket *bucket, int64 bytes, int ops);
+
+/* Reserve shared memory for the buckets, called from _PG_init() */
+void
+datalink_throttle_shmem_request(void)
+{
+	RequestAddinShmemSpace(MAXALIGN(sizeof(ThrottleShared)));
+	RequestAddinShmemSpace(hash_estimate_size(DL_THROTTLE_MAX_BASES,
+								sizeof(ThrottleBucket)));
+	RequestNamedLWLockTranche("datalink_throttle", 1);
+}
+
+/* Attach to the shared buckets, AddinShmemInitLock is held */
+void
+datalink_throttle_shmem_init(void)
+{
+	bool        found;
+	HASHCTL     info;
+
+	throttle_shared = ShmemInitStruct("datalink throttle",
+							sizeof(ThrottleShared), &found);
+	if (!found)
+		throttle_shared->lock = &(GetNamedLWLockTranche("datalink_throttle"))->lock;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(ThrottleKey);
+	info.entrysize = sizeof(ThrottleBucket);
+	throttle_buckets = ShmemInitHash("datalink throttle hash",
+								DL_THROTTLE_MAX_BASES, DL_THROTTLE_MAX_BASES,
+								&info, HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * Read the limits of the base directories with the file scheme, this is
+ * done once per transaction.
+ */
+static void
+throttle_load_bases(void)
+{
+	MemoryContext   oldcontext;
+	int             ret;
+	uint64          i;
+
+	if (throttle_bases != NULL && throttle_lxid == DL_CURRENT_LXID)
+		return;
+
+	if (throttle_bases != NULL)
+	{
+		for (i = 0; i < (uint64) throttle_nbases; i++)
+			pfree(throttle_bases[i].path);
+		pfree(throttle_bases);
+		throttle_bases = NULL;
+		throttle_nbases = 0;
+	}
+
+	if ((ret = SPI_connect()) < 0)
+		elog(ERROR, "SPI_connect failed: %d", ret);
+	ret = SPI_execute("SELECT dirid, coalesce(nullif(rtrim(uri_get_path(base), '/'), ''), '/'), "
+					  "maxbandwidth, maxiops FROM pg_datalink_bases "
+					  "WHERE uri_get_scheme(base) = 'file' AND (maxbandwidth > 0 OR maxiops > 0)",
+					  true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read the I/O limits of the base directories: %d", ret);
+
+	oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+	throttle_bases = (ThrottleBase *) palloc0(Max(SPI_processed, 1) * sizeof(ThrottleBase));
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple       tuple = SPI_tuptable->vals[i];
+		TupleDesc       tupdesc = SPI_tuptable->tupdesc;
+		ThrottleBase   *base = &throttle_bases[i];
+		bool            isnull;
+
+		base->dirid = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+		base->path = TextDatumGetCString(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+		base->pathlen = strlen(base->path);
+		base->maxbandwidth = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 3, &isnull));
+		if (isnull)
+			base->maxbandwidth = 0;
+		base->maxiops = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+		if (isnull)
+			base->maxiops = 0;
+	}
+	throttle_nbases = (int) SPI_processed;
+	MemoryContextSwitchTo(oldcontext);
+
+	SPI_finish();
+	throttle_lxid = DL_CURRENT_LXID;
+
+	throttle_sync_buckets();
+}
+
+/*
+ * Store the limits just read into the buckets of the current database, the
+ * tokens above a lowered limit are taken back. The buckets of the base
+ * directories that have no limit anymore are removed.
+ */
+static void
+throttle_sync_buckets(void)
+{
+	HASH_SEQ_STATUS     status;
+	ThrottleBucket     *bucket;
+	int                 i;
+
+	LWLockAcquire(throttle_shared->lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, throttle_buckets);
+	while ((bucket = (ThrottleBucket *) hash_seq_search(&status)) != NULL)
+	{
+		ThrottleBase   *base = NULL;
+
+		if (bucket->key.dbid != MyDatabaseId)
+			continue;
+		for (i = 0; i < throttle_nbases; i++)
+		{
+			if (throttle_bases[i].dirid == bucket->key.dirid)
+			{
+				base = &throttle_bases[i];
+				break;
+			}
+		}
+		if (base == NULL)
+		{
+			(void) hash_search(throttle_buckets, &bucket->key, HASH_REMOVE, NULL);
+			continue;
+		}
+		bucket->maxbandwidth = base->maxbandwidth;
+		bucket->maxiops = base->maxiops;
+		bucket->bytes = Min(bucket->bytes, (double) base->maxbandwidth);
+		bucket->ops = Min(bucket->ops, (double) base->maxiops);
+	}
+	LWLockRelease(throttle_shared->lock);
+}
+
+/*
+ * Return the base directory with I/O limits holding a file, the one with
+ * the longest path when they are nested, or -1 when the I/O on the file are
+ * not throttled. The result is only valid in the current transaction.
+ */
+int
+datalink_throttle_base(const char *path)
+{
+	int     result = -1;
+	int     i;
+
+	if (throttle_shared == NULL)
+		return -1;
+
+	throttle_load_bases();
+	for (i = 0; i < throttle_nbases; i++)
+	{
+		ThrottleBase   *base = &throttle_bases[i];
+
+		if (strncmp(path, base->path, base->pathlen) != 0)
+			continue;
+		if (path[base->pathlen] != '/' && strcmp(base->path, "/") != 0)
+			continue;
+		if (result < 0 || base->pathlen > throttle_bases[result].pathlen)
+			result = i;
+	}
+
+	return result;
+}
+
+/*
+ * Refill a bucket with the tokens earned since its last refill and take the
+ * ones needed, the lock is held in exclusive mode. The bucket holds at most
+ * one second of I/O. Returns the number of seconds to wait for the debt to
+ * be paid back.
+ */
+static double
+throttle_refill(ThrottleBucket *bucket, int64 bytes, int ops)
+{
+	TimestampTz     now = GetCurrentTimestamp();
+	double          elapsed = (double) (now - bucket->last) / USECS_PER_SEC;
+	double          wait = 0;
+
+	bucket->last = now;
+	if (bucket->maxbandwidth > 0)
+	{
+		bucket->bytes = Min(bucket->bytes + elapsed * bucket->maxbandwidth,
+							(double) bucket->maxbandwidth);
+		bucket->bytes -= bytes;
+		if (bucket->bytes < 0)
+			wait = -bucket->bytes / bucket->maxbandwidth;
+	}
+	if (bucket->maxiops > 0)
+	{
+		bucket->ops = Min(bucket->ops + elapsed * bucket->maxiops,
+						  (double) bucket->maxiops);
+		bucket->ops -= ops;
+		if (bucket->ops < 0)
+			wait = Max(wait, -bucket->ops / bucket->maxiops);
+	}
+
+	return wait;
+}
+
+/*
+ * Charge bytes and operations against the limits of the base directory
+ * returned by datalink_throttle_base() and sleep as long as needed to stay
+ * below them.
+ */
+void
+datalink_throttle(int base, int64 bytes, int ops)
+{
+	ThrottleBase   *limits;
+	ThrottleBucket *bucket;
+	ThrottleKey     key;
+	bool            found;
+	double          wait;
+	TimestampTz     deadline;
+
+	if (base < 0 || base >= throttle_nbases)
+		return;
+	limits = &throttle_bases[base];
+
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.dirid = limits->dirid;
+
+	LWLockAcquire(throttle_shared->lock, LW_EXCLUSIVE);
+	bucket = (ThrottleBucket *) hash_search(throttle_buckets, &key,
+											HASH_ENTER_NULL, &found);
+	if (bucket == NULL)
+	{
+		/* more base directories with limits than buckets */
+		LWLockRelease(throttle_shared->lock);
+		return;
+	}
+	if (!found)
+	{
+		bucket->maxbandwidth = limits->maxbandwidth;
+		bucket->maxiops = limits->maxiops;
+		bucket->bytes = (double) limits->maxbandwidth;
+		bucket->ops = (double) limits->maxiops;
+		bucket->last = GetCurrentTimestamp();
+	}
+	wait = throttle_refill(bucket, bytes, ops);
+	LWLockRelease(throttle_shared->lock);
+
+	if (wait <= 0)
+		return;
+
+#if PG_VERSION_NUM >= 170000
+	if (throttle_wait_event == 0)
+		throttle_wait_event = WaitEventExtensionNew("DatalinkIOThrottle");
+#else
+	throttle_wait_event = PG_WAIT_EXTENSION;
+#endif
+
+	deadline = TimestampTzPlusMilliseconds(GetCurrentTimestamp(),
+										   (int64) (wait * 1000) + 1);
+	for (;;)
+	{
+		long    secs;
+		int     usecs;
+		long    timeout;
+
+		TimestampDifference(GetCurrentTimestamp(), deadline, &secs, &usecs);
+		timeout = secs * 1000 + usecs / 1000;
+		if (timeout <= 0)
+			break;
+
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 timeout, throttle_wait_event);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+}
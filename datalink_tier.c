@@ -0,0 +1,608 @@
+/*
+ * datalink_tier.c
+ *
+ * Tiered storage of the linked files. A base directory can be given a tier
+ * directory in pg_datalink_bases where the files that have not been
+ * accessed for tierafter are moved by dl_tier_migrate(), optionally
+ * compressed with zstd when PostgreSQL has been built with it. The files
+ * are recalled by dl_tier_recall() before a token is issued or the file is
+ * read, which also records the access.
+ *
+ * Accesses are recorded in a shared hash table keyed by the device and
+ * inode of the file holding the last access time and the number of reads.
+ * The table is emptied into pg_datalink_access by dl_access_flush(), an
+ * access that does not fit in the table is lost until the next flush. The
+ * tiering worker calls dl_tier_migrate() every datalink.dl_tier_naptime
+ * seconds in database datalink.dl_tier_database.
+ *
+ * Access tracking and the tiering worker are only available when the
+ * extension is loaded with shared_preload_libraries.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef USE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "common/file_perm.h"
+#include "executor/spi.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/fd.h"
+#include "storage/ipc.h"
+#include "storage/latch.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/hsearch.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+
+#include "datalink.h"
+
+/* Key of an access entry, the file identity */
+typedef struct AccessKey
+{
+	dev_t       dev;
+	ino_t       ino;
+} AccessKey;
+
+/* Accesses to a file since the last flush */
+typedef struct AccessEntry
+{
+	AccessKey   key;
+	TimestampTz last_access;
+	int64       reads;
+} AccessEntry;
+
+typedef struct AccessShared
+{
+	LWLock     *lock;
+} AccessShared;
+
+/* State of the set returning function between two calls */
+typedef struct AccessFlushState
+{
+	AccessEntry *entries;
+	int         nentries;
+	int         next;
+} AccessFlushState;
+
+/* Transformation of the content of a file moved between the tiers */
+typedef enum TierMode
+{
+	DL_TIER_COPY,
+	DL_TIER_COMPRESS,
+	DL_TIER_DECOMPRESS
+} TierMode;
+
+static AccessShared *access_shared = NULL;
+static HTAB *access_hash = NULL;
+
+static volatile sig_atomic_t tier_got_sighup = false;
+
+PGDLLEXPORT void datalink_tier_worker_main(Datum main_arg);
+
+static void tier_write(int fd, const char *path, const char *buf, size_t len);
+static int64 tier_transfer(int fd_in, int fd_out, const char *src, const char *dst,
+						   TierMode mode, int rbase, int wbase);
+static void tier_sighup(SIGNAL_ARGS);
+static void tier_run(void);
+
+/* Reserve shared memory for the access table, called from _PG_init() */
+void
+datalink_access_shmem_request(int table_size)
+{
+	if (table_size <= 0)
+		return;
+
+	RequestAddinShmemSpace(MAXALIGN(sizeof(AccessShared)));
+	RequestAddinShmemSpace(hash_estimate_size(table_size, sizeof(AccessEntry)));
+	RequestNamedLWLockTranche("datalink_access", 1);
+}
+
+/* Attach to the shared access table, AddinShmemInitLock is held */
+void
+datalink_access_shmem_init(int table_size)
+{
+	bool        found;
+	HASHCTL     info;
+
+	if (table_size <= 0)
+		return;
+
+	access_shared = ShmemInitStruct("datalink access",
+							sizeof(AccessShared), &found);
+	if (!found)
+		access_shared->lock = &(GetNamedLWLockTranche("datalink_access"))->lock;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(AccessKey);
+	info.entrysize = sizeof(AccessEntry);
+	access_hash = ShmemInitHash("datalink access hash",
+								table_size, table_size,
+								&info, HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * Record an access to a file, nothing is done when it does not exist or
+ * the access table is not available.
+ */
+PG_FUNCTION_INFO_V1(datalink_record_access);
+Datum
+datalink_record_access(PG_FUNCTION_ARGS)
+{
+	char           *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	struct stat     st;
+	AccessKey       key;
+	AccessEntry    *entry;
+	bool            found;
+
+	if (access_shared == NULL || stat(path, &st) < 0)
+		PG_RETURN_BOOL(false);
+
+	/* clear padding, the key is hashed as a blob */
+	memset(&key, 0, sizeof(AccessKey));
+	key.dev = st.st_dev;
+	key.ino = st.st_ino;
+
+	LWLockAcquire(access_shared->lock, LW_EXCLUSIVE);
+	entry = (AccessEntry *) hash_search(access_hash, &key, HASH_ENTER_NULL, &found);
+	if (entry != NULL)
+	{
+		if (!found)
+			entry->reads = 0;
+		entry->last_access = GetCurrentTimestamp();
+		entry->reads++;
+	}
+	LWLockRelease(access_shared->lock);
+
+	PG_RETURN_BOOL(entry != NULL);
+}
+
+/*
+ * Return the accesses recorded since the previous call and empty the access
+ * table: device, inode, last access time and number of reads of the files.
+ */
+PG_FUNCTION_INFO_V1(datalink_access_flush);
+Datum
+datalink_access_flush(PG_FUNCTION_ARGS)
+{
+	FuncCallContext    *funcctx;
+	AccessFlushState   *state;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext       oldcontext;
+		TupleDesc           tupdesc;
+		HASH_SEQ_STATUS     status;
+		AccessEntry        *entry;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		state = (AccessFlushState *) palloc0(sizeof(AccessFlushState));
+		if (access_shared != NULL)
+		{
+			LWLockAcquire(access_shared->lock, LW_EXCLUSIVE);
+			state->entries = (AccessEntry *) palloc(Max(hash_get_num_entries(access_hash), 1)
+													* sizeof(AccessEntry));
+			hash_seq_init(&status, access_hash);
+			while ((entry = (AccessEntry *) hash_seq_search(&status)) != NULL)
+			{
+				state->entries[state->nentries++] = *entry;
+				hash_search(access_hash, &entry->key, HASH_REMOVE, NULL);
+			}
+			LWLockRelease(access_shared->lock);
+		}
+
+		funcctx->user_fctx = state;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	state = (AccessFlushState *) funcctx->user_fctx;
+
+	if (state->next < state->nentries)
+	{
+		AccessEntry    *entry = &state->entries[state->next++];
+		Datum           values[4];
+		bool            nulls[4] = {false, false, false, false};
+		HeapTuple       tuple;
+
+		values[0] = Int64GetDatum((int64) entry->key.dev);
+		values[1] = Int64GetDatum((int64) entry->key.ino);
+		values[2] = TimestampTzGetDatum(entry->last_access);
+		values[3] = Int64GetDatum(entry->reads);
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Return the device, inode, size and modification time of a file, symbolic
+ * links are followed. All are NULL when the file does not exist.
+ */
+PG_FUNCTION_INFO_V1(datalink_file_stat);
+Datum
+datalink_file_stat(PG_FUNCTION_ARGS)
+{
+	char           *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	TupleDesc       tupdesc;
+	Datum           values[4];
+	bool            nulls[4] = {true, true, true, true};
+	struct stat     st;
+
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupdesc = BlessTupleDesc(tupdesc);
+
+	if (stat(path, &st) == 0)
+	{
+		memset(nulls, false, sizeof(nulls));
+		values[0] = Int64GetDatum((int64) st.st_dev);
+		values[1] = Int64GetDatum((int64) st.st_ino);
+		values[2] = Int64GetDatum((int64) st.st_size);
+		values[3] = TimestampTzGetDatum(time_t_to_timestamptz(st.st_mtim.tv_sec) +
+										st.st_mtim.tv_nsec / 1000);
+	}
+	else if (errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not stat file \"%s\": %m", path)));
+
+	PG_RETURN_DATUM(HeapTupleGetDatum(heap_form_tuple(tupdesc, values, nulls)));
+}
+
+/* Write a whole buffer to a file */
+static void
+tier_write(int fd, const char *path, const char *buf, size_t len)
+{
+	while (len > 0)
+	{
+		ssize_t     n = write(fd, buf, len);
+
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not write server file \"%s\": %m", path)));
+		}
+		buf += n;
+		len -= n;
+	}
+}
+
+/*
+ * Copy the content of a file to another one, compressed or decompressed
+ * following the mode. Returns the number of bytes written.
+ */
+static int64
+tier_transfer(int fd_in, int fd_out, const char *src, const char *dst,
+			  TierMode mode, int rbase, int wbase)
+{
+	char       *buf = palloc(DATALINK_THROTTLE_CHUNK_SIZE);
+	ssize_t     inbytes;
+	int64       total = 0;
+#ifdef USE_ZSTD
+	ZSTD_CCtx  *cctx = NULL;
+	ZSTD_DCtx  *dctx = NULL;
+	char       *zbuf = NULL;
+	size_t      zsize = 0;
+	size_t      left = 0;
+
+	if (mode == DL_TIER_COMPRESS)
+	{
+		cctx = ZSTD_createCCtx();
+		zsize = ZSTD_CStreamOutSize();
+	}
+	else if (mode == DL_TIER_DECOMPRESS)
+	{
+		dctx = ZSTD_createDCtx();
+		zsize = ZSTD_DStreamOutSize();
+	}
+	if (mode != DL_TIER_COPY && cctx == NULL && dctx == NULL)
+		ereport(ERROR,
+				(errcode(ERRCODE_OUT_OF_MEMORY),
+				 errmsg("could not create a zstd context")));
+	if (zsize > 0)
+		zbuf = palloc(zsize);
+
+	PG_TRY();
+	{
+#endif
+		for (;;)
+		{
+			inbytes = read(fd_in, buf, DATALINK_THROTTLE_CHUNK_SIZE);
+			if (inbytes < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				ereport(ERROR,
+						(errcode_for_file_access(),
+						 errmsg("could not read server file \"%s\": %m", src)));
+			}
+			CHECK_FOR_INTERRUPTS();
+			datalink_throttle(rbase, inbytes, 0);
+
+			if (mode == DL_TIER_COPY)
+			{
+				if (inbytes == 0)
+					break;
+				datalink_throttle(wbase, inbytes, 0);
+				tier_write(fd_out, dst, buf, inbytes);
+				total += inbytes;
+				continue;
+			}
+#ifdef USE_ZSTD
+			if (mode == DL_TIER_COMPRESS)
+			{
+				ZSTD_inBuffer       in = {buf, (size_t) inbytes, 0};
+				ZSTD_EndDirective   end = (inbytes == 0) ? ZSTD_e_end : ZSTD_e_continue;
+
+				do
+				{
+					ZSTD_outBuffer  out = {zbuf, zsize, 0};
+
+					left = ZSTD_compressStream2(cctx, &out, &in, end);
+					if (ZSTD_isError(left))
+						ereport(ERROR,
+								(errmsg("could not compress file \"%s\": %s",
+										src, ZSTD_getErrorName(left))));
+					datalink_throttle(wbase, out.pos, 0);
+					tier_write(fd_out, dst, zbuf, out.pos);
+					total += out.pos;
+				} while (end == ZSTD_e_end ? left != 0 : in.pos < in.size);
+			}
+			else
+			{
+				ZSTD_inBuffer       in = {buf, (size_t) inbytes, 0};
+
+				while (in.pos < in.size)
+				{
+					ZSTD_outBuffer  out = {zbuf, zsize, 0};
+
+					left = ZSTD_decompressStream(dctx, &out, &in);
+					if (ZSTD_isError(left))
+						ereport(ERROR,
+								(errmsg("could not decompress file \"%s\": %s",
+										src, ZSTD_getErrorName(left))));
+					datalink_throttle(wbase, out.pos, 0);
+					tier_write(fd_out, dst, zbuf, out.pos);
+					total += out.pos;
+				}
+				if (inbytes == 0 && left != 0)
+					ereport(ERROR,
+							(errcode(ERRCODE_DATA_CORRUPTED),
+							 errmsg("compressed file \"%s\" is truncated", src)));
+			}
+#endif
+			if (inbytes == 0)
+				break;
+		}
+#ifdef USE_ZSTD
+	}
+	PG_CATCH();
+	{
+		ZSTD_freeCCtx(cctx);
+		ZSTD_freeDCtx(dctx);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+	ZSTD_freeCCtx(cctx);
+	ZSTD_freeDCtx(dctx);
+#endif
+
+	pfree(buf);
+
+	return total;
+}
+
+/*
+ * Copy a file between a base directory and its tier directory, the third
+ * argument is copy, compress or decompress. The missing directories of the
+ * destination are created, the destination is written as a new file renamed
+ * over the existing one and flushed to disk at commit. Returns the number of
+ * bytes written.
+ */
+PG_FUNCTION_INFO_V1(datalink_tier_copy);
+Datum
+datalink_tier_copy(PG_FUNCTION_ARGS)
+{
+	char       *src = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char       *dst = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char       *modename = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	char       *dir = pstrdup(dst);
+	TierMode    mode;
+	int         fds[2];
+	int         fd_out;
+	char        tmppath[MAXPGPATH];
+	const char *paths[2];
+	bool        exclusive[2] = {false, true};
+	int         rbase, wbase;
+	int64       total;
+
+	if (strcmp(modename, "copy") == 0)
+		mode = DL_TIER_COPY;
+	else if (strcmp(modename, "compress") == 0)
+		mode = DL_TIER_COMPRESS;
+	else if (strcmp(modename, "decompress") == 0)
+		mode = DL_TIER_DECOMPRESS;
+	else
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid tier copy mode \"%s\"", modename),
+				 errhint("Valid modes are \"copy\", \"compress\" and \"decompress\".")));
+#ifndef USE_ZSTD
+	if (mode != DL_TIER_COPY)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("zstd compression is not supported by this build")));
+#endif
+
+	/* Charge the opening of the files before taking any lock */
+	rbase = datalink_throttle_base(src);
+	wbase = datalink_throttle_base(dst);
+	datalink_throttle(rbase, 0, 1);
+	datalink_throttle(wbase, 0, 1);
+
+	fds[0] = OpenTransientFile(src, O_RDONLY | PG_BINARY);
+	if (fds[0] < 0)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open server file \"%s\": %m", src)));
+
+	get_parent_directory(dir);
+	if (dir[0] != '\0' && pg_mkdir_p(dir, pg_dir_create_mode) != 0 && errno != EEXIST)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not create directory \"%s\": %m", dir)));
+	/* An existing destination is only locked, it is replaced by a new file */
+	fds[1] = OpenTransientFile(dst, O_WRONLY | PG_BINARY);
+	if (fds[1] < 0 && errno != ENOENT)
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not open server file \"%s\": %m", dst)));
+
+	/* Wait for the locks of concurrent backends */
+	paths[0] = src;
+	paths[1] = dst;
+	datalink_lock_files((fds[1] >= 0) ? 2 : 1, fds, paths, exclusive);
+	datalink_objcache_invalidate(dst);
+
+	/* The file keeps its mode and owner when it is moved or recalled */
+	fd_out = datalink_open_replacement(dst, (fds[1] >= 0) ? fds[1] : fds[0],
+									   tmppath, sizeof(tmppath));
+	PG_TRY();
+	{
+		total = tier_transfer(fds[0], fd_out, src, tmppath, mode, rbase, wbase);
+		datalink_install_replacement(fd_out, tmppath, dst);
+	}
+	PG_CATCH();
+	{
+		unlink(tmppath);
+		PG_RE_THROW();
+	}
+	PG_END_TRY();
+
+	if (CloseTransientFile(fds[0]))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", src)));
+	if (fds[1] >= 0 && CloseTransientFile(fds[1]))
+		ereport(ERROR,
+				(errcode_for_file_access(),
+				 errmsg("could not close file \"%s\": %m", dst)));
+	datalink_unlock_files();
+	datalink_track_sync(dst, true);
+	/* A file recalled is linked again, the tier directory is not counted */
+	datalink_usage_add(dst, DL_USAGE_LIVE, total, 1);
+
+	PG_RETURN_INT64(total);
+}
+
+static void
+tier_sighup(SIGNAL_ARGS)
+{
+	int         save_errno = errno;
+
+	tier_got_sighup = true;
+	SetLatch(MyLatch);
+
+	errno = save_errno;
+}
+
+/*
+ * Run dl_tier_migrate() in a transaction, nothing is done when the
+ * extension is not installed in the database.
+ */
+static void
+tier_run(void)
+{
+	int     ret;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	if ((ret = SPI_connect()) < 0)
+		elog(ERROR, "SPI_connect failed: %d", ret);
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "SELECT dl_tier_migrate()");
+
+	ret = SPI_execute("SELECT quote_ident(n.nspname) FROM pg_extension e"
+					  " JOIN pg_namespace n ON (n.oid = e.extnamespace)"
+					  " WHERE e.extname = 'datalink'", true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not look for the datalink extension: %d", ret);
+	if (SPI_processed > 0)
+	{
+		char   *nspname = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+		ret = SPI_execute(psprintf("SELECT %s.dl_tier_migrate()", nspname), false, 0);
+		if (ret != SPI_OK_SELECT)
+			elog(ERROR, "dl_tier_migrate() failed: %d", ret);
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+}
+
+/* Main function of the tiering worker */
+void
+datalink_tier_worker_main(Datum main_arg)
+{
+	const char *dbname = GetConfigOption("datalink.dl_tier_database", true, false);
+
+	pqsignal(SIGHUP, tier_sighup);
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnection(dbname, NULL, 0);
+
+	for (;;)
+	{
+		const char *setting;
+		int         naptime = DATALINK_TIER_NAPTIME;
+
+		if (tier_got_sighup)
+		{
+			tier_got_sighup = false;
+			ProcessConfigFile(PGC_SIGHUP);
+		}
+
+		tier_run();
+
+		setting = GetConfigOption("datalink.dl_tier_naptime", true, false);
+		if (setting != NULL)
+			naptime = atoi(setting);
+		(void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+						 naptime * 1000L, PG_WAIT_EXTENSION);
+		ResetLatch(MyLatch);
+		CHECK_FOR_INTERRUPTS();
+	}
+}
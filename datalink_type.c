@@ -0,0 +1,618 @@
+/*
+ * datalink_type.c
+ *
+ * Native DATALINK data type. A datalink was first a composite type of
+ * (dl_base integer, dl_path uri, dl_comment text, dl_token uuid,
+ * dl_prev_token uuid) and the text representation is kept identical to
+ * the one of this record so that dump and restore, and the SQL functions
+ * using field notation like ($1).dl_path, still work. Values are compared,
+ * indexed and hashed on the base directory, the path and the comment, the
+ * columns of the unique index of the datalink columns. The tokens change
+ * with each new version of the file and are ignored.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <ctype.h>
+
+#include "access/hash.h"
+#include "fmgr.h"
+#include "lib/stringinfo.h"
+#include "libpq/pqformat.h"
+#include "mb/pg_wchar.h"
+#include "utils/builtins.h"
+#include "utils/uuid.h"
+
+#include "datalink.h"
+
+#define DATALINK_NFIELDS 5
+
+/* Fields of a datalink, NULL pointers for absent fields */
+typedef struct DatalinkFields
+{
+	bool        has_base;
+	int32       base;
+	char       *path;
+	char       *comment;
+	pg_uuid_t  *token;
+	pg_uuid_t  *prev_token;
+} DatalinkFields;
+
+Datum		datalink_in(PG_FUNCTION_ARGS);
+Datum		datalink_out(PG_FUNCTION_ARGS);
+Datum		datalink_recv(PG_FUNCTION_ARGS);
+Datum		datalink_send(PG_FUNCTION_ARGS);
+Datum		datalink_make(PG_FUNCTION_ARGS);
+Datum		datalink_get_base(PG_FUNCTION_ARGS);
+Datum		datalink_get_path(PG_FUNCTION_ARGS);
+Datum		datalink_get_comment(PG_FUNCTION_ARGS);
+Datum		datalink_get_token(PG_FUNCTION_ARGS);
+Datum		datalink_get_prev_token(PG_FUNCTION_ARGS);
+Datum		datalink_cmp(PG_FUNCTION_ARGS);
+Datum		datalink_eq(PG_FUNCTION_ARGS);
+Datum		datalink_ne(PG_FUNCTION_ARGS);
+Datum		datalink_lt(PG_FUNCTION_ARGS);
+Datum		datalink_le(PG_FUNCTION_ARGS);
+Datum		datalink_gt(PG_FUNCTION_ARGS);
+Datum		datalink_ge(PG_FUNCTION_ARGS);
+Datum		datalink_hash(PG_FUNCTION_ARGS);
+
+static Datalink *datalink_form(const DatalinkFields *f);
+static void datalink_deform(Datalink *dl, DatalinkFields *f);
+static int  datalink_compare(Datalink *a, Datalink *b);
+static void append_field(StringInfo buf, const char *value);
+static void send_counted_text(StringInfo buf, const char *str);
+
+/* Build a datalink from its fields */
+static Datalink *
+datalink_form(const DatalinkFields *f)
+{
+	Datalink   *dl;
+	Size        len = offsetof(Datalink, dl_data);
+	char       *p;
+
+	if (f->token != NULL)
+		len += UUID_LEN;
+	if (f->prev_token != NULL)
+		len += UUID_LEN;
+	if (f->path != NULL)
+		len += strlen(f->path) + 1;
+	if (f->comment != NULL)
+		len += strlen(f->comment) + 1;
+
+	dl = (Datalink *) palloc0(len);
+	SET_VARSIZE(dl, len);
+	dl->dl_base = f->has_base ? f->base : 0;
+	dl->dl_flags = f->has_base ? DL_HAS_BASE : 0;
+
+	p = dl->dl_data;
+	if (f->token != NULL)
+	{
+		dl->dl_flags |= DL_HAS_TOKEN;
+		memcpy(p, f->token->data, UUID_LEN);
+		p += UUID_LEN;
+	}
+	if (f->prev_token != NULL)
+	{
+		dl->dl_flags |= DL_HAS_PREV_TOKEN;
+		memcpy(p, f->prev_token->data, UUID_LEN);
+		p += UUID_LEN;
+	}
+	if (f->path != NULL)
+	{
+		dl->dl_flags |= DL_HAS_PATH;
+		strcpy(p, f->path);
+		p += strlen(f->path) + 1;
+	}
+	if (f->comment != NULL)
+	{
+		dl->dl_flags |= DL_HAS_COMMENT;
+		strcpy(p, f->comment);
+	}
+
+	return dl;
+}
+
+/* Get the fields of a datalink, they point into the datalink */
+static void
+datalink_deform(Datalink *dl, DatalinkFields *f)
+{
+	char   *p = dl->dl_data;
+
+	memset(f, 0, sizeof(DatalinkFields));
+	f->has_base = (dl->dl_flags & DL_HAS_BASE) != 0;
+	f->base = dl->dl_base;
+	if (dl->dl_flags & DL_HAS_TOKEN)
+	{
+		f->token = (pg_uuid_t *) p;
+		p += UUID_LEN;
+	}
+	if (dl->dl_flags & DL_HAS_PREV_TOKEN)
+	{
+		f->prev_token = (pg_uuid_t *) p;
+		p += UUID_LEN;
+	}
+	if (dl->dl_flags & DL_HAS_PATH)
+	{
+		f->path = p;
+		p += strlen(p) + 1;
+	}
+	if (dl->dl_flags & DL_HAS_COMMENT)
+		f->comment = p;
+}
+
+/*
+ * Input function, the syntax is the one of a record:
+ * (dl_base,dl_path,dl_comment,dl_token,dl_prev_token)
+ */
+PG_FUNCTION_INFO_V1(datalink_in);
+Datum
+datalink_in(PG_FUNCTION_ARGS)
+{
+	char           *str = PG_GETARG_CSTRING(0);
+	char           *ptr = str;
+	char           *values[DATALINK_NFIELDS];
+	DatalinkFields  f;
+	StringInfoData  buf;
+	int             i;
+
+	while (*ptr && isspace((unsigned char) *ptr))
+		ptr++;
+	if (*ptr++ != '(')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("malformed datalink literal: \"%s\"", str),
+				 errdetail("Missing left parenthesis.")));
+
+	initStringInfo(&buf);
+	for (i = 0; i < DATALINK_NFIELDS; i++)
+	{
+		bool    inquote = false;
+
+		if (i > 0 && *ptr++ != ',')
+			ereport(ERROR,
+					(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+					 errmsg("malformed datalink literal: \"%s\"", str),
+					 errdetail("Too few columns.")));
+
+		/* An empty unquoted field is NULL */
+		if (*ptr == ',' || *ptr == ')')
+		{
+			values[i] = NULL;
+			continue;
+		}
+
+		resetStringInfo(&buf);
+		while (inquote || !(*ptr == ',' || *ptr == ')'))
+		{
+			char    ch = *ptr++;
+
+			if (ch == '\0')
+				ereport(ERROR,
+						(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+						 errmsg("malformed datalink literal: \"%s\"", str),
+						 errdetail("Unexpected end of input.")));
+			if (ch == '\\')
+			{
+				if (*ptr == '\0')
+					ereport(ERROR,
+							(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+							 errmsg("malformed datalink literal: \"%s\"", str),
+							 errdetail("Unexpected end of input.")));
+				appendStringInfoChar(&buf, *ptr++);
+			}
+			else if (ch == '"')
+			{
+				if (!inquote)
+					inquote = true;
+				else if (*ptr == '"')
+					appendStringInfoChar(&buf, *ptr++);
+				else
+					inquote = false;
+			}
+			else
+				appendStringInfoChar(&buf, ch);
+		}
+		values[i] = pstrdup(buf.data);
+	}
+
+	if (*ptr++ != ')')
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("malformed datalink literal: \"%s\"", str),
+				 errdetail("Too many columns.")));
+	while (*ptr && isspace((unsigned char) *ptr))
+		ptr++;
+	if (*ptr)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_TEXT_REPRESENTATION),
+				 errmsg("malformed datalink literal: \"%s\"", str),
+				 errdetail("Junk after right parenthesis.")));
+
+	memset(&f, 0, sizeof(DatalinkFields));
+	if (values[0] != NULL)
+	{
+		f.has_base = true;
+		f.base = DatumGetInt32(DirectFunctionCall1(int4in,
+								CStringGetDatum(values[0])));
+	}
+	f.path = values[1];
+	f.comment = values[2];
+	if (values[3] != NULL)
+		f.token = DatumGetUUIDP(DirectFunctionCall1(uuid_in,
+								CStringGetDatum(values[3])));
+	if (values[4] != NULL)
+		f.prev_token = DatumGetUUIDP(DirectFunctionCall1(uuid_in,
+								CStringGetDatum(values[4])));
+
+	PG_RETURN_DATALINK_P(datalink_form(&f));
+}
+
+/* Append a field to the output, quoted like record_out() does */
+static void
+append_field(StringInfo buf, const char *value)
+{
+	bool        nq = (value[0] == '\0');
+	const char *p;
+
+	for (p = value; *p && !nq; p++)
+	{
+		if (*p == '"' || *p == '\\' || *p == '(' || *p == ')' || *p == ','
+				|| isspace((unsigned char) *p))
+			nq = true;
+	}
+
+	if (!nq)
+	{
+		appendStringInfoString(buf, value);
+		return;
+	}
+
+	appendStringInfoChar(buf, '"');
+	for (p = value; *p; p++)
+	{
+		if (*p == '"' || *p == '\\')
+			appendStringInfoChar(buf, *p);
+		appendStringInfoChar(buf, *p);
+	}
+	appendStringInfoChar(buf, '"');
+}
+
+PG_FUNCTION_INFO_V1(datalink_out);
+Datum
+datalink_out(PG_FUNCTION_ARGS)
+{
+	Datalink       *dl = PG_GETARG_DATALINK_P(0);
+	DatalinkFields  f;
+	StringInfoData  buf;
+
+	datalink_deform(dl, &f);
+
+	initStringInfo(&buf);
+	appendStringInfoChar(&buf, '(');
+	if (f.has_base)
+		appendStringInfo(&buf, "%d", f.base);
+	appendStringInfoChar(&buf, ',');
+	if (f.path != NULL)
+		append_field(&buf, f.path);
+	appendStringInfoChar(&buf, ',');
+	if (f.comment != NULL)
+		append_field(&buf, f.comment);
+	appendStringInfoChar(&buf, ',');
+	if (f.token != NULL)
+		appendStringInfoString(&buf, DatumGetCString(DirectFunctionCall1(uuid_out,
+								UUIDPGetDatum(f.token))));
+	appendStringInfoChar(&buf, ',');
+	if (f.prev_token != NULL)
+		appendStringInfoString(&buf, DatumGetCString(DirectFunctionCall1(uuid_out,
+								UUIDPGetDatum(f.prev_token))));
+	appendStringInfoChar(&buf, ')');
+
+	PG_RETURN_CSTRING(buf.data);
+}
+
+/*
+ * Binary input, the format is the flags byte followed by the fields that
+ * are present: base as int4, tokens as 16 bytes, path and comment as text
+ * prefixed by their length.
+ */
+PG_FUNCTION_INFO_V1(datalink_recv);
+Datum
+datalink_recv(PG_FUNCTION_ARGS)
+{
+	StringInfo      buf = (StringInfo) PG_GETARG_POINTER(0);
+	DatalinkFields  f;
+	uint8           flags;
+	int             nbytes;
+
+	memset(&f, 0, sizeof(DatalinkFields));
+	flags = (uint8) pq_getmsgbyte(buf);
+	if (flags & ~(DL_HAS_BASE | DL_HAS_PATH | DL_HAS_COMMENT | DL_HAS_TOKEN | DL_HAS_PREV_TOKEN))
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_BINARY_REPRESENTATION),
+				 errmsg("invalid flags in external datalink value")));
+
+	if (flags & DL_HAS_BASE)
+	{
+		f.has_base = true;
+		f.base = (int32) pq_getmsgint(buf, 4);
+	}
+	if (flags & DL_HAS_TOKEN)
+	{
+		f.token = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
+		memcpy(f.token->data, pq_getmsgbytes(buf, UUID_LEN), UUID_LEN);
+	}
+	if (flags & DL_HAS_PREV_TOKEN)
+	{
+		f.prev_token = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
+		memcpy(f.prev_token->data, pq_getmsgbytes(buf, UUID_LEN), UUID_LEN);
+	}
+	if (flags & DL_HAS_PATH)
+	{
+		nbytes = pq_getmsgint(buf, 4);
+		f.path = pq_getmsgtext(buf, nbytes, &nbytes);
+	}
+	if (flags & DL_HAS_COMMENT)
+	{
+		nbytes = pq_getmsgint(buf, 4);
+		f.comment = pq_getmsgtext(buf, nbytes, &nbytes);
+	}
+
+	PG_RETURN_DATALINK_P(datalink_form(&f));
+}
+
+/* Send a string converted to the client encoding prefixed with its length */
+static void
+send_counted_text(StringInfo buf, const char *str)
+{
+	char   *p = pg_server_to_client(str, strlen(str));
+	int     len = strlen(p);
+
+	pq_sendint32(buf, len);
+	pq_sendbytes(buf, p, len);
+}
+
+PG_FUNCTION_INFO_V1(datalink_send);
+Datum
+datalink_send(PG_FUNCTION_ARGS)
+{
+	Datalink       *dl = PG_GETARG_DATALINK_P(0);
+	DatalinkFields  f;
+	StringInfoData  buf;
+
+	datalink_deform(dl, &f);
+
+	pq_begintypsend(&buf);
+	pq_sendbyte(&buf, dl->dl_flags);
+	if (f.has_base)
+		pq_sendint32(&buf, f.base);
+	if (f.token != NULL)
+		pq_sendbytes(&buf, (char *) f.token->data, UUID_LEN);
+	if (f.prev_token != NULL)
+		pq_sendbytes(&buf, (char *) f.prev_token->data, UUID_LEN);
+	if (f.path != NULL)
+		send_counted_text(&buf, f.path);
+	if (f.comment != NULL)
+		send_counted_text(&buf, f.comment);
+
+	PG_RETURN_BYTEA_P(pq_endtypsend(&buf));
+}
+
+/* Build a datalink from its fields, used by the SQL functions */
+PG_FUNCTION_INFO_V1(datalink_make);
+Datum
+datalink_make(PG_FUNCTION_ARGS)
+{
+	DatalinkFields  f;
+
+	memset(&f, 0, sizeof(DatalinkFields));
+	if (!PG_ARGISNULL(0))
+	{
+		f.has_base = true;
+		f.base = PG_GETARG_INT32(0);
+	}
+	if (!PG_ARGISNULL(1))
+		f.path = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	if (!PG_ARGISNULL(2))
+		f.comment = text_to_cstring(PG_GETARG_TEXT_PP(2));
+	if (!PG_ARGISNULL(3))
+		f.token = PG_GETARG_UUID_P(3);
+	if (!PG_ARGISNULL(4))
+		f.prev_token = PG_GETARG_UUID_P(4);
+
+	PG_RETURN_DATALINK_P(datalink_form(&f));
+}
+
+/* Accessors, they are called with the field notation ($1).dl_path */
+PG_FUNCTION_INFO_V1(datalink_get_base);
+Datum
+datalink_get_base(PG_FUNCTION_ARGS)
+{
+	Datalink   *dl = PG_GETARG_DATALINK_P(0);
+
+	if (!(dl->dl_flags & DL_HAS_BASE))
+		PG_RETURN_NULL();
+
+	PG_RETURN_INT32(dl->dl_base);
+}
+
+PG_FUNCTION_INFO_V1(datalink_get_path);
+Datum
+datalink_get_path(PG_FUNCTION_ARGS)
+{
+	Datalink       *dl = PG_GETARG_DATALINK_P(0);
+	DatalinkFields  f;
+
+	datalink_deform(dl, &f);
+	if (f.path == NULL)
+		PG_RETURN_NULL();
+
+	PG_RETURN_TEXT_P(cstring_to_text(f.path));
+}
+
+PG_FUNCTION_INFO_V1(datalink_get_comment);
+Datum
+datalink_get_comment(PG_FUNCTION_ARGS)
+{
+	Datalink       *dl = PG_GETARG_DATALINK_P(0);
+	DatalinkFields  f;
+
+	datalink_deform(dl, &f);
+	if (f.comment == NULL)
+		PG_RETURN_NULL();
+
+	PG_RETURN_TEXT_P(cstring_to_text(f.comment));
+}
+
+PG_FUNCTION_INFO_V1(datalink_get_token);
+Datum
+datalink_get_token(PG_FUNCTION_ARGS)
+{
+	Datalink       *dl = PG_GETARG_DATALINK_P(0);
+	DatalinkFields  f;
+	pg_uuid_t      *uuid;
+
+	datalink_deform(dl, &f);
+	if (f.token == NULL)
+		PG_RETURN_NULL();
+
+	uuid = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
+	memcpy(uuid->data, f.token->data, UUID_LEN);
+
+	PG_RETURN_UUID_P(uuid);
+}
+
+PG_FUNCTION_INFO_V1(datalink_get_prev_token);
+Datum
+datalink_get_prev_token(PG_FUNCTION_ARGS)
+{
+	Datalink       *dl = PG_GETARG_DATALINK_P(0);
+	DatalinkFields  f;
+	pg_uuid_t      *uuid;
+
+	datalink_deform(dl, &f);
+	if (f.prev_token == NULL)
+		PG_RETURN_NULL();
+
+	uuid = (pg_uuid_t *) palloc(sizeof(pg_uuid_t));
+	memcpy(uuid->data, f.prev_token->data, UUID_LEN);
+
+	PG_RETURN_UUID_P(uuid);
+}
+
+/*
+ * Compare two datalinks on the base directory, on the path then on the
+ * comment, a missing field sorts before any value.
+ */
+static int
+datalink_compare(Datalink *a, Datalink *b)
+{
+	DatalinkFields  fa;
+	DatalinkFields  fb;
+	int             cmp;
+
+	datalink_deform(a, &fa);
+	datalink_deform(b, &fb);
+
+	if (fa.has_base != fb.has_base)
+		return fa.has_base ? 1 : -1;
+	if (fa.base != fb.base)
+		return (fa.base < fb.base) ? -1 : 1;
+	if (fa.path == NULL || fb.path == NULL)
+	{
+		if (fa.path != NULL || fb.path != NULL)
+			return (fa.path != NULL) - (fb.path != NULL);
+	}
+	else if ((cmp = strcmp(fa.path, fb.path)) != 0)
+		return cmp;
+	if (fa.comment == NULL || fb.comment == NULL)
+		return (fa.comment != NULL) - (fb.comment != NULL);
+
+	return strcmp(fa.comment, fb.comment);
+}
+
+PG_FUNCTION_INFO_V1(datalink_cmp);
+Datum
+datalink_cmp(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_INT32(datalink_compare(PG_GETARG_DATALINK_P(0),
+									PG_GETARG_DATALINK_P(1)));
+}
+
+PG_FUNCTION_INFO_V1(datalink_eq);
+Datum
+datalink_eq(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(datalink_compare(PG_GETARG_DATALINK_P(0),
+									PG_GETARG_DATALINK_P(1)) == 0);
+}
+
+PG_FUNCTION_INFO_V1(datalink_ne);
+Datum
+datalink_ne(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(datalink_compare(PG_GETARG_DATALINK_P(0),
+									PG_GETARG_DATALINK_P(1)) != 0);
+}
+
+PG_FUNCTION_INFO_V1(datalink_lt);
+Datum
+datalink_lt(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(datalink_compare(PG_GETARG_DATALINK_P(0),
+									PG_GETARG_DATALINK_P(1)) < 0);
+}
+
+PG_FUNCTION_INFO_V1(datalink_le);
+Datum
+datalink_le(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(datalink_compare(PG_GETARG_DATALINK_P(0),
+									PG_GETARG_DATALINK_P(1)) <= 0);
+}
+
+PG_FUNCTION_INFO_V1(datalink_gt);
+Datum
+datalink_gt(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(datalink_compare(PG_GETARG_DATALINK_P(0),
+									PG_GETARG_DATALINK_P(1)) > 0);
+}
+
+PG_FUNCTION_INFO_V1(datalink_ge);
+Datum
+datalink_ge(PG_FUNCTION_ARGS)
+{
+	PG_RETURN_BOOL(datalink_compare(PG_GETARG_DATALINK_P(0),
+									PG_GETARG_DATALINK_P(1)) >= 0);
+}
+
+/*
+ * Hash on the base directory, the path and the comment, consistent with
+ * datalink_eq().
+ */
+PG_FUNCTION_INFO_V1(datalink_hash);
+Datum
+datalink_hash(PG_FUNCTION_ARGS)
+{
+	Datalink       *dl = PG_GETARG_DATALINK_P(0);
+	DatalinkFields  f;
+	uint32          h;
+
+	datalink_deform(dl, &f);
+	h = f.has_base ? DatumGetUInt32(hash_uint32((uint32) f.base)) : 0;
+	if (f.path != NULL)
+		h ^= DatumGetUInt32(hash_any((const unsigned char *) f.path,
+									strlen(f.path))) + 1;
+	h = (h << 1) | (h >> 31);
+	if (f.comment != NULL)
+		h ^= DatumGetUInt32(hash_any((const unsigned char *) f.comment,
+									strlen(f.comment))) + 1;
+
+	PG_RETURN_UINT32(h);
+}
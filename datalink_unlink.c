@@ -0,0 +1,791 @@
+/*
+ * datalink_unlink.c
+ *
+ * Unlink of the datalinks of the tables truncated or dropped. The row and
+ * statement level triggers are not fired by TRUNCATE and DROP TABLE, the
+ * datalinks of the table are captured set-wise before the command by a
+ * BEFORE TRUNCATE statement trigger and by an event trigger at the start of
+ * DROP TABLE, DROP SCHEMA, DROP OWNED and ALTER TABLE ... DROP COLUMN. They
+ * are inserted into table pg_datalink_unlink_queue in the transaction of
+ * the command, so they are discarded if it aborts. The rows of a table are
+ * no more readable once it is dropped, an sql_drop event trigger only warns
+ * about the datalink columns dropped by other commands, DROP EXTENSION for
+ * example, whose files have been left linked.
+ *
+ * Just before the transaction commits a dynamic background worker is
+ * registered in its database, nothing waits for it to start. The worker
+ * waits for the end of the transaction, whose queued files it could not see
+ * before, then it calls dl_process_unlinks() until the queue is empty,
+ * each call claims a batch of files sorted by path and applies ON UNLINK
+ * RESTORE and ON UNLINK DELETE to them with a pool of
+ * datalink.dl_io_threads threads: the files to restore are all renamed
+ * first, then the files to delete are removed. As for dl_audit(), the
+ * threads never call any PostgreSQL function. A batch is removed from the
+ * queue when its transaction commits, a batch interrupted by a crash is
+ * processed again and the files already done are skipped.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <pthread.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "catalog/dependency.h"
+#include "catalog/namespace.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_class.h"
+#include "catalog/pg_inherits.h"
+#include "catalog/pg_trigger.h"
+#include "catalog/pg_type.h"
+#include "commands/event_trigger.h"
+#include "commands/trigger.h"
+#include "executor/spi.h"
+#include "fmgr.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "port/atomics.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/lmgr.h"
+#include "storage/proc.h"
+#include "tcop/tcopprot.h"
+#include "utils/acl.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/guc.h"
+#include "utils/lsyscache.h"
+#include "utils/snapmgr.h"
+#include "utils/syscache.h"
+
+#include "datalink.h"
+
+/* A file of the queue, the result is filled by the threads */
+typedef struct UnlinkFile
+{
+	char       *path;
+	char       *token_path;    /* file renamed with its token, can be NULL */
+	bool        restore;
+	int         err;           /* errno of the failure or 0 */
+	int64       size;          /* size of the file processed, -1 if none */
+} UnlinkFile;
+
+/* Work shared by the threads of the pool */
+typedef struct DatalinkUnlinkWork
+{
+	int                 nfiles;
+	UnlinkFile         *files;
+	bool                restore;       /* pass of the renames or of the unlinks */
+	pg_atomic_uint32    next;          /* first file of the next chunk */
+} DatalinkUnlinkWork;
+
+/* Datalink column existing when a command that can drop it starts */
+typedef struct DropColumn
+{
+	Oid         relid;
+	AttrNumber  attnum;
+	char       *attname;
+	Oid         nspoid;
+	Oid         owner;
+	bool        queued;        /* its datalinks have been queued */
+} DropColumn;
+
+/*
+ * Datalink columns of the database seen by the last command start, they are
+ * kept in TopTransactionContext and only valid in that transaction.
+ */
+static List *drop_columns = NIL;
+static LocalTransactionId drop_columns_lxid = InvalidLocalTransactionId;
+
+Datum		datalink_unlink_table(PG_FUNCTION_ARGS);
+Datum		datalink_drop_table(PG_FUNCTION_ARGS);
+Datum		datalink_dropped_objects(PG_FUNCTION_ARGS);
+Datum		datalink_bulk_unlink(PG_FUNCTION_ARGS);
+PGDLLEXPORT void datalink_unlink_worker_main(Datum main_arg);
+
+static int64 queue_table_unlinks(const char *nspname, Oid relid,
+								 const char *column, bool from_ddl);
+static void unlink_one(DatalinkUnlinkWork *work, UnlinkFile *file);
+static void *unlink_worker(void *arg);
+static void run_unlink_workers(DatalinkUnlinkWork *work, int nworkers);
+static int64 unlink_run(void);
+static List *load_drop_columns(const char *nspname);
+static void queue_dropped_table(const char *nspname, Oid relid);
+static void drop_column_triggers(Oid relid, const char *attname);
+
+/*
+ * Queue the datalinks of a column of a table, or of all its datalink
+ * columns when column is NULL. The caller must be allowed to truncate the
+ * table, the queue is written as superuser. When from_ddl is true the
+ * privileges are checked by the DDL command being run, the queue is
+ * discarded if it fails. Returns the number of files queued.
+ */
+static int64
+queue_table_unlinks(const char *nspname, Oid relid, const char *column,
+					bool from_ddl)
+{
+	HeapTuple   tuple;
+	Oid         relowner;
+	Oid         save_userid;
+	int         save_sec_context;
+	Oid         argtypes[2] = {REGCLASSOID, TEXTOID};
+	Datum       values[2];
+	char        nulls[2] = {' ', ' '};
+	bool        isnull;
+	int64       nqueued = 0;
+	int         ret;
+
+	tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+	if (!HeapTupleIsValid(tuple))
+		return 0;
+	relowner = ((Form_pg_class) GETSTRUCT(tuple))->relowner;
+	ReleaseSysCache(tuple);
+
+	if (!from_ddl && !has_privs_of_role(GetUserId(), relowner) &&
+		pg_class_aclcheck(relid, GetUserId(), ACL_TRUNCATE) != ACLCHECK_OK)
+		ereport(ERROR,
+				(errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+				 errmsg("permission denied to unlink the datalinks of table \"%s\"",
+						get_rel_name(relid))));
+
+	values[0] = ObjectIdGetDatum(relid);
+	if (column != NULL)
+		values[1] = CStringGetTextDatum(column);
+	else
+		nulls[1] = 'n';
+
+	GetUserIdAndSecContext(&save_userid, &save_sec_context);
+	SetUserIdAndSecContext(BOOTSTRAP_SUPERUSERID,
+						   save_sec_context | SECURITY_LOCAL_USERID_CHANGE);
+
+	if ((ret = SPI_connect()) < 0)
+		elog(ERROR, "SPI_connect failed: %d", ret);
+	ret = SPI_execute_with_args(psprintf("SELECT %s.dl_queue_table_unlinks($1, $2)", nspname),
+								2, argtypes, values, nulls, false, 1);
+	if (ret != SPI_OK_SELECT || SPI_processed != 1)
+		elog(ERROR, "dl_queue_table_unlinks() failed: %d", ret);
+	nqueued = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+										  SPI_tuptable->tupdesc, 1, &isnull));
+	SPI_finish();
+
+	SetUserIdAndSecContext(save_userid, save_sec_context);
+
+	/* Start a worker for the files when the transaction commits */
+	if (nqueued > 0)
+		datalink_track_bulk_unlinks();
+
+	return nqueued;
+}
+
+/*
+ * Queue the datalinks of a column of a table, of all its datalink columns
+ * when the column is NULL. Called by the BEFORE TRUNCATE trigger.
+ */
+PG_FUNCTION_INFO_V1(datalink_unlink_table);
+Datum
+datalink_unlink_table(PG_FUNCTION_ARGS)
+{
+	Oid         relid;
+	char       *column = NULL;
+	char       *nspname;
+
+	if (PG_ARGISNULL(0))
+		PG_RETURN_NULL();
+	relid = PG_GETARG_OID(0);
+	if (!PG_ARGISNULL(1))
+		column = text_to_cstring(PG_GETARG_TEXT_PP(1));
+
+	nspname = quote_identifier(get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid)));
+
+	PG_RETURN_INT64(queue_table_unlinks(nspname, relid, column, false));
+}
+
+/*
+ * Return the datalink columns of the tables of the current database, in
+ * TopTransactionContext.
+ */
+static List *
+load_drop_columns(const char *nspname)
+{
+	List           *columns = NIL;
+	MemoryContext   oldcxt;
+	uint64          i;
+	int             ret;
+
+	if ((ret = SPI_connect()) < 0)
+		elog(ERROR, "SPI_connect failed: %d", ret);
+	ret = SPI_execute(psprintf("SELECT a.attrelid, a.attnum, a.attname::text, c.relnamespace, c.relowner"
+							   " FROM pg_catalog.pg_attribute a JOIN pg_catalog.pg_class c ON (c.oid = a.attrelid)"
+							   " WHERE a.atttypid = '%s.datalink'::pg_catalog.regtype AND a.attnum > 0"
+							   " AND NOT a.attisdropped AND c.relkind IN ('r', 'p')", nspname),
+					  true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not look for the datalink columns: %d", ret);
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple   tuple = SPI_tuptable->vals[i];
+		TupleDesc   tupdesc = SPI_tuptable->tupdesc;
+		DropColumn *col = (DropColumn *) palloc(sizeof(DropColumn));
+		bool        isnull;
+
+		col->relid = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+		col->attnum = DatumGetInt16(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+		col->attname = SPI_getvalue(tuple, tupdesc, 3);
+		col->nspoid = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+		col->owner = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 5, &isnull));
+		col->queued = false;
+		columns = lappend(columns, col);
+	}
+	MemoryContextSwitchTo(oldcxt);
+	SPI_finish();
+
+	return columns;
+}
+
+/* Queue the datalinks of a table dropped and of its children */
+static void
+queue_dropped_table(const char *nspname, Oid relid)
+{
+	List       *children = find_all_inheritors(relid, NoLock, NULL);
+	ListCell   *lc;
+	ListCell   *lc2;
+
+	foreach(lc, children)
+	{
+		Oid     child = lfirst_oid(lc);
+		bool    found = false;
+
+		foreach(lc2, drop_columns)
+		{
+			DropColumn *col = (DropColumn *) lfirst(lc2);
+
+			if (col->relid == child && !col->queued)
+			{
+				col->queued = true;
+				found = true;
+			}
+		}
+		if (found)
+			(void) queue_table_unlinks(nspname, child, NULL, true);
+	}
+}
+
+/*
+ * Drop the triggers created by add_datalink_trigger() for a datalink column
+ * dropped, they would fail once the column is gone. The clones of the row
+ * trigger on the partitions go with the one of their parent.
+ */
+static void
+drop_column_triggers(Oid relid, const char *attname)
+{
+	const char *suffixes[] = {"upd", "del", "trunc"};
+	int         i;
+
+	for (i = 0; i < lengthof(suffixes); i++)
+	{
+		ObjectAddress   trigger;
+
+		trigger.classId = TriggerRelationId;
+		trigger.objectId = get_trigger_oid(relid, psprintf("dltrg_%s_%s", attname, suffixes[i]), true);
+		trigger.objectSubId = 0;
+		if (OidIsValid(trigger.objectId))
+			performDeletion(&trigger, DROP_RESTRICT, PERFORM_DELETION_INTERNAL);
+	}
+}
+
+/*
+ * Event trigger fired at the start of the DDL commands. The datalink
+ * columns are recorded before the commands that can drop them, the datalinks of the tables dropped and of their
+ * children, or of the datalink columns dropped, are queued before they
+ * disappear.
+ */
+PG_FUNCTION_INFO_V1(datalink_drop_table);
+Datum
+datalink_drop_table(PG_FUNCTION_ARGS)
+{
+	EventTriggerData   *trigdata;
+	Node               *parsetree;
+	char               *nspname;
+	ListCell           *lc;
+	ListCell           *lc2;
+
+	if (!CALLED_AS_EVENT_TRIGGER(fcinfo))
+		elog(ERROR, "datalink_drop_table: not fired by event trigger manager");
+
+	trigdata = (EventTriggerData *) fcinfo->context;
+	parsetree = trigdata->parsetree;
+	drop_columns = NIL;
+	drop_columns_lxid = DL_CURRENT_LXID;
+	if (!IsA(parsetree, DropStmt) && !IsA(parsetree, DropOwnedStmt) &&
+		!IsA(parsetree, AlterTableStmt))
+		PG_RETURN_VOID();
+
+	nspname = quote_identifier(get_namespace_name(get_func_namespace(fcinfo->flinfo->fn_oid)));
+	drop_columns = load_drop_columns(nspname);
+	if (drop_columns == NIL)
+		PG_RETURN_VOID();
+
+	if (IsA(parsetree, DropStmt))
+	{
+		DropStmt   *stmt = (DropStmt *) parsetree;
+
+		foreach(lc, stmt->objects)
+		{
+			if (stmt->removeType == OBJECT_TABLE)
+			{
+				RangeVar   *rv = makeRangeVarFromNameList((List *) lfirst(lc));
+				Oid         relid = RangeVarGetRelid(rv, NoLock, true);
+
+				/* DROP TABLE IF EXISTS, or the command will fail */
+				if (OidIsValid(relid))
+					queue_dropped_table(nspname, relid);
+			}
+			else if (stmt->removeType == OBJECT_SCHEMA)
+			{
+				Oid     nspoid = get_namespace_oid(strVal(lfirst(lc)), true);
+
+				foreach(lc2, drop_columns)
+				{
+					DropColumn *col = (DropColumn *) lfirst(lc2);
+
+					if (OidIsValid(nspoid) && col->nspoid == nspoid && !col->queued)
+						queue_dropped_table(nspname, col->relid);
+				}
+			}
+		}
+	}
+	else if (IsA(parsetree, DropOwnedStmt))
+	{
+		DropOwnedStmt  *stmt = (DropOwnedStmt *) parsetree;
+
+		foreach(lc, stmt->roles)
+		{
+			Oid     roleid = get_rolespec_oid((RoleSpec *) lfirst(lc), true);
+
+			foreach(lc2, drop_columns)
+			{
+				DropColumn *col = (DropColumn *) lfirst(lc2);
+
+				if (OidIsValid(roleid) && col->owner == roleid && !col->queued)
+					queue_dropped_table(nspname, col->relid);
+			}
+		}
+	}
+	else
+	{
+		AlterTableStmt *stmt = (AlterTableStmt *) parsetree;
+		Oid             relid = RangeVarGetRelid(stmt->relation, NoLock, true);
+		List           *rels;
+
+		if (!OidIsValid(relid))
+			PG_RETURN_VOID();
+		rels = stmt->relation->inh ? find_all_inheritors(relid, NoLock, NULL) :
+			list_make1_oid(relid);
+
+		foreach(lc, stmt->cmds)
+		{
+			AlterTableCmd  *cmd = (AlterTableCmd *) lfirst(lc);
+			ListCell       *lc3;
+
+			if (cmd->subtype != AT_DropColumn)
+				continue;
+			foreach(lc2, drop_columns)
+			{
+				DropColumn *col = (DropColumn *) lfirst(lc2);
+
+				if (col->queued || strcmp(col->attname, cmd->name) != 0)
+					continue;
+				foreach(lc3, rels)
+				{
+					if (lfirst_oid(lc3) == col->relid)
+					{
+						col->queued = true;
+						(void) queue_table_unlinks(nspname, col->relid, col->attname, true);
+					}
+				}
+			}
+
+			/* the parents come first, their row trigger has clones */
+			foreach(lc3, rels)
+			{
+				foreach(lc2, drop_columns)
+				{
+					DropColumn *col = (DropColumn *) lfirst(lc2);
+
+					if (col->relid == lfirst_oid(lc3) && strcmp(col->attname, cmd->name) == 0)
+						drop_column_triggers(col->relid, col->attname);
+				}
+			}
+		}
+	}
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Event trigger fired by sql_drop. The datalink columns dropped whose
+ * datalinks have not been queued at the start of the command can not be
+ * read anymore, their files are left linked and a warning is raised.
+ */
+PG_FUNCTION_INFO_V1(datalink_dropped_objects);
+Datum
+datalink_dropped_objects(PG_FUNCTION_ARGS)
+{
+	uint64      i;
+	int         ret;
+
+	if (!CALLED_AS_EVENT_TRIGGER(fcinfo))
+		elog(ERROR, "datalink_dropped_objects: not fired by event trigger manager");
+
+	/* the start of the command has not been seen */
+	if (drop_columns_lxid != DL_CURRENT_LXID || drop_columns == NIL)
+		PG_RETURN_VOID();
+
+	if ((ret = SPI_connect()) < 0)
+		elog(ERROR, "SPI_connect failed: %d", ret);
+	ret = SPI_execute("SELECT objid, objsubid, object_identity FROM pg_catalog.pg_event_trigger_dropped_objects()"
+					  " WHERE object_type IN ('table', 'table column')", true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not get the dropped objects: %d", ret);
+
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple   tuple = SPI_tuptable->vals[i];
+		TupleDesc   tupdesc = SPI_tuptable->tupdesc;
+		Oid         relid;
+		int32       attnum;
+		bool        isnull;
+		ListCell   *lc;
+
+		relid = DatumGetObjectId(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+		attnum = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+		foreach(lc, drop_columns)
+		{
+			DropColumn *col = (DropColumn *) lfirst(lc);
+
+			if (col->relid != relid || col->queued ||
+				(attnum != 0 && col->attnum != attnum))
+				continue;
+			ereport(WARNING,
+					(errmsg("datalinks of \"%s\" dropped without being unlinked",
+							SPI_getvalue(tuple, tupdesc, 3)),
+					 errhint("The files renamed with their token are reported as orphan copies by dl_audit().")));
+			break;
+		}
+	}
+	SPI_finish();
+
+	/* the list is freed with the transaction */
+	drop_columns = NIL;
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Restore or remove a file, a file already processed is not an error. The
+ * size of a regular file is kept for the space used by its base directory.
+ */
+static void
+unlink_one(DatalinkUnlinkWork *work, UnlinkFile *file)
+{
+	struct stat st;
+
+	if (work->restore)
+	{
+		if (!file->restore || file->token_path == NULL)
+			return;
+		if (lstat(file->token_path, &st) == 0 && S_ISREG(st.st_mode))
+			file->size = st.st_size;
+		if (rename(file->token_path, file->path) < 0)
+		{
+			if (errno != ENOENT)
+				file->err = errno;
+			file->size = -1;
+		}
+	}
+	else
+	{
+		if (file->restore)
+			return;
+		if (lstat(file->path, &st) == 0 && S_ISREG(st.st_mode))
+			file->size = st.st_size;
+		if (unlink(file->path) < 0)
+		{
+			if (errno != ENOENT)
+				file->err = errno;
+			file->size = -1;
+		}
+	}
+}
+
+/*
+ * Thread of the pool, processes chunks of consecutive files so that the
+ * files of a directory are mostly handled by the same thread.
+ */
+static void *
+unlink_worker(void *arg)
+{
+	DatalinkUnlinkWork *work = (DatalinkUnlinkWork *) arg;
+	uint32      first;
+	uint32      i;
+
+	while ((first = pg_atomic_fetch_add_u32(&work->next, DATALINK_UNLINK_CHUNK)) < (uint32) work->nfiles)
+	{
+		for (i = first; i < first + DATALINK_UNLINK_CHUNK && i < (uint32) work->nfiles; i++)
+			unlink_one(work, &work->files[i]);
+	}
+
+	return NULL;
+}
+
+/*
+ * Process all the files of the work with nworkers threads. The backend
+ * processes the files itself when no thread can be started.
+ */
+static void
+run_unlink_workers(DatalinkUnlinkWork *work, int nworkers)
+{
+	pthread_t  *threads;
+	sigset_t    blocked;
+	sigset_t    saved;
+	int         nstarted = 0;
+	int         i;
+
+	threads = (pthread_t *) palloc(Max(nworkers, 1) * sizeof(pthread_t));
+	pg_atomic_init_u32(&work->next, 0);
+
+	/* Threads inherit the signal mask, they must not receive any signal */
+	sigfillset(&blocked);
+	pthread_sigmask(SIG_SETMASK, &blocked, &saved);
+	for (i = 0; i < nworkers; i++)
+	{
+		if (pthread_create(&threads[i], NULL, unlink_worker, work) != 0)
+			break;
+		nstarted++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	/* Take part in the work, this also handles a failure to start threads */
+	unlink_worker(work);
+
+	for (i = 0; i < nstarted; i++)
+		pthread_join(threads[i], NULL);
+
+	pfree(threads);
+}
+
+/*
+ * Apply ON UNLINK RESTORE and DELETE to a batch of files sorted by path.
+ * Arguments are the paths of the datalinks, the paths of the files renamed
+ * with their token and whether the files must be restored. Failures are
+ * reported as warnings, returns the number of files processed.
+ */
+PG_FUNCTION_INFO_V1(datalink_bulk_unlink);
+Datum
+datalink_bulk_unlink(PG_FUNCTION_ARGS)
+{
+	ArrayType  *paths = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType  *token_paths = PG_GETARG_ARRAYTYPE_P(1);
+	ArrayType  *restores = PG_GETARG_ARRAYTYPE_P(2);
+	Datum      *path_elems;
+	Datum      *token_elems;
+	Datum      *restore_elems;
+	bool       *path_nulls;
+	bool       *token_nulls;
+	bool       *restore_nulls;
+	int         npaths;
+	int         ntokens;
+	int         nrestores;
+	DatalinkUnlinkWork work;
+	const char *setting;
+	int         nworkers = DATALINK_IO_THREADS;
+	int64       ndone = 0;
+	int         i;
+
+	deconstruct_array(paths, TEXTOID, -1, false, 'i',
+						&path_elems, &path_nulls, &npaths);
+	deconstruct_array(token_paths, TEXTOID, -1, false, 'i',
+						&token_elems, &token_nulls, &ntokens);
+	deconstruct_array(restores, BOOLOID, 1, true, 'c',
+						&restore_elems, &restore_nulls, &nrestores);
+	if (npaths != ntokens || npaths != nrestores)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("arrays of the files to unlink must have the same size")));
+
+	work.nfiles = 0;
+	work.files = (UnlinkFile *) palloc0(Max(npaths, 1) * sizeof(UnlinkFile));
+	for (i = 0; i < npaths; i++)
+	{
+		UnlinkFile *file;
+
+		if (path_nulls[i])
+			continue;
+		file = &work.files[work.nfiles++];
+		file->path = TextDatumGetCString(path_elems[i]);
+		file->token_path = token_nulls[i] ? NULL : TextDatumGetCString(token_elems[i]);
+		file->restore = !restore_nulls[i] && DatumGetBool(restore_elems[i]);
+		file->size = -1;
+	}
+	if (work.nfiles == 0)
+		PG_RETURN_INT64(0);
+
+	setting = GetConfigOption("datalink.dl_io_threads", true, false);
+	if (setting != NULL)
+		nworkers = atoi(setting);
+	/* The backend is one of the workers */
+	nworkers = Min(nworkers, (work.nfiles + DATALINK_UNLINK_CHUNK - 1) / DATALINK_UNLINK_CHUNK) - 1;
+
+	/* First pass: rename the files back to their original name */
+	work.restore = true;
+	run_unlink_workers(&work, Max(nworkers, 0));
+	CHECK_FOR_INTERRUPTS();
+
+	/* Second pass: remove the files */
+	work.restore = false;
+	run_unlink_workers(&work, Max(nworkers, 0));
+	CHECK_FOR_INTERRUPTS();
+
+	for (i = 0; i < work.nfiles; i++)
+	{
+		UnlinkFile *file = &work.files[i];
+
+		if (file->err == 0)
+		{
+			if (file->restore)
+				datalink_usage_renamed(file->token_path, file->path, file->size, -1);
+			else
+				datalink_usage_unlinked(file->path, file->size);
+			ndone++;
+			continue;
+		}
+		errno = file->err;
+		if (file->restore)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not rename file \"%s\" to \"%s\": %m",
+							file->token_path, file->path)));
+		else
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not unlink file \"%s\": %m", file->path)));
+	}
+
+	PG_RETURN_INT64(ndone);
+}
+
+/*
+ * Register a worker processing the queue of the current database, called
+ * just before a transaction that has queued files commits. The worker is
+ * given the transaction id to wait for, the backend does not wait for it.
+ */
+void
+datalink_launch_unlink_worker(void)
+{
+	BackgroundWorker        worker;
+	BackgroundWorkerHandle *handle;
+	TransactionId           xid = GetTopTransactionIdIfAny();
+
+	memset(&worker, 0, sizeof(worker));
+	snprintf(worker.bgw_name, BGW_MAXLEN, "Datalink unlink worker");
+#if PG_VERSION_NUM >= 110000
+	snprintf(worker.bgw_type, BGW_MAXLEN, "datalink unlink worker");
+#endif
+	worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+	worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+	worker.bgw_restart_time = BGW_NEVER_RESTART;
+	snprintf(worker.bgw_library_name, BGW_MAXLEN, "datalink");
+	snprintf(worker.bgw_function_name, BGW_MAXLEN, "datalink_unlink_worker_main");
+	worker.bgw_main_arg = ObjectIdGetDatum(MyDatabaseId);
+	worker.bgw_notify_pid = 0;
+	memcpy(worker.bgw_extra, &xid, sizeof(xid));
+
+	if (RegisterDynamicBackgroundWorker(&worker, &handle))
+		return;
+
+	ereport(WARNING,
+			(errmsg("could not start a datalink unlink worker"),
+			 errhint("Run dl_process_unlinks() to process the files of the tables truncated or dropped.")));
+}
+
+/*
+ * Run dl_process_unlinks() in a transaction. Returns the number of files
+ * claimed, 0 when the queue is empty or the extension is not installed.
+ */
+static int64
+unlink_run(void)
+{
+	int64   nclaimed = 0;
+	bool    isnull;
+	int     ret;
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	if ((ret = SPI_connect()) < 0)
+		elog(ERROR, "SPI_connect failed: %d", ret);
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "SELECT dl_process_unlinks()");
+
+	ret = SPI_execute("SELECT quote_ident(n.nspname) FROM pg_extension e"
+					  " JOIN pg_namespace n ON (n.oid = e.extnamespace)"
+					  " WHERE e.extname = 'datalink'", true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not look for the datalink extension: %d", ret);
+	if (SPI_processed > 0)
+	{
+		char   *nspname = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+		ret = SPI_execute(psprintf("SELECT %s.dl_process_unlinks()", nspname), false, 1);
+		if (ret != SPI_OK_SELECT || SPI_processed != 1)
+			elog(ERROR, "dl_process_unlinks() failed: %d", ret);
+		nclaimed = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0],
+											   SPI_tuptable->tupdesc, 1, &isnull));
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	return nclaimed;
+}
+
+/*
+ * Main function of an unlink worker, the argument is the database oid and
+ * the extra data the id of the transaction that has queued the files.
+ */
+void
+datalink_unlink_worker_main(Datum main_arg)
+{
+	Oid             dboid = DatumGetObjectId(main_arg);
+	TransactionId   xid;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnectionByOid(dboid, InvalidOid, 0);
+
+	/* The files queued are only visible once the transaction has committed */
+	memcpy(&xid, MyBgworkerEntry->bgw_extra, sizeof(xid));
+	if (TransactionIdIsValid(xid))
+	{
+		StartTransactionCommand();
+		XactLockTableWait(xid, NULL, NULL, XLTW_None);
+		CommitTransactionCommand();
+	}
+
+	while (unlink_run() > 0)
+		CHECK_FOR_INTERRUPTS();
+
+	proc_exit(0);
+}
@@ -0,0 +1,800 @@
+/*
+ * datalink_usage.c
+ *
+ * Space and number of files used by the base directories with link control
+ * and write permission, kept up to date by the file functions instead of
+ * stating every file. The files of a base directory are counted in three
+ * kinds:
+ *
+ *   - live: the files referenced by the datalinks;
+ *   - copy: the previous versions kept for dlpreviouscopy(), the files
+ *     with the .old suffix and the ones of the previous token;
+ *   - pending: the copies made for the write tokens and the files with the
+ *     .new suffix, not yet validated by dlnewcopy() or dlreplacecontent(),
+ *     and the versions no more referenced. They are removed when their
+ *     transaction aborts or by hand.
+ *
+ * Copies and writes add to the pending files, renames move a file between
+ * kinds according to the name of the source and of the destination, and
+ * unlinks remove it. The SQL functions that change the file referenced by
+ * a datalink without touching the filesystem move it with
+ * datalink_usage_move(), through the SECURITY DEFINER wrapper dl_usage_move():
+ * the functions that write the counters are not granted to PUBLIC.
+ *
+ * The file operations are not undone when their transaction aborts, they
+ * are counted at once. The moves only follow the datalinks and are rolled
+ * back with them: they are kept by the transaction and applied to the
+ * counters when it commits, the ones of an aborted subtransaction are
+ * forgotten.
+ *
+ * The counters are kept in shared memory by database and base directory.
+ * They are loaded from table pg_datalink_usage the first time the base
+ * directory is used and written back to it by dl_usage_flush(), which the
+ * main background worker has a dynamic worker run in each database with
+ * changes every datalink.dl_usage_flush_interval seconds. Changes done
+ * after the last flush are lost by a crash, dl_usage_rebuild() counts the
+ * files again from the filesystem.
+ *
+ * The quotas of a base directory, the maxbytes and maxfiles columns of
+ * pg_datalink_bases, are checked against the counters before a copy or a
+ * write. Counting and quotas are only available when the extension is
+ * loaded with shared_preload_libraries.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include <ctype.h>
+#include <sys/stat.h>
+
+#include "access/htup_details.h"
+#include "access/xact.h"
+#include "executor/spi.h"
+#include "fmgr.h"
+#include "funcapi.h"
+#include "miscadmin.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/proc.h"
+#include "storage/shmem.h"
+#include "tcop/tcopprot.h"
+#include "utils/builtins.h"
+#include "utils/hsearch.h"
+#include "utils/memutils.h"
+#include "utils/snapmgr.h"
+#include "utils/timestamp.h"
+#include "utils/uuid.h"
+
+#include "datalink.h"
+
+/* Counters of a base directory are kept by database */
+typedef struct UsageKey
+{
+	Oid         dbid;
+	int         dirid;
+} UsageKey;
+
+typedef struct UsageEntry
+{
+	UsageKey    key;
+	char        path[MAXPGPATH];   /* path of the base directory */
+	int         pathlen;
+	int64       maxbytes;          /* quotas, 0 means no limit */
+	int64       maxfiles;
+	int64       bytes[DL_USAGE_NKINDS];
+	int64       files[DL_USAGE_NKINDS];
+	bool        dirty;             /* changed since the last flush */
+	TimestampTz flushed;           /* last flush or flush request */
+} UsageEntry;
+
+typedef struct UsageShared
+{
+	LWLock     *lock;
+} UsageShared;
+
+/* Move of a file between kinds, applied when its transaction commits */
+typedef struct UsageMove
+{
+	int         nestlevel;
+	int         dirid;
+	DatalinkUsageKind from;
+	DatalinkUsageKind to;
+	int64       size;
+} UsageMove;
+
+static UsageShared *usage_shared = NULL;
+static HTAB *usage_entries = NULL;
+
+/* Moves of the current transaction, kept in TopTransactionContext */
+static List *usage_moves = NIL;
+
+/* Transaction in which the base directories have been loaded */
+static LocalTransactionId usage_lxid = InvalidLocalTransactionId;
+
+static const char *const usage_kind_names[DL_USAGE_NKINDS] = {"live", "copy", "pending"};
+
+Datum		datalink_usage_move(PG_FUNCTION_ARGS);
+Datum		datalink_usage_counters(PG_FUNCTION_ARGS);
+Datum		datalink_usage_set(PG_FUNCTION_ARGS);
+PGDLLEXPORT void datalink_usage_worker_main(Datum main_arg);
+
+static void usage_load_bases(void);
+static UsageEntry *usage_find(const char *path);
+static void usage_update(UsageEntry *entry, DatalinkUsageKind kind,
+		int64 bytes, int64 files);
+static DatalinkUsageKind usage_kind(const char *path);
+static bool usage_has_token(const char *path);
+static DatalinkUsageKind usage_kind_value(const char *name);
+
+/* Reserve shared memory for the counters, called from _PG_init() */
+void
+datalink_usage_shmem_request(void)
+{
+	RequestAddinShmemSpace(MAXALIGN(sizeof(UsageShared)));
+	RequestAddinShmemSpace(hash_estimate_size(DL_USAGE_MAX_BASES,
+								sizeof(UsageEntry)));
+	RequestNamedLWLockTranche("datalink_usage", 1);
+}
+
+/* Attach to the shared counters, AddinShmemInitLock is held */
+void
+datalink_usage_shmem_init(void)
+{
+	bool        found;
+	HASHCTL     info;
+
+	usage_shared = ShmemInitStruct("datalink usage",
+							sizeof(UsageShared), &found);
+	if (!found)
+		usage_shared->lock = &(GetNamedLWLockTranche("datalink_usage"))->lock;
+
+	memset(&info, 0, sizeof(info));
+	info.keysize = sizeof(UsageKey);
+	info.entrysize = sizeof(UsageEntry);
+	usage_entries = ShmemInitHash("datalink usage hash",
+								DL_USAGE_MAX_BASES, DL_USAGE_MAX_BASES,
+								&info, HASH_ELEM | HASH_BLOBS);
+}
+
+/*
+ * Read the base directories of the database and their quotas, this is done
+ * once per transaction. The counters of a base directory seen for the first
+ * time are loaded from pg_datalink_usage and the ones of the base
+ * directories that are no more counted are forgotten. Outside of a
+ * transaction, at commit or in the main background worker, the base
+ * directories already known are used.
+ */
+static void
+usage_load_bases(void)
+{
+	HASH_SEQ_STATUS status;
+	UsageEntry     *entry;
+	int            *dirids;
+	int             ndirids = 0;
+	int             ret;
+	uint64          i;
+
+	if (!IsTransactionState() || !OidIsValid(MyDatabaseId))
+		return;
+	if (usage_lxid == DL_CURRENT_LXID)
+		return;
+
+	if ((ret = SPI_connect()) < 0)
+		elog(ERROR, "SPI_connect failed: %d", ret);
+	ret = SPI_execute("SELECT b.dirid, coalesce(nullif(rtrim(uri_get_path(b.base), '/'), ''), '/'), "
+					  "b.maxbytes, b.maxfiles, u.live_bytes, u.live_files, u.copy_bytes, "
+					  "u.copy_files, u.pending_bytes, u.pending_files "
+					  "FROM pg_datalink_bases b LEFT JOIN pg_datalink_usage u ON (u.dirid = b.dirid) "
+					  "WHERE b.linkcontrol AND b.writeperm AND uri_get_scheme(b.base) = 'file'",
+					  true, 0);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not read the quotas of the base directories: %d", ret);
+
+	dirids = (int *) palloc(Max(SPI_processed, 1) * sizeof(int));
+	LWLockAcquire(usage_shared->lock, LW_EXCLUSIVE);
+	for (i = 0; i < SPI_processed; i++)
+	{
+		HeapTuple   tuple = SPI_tuptable->vals[i];
+		TupleDesc   tupdesc = SPI_tuptable->tupdesc;
+		UsageKey    key;
+		bool        found;
+		bool        isnull;
+		char       *path;
+		int         k;
+
+		memset(&key, 0, sizeof(key));
+		key.dbid = MyDatabaseId;
+		key.dirid = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 1, &isnull));
+		dirids[ndirids++] = key.dirid;
+
+		entry = (UsageEntry *) hash_search(usage_entries, &key, HASH_ENTER_NULL, &found);
+		if (entry == NULL)
+			continue;  /* more base directories than entries */
+		if (!found)
+		{
+			for (k = 0; k < DL_USAGE_NKINDS; k++)
+			{
+				entry->bytes[k] = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 5 + 2 * k, &isnull));
+				if (isnull)
+					entry->bytes[k] = 0;
+				entry->files[k] = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 6 + 2 * k, &isnull));
+				if (isnull)
+					entry->files[k] = 0;
+			}
+			entry->dirty = false;
+			entry->flushed = GetCurrentTimestamp();
+		}
+		path = SPI_getvalue(tuple, tupdesc, 2);
+		strlcpy(entry->path, path, MAXPGPATH);
+		entry->pathlen = strlen(entry->path);
+		entry->maxbytes = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 3, &isnull));
+		if (isnull)
+			entry->maxbytes = 0;
+		entry->maxfiles = DatumGetInt64(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+		if (isnull)
+			entry->maxfiles = 0;
+	}
+
+	/* Base directories dropped or no more under link control */
+	hash_seq_init(&status, usage_entries);
+	while ((entry = (UsageEntry *) hash_seq_search(&status)) != NULL)
+	{
+		int     k;
+
+		if (entry->key.dbid != MyDatabaseId)
+			continue;
+		for (k = 0; k < ndirids; k++)
+		{
+			if (dirids[k] == entry->key.dirid)
+				break;
+		}
+		if (k == ndirids)
+			hash_search(usage_entries, &entry->key, HASH_REMOVE, NULL);
+	}
+	LWLockRelease(usage_shared->lock);
+
+	pfree(dirids);
+	SPI_finish();
+	usage_lxid = DL_CURRENT_LXID;
+}
+
+/*
+ * Return the counters of the base directory holding a file, the one with
+ * the longest path when they are nested, or NULL when the file is not in a
+ * counted base directory. The base directories of the current database are
+ * looked at, of all databases in the main background worker. The lock must
+ * be held.
+ */
+static UsageEntry *
+usage_find(const char *path)
+{
+	HASH_SEQ_STATUS status;
+	UsageEntry     *entry;
+	UsageEntry     *result = NULL;
+
+	hash_seq_init(&status, usage_entries);
+	while ((entry = (UsageEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (OidIsValid(MyDatabaseId) && entry->key.dbid != MyDatabaseId)
+			continue;
+		if (strncmp(path, entry->path, entry->pathlen) != 0)
+			continue;
+		if (path[entry->pathlen] != '/' && strcmp(entry->path, "/") != 0)
+			continue;
+		if (result == NULL || entry->pathlen > result->pathlen)
+			result = entry;
+	}
+
+	return result;
+}
+
+/* Return true when the name of a file starts with a token */
+static bool
+usage_has_token(const char *path)
+{
+	const char *name = strrchr(path, '/');
+	int         i;
+
+	name = (name != NULL) ? name + 1 : path;
+	for (i = 0; i < UUID_LEN * 2 + 4; i++)
+	{
+		if (!isxdigit((unsigned char) name[i]) && name[i] != '-')
+			return false;
+	}
+
+	return (name[i] == ';');
+}
+
+/* Kind of a file according to its name */
+static DatalinkUsageKind
+usage_kind(const char *path)
+{
+	int     len = strlen(path);
+
+	if (len > 4 && strcmp(path + len - 4, ".new") == 0)
+		return DL_USAGE_PENDING;
+	if (len > 4 && strcmp(path + len - 4, ".old") == 0)
+		return DL_USAGE_COPY;
+
+	return DL_USAGE_LIVE;
+}
+
+static DatalinkUsageKind
+usage_kind_value(const char *name)
+{
+	int     k;
+
+	for (k = 0; k < DL_USAGE_NKINDS; k++)
+	{
+		if (strcmp(name, usage_kind_names[k]) == 0)
+			return (DatalinkUsageKind) k;
+	}
+	ereport(ERROR,
+			(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+			 errmsg("invalid usage kind \"%s\"", name),
+			 errhint("Valid kinds are \"live\", \"copy\" and \"pending\".")));
+
+	return DL_USAGE_NONE;  /* keep compiler quiet */
+}
+
+/*
+ * Size of a file to count, -1 when it is not a regular file or when the
+ * files are not counted. Symlinks are not counted.
+ */
+int64
+datalink_usage_size(const char *path)
+{
+	struct stat st;
+
+	if (usage_shared == NULL)
+		return -1;
+	if (lstat(path, &st) < 0 || !S_ISREG(st.st_mode))
+		return -1;
+
+	return (int64) st.st_size;
+}
+
+/* Add bytes and files to a kind of the base directory holding a file */
+void
+datalink_usage_add(const char *path, DatalinkUsageKind kind, int64 bytes, int64 files)
+{
+	UsageEntry *entry;
+
+	if (usage_shared == NULL || kind == DL_USAGE_NONE || (bytes == 0 && files == 0))
+		return;
+
+	usage_load_bases();
+	LWLockAcquire(usage_shared->lock, LW_EXCLUSIVE);
+	entry = usage_find(path);
+	if (entry != NULL)
+		usage_update(entry, kind, bytes, files);
+	LWLockRelease(usage_shared->lock);
+}
+
+/* Change a kind of counters, the lock must be held in exclusive mode */
+static void
+usage_update(UsageEntry *entry, DatalinkUsageKind kind, int64 bytes, int64 files)
+{
+	/* counters that have drifted never go below zero */
+	entry->bytes[kind] = Max(entry->bytes[kind] + bytes, 0);
+	entry->files[kind] = Max(entry->files[kind] + files, 0);
+	entry->dirty = true;
+}
+
+/*
+ * Count a file removed, its size has been taken with datalink_usage_size()
+ * before.
+ */
+void
+datalink_usage_unlinked(const char *path, int64 size)
+{
+	if (size >= 0)
+		datalink_usage_add(path, usage_kind(path), -size, -1);
+}
+
+/*
+ * Count a file renamed, size is the one of the source and replaced the one
+ * of the file overwritten by the rename, both taken before. A file renamed
+ * with its token is being linked and a file renamed back to its name is
+ * restored, they were and are no more counted.
+ */
+void
+datalink_usage_renamed(const char *src, const char *dst, int64 size, int64 replaced)
+{
+	DatalinkUsageKind from = usage_kind(src);
+	DatalinkUsageKind to = usage_kind(dst);
+
+	if (from == DL_USAGE_LIVE && !usage_has_token(src) && usage_has_token(dst))
+		from = DL_USAGE_NONE;
+	if (to == DL_USAGE_LIVE && usage_has_token(src) && !usage_has_token(dst))
+		to = DL_USAGE_NONE;
+
+	if (replaced >= 0)
+		datalink_usage_add(dst, usage_kind(dst), -replaced, -1);
+	if (size >= 0)
+	{
+		datalink_usage_add(src, from, -size, -1);
+		datalink_usage_add(dst, to, size, 1);
+	}
+}
+
+/*
+ * Raise an error when adding bytes and files to the base directory holding
+ * a file would exceed its quotas. The check is not atomic with the I/O that
+ * follows, concurrent copies can go a little over the quota.
+ */
+void
+datalink_usage_check(const char *path, int64 bytes, int64 files)
+{
+	UsageEntry *entry;
+	char        basepath[MAXPGPATH];
+	int64       usedbytes = 0;
+	int64       usedfiles = 0;
+	int64       maxbytes = 0;
+	int64       maxfiles = 0;
+	int         k;
+
+	if (usage_shared == NULL || (bytes <= 0 && files <= 0))
+		return;
+
+	usage_load_bases();
+	LWLockAcquire(usage_shared->lock, LW_SHARED);
+	entry = usage_find(path);
+	if (entry != NULL)
+	{
+		strlcpy(basepath, entry->path, MAXPGPATH);
+		maxbytes = entry->maxbytes;
+		maxfiles = entry->maxfiles;
+		for (k = 0; k < DL_USAGE_NKINDS; k++)
+		{
+			usedbytes += entry->bytes[k];
+			usedfiles += entry->files[k];
+		}
+	}
+	LWLockRelease(usage_shared->lock);
+
+	if (maxbytes > 0 && bytes > 0 && usedbytes + bytes > maxbytes)
+		ereport(ERROR,
+				(errcode(ERRCODE_DISK_FULL),
+				 errmsg("quota of base directory \"%s\" exceeded", basepath),
+				 errdetail("Writing " INT64_FORMAT " bytes would use " INT64_FORMAT " bytes of the " INT64_FORMAT " allowed.",
+						   bytes, usedbytes + bytes, maxbytes)));
+	if (maxfiles > 0 && files > 0 && usedfiles + files > maxfiles)
+		ereport(ERROR,
+				(errcode(ERRCODE_DISK_FULL),
+				 errmsg("quota of base directory \"%s\" exceeded", basepath),
+				 errdetail("Creating " INT64_FORMAT " files would use " INT64_FORMAT " files of the " INT64_FORMAT " allowed.",
+						   files, usedfiles + files, maxfiles)));
+}
+
+/*
+ * Move a file from a kind to another, used when the file referenced by a
+ * datalink changes without any file operation. The move is applied when
+ * the transaction commits. Returns false when the file is not counted.
+ */
+PG_FUNCTION_INFO_V1(datalink_usage_move);
+Datum
+datalink_usage_move(PG_FUNCTION_ARGS)
+{
+	char       *path = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	DatalinkUsageKind from = usage_kind_value(text_to_cstring(PG_GETARG_TEXT_PP(1)));
+	DatalinkUsageKind to = usage_kind_value(text_to_cstring(PG_GETARG_TEXT_PP(2)));
+	UsageEntry *entry;
+	UsageMove  *move;
+	MemoryContext oldcxt;
+	int         dirid = 0;
+	int64       size;
+
+	size = datalink_usage_size(path);
+	if (size < 0 || from == to)
+		PG_RETURN_BOOL(false);
+
+	usage_load_bases();
+	LWLockAcquire(usage_shared->lock, LW_SHARED);
+	entry = usage_find(path);
+	if (entry != NULL)
+		dirid = entry->key.dirid;
+	LWLockRelease(usage_shared->lock);
+	if (entry == NULL)
+		PG_RETURN_BOOL(false);
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	move = (UsageMove *) palloc(sizeof(UsageMove));
+	move->nestlevel = GetCurrentTransactionNestLevel();
+	move->dirid = dirid;
+	move->from = from;
+	move->to = to;
+	move->size = size;
+	usage_moves = lappend(usage_moves, move);
+	MemoryContextSwitchTo(oldcxt);
+	datalink_track_usage();
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Called when the current transaction ends, its moves are applied to the
+ * counters when it commits or is prepared, forgotten when it aborts.
+ */
+void
+datalink_usage_xact_end(bool commit)
+{
+	ListCell   *lc;
+
+	if (commit && usage_moves != NIL)
+	{
+		LWLockAcquire(usage_shared->lock, LW_EXCLUSIVE);
+		foreach(lc, usage_moves)
+		{
+			UsageMove  *move = (UsageMove *) lfirst(lc);
+			UsageEntry *entry;
+			UsageKey    key;
+
+			memset(&key, 0, sizeof(key));
+			key.dbid = MyDatabaseId;
+			key.dirid = move->dirid;
+			entry = (UsageEntry *) hash_search(usage_entries, &key, HASH_FIND, NULL);
+			if (entry == NULL)
+				continue;   /* base directory dropped meanwhile */
+			usage_update(entry, move->from, -move->size, -1);
+			usage_update(entry, move->to, move->size, 1);
+		}
+		LWLockRelease(usage_shared->lock);
+	}
+
+	/* memory is released with the transaction context */
+	usage_moves = NIL;
+}
+
+/*
+ * Called when a subtransaction ends, its moves are given to the parent when
+ * it commits and forgotten when it aborts.
+ */
+void
+datalink_usage_subxact_end(bool commit, int nestlevel)
+{
+	List       *keep = NIL;
+	ListCell   *lc;
+	MemoryContext oldcxt;
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	foreach(lc, usage_moves)
+	{
+		UsageMove  *move = (UsageMove *) lfirst(lc);
+
+		if (move->nestlevel >= nestlevel)
+		{
+			if (!commit)
+				continue;
+			move->nestlevel = nestlevel - 1;
+		}
+		keep = lappend(keep, move);
+	}
+	usage_moves = keep;
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Return the counters of the base directories of the current database kept
+ * in shared memory. When the argument is true they are being flushed and
+ * are marked as clean.
+ */
+PG_FUNCTION_INFO_V1(datalink_usage_counters);
+Datum
+datalink_usage_counters(PG_FUNCTION_ARGS)
+{
+	FuncCallContext    *funcctx;
+	UsageEntry         *entries;
+
+	if (SRF_IS_FIRSTCALL())
+	{
+		MemoryContext   oldcontext;
+		TupleDesc       tupdesc;
+		bool            flush = PG_GETARG_BOOL(0);
+		int             n = 0;
+
+		funcctx = SRF_FIRSTCALL_INIT();
+		oldcontext = MemoryContextSwitchTo(funcctx->multi_call_memory_ctx);
+
+		if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+			elog(ERROR, "return type must be a row type");
+		funcctx->tuple_desc = BlessTupleDesc(tupdesc);
+
+		/* Copy the entries so that the lock is not held between calls */
+		if (usage_shared != NULL)
+		{
+			HASH_SEQ_STATUS status;
+			UsageEntry     *entry;
+
+			usage_load_bases();
+			entries = (UsageEntry *) palloc(DL_USAGE_MAX_BASES * sizeof(UsageEntry));
+			LWLockAcquire(usage_shared->lock, flush ? LW_EXCLUSIVE : LW_SHARED);
+			hash_seq_init(&status, usage_entries);
+			while ((entry = (UsageEntry *) hash_seq_search(&status)) != NULL)
+			{
+				if (entry->key.dbid != MyDatabaseId || n >= DL_USAGE_MAX_BASES)
+					continue;
+				memcpy(&entries[n++], entry, sizeof(UsageEntry));
+				if (flush)
+				{
+					entry->dirty = false;
+					entry->flushed = GetCurrentTimestamp();
+				}
+			}
+			LWLockRelease(usage_shared->lock);
+			funcctx->user_fctx = entries;
+		}
+		funcctx->max_calls = n;
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	funcctx = SRF_PERCALL_SETUP();
+	entries = (UsageEntry *) funcctx->user_fctx;
+
+	if (funcctx->call_cntr < funcctx->max_calls)
+	{
+		UsageEntry *entry = &entries[funcctx->call_cntr];
+		Datum       values[1 + 2 * DL_USAGE_NKINDS];
+		bool        nulls[1 + 2 * DL_USAGE_NKINDS];
+		HeapTuple   tuple;
+		int         k;
+
+		memset(nulls, 0, sizeof(nulls));
+		values[0] = Int32GetDatum(entry->key.dirid);
+		for (k = 0; k < DL_USAGE_NKINDS; k++)
+		{
+			values[1 + 2 * k] = Int64GetDatum(entry->bytes[k]);
+			values[2 + 2 * k] = Int64GetDatum(entry->files[k]);
+		}
+		tuple = heap_form_tuple(funcctx->tuple_desc, values, nulls);
+
+		SRF_RETURN_NEXT(funcctx, HeapTupleGetDatum(tuple));
+	}
+
+	SRF_RETURN_DONE(funcctx);
+}
+
+/*
+ * Replace the counters of a base directory of the current database, used
+ * by dl_usage_rebuild(). Returns false when they are not kept in shared
+ * memory.
+ */
+PG_FUNCTION_INFO_V1(datalink_usage_set);
+Datum
+datalink_usage_set(PG_FUNCTION_ARGS)
+{
+	UsageKey    key;
+	UsageEntry *entry;
+	int         k;
+
+	if (usage_shared == NULL)
+		PG_RETURN_BOOL(false);
+
+	usage_load_bases();
+	memset(&key, 0, sizeof(key));
+	key.dbid = MyDatabaseId;
+	key.dirid = PG_GETARG_INT32(0);
+
+	LWLockAcquire(usage_shared->lock, LW_EXCLUSIVE);
+	entry = (UsageEntry *) hash_search(usage_entries, &key, HASH_FIND, NULL);
+	if (entry != NULL)
+	{
+		for (k = 0; k < DL_USAGE_NKINDS; k++)
+		{
+			entry->bytes[k] = PG_GETARG_INT64(1 + 2 * k);
+			entry->files[k] = PG_GETARG_INT64(2 + 2 * k);
+		}
+		entry->dirty = false;
+		entry->flushed = GetCurrentTimestamp();
+	}
+	LWLockRelease(usage_shared->lock);
+
+	PG_RETURN_BOOL(entry != NULL);
+}
+
+/*
+ * Start a worker flushing the counters of each database with changes not
+ * flushed for interval seconds, called by the main background worker.
+ */
+void
+datalink_usage_launch_flush(int interval)
+{
+	HASH_SEQ_STATUS status;
+	UsageEntry     *entry;
+	TimestampTz     now = GetCurrentTimestamp();
+	Oid             dbids[DL_USAGE_MAX_BASES];
+	int             ndbids = 0;
+	int             i;
+
+	if (usage_shared == NULL || interval <= 0)
+		return;
+
+	LWLockAcquire(usage_shared->lock, LW_EXCLUSIVE);
+	hash_seq_init(&status, usage_entries);
+	while ((entry = (UsageEntry *) hash_seq_search(&status)) != NULL)
+	{
+		if (!entry->dirty
+			|| !TimestampDifferenceExceeds(entry->flushed, now, interval * 1000))
+			continue;
+		for (i = 0; i < ndbids; i++)
+		{
+			if (dbids[i] == entry->key.dbid)
+				break;
+		}
+		if (i == ndbids && ndbids < DL_USAGE_MAX_BASES)
+			dbids[ndbids++] = entry->key.dbid;
+		/* do not ask again before the next interval */
+		entry->flushed = now;
+	}
+	LWLockRelease(usage_shared->lock);
+
+	for (i = 0; i < ndbids; i++)
+	{
+		BackgroundWorker        worker;
+		BackgroundWorkerHandle *handle;
+
+		memset(&worker, 0, sizeof(worker));
+		snprintf(worker.bgw_name, BGW_MAXLEN, "Datalink usage worker");
+#if PG_VERSION_NUM >= 110000
+		snprintf(worker.bgw_type, BGW_MAXLEN, "datalink usage worker");
+#endif
+		worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+		worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+		worker.bgw_restart_time = BGW_NEVER_RESTART;
+		snprintf(worker.bgw_library_name, BGW_MAXLEN, "datalink");
+		snprintf(worker.bgw_function_name, BGW_MAXLEN, "datalink_usage_worker_main");
+		worker.bgw_main_arg = ObjectIdGetDatum(dbids[i]);
+		worker.bgw_notify_pid = 0;
+
+		if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+			ereport(LOG,
+					(errmsg("could not start a datalink usage worker")));
+	}
+}
+
+/* Main function of a usage worker, the argument is the database oid */
+void
+datalink_usage_worker_main(Datum main_arg)
+{
+	Oid     dboid = DatumGetObjectId(main_arg);
+	int     ret;
+
+	pqsignal(SIGTERM, die);
+	BackgroundWorkerUnblockSignals();
+
+	BackgroundWorkerInitializeConnectionByOid(dboid, InvalidOid, 0);
+
+	SetCurrentStatementStartTimestamp();
+	StartTransactionCommand();
+	if ((ret = SPI_connect()) < 0)
+		elog(ERROR, "SPI_connect failed: %d", ret);
+	PushActiveSnapshot(GetTransactionSnapshot());
+	pgstat_report_activity(STATE_RUNNING, "SELECT dl_usage_flush()");
+
+	ret = SPI_execute("SELECT quote_ident(n.nspname) FROM pg_extension e"
+					  " JOIN pg_namespace n ON (n.oid = e.extnamespace)"
+					  " WHERE e.extname = 'datalink'", true, 1);
+	if (ret != SPI_OK_SELECT)
+		elog(ERROR, "could not look for the datalink extension: %d", ret);
+	if (SPI_processed > 0)
+	{
+		char   *nspname = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+		ret = SPI_execute(psprintf("SELECT %s.dl_usage_flush()", nspname), false, 1);
+		if (ret != SPI_OK_SELECT)
+			elog(ERROR, "dl_usage_flush() failed: %d", ret);
+	}
+
+	SPI_finish();
+	PopActiveSnapshot();
+	CommitTransactionCommand();
+	pgstat_report_activity(STATE_IDLE, NULL);
+
+	proc_exit(0);
+}
@@ -0,0 +1,899 @@
+/*
+ * datalink_xact.c
+ *
+ * Transaction tracking of the access control tokens registered by the
+ * datalink extension. Read tokens and write tokens are only valid while
+ * the transaction that has created them is in progress, so their files
+ * can be removed as soon as the transaction ends instead of waiting for
+ * the background worker to find them expired:
+ *
+ *   - on commit the symlinks of read tokens and the token files are
+ *     removed, copies of write tokens may be referenced and are kept;
+ *   - on abort the copies of write tokens are removed too;
+ *   - on subtransaction abort the same is done for the tokens registered
+ *     by the subtransaction.
+ *
+ * The background worker is only a safety net for backends that have
+ * crashed or transactions that have been prepared.
+ *
+ * The files of the datalinks unlinked by the statement level triggers are
+ * also queued here and only restored or removed when the transaction
+ * commits, sorted by path so that each directory is processed in one pass.
+ *
+ * Files written and directories modified by the transaction are recorded
+ * too and flushed together just before commit: writeback of all the files
+ * is started first, then each file is fdatasync'ed and each directory is
+ * fsync'ed once. The directories of the files of unlinked datalinks, only
+ * renamed or removed at commit, are fsync'ed once they have been processed.
+ *
+ * Transactions that have queued the datalinks of tables truncated or
+ * dropped register before they commit a worker that processes them once
+ * they have committed.
+ *
+ * With datalink.dl_read_token_scope set to transaction, the files handed
+ * out for reading share one read token and are linked into link
+ * directories named after it. The links are queued and created in batches,
+ * at the latest before a row of the outermost statement is sent or when it
+ * ends, and each link directory is removed as a whole when the transaction
+ * ends. They only live during
+ * the transaction so they are not flushed to disk.
+ *
+ * This program is open source, licensed under the PostgreSQL license.
+ * For license terms, see the COPYING file.
+ *
+ * Copyright (c) 2019 Gilles Darold
+ */
+
+#include "postgres.h"
+
+#include "access/xact.h"
+#include "catalog/pg_type.h"
+#include "fmgr.h"
+#include "nodes/pg_list.h"
+#include "storage/fd.h"
+#include "utils/array.h"
+#include "utils/builtins.h"
+#include "utils/memutils.h"
+
+#include "datalink.h"
+
+/* Token registered by the current transaction */
+typedef struct DatalinkXactToken
+{
+	char    mode;          /* R for read token or W for write token */
+	int     nestlevel;     /* transaction nesting level at registration */
+	char   *token_file;    /* token file, NULL for signed read tokens */
+	char   *dlpath;        /* symlink for read token, copy for write token */
+} DatalinkXactToken;
+
+/* File of a datalink unlinked by the current transaction */
+typedef struct DatalinkUnlinkOp
+{
+	int     nestlevel;     /* transaction nesting level at unlink */
+	bool    restore;       /* ON UNLINK RESTORE, rename the file back */
+	char   *path;          /* path of the datalink */
+	char   *token_path;    /* file renamed with its token, can be NULL */
+} DatalinkUnlinkOp;
+
+/* File or directory to flush before commit */
+typedef struct DatalinkSyncEntry
+{
+	bool    isdir;
+	char   *path;
+} DatalinkSyncEntry;
+
+/* Link of the transaction scoped read token waiting to be created */
+typedef struct DatalinkXactLink
+{
+	char   *link;          /* path of the link in its link directory */
+	char   *target;        /* file linked */
+} DatalinkXactLink;
+
+static List *xact_tokens = NIL;
+static List *xact_unlinks = NIL;
+static List *xact_syncs = NIL;
+static bool callbacks_registered = false;
+static bool xact_bulk_unlinks = false;
+
+/* Transaction scoped read token, NULL until the first file is handed out */
+static char *xact_read_token = NULL;
+static char *xact_token_file = NULL;
+static List *xact_link_dirs = NIL;
+static List *xact_links = NIL;
+
+Datum		datalink_queue_unlink(PG_FUNCTION_ARGS);
+Datum		datalink_xact_token(PG_FUNCTION_ARGS);
+Datum		datalink_xact_link(PG_FUNCTION_ARGS);
+
+static void register_xact_callbacks(void);
+static void datalink_xact_callback(XactEvent event, void *arg);
+static void datalink_subxact_callback(SubXactEvent event,
+		SubTransactionId mySubid, SubTransactionId parentSubid, void *arg);
+static bool remove_token_file(const char *path, const char *what);
+static void remove_write_copy(const char *path);
+static int  unlink_op_cmp(const void *a, const void *b);
+static void process_unlinks(void);
+static void sync_unlink_dir(const char *path, char *lastdir);
+static void add_sync_entry(const char *path, bool isdir);
+static int  sync_entry_cmp(const void *a, const void *b);
+static void process_syncs(void);
+static void remove_xact_links(void);
+
+/* Register the transaction callbacks the first time they are needed */
+static void
+register_xact_callbacks(void)
+{
+	if (callbacks_registered)
+		return;
+
+	RegisterXactCallback(datalink_xact_callback, NULL);
+	RegisterSubXactCallback(datalink_subxact_callback, NULL);
+	callbacks_registered = true;
+}
+
+/*
+ * Keep track of a token registered by the current transaction. The token
+ * file can be NULL when the token has not been written to disk.
+ */
+void
+datalink_track_token(char mode, const char *token_file, const char *dlpath)
+{
+	MemoryContext       oldcxt;
+	DatalinkXactToken  *tok;
+
+	register_xact_callbacks();
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	tok = (DatalinkXactToken *) palloc(sizeof(DatalinkXactToken));
+	tok->mode = mode;
+	tok->nestlevel = GetCurrentTransactionNestLevel();
+	tok->token_file = (token_file != NULL) ? pstrdup(token_file) : NULL;
+	tok->dlpath = pstrdup(dlpath);
+	xact_tokens = lappend(xact_tokens, tok);
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Record that the current transaction has queued files in table
+ * pg_datalink_unlink_queue, a worker is registered for them before commit.
+ */
+void
+datalink_track_bulk_unlinks(void)
+{
+	register_xact_callbacks();
+	xact_bulk_unlinks = true;
+}
+
+/*
+ * Record a file modified by the current transaction so that it is flushed
+ * to disk before commit. When data is false only the directory entry has
+ * changed (rename, symlink, unlink) and only the parent directory is
+ * flushed.
+ */
+void
+datalink_track_sync(const char *path, bool data)
+{
+	char   *dir;
+
+	register_xact_callbacks();
+
+	if (data)
+		add_sync_entry(path, false);
+
+	dir = pstrdup(path);
+	get_parent_directory(dir);
+	if (*dir != '\0')
+		add_sync_entry(dir, true);
+	pfree(dir);
+}
+
+/*
+ * Record a rename done by the current transaction, a file written before
+ * being renamed is flushed under its new name.
+ */
+void
+datalink_track_rename(const char *src, const char *dst)
+{
+	ListCell   *lc;
+	bool        found = false;
+
+	foreach(lc, xact_syncs)
+	{
+		DatalinkSyncEntry *entry = (DatalinkSyncEntry *) lfirst(lc);
+
+		if (!entry->isdir && strcmp(entry->path, src) == 0)
+		{
+			entry->path = MemoryContextStrdup(TopTransactionContext, dst);
+			found = true;
+		}
+	}
+
+	datalink_track_sync(src, false);
+	datalink_track_sync(dst, found);
+}
+
+/*
+ * Called when the current transaction has queued asynchronous copies, they
+ * are canceled if it aborts.
+ */
+void
+datalink_track_copies(void)
+{
+	register_xact_callbacks();
+}
+
+/*
+ * Called when the current transaction has moved files between the kinds of
+ * the usage counters, the moves are applied if it commits.
+ */
+void
+datalink_track_usage(void)
+{
+	register_xact_callbacks();
+}
+
+/* Append a file or a directory to the list of entries to flush */
+static void
+add_sync_entry(const char *path, bool isdir)
+{
+	MemoryContext       oldcxt;
+	DatalinkSyncEntry  *entry;
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	entry = (DatalinkSyncEntry *) palloc(sizeof(DatalinkSyncEntry));
+	entry->isdir = isdir;
+	entry->path = pstrdup(path);
+	xact_syncs = lappend(xact_syncs, entry);
+	MemoryContextSwitchTo(oldcxt);
+}
+
+/*
+ * Queue the files of the datalinks unlinked by a statement in a base
+ * directory, they are processed at commit. Arguments are the paths of the
+ * datalinks, the paths of the files renamed with their token (NULL when the
+ * datalink has no token) and whether the files must be restored. Returns
+ * the number of files queued.
+ */
+PG_FUNCTION_INFO_V1(datalink_queue_unlink);
+Datum
+datalink_queue_unlink(PG_FUNCTION_ARGS)
+{
+	ArrayType  *paths = PG_GETARG_ARRAYTYPE_P(0);
+	ArrayType  *token_paths = PG_GETARG_ARRAYTYPE_P(1);
+	bool        restore = PG_GETARG_BOOL(2);
+	Datum      *path_elems;
+	Datum      *token_elems;
+	bool       *path_nulls;
+	bool       *token_nulls;
+	int         npaths;
+	int         ntokens;
+	int         nestlevel = GetCurrentTransactionNestLevel();
+	int         i;
+	MemoryContext oldcxt;
+
+	deconstruct_array(paths, TEXTOID, -1, false, 'i',
+						&path_elems, &path_nulls, &npaths);
+	deconstruct_array(token_paths, TEXTOID, -1, false, 'i',
+						&token_elems, &token_nulls, &ntokens);
+	if (npaths != ntokens)
+		ereport(ERROR,
+				(errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+				 errmsg("arrays of paths and token paths must have the same size")));
+
+	register_xact_callbacks();
+
+	for (i = 0; i < npaths; i++)
+	{
+		DatalinkUnlinkOp   *op;
+		char               *path;
+		struct stat         st;
+
+		if (path_nulls[i])
+			continue;
+
+		/* The external file must still exist when it is unlinked */
+		path = TextDatumGetCString(path_elems[i]);
+		if (stat(path, &st) < 0)
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("Data location source file \"%s\" must exists on filesystem.", path)));
+
+		oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+		op = (DatalinkUnlinkOp *) palloc(sizeof(DatalinkUnlinkOp));
+		op->nestlevel = nestlevel;
+		op->restore = restore;
+		op->path = pstrdup(path);
+		op->token_path = token_nulls[i] ? NULL : TextDatumGetCString(token_elems[i]);
+		xact_unlinks = lappend(xact_unlinks, op);
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	PG_RETURN_INT32(npaths);
+}
+
+/* Sort unlink operations by path */
+static int
+unlink_op_cmp(const void *a, const void *b)
+{
+	const DatalinkUnlinkOp *opa = *(const DatalinkUnlinkOp * const *) a;
+	const DatalinkUnlinkOp *opb = *(const DatalinkUnlinkOp * const *) b;
+
+	return strcmp(opa->path, opb->path);
+}
+
+/*
+ * Flush the directory of a file renamed or removed at commit, unless it is
+ * the directory flushed by the previous call whose path is in lastdir. The
+ * transaction has already committed, a failure is only reported.
+ */
+static void
+sync_unlink_dir(const char *path, char *lastdir)
+{
+	char    dir[MAXPGPATH];
+	int     fd;
+
+	strlcpy(dir, path, MAXPGPATH);
+	get_parent_directory(dir);
+	if (*dir == '\0' || strcmp(dir, lastdir) == 0)
+		return;
+	strlcpy(lastdir, dir, MAXPGPATH);
+
+	fd = OpenTransientFile(dir, O_RDONLY | PG_BINARY);
+	if (fd < 0)
+	{
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not open directory \"%s\": %m", dir)));
+		return;
+	}
+	if (pg_fsync(fd) != 0)
+		ereport(data_sync_elevel(WARNING),
+				(errcode_for_file_access(),
+				 errmsg("could not fsync directory \"%s\": %m", dir)));
+	else
+		ereport(DEBUG1,
+				(errmsg("flushed directory \"%s\" of the unlinked datalinks", dir)));
+	CloseTransientFile(fd);
+}
+
+/*
+ * Restore or remove the files of the datalinks unlinked by the transaction.
+ * Operations are sorted by path and files to restore are all renamed before
+ * the links to remove are processed, then the directories modified are
+ * flushed. Called at commit, failures are only reported as warnings.
+ */
+static void
+process_unlinks(void)
+{
+	DatalinkUnlinkOp  **ops;
+	ListCell           *lc;
+	bool               *done;
+	char                lastdir[MAXPGPATH];
+	int                 nops = list_length(xact_unlinks);
+	int                 i = 0;
+
+	if (nops == 0)
+		return;
+
+	done = (bool *) palloc0(nops * sizeof(bool));
+
+	ops = (DatalinkUnlinkOp **) palloc(nops * sizeof(DatalinkUnlinkOp *));
+	foreach(lc, xact_unlinks)
+		ops[i++] = (DatalinkUnlinkOp *) lfirst(lc);
+	qsort(ops, nops, sizeof(DatalinkUnlinkOp *), unlink_op_cmp);
+
+	/* First pass: rename the files back to their original name */
+	for (i = 0; i < nops; i++)
+	{
+		int64   size;
+
+		if (!ops[i]->restore || ops[i]->token_path == NULL)
+			continue;
+		size = datalink_usage_size(ops[i]->token_path);
+		if (rename(ops[i]->token_path, ops[i]->path) < 0)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not rename file \"%s\" to \"%s\": %m",
+							ops[i]->token_path, ops[i]->path)));
+		else
+		{
+			datalink_usage_renamed(ops[i]->token_path, ops[i]->path, size, -1);
+			done[i] = true;
+		}
+	}
+
+	/* Second pass: just delete the links */
+	for (i = 0; i < nops; i++)
+	{
+		int64   size;
+
+		if (ops[i]->restore)
+			continue;
+		size = datalink_usage_size(ops[i]->path);
+		if (unlink(ops[i]->path) < 0)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not unlink file \"%s\": %m", ops[i]->path)));
+		else
+		{
+			datalink_usage_unlinked(ops[i]->path, size);
+			done[i] = true;
+		}
+	}
+
+	/*
+	 * Last pass: make the renames and removals durable, the operations are
+	 * sorted by path so the files of a directory follow each other.
+	 */
+	lastdir[0] = '\0';
+	for (i = 0; i < nops; i++)
+	{
+		if (done[i])
+			sync_unlink_dir(ops[i]->path, lastdir);
+	}
+	for (i = 0; i < nops; i++)
+	{
+		if (done[i] && ops[i]->token_path != NULL && ops[i]->restore)
+			sync_unlink_dir(ops[i]->token_path, lastdir);
+	}
+
+	pfree(done);
+	pfree(ops);
+}
+
+/* Sort entries to flush, files first, then by path */
+static int
+sync_entry_cmp(const void *a, const void *b)
+{
+	const DatalinkSyncEntry *ea = *(const DatalinkSyncEntry * const *) a;
+	const DatalinkSyncEntry *eb = *(const DatalinkSyncEntry * const *) b;
+
+	if (ea->isdir != eb->isdir)
+		return ea->isdir ? 1 : -1;
+
+	return strcmp(ea->path, eb->path);
+}
+
+/*
+ * Flush the files and directories modified by the transaction. Called
+ * before commit so a failure aborts the transaction. Files that have been
+ * removed since they were recorded are skipped.
+ */
+static void
+process_syncs(void)
+{
+	DatalinkSyncEntry **entries;
+	ListCell           *lc;
+	int                 nentries = list_length(xact_syncs);
+	int                 i = 0;
+	int                 fd;
+
+	if (nentries == 0)
+		return;
+
+	entries = (DatalinkSyncEntry **) palloc(nentries * sizeof(DatalinkSyncEntry *));
+	foreach(lc, xact_syncs)
+		entries[i++] = (DatalinkSyncEntry *) lfirst(lc);
+	qsort(entries, nentries, sizeof(DatalinkSyncEntry *), sync_entry_cmp);
+
+	/*
+	 * The files are opened read-only: they may not be writable by the server,
+	 * for example a linked file made read-only, and the writeback and
+	 * fdatasync() of a descriptor do not need write access.
+	 */
+
+	/* First pass: start the writeback of all the files */
+	for (i = 0; i < nentries; i++)
+	{
+		if (entries[i]->isdir ||
+			(i > 0 && sync_entry_cmp(&entries[i - 1], &entries[i]) == 0))
+			continue;
+		fd = OpenTransientFile(entries[i]->path, O_RDONLY | PG_BINARY);
+		if (fd < 0)
+			continue;
+		pg_flush_data(fd, 0, 0);
+		CloseTransientFile(fd);
+	}
+
+	/* Second pass: wait for the data of each file */
+	for (i = 0; i < nentries; i++)
+	{
+		if (entries[i]->isdir ||
+			(i > 0 && sync_entry_cmp(&entries[i - 1], &entries[i]) == 0))
+			continue;
+		fd = OpenTransientFile(entries[i]->path, O_RDONLY | PG_BINARY);
+		if (fd < 0)
+		{
+			if (errno == ENOENT)
+				continue;
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not open file \"%s\": %m", entries[i]->path)));
+		}
+		if (pg_fdatasync(fd) != 0)
+			ereport(data_sync_elevel(ERROR),
+					(errcode_for_file_access(),
+					 errmsg("could not fsync file \"%s\": %m", entries[i]->path)));
+		CloseTransientFile(fd);
+	}
+
+	/* Last pass: fsync each directory once */
+	for (i = 0; i < nentries; i++)
+	{
+		if (!entries[i]->isdir ||
+			(i > 0 && sync_entry_cmp(&entries[i - 1], &entries[i]) == 0))
+			continue;
+		fsync_fname(entries[i]->path, true);
+	}
+
+	pfree(entries);
+	xact_syncs = NIL;
+}
+
+/*
+ * Return the read token shared by the files handed out by the current
+ * transaction, it is generated and registered by the first call.
+ */
+PG_FUNCTION_INFO_V1(datalink_xact_token);
+Datum
+datalink_xact_token(PG_FUNCTION_ARGS)
+{
+	char            token_file[MAXPGPATH];
+	char           *token_str;
+	MemoryContext   oldcxt;
+
+	if (xact_read_token == NULL)
+	{
+		register_xact_callbacks();
+
+		token_str = datalink_new_xact_token(token_file, sizeof(token_file));
+		oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+		xact_read_token = pstrdup(token_str);
+		if (token_file[0] != '\0')
+			xact_token_file = pstrdup(token_file);
+		MemoryContextSwitchTo(oldcxt);
+	}
+
+	PG_RETURN_TEXT_P(cstring_to_text(xact_read_token));
+}
+
+/*
+ * Queue the link of a file into a link directory of the transaction scoped
+ * read token, the links are created in batches.
+ */
+PG_FUNCTION_INFO_V1(datalink_xact_link);
+Datum
+datalink_xact_link(PG_FUNCTION_ARGS)
+{
+	char               *link = text_to_cstring(PG_GETARG_TEXT_PP(0));
+	char               *target = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	char               *dir;
+	char               *suffix;
+	MemoryContext       oldcxt;
+	DatalinkXactLink   *xl;
+
+	/* The link must be in a link directory of the current transaction */
+	dir = pstrdup(link);
+	get_parent_directory(dir);
+	suffix = psprintf("/%s/%s", DATALINK_XACT_LINK_DIR,
+						(xact_read_token != NULL) ? xact_read_token : "");
+	if (xact_read_token == NULL || strlen(dir) < strlen(suffix) ||
+		strcmp(dir + strlen(dir) - strlen(suffix), suffix) != 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("\"%s\" is not in a link directory of the current transaction",
+						link)));
+
+	oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+	xl = (DatalinkXactLink *) palloc(sizeof(DatalinkXactLink));
+	xl->link = pstrdup(link);
+	xl->target = pstrdup(target);
+	xact_links = lappend(xact_links, xl);
+	MemoryContextSwitchTo(oldcxt);
+
+	if (list_length(xact_links) >= DATALINK_XACT_LINK_BATCH)
+		datalink_flush_xact_links();
+
+	PG_RETURN_BOOL(true);
+}
+
+/*
+ * Create the links queued for the transaction scoped read token. A link
+ * directory is created with the first link it receives. A file handed out
+ * twice is linked again to its current target.
+ */
+void
+datalink_flush_xact_links(void)
+{
+	char            dir[MAXPGPATH];
+	char            lastdir[MAXPGPATH];
+	ListCell       *lc;
+	ListCell       *lc2;
+	MemoryContext   oldcxt;
+	bool            found;
+
+	if (xact_links == NIL)
+		return;
+
+	lastdir[0] = '\0';
+	foreach(lc, xact_links)
+	{
+		DatalinkXactLink *xl = (DatalinkXactLink *) lfirst(lc);
+
+		strlcpy(dir, xl->link, sizeof(dir));
+		get_parent_directory(dir);
+		if (strcmp(dir, lastdir) != 0)
+		{
+			found = false;
+			foreach(lc2, xact_link_dirs)
+			{
+				if (strcmp((char *) lfirst(lc2), dir) == 0)
+				{
+					found = true;
+					break;
+				}
+			}
+			if (!found)
+			{
+				int     ret;
+				int     retry;
+
+				/*
+				 * The .dlxact directory is removed by the transaction that
+				 * empties it, it may vanish while the link directory is
+				 * created under it.
+				 */
+				for (retry = 0; retry < 3; retry++)
+				{
+					ret = pg_mkdir_p(dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+					if (ret == 0 || errno != ENOENT)
+						break;
+				}
+				if (ret != 0)
+					ereport(ERROR,
+							(errcode_for_file_access(),
+							 errmsg("could not create directory \"%s\": %m", dir)));
+				oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+				xact_link_dirs = lappend(xact_link_dirs, pstrdup(dir));
+				MemoryContextSwitchTo(oldcxt);
+			}
+			strlcpy(lastdir, dir, sizeof(lastdir));
+		}
+
+		if (symlink(xl->target, xl->link) != 0 &&
+			(errno != EEXIST || unlink(xl->link) != 0 ||
+			 symlink(xl->target, xl->link) != 0))
+			ereport(ERROR,
+					(errcode_for_file_access(),
+					 errmsg("could not symlink \"%s\" to file \"%s\": %m",
+							xl->link, xl->target)));
+	}
+
+	foreach(lc, xact_links)
+	{
+		DatalinkXactLink *xl = (DatalinkXactLink *) lfirst(lc);
+
+		pfree(xl->link);
+		pfree(xl->target);
+	}
+	list_free_deep(xact_links);
+	xact_links = NIL;
+}
+
+/*
+ * Remove the link directories of the transaction scoped read token and its
+ * token file. Failures are reported as warnings by rmtree(). The .dlxact
+ * directory holding a link directory is removed too when no other
+ * transaction uses it.
+ */
+static void
+remove_xact_links(void)
+{
+	ListCell   *lc;
+
+	foreach(lc, xact_link_dirs)
+	{
+		char   *dir = (char *) lfirst(lc);
+
+		(void) rmtree(dir, true);
+		get_parent_directory(dir);
+		if (rmdir(dir) != 0 && errno != ENOTEMPTY && errno != EEXIST && errno != ENOENT)
+			ereport(WARNING,
+					(errcode_for_file_access(),
+					 errmsg("could not remove directory \"%s\": %m", dir)));
+	}
+	if (xact_token_file != NULL)
+		remove_token_file(xact_token_file, "token file");
+
+	/* memory is released with the transaction context */
+	xact_read_token = NULL;
+	xact_token_file = NULL;
+	xact_link_dirs = NIL;
+	xact_links = NIL;
+}
+
+/*
+ * Remove the files of the tokens registered by the transaction when it ends.
+ * Errors are not allowed here, failures are just reported as warnings and
+ * the remaining files will be removed by the background worker.
+ */
+static void
+datalink_xact_callback(XactEvent event, void *arg)
+{
+	ListCell   *lc;
+
+	switch (event)
+	{
+		case XACT_EVENT_COMMIT:
+		case XACT_EVENT_PARALLEL_COMMIT:
+			datalink_reset_copies();
+			datalink_usage_xact_end(true);
+			process_unlinks();
+			remove_xact_links();
+			foreach(lc, xact_tokens)
+			{
+				DatalinkXactToken *tok = (DatalinkXactToken *) lfirst(lc);
+
+				if (tok->mode == 'R')
+					remove_token_file(tok->dlpath, "symlink");
+				if (tok->token_file != NULL)
+					remove_token_file(tok->token_file, "token file");
+			}
+			break;
+		case XACT_EVENT_ABORT:
+		case XACT_EVENT_PARALLEL_ABORT:
+			/* Stop the copies of the write tokens before removing them */
+			datalink_cancel_copies();
+			datalink_usage_xact_end(false);
+			remove_xact_links();
+			foreach(lc, xact_tokens)
+			{
+				DatalinkXactToken *tok = (DatalinkXactToken *) lfirst(lc);
+
+				if (tok->mode == 'R')
+					remove_token_file(tok->dlpath, "symlink");
+				else
+					remove_write_copy(tok->dlpath);
+				if (tok->token_file != NULL)
+					remove_token_file(tok->token_file, "token file");
+			}
+			break;
+		case XACT_EVENT_PRE_COMMIT:
+		case XACT_EVENT_PARALLEL_PRE_COMMIT:
+			process_syncs();
+			/* The worker waits for the commit, nothing waits for it here */
+			if (xact_bulk_unlinks)
+				datalink_launch_unlink_worker();
+			return;
+		case XACT_EVENT_PRE_PREPARE:
+			/* Files of unlinked datalinks can not be left to another session */
+			if (xact_unlinks != NIL)
+				ereport(ERROR,
+						(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+						 errmsg("cannot PREPARE a transaction that has unlinked datalinks")));
+			process_syncs();
+			return;
+		case XACT_EVENT_PREPARE:
+			datalink_reset_copies();
+			datalink_usage_xact_end(true);
+			/* Link directories can not be found by the background worker */
+			remove_xact_links();
+			/*
+			 * The transaction is still in progress, registered tokens are
+			 * left to the background worker. Symlinks of signed read tokens
+			 * can not be found by it, they are removed now.
+			 */
+			foreach(lc, xact_tokens)
+			{
+				DatalinkXactToken *tok = (DatalinkXactToken *) lfirst(lc);
+
+				if (tok->mode == 'R' && tok->token_file == NULL)
+					remove_token_file(tok->dlpath, "symlink");
+			}
+			break;
+		default:
+			return;
+	}
+
+	/* memory is released with the transaction context */
+	xact_tokens = NIL;
+	xact_unlinks = NIL;
+	xact_syncs = NIL;
+	xact_bulk_unlinks = false;
+}
+
+/*
+ * On subtransaction abort remove the files of the tokens it has registered,
+ * on commit the tokens are given to the parent transaction.
+ */
+static void
+datalink_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+						SubTransactionId parentSubid, void *arg)
+{
+	int         nestlevel = GetCurrentTransactionNestLevel();
+	List       *keep = NIL;
+	ListCell   *lc;
+	MemoryContext oldcxt;
+
+	switch (event)
+	{
+		case SUBXACT_EVENT_COMMIT_SUB:
+			foreach(lc, xact_tokens)
+			{
+				DatalinkXactToken *tok = (DatalinkXactToken *) lfirst(lc);
+
+				if (tok->nestlevel >= nestlevel)
+					tok->nestlevel = nestlevel - 1;
+			}
+			foreach(lc, xact_unlinks)
+			{
+				DatalinkUnlinkOp *op = (DatalinkUnlinkOp *) lfirst(lc);
+
+				if (op->nestlevel >= nestlevel)
+					op->nestlevel = nestlevel - 1;
+			}
+			datalink_usage_subxact_end(true, nestlevel);
+			break;
+		case SUBXACT_EVENT_ABORT_SUB:
+			oldcxt = MemoryContextSwitchTo(TopTransactionContext);
+			foreach(lc, xact_tokens)
+			{
+				DatalinkXactToken *tok = (DatalinkXactToken *) lfirst(lc);
+
+				if (tok->nestlevel < nestlevel)
+				{
+					keep = lappend(keep, tok);
+					continue;
+				}
+				if (tok->mode == 'R')
+					remove_token_file(tok->dlpath, "symlink");
+				else
+					remove_write_copy(tok->dlpath);
+				if (tok->token_file != NULL)
+					remove_token_file(tok->token_file, "token file");
+			}
+			xact_tokens = keep;
+
+			/* Unlinks of the subtransaction are just forgotten */
+			keep = NIL;
+			foreach(lc, xact_unlinks)
+			{
+				DatalinkUnlinkOp *op = (DatalinkUnlinkOp *) lfirst(lc);
+
+				if (op->nestlevel < nestlevel)
+					keep = lappend(keep, op);
+			}
+			xact_unlinks = keep;
+			MemoryContextSwitchTo(oldcxt);
+			datalink_usage_subxact_end(false, nestlevel);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Remove a file, it is not an error if it has already been removed. Returns
+ * true when the file has been removed.
+ */
+static bool
+remove_token_file(const char *path, const char *what)
+{
+	if (unlink(path) == 0)
+		return true;
+	if (errno != ENOENT)
+		ereport(WARNING,
+				(errcode_for_file_access(),
+				 errmsg("could not remove %s \"%s\": %m", what, path)));
+	return false;
+}
+
+/* Remove the copy of a write token, it is no more pending */
+static void
+remove_write_copy(const char *path)
+{
+	int64   size = datalink_usage_size(path);
+
+	if (remove_token_file(path, "external file") && size >= 0)
+		datalink_usage_add(path, DL_USAGE_PENDING, -size, -1);
+}
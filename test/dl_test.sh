@@ -17,6 +17,15 @@ init_test () {
 	mkdir out/ 2>/dev/null
 }
 
+# Run a test in a new temporary directory and show the differences between
+# its output and the expected one
+run_test () {
+	init_test
+	echo "Running $2 tests..."
+	psql -f sql/dl_$1.sql > out/dl_$1.out 2>&1
+	diff out/dl_$1.out expected/dl_$1.out | grep -vE "^---|^[0-9,]+[a-f][0-9,]+"
+}
+
 # Recompile and reinstall the extension
 echo "Recompile and install the Datalink extension..."
 cd ../
@@ -39,6 +48,31 @@ psql -f sql/dl_advanced.sql > out/dl_advanced.out 2>&1
 perl -p -i -e 's/.* ...\s+\d{1,2}\s+\d{2}:\d{2} / /' out/dl_advanced.out
 diff out/dl_advanced.out expected/dl_advanced.out | sed 's/... .. ..:..//' | grep -v " \.\.$" | grep -vE "........-....-....-....|^---|^[0-9,]+[a-f][0-9,]+|postgres postgres"
 
+run_test token "signed token"
+run_test cleanup "transaction end"
+run_test layout "token layout"
+run_test unlink "unlink"
+run_test type "type"
+run_test audit "audit"
+run_test export "export"
+run_test changes "changes"
+run_test io "I/O"
+run_test lock "lock"
+run_test objcache "object cache"
+run_test copy "asynchronous copy"
+run_test command "statement type"
+run_test snapshot "snapshot"
+run_test tier "tiered storage"
+run_test xact "transaction scoped token"
+run_test usage "usage"
+
+# The remote files are served by a local HTTP server
+python3 -m http.server 8081 --bind 127.0.0.1 --directory files >/dev/null 2>&1 &
+HTTP_PID=$!
+sleep 1
+run_test remote "remote"
+kill $HTTP_PID
+
 #rm -rf out/
 #rm -rf /tmp/test_datalink/
 #rm -f /tmp/img2.png
@@ -431,3 +431,12 @@ SELECT * FROM dl_example WHERE ex_id=4;
 \echo --------------------------------------------------------------------------------
 SELECT * FROM pg_datalink_archives;
 
+
+\echo --------------------------------------------------------------------------------
+\echo Delete the record with ON UNLINK RESTORE, file6.txt is restored at commit and
+\echo its directory must be flushed to disk after the rename
+\echo --------------------------------------------------------------------------------
+SET client_min_messages TO debug1;
+DELETE FROM dl_example WHERE ex_id = 4;
+RESET client_min_messages;
+\! ls /tmp/test_datalink/ | grep -c '^file6.txt$'
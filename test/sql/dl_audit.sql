@@ -0,0 +1,54 @@
+------------------------------------------------------------------------------
+-- Audit of the files of the datalinks with link control
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control, files are restored when unlinked
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_audit.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+
+CREATE TABLE dl_audit (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+INSERT INTO dl_audit VALUES (1, dlvalue('file2.txt'::uri, 'public.dl_audit.efile'::text, 'First file'::text));
+INSERT INTO dl_audit VALUES (2, dlvalue('file3.txt'::uri, 'public.dl_audit.efile'::text, 'Second file'::text));
+INSERT INTO dl_audit VALUES (3, dlvalue('file4.txt'::uri, 'public.dl_audit.efile'::text, 'Third file'::text));
+
+\echo --------------------------------------------------------------------------------
+\echo All the files of the datalinks are found
+\echo --------------------------------------------------------------------------------
+SELECT * FROM dl_audit('dl_audit') ORDER BY ctid;
+
+\echo --------------------------------------------------------------------------------
+\echo A file whose size has changed since the last dl_changes() is reported
+\echo --------------------------------------------------------------------------------
+SELECT count(*) > 0 FROM dl_changes();
+\! sudo -u postgres sh -c 'echo changed >> /tmp/test_datalink/*\;file3.txt'
+SELECT * FROM dl_audit('dl_audit') ORDER BY ctid;
+
+\echo --------------------------------------------------------------------------------
+\echo A file removed behind the database's back is reported as missing
+\echo --------------------------------------------------------------------------------
+\! sudo -u postgres sh -c 'rm /tmp/test_datalink/*\;file4.txt'
+SELECT * FROM dl_audit('dl_audit') ORDER BY ctid;
+
+\echo --------------------------------------------------------------------------------
+\echo A copy named with a token created since less than the token expiry may be in
+\echo use by a transaction, it is not reported as an orphan
+\echo --------------------------------------------------------------------------------
+\! sudo -u postgres cp /tmp/test_datalink/file5.txt '/tmp/test_datalink/9d0b3b9c-7c8e-4b0e-9c53-1f4b1d0d2e7a;file5.txt'
+SELECT * FROM dl_audit('dl_audit') ORDER BY ctid;
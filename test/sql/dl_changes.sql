@@ -0,0 +1,58 @@
+------------------------------------------------------------------------------
+-- Changes of the files of the base directories
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control holding only the files of the test
+\! sudo -u postgres sh -c 'mkdir -p /tmp/test_datalink/changes/sub && cp /tmp/test_datalink/file2.txt /tmp/test_datalink/file3.txt /tmp/test_datalink/changes/ && cp /tmp/test_datalink/file4.txt /tmp/test_datalink/changes/sub/'
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_changes.efile', 'file:///tmp/test_datalink/changes/', true, true, true, true, true, true, false, 'RESTORE');
+
+CREATE TABLE dl_changes (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+INSERT INTO dl_changes VALUES (1, dlvalue('file2.txt'::uri, 'public.dl_changes.efile'::text, 'First file'::text));
+INSERT INTO dl_changes VALUES (2, dlvalue('file3.txt'::uri, 'public.dl_changes.efile'::text, 'Second file'::text));
+
+\echo --------------------------------------------------------------------------------
+\echo The first call reports all the files as created, the next one finds nothing
+\echo --------------------------------------------------------------------------------
+SELECT dirname, regexp_replace(url, '[0-9a-f-]{36};', 'token;') AS url, change FROM dl_changes() ORDER BY url;
+SELECT count(*) FROM dl_changes();
+
+\echo --------------------------------------------------------------------------------
+\echo Files created, modified, replaced or deleted behind the database's back
+\echo --------------------------------------------------------------------------------
+\! sudo -u postgres sh -c 'echo changed >> /tmp/test_datalink/changes/*\;file3.txt'
+\! sudo -u postgres sh -c 'cp /tmp/test_datalink/file4.txt /tmp/test_datalink/changes/file2.tmp && mv /tmp/test_datalink/changes/file2.tmp /tmp/test_datalink/changes/*\;file2.txt'
+\! sudo -u postgres sh -c 'rm /tmp/test_datalink/changes/sub/file4.txt && cp /tmp/test_datalink/file5.txt /tmp/test_datalink/changes/sub/'
+SELECT dirname, regexp_replace(url, '[0-9a-f-]{36};', 'token;') AS url, change FROM dl_changes('public.dl_changes.efile', false) ORDER BY url;
+
+\echo --------------------------------------------------------------------------------
+\echo The datalinks of the files changed are found, the snapshot is then updated
+\echo --------------------------------------------------------------------------------
+SELECT relid, attname, ctid, change FROM dl_changed_links() ORDER BY ctid;
+SELECT count(*) FROM dl_changes();
+
+\echo --------------------------------------------------------------------------------
+\echo A subdirectory that cannot be read makes the call fail instead of reporting
+\echo its files as deleted
+\echo --------------------------------------------------------------------------------
+\! sudo -u postgres chmod 000 /tmp/test_datalink/changes/sub
+SELECT count(*) FROM dl_changes();
+\! sudo -u postgres chmod 755 /tmp/test_datalink/changes/sub
+SELECT count(*) FROM pg_datalink_snapshots WHERE path LIKE 'sub/%';
@@ -0,0 +1,60 @@
+------------------------------------------------------------------------------
+-- Removal of the token files, read links and write copies at transaction end
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control and write tokens
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_cleanup.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+
+CREATE TABLE dl_cleanup (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+INSERT INTO dl_cleanup VALUES (1, dlvalue('file2.txt'::uri, 'public.dl_cleanup.efile'::text, 'First file'::text));
+INSERT INTO dl_cleanup VALUES (2, dlvalue('file3.txt'::uri, 'public.dl_cleanup.efile'::text, 'Second file'::text));
+
+\echo --------------------------------------------------------------------------------
+\echo A rolled back transaction removes its token files, read links and write copies
+\echo --------------------------------------------------------------------------------
+BEGIN;
+SELECT dlurlcomplete(efile) IS NOT NULL AS read_url FROM dl_cleanup WHERE id = 1;
+SELECT dlurlcompletewrite(efile) IS NOT NULL AS write_url FROM dl_cleanup WHERE id = 2;
+\! ls /tmp/test_datalink/pg_dltoken/ | wc -l
+\! ls /tmp/test_datalink/ | grep -c ';'
+ROLLBACK;
+\! ls /tmp/test_datalink/pg_dltoken/ | wc -l
+\! ls /tmp/test_datalink/ | grep -c ';'
+
+\echo --------------------------------------------------------------------------------
+\echo A rolled back savepoint removes the files of its tokens only
+\echo --------------------------------------------------------------------------------
+BEGIN;
+SELECT dlurlcomplete(efile) IS NOT NULL AS read_url FROM dl_cleanup WHERE id = 1;
+SAVEPOINT sp1;
+SELECT dlurlcompletewrite(efile) IS NOT NULL AS write_url FROM dl_cleanup WHERE id = 2;
+\! ls /tmp/test_datalink/ | grep -c ';'
+ROLLBACK TO SAVEPOINT sp1;
+\! ls /tmp/test_datalink/pg_dltoken/ | wc -l
+\! ls /tmp/test_datalink/ | grep -c ';'
+
+\echo --------------------------------------------------------------------------------
+\echo At commit the read links and the token files are removed
+\echo --------------------------------------------------------------------------------
+COMMIT;
+\! ls /tmp/test_datalink/pg_dltoken/ | wc -l
+\! ls /tmp/test_datalink/ | grep -c ';'
+\! ls /tmp/test_datalink/
@@ -0,0 +1,55 @@
+------------------------------------------------------------------------------
+-- Statement type seen by dlvalue() and dlnewcopy()
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with no link control, the files are not touched
+INSERT INTO pg_datalink_bases (dirname, base) VALUES ('public.dl_command.efile', 'file:///tmp/test_datalink/');
+
+CREATE TABLE dl_command (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+
+\echo --------------------------------------------------------------------------------
+\echo The command type is the one of the statement running, not guessed from the
+\echo query text: comments looking like an update or an insert are accepted
+\echo --------------------------------------------------------------------------------
+SELECT datalink_current_command();
+INSERT INTO dl_command VALUES
+	(1, dlvalue('file2.txt'::uri, 'public.dl_command.efile'::text, 'efile = dlvalue()'::text)),
+	(2, dlvalue('file3.txt'::uri, 'public.dl_command.efile'::text, 'Second file'::text));
+UPDATE dl_command SET efile = dlvalue(efile, 'file4.txt'::uri, 'public.dl_command.efile'::text, 'replaces (dlvalue'::text) WHERE id = 2;
+SELECT id, dlurlpathonly(efile), dlcomment(efile) FROM dl_command ORDER BY id;
+
+\echo --------------------------------------------------------------------------------
+\echo A cursor opened before an INSERT keeps its own command type
+\echo --------------------------------------------------------------------------------
+BEGIN;
+DECLARE c CURSOR FOR SELECT datalink_current_command() FROM generate_series(1, 2);
+FETCH 1 FROM c;
+INSERT INTO dl_command VALUES (3, dlvalue('file5.txt'::uri, 'public.dl_command.efile'::text, 'Third file'::text));
+FETCH 1 FROM c;
+COMMIT;
+
+\echo --------------------------------------------------------------------------------
+\echo Errors: each form of dlvalue() in the wrong statement and dlnewcopy()
+\echo outside of an UPDATE
+\echo --------------------------------------------------------------------------------
+UPDATE dl_command SET efile = dlvalue('file5.txt'::uri, 'public.dl_command.efile'::text, 'Wrong form'::text) WHERE id = 1;
+INSERT INTO dl_command SELECT 4, dlvalue(efile, 'file5.txt'::uri, 'public.dl_command.efile'::text, 'Wrong form'::text) FROM dl_command WHERE id = 1;
+SELECT dlnewcopy(efile, 'file5.txt'::uri, false) FROM dl_command WHERE id = 1;
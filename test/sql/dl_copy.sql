@@ -0,0 +1,70 @@
+------------------------------------------------------------------------------
+-- Asynchronous copies for the write tokens, needs shared_preload_libraries
+-- = 'datalink'
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control, files are restored when unlinked
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_copy.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+
+CREATE TABLE dl_copy (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+INSERT INTO dl_copy VALUES (1, dlvalue('file2.txt'::uri, 'public.dl_copy.efile'::text, 'First file'::text));
+
+-- Copies are done by the copy workers
+ALTER SYSTEM SET datalink.dl_copy_workers = 2;
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+SHOW datalink.dl_copy_workers;
+
+\echo --------------------------------------------------------------------------------
+\echo A queued copy is shown by pg_datalink_copies until its result is collected
+\echo --------------------------------------------------------------------------------
+SELECT datalink_queue_copy('/tmp/test_datalink/img1.png', '/tmp/test_datalink/img1.png.copy');
+SELECT src, state IN ('queued', 'running', 'done') AS pending, bytes_total
+	FROM pg_datalink_copies WHERE dst = '/tmp/test_datalink/img1.png.copy';
+SELECT datalink_wait_copy('/tmp/test_datalink/img1.png.copy');
+SELECT count(*) FROM pg_datalink_copies WHERE dst = '/tmp/test_datalink/img1.png.copy';
+SELECT pg_read_binary_file('/tmp/test_datalink/img1.png.copy') = pg_read_binary_file('/tmp/test_datalink/img1.png') AS same;
+
+\echo --------------------------------------------------------------------------------
+\echo dlwritefile() waits for the copy queued by dlurlcompletewrite()
+\echo --------------------------------------------------------------------------------
+SELECT dlurlcompletewrite(efile) AS wuri FROM dl_copy WHERE id = 1 \gset
+SELECT dlwritefile(efile, :'wuri'::uri, 'Hello world'::bytea) FROM dl_copy WHERE id = 1;
+SELECT count(*) FROM pg_datalink_copies WHERE dst = uri_get_path(:'wuri'::uri);
+
+\echo --------------------------------------------------------------------------------
+\echo Errors: the source file is checked before queuing, the error of a copy
+\echo worker is raised by the wait
+\echo --------------------------------------------------------------------------------
+SELECT datalink_queue_copy('/tmp/test_datalink/nofile.txt', '/tmp/test_datalink/nofile.txt.copy');
+SELECT datalink_queue_copy('/tmp/test_datalink/file4.txt', '/tmp/test_datalink/pg_dltoken');
+SELECT datalink_wait_copy('/tmp/test_datalink/pg_dltoken');
+SELECT count(*) FROM pg_datalink_copies WHERE dst = '/tmp/test_datalink/pg_dltoken';
+
+ALTER SYSTEM RESET datalink.dl_copy_workers;
+SELECT pg_reload_conf();
+
+\echo --------------------------------------------------------------------------------
+\echo Copies are only queued for the files of a write token, through
+\echo dlurlcompletewrite()
+\echo --------------------------------------------------------------------------------
+SELECT has_function_privilege('public', 'datalink_queue_copy(text, text)', 'EXECUTE') AS queue_copy;
+SELECT dl_queue_copy('/tmp/test_datalink/file4.txt', '/tmp/test_datalink/file5.txt');
@@ -0,0 +1,50 @@
+------------------------------------------------------------------------------
+-- Export of the linked files as a tar archive
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control, files are renamed with their token
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_export.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+
+CREATE TABLE dl_export (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+INSERT INTO dl_export VALUES (1, dlvalue('file2.txt'::uri, 'public.dl_export.efile'::text, 'First file'::text));
+INSERT INTO dl_export VALUES (2, dlvalue('file3.txt'::uri, 'public.dl_export.efile'::text, 'Second file'::text));
+
+\echo --------------------------------------------------------------------------------
+\echo The archive is returned by chunks, a header and the content of each file
+\echo padded to 512 bytes, then the two empty blocks of the end of the archive
+\echo --------------------------------------------------------------------------------
+SELECT count(*) AS chunks, sum(length(c)) AS size FROM dl_export('SELECT efile FROM dl_export ORDER BY id') c;
+
+\echo --------------------------------------------------------------------------------
+\echo The archive written to a server file holds the files under their datalink
+\echo path, not under the name with the token they have on disk
+\echo --------------------------------------------------------------------------------
+SELECT dl_export_to_file('SELECT efile FROM dl_export ORDER BY id', '/tmp/test_datalink/dl_export.tar');
+\! sudo -u postgres tar tf /tmp/test_datalink/dl_export.tar
+\! sudo -u postgres tar xOf /tmp/test_datalink/dl_export.tar tmp/test_datalink/file3.txt
+SELECT string_agg(c, ''::bytea) = pg_read_binary_file('/tmp/test_datalink/dl_export.tar') AS same
+	FROM dl_export('SELECT efile FROM dl_export ORDER BY id') c;
+
+\echo --------------------------------------------------------------------------------
+\echo Errors
+\echo --------------------------------------------------------------------------------
+SELECT count(*) FROM dl_export('SELECT efile FROM dl_export', 'gzip');
+SELECT dl_export_to_file('SELECT efile FROM dl_export', 'dl_export.tar');
@@ -0,0 +1,68 @@
+------------------------------------------------------------------------------
+-- I/O of the file functions, needs shared_preload_libraries = 'datalink'
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control, files are restored when unlinked
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_io.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+
+\echo --------------------------------------------------------------------------------
+\echo Reads are throttled to the bandwidth of the base directory, 3 reads of the
+\echo 7279 bytes of img1.png at 8000 bytes per second last more than one second
+\echo --------------------------------------------------------------------------------
+UPDATE pg_datalink_bases SET maxbandwidth = 8000 WHERE dirid = 1;
+SELECT clock_timestamp() AS start \gset
+SELECT sum(length(datalink_read_localfile('/tmp/test_datalink/img1.png', 0 * i, 7279))) FROM generate_series(1, 3) i;
+SELECT clock_timestamp() - :'start'::timestamptz >= interval '1 second' AS throttled;
+
+\echo --------------------------------------------------------------------------------
+\echo A lowered limit applies at once to the bucket filled with the previous one
+\echo --------------------------------------------------------------------------------
+UPDATE pg_datalink_bases SET maxbandwidth = 1000000 WHERE dirid = 1;
+SELECT sum(length(datalink_read_localfile('/tmp/test_datalink/img1.png', 0 * i, 7279))) FROM generate_series(1, 3) i;
+UPDATE pg_datalink_bases SET maxbandwidth = 8000 WHERE dirid = 1;
+SELECT clock_timestamp() AS start \gset
+SELECT sum(length(datalink_read_localfile('/tmp/test_datalink/img1.png', 0 * i, 7279))) FROM generate_series(1, 3) i;
+SELECT clock_timestamp() - :'start'::timestamptz >= interval '1 second' AS throttled;
+
+\echo --------------------------------------------------------------------------------
+\echo Without limit the reads are not throttled anymore
+\echo --------------------------------------------------------------------------------
+UPDATE pg_datalink_bases SET maxbandwidth = 0 WHERE dirid = 1;
+SELECT clock_timestamp() AS start \gset
+SELECT sum(length(datalink_read_localfile('/tmp/test_datalink/img1.png', 0 * i, 7279))) FROM generate_series(1, 3) i;
+SELECT clock_timestamp() - :'start'::timestamptz < interval '1 second' AS throttled;
+
+\echo --------------------------------------------------------------------------------
+\echo Range reads in a transaction are served by the file kept open, the ranges
+\echo put together give the content of the file
+\echo --------------------------------------------------------------------------------
+BEGIN;
+SELECT convert_from(datalink_read_localfile('/tmp/test_datalink/file2.txt', 0, 14), 'UTF8') AS first;
+SELECT convert_from(datalink_read_localfile('/tmp/test_datalink/file2.txt', 15, 4), 'UTF8') AS second;
+SELECT convert_from(datalink_read_localfile('/tmp/test_datalink/file2.txt', -10, 9), 'UTF8') AS last;
+SELECT string_agg(datalink_read_localfile('/tmp/test_datalink/file2.txt', (i - 1) * 10, 10), ''::bytea ORDER BY i)
+	= datalink_read_localfile('/tmp/test_datalink/file2.txt', 0, -1) AS same
+	FROM generate_series(1, 5) i;
+
+\echo --------------------------------------------------------------------------------
+\echo A file renamed over the one kept open is read at the next call
+\echo --------------------------------------------------------------------------------
+\! sudo -u postgres sh -c 'cp /tmp/test_datalink/file3.txt /tmp/test_datalink/file2.txt.new && mv /tmp/test_datalink/file2.txt.new /tmp/test_datalink/file2.txt'
+SELECT length(datalink_read_localfile('/tmp/test_datalink/file2.txt', 0, -1));
+SELECT convert_from(datalink_read_localfile('/tmp/test_datalink/file2.txt', -10, 9), 'UTF8') AS last;
+COMMIT;
@@ -0,0 +1,70 @@
+------------------------------------------------------------------------------
+-- Migration of the files named with a token between the flat and the hashed
+-- layout
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control and write tokens
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_layout.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+
+CREATE TABLE dl_layout (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+INSERT INTO dl_layout VALUES (1, dlvalue('file2.txt'::uri, 'public.dl_layout.efile'::text, 'First file'::text));
+
+\echo --------------------------------------------------------------------------------
+\echo The new version of a linked file is named with its token
+\echo --------------------------------------------------------------------------------
+BEGIN;
+SELECT dlurlcompletewrite(efile) AS wuri FROM dl_layout WHERE id = 1 \gset
+SELECT dlwritefile(efile, :'wuri'::uri, 'New content'::bytea) FROM dl_layout WHERE id = 1;
+UPDATE dl_layout SET efile = dlnewcopy(efile, :'wuri'::uri, true) WHERE id = 1;
+COMMIT;
+\! ls /tmp/test_datalink/ | grep -c ';file2.txt$'
+
+\echo --------------------------------------------------------------------------------
+\echo Migration to the hashed layout, the datalink still resolves to the new version
+\echo --------------------------------------------------------------------------------
+ALTER SYSTEM SET datalink.dl_token_layout = 'hashed';
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+SELECT dl_migrate_token_layout();
+\! ls /tmp/test_datalink/ | grep -c ';file2.txt$'
+\! ls /tmp/test_datalink/.dl/*/*/ | grep -c ';file2.txt$'
+BEGIN;
+SELECT regexp_replace(dlurlcomplete(efile), '[0-9a-f]{2}/[0-9a-f]{2}/[0-9a-f-]{36}', 'xx/yy/TOKEN') AS url FROM dl_layout WHERE id = 1;
+SELECT convert_from(dlreadfile(efile, dlurlcomplete(efile)::uri), 'UTF8') AS content FROM dl_layout WHERE id = 1;
+COMMIT;
+
+\echo --------------------------------------------------------------------------------
+\echo Migration back to the flat layout removes the emptied fan-out directories
+\echo --------------------------------------------------------------------------------
+ALTER SYSTEM SET datalink.dl_token_layout = 'flat';
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+SELECT dl_migrate_token_layout();
+\! ls /tmp/test_datalink/ | grep -c ';file2.txt$'
+\! ls -a /tmp/test_datalink/ | grep -c '^\.dl$'
+\! ls /tmp/test_datalink/pg_dltoken/ | wc -l
+BEGIN;
+SELECT regexp_replace(dlurlcomplete(efile), '[0-9a-f-]{36}', 'TOKEN') AS url FROM dl_layout WHERE id = 1;
+SELECT convert_from(dlreadfile(efile, dlurlcomplete(efile)::uri), 'UTF8') AS content FROM dl_layout WHERE id = 1;
+COMMIT;
+
+ALTER SYSTEM RESET datalink.dl_token_layout;
+SELECT pg_reload_conf();
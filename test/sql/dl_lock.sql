@@ -0,0 +1,73 @@
+------------------------------------------------------------------------------
+-- Locks of the external files between sessions, needs
+-- shared_preload_libraries = 'datalink'
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control, the writes are throttled to last long
+-- enough for the other sessions to find the file locked
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_lock.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+UPDATE pg_datalink_bases SET maxbandwidth = 8000 WHERE dirid = 1;
+
+\echo --------------------------------------------------------------------------------
+\echo A reader waits for the session writing the file, with the extension wait
+\echo event, and then reads the complete content it has opened
+\echo --------------------------------------------------------------------------------
+\! psql -d test_datalink -Atqc "SELECT datalink_write_localfile('/tmp/test_datalink/file2.txt', convert_to(repeat('x', 24000), 'UTF8'))" > /dev/null 2>&1 &
+SELECT pg_sleep(0.5);
+\! psql -d test_datalink -Atqc "SELECT convert_from(datalink_read_localfile('/tmp/test_datalink/file2.txt', 0, -1), 'UTF8')" > /tmp/dl_lock_reader.out 2>&1 &
+SELECT pg_sleep(0.5);
+SELECT count(*) AS waiting FROM pg_stat_activity
+	WHERE datname = current_database() AND pid <> pg_backend_pid()
+	AND query LIKE '%datalink_read_localfile%' AND wait_event_type = 'Extension';
+DO $$
+BEGIN
+    WHILE EXISTS (SELECT 1 FROM pg_stat_activity WHERE datname = current_database() AND pid <> pg_backend_pid() AND state = 'active') LOOP
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+END
+$$;
+\! cat /tmp/dl_lock_reader.out
+\! rm -f /tmp/dl_lock_reader.out
+UPDATE pg_datalink_bases SET maxbandwidth = 0 WHERE dirid = 1;
+SELECT length(datalink_read_localfile('/tmp/test_datalink/file2.txt', 0, -1)) AS written;
+
+\echo --------------------------------------------------------------------------------
+\echo A writer waits at most lock_timeout for the session writing the same file
+\echo --------------------------------------------------------------------------------
+UPDATE pg_datalink_bases SET maxbandwidth = 8000 WHERE dirid = 1;
+\! psql -d test_datalink -Atqc "SELECT datalink_write_localfile('/tmp/test_datalink/file2.txt', convert_to(repeat('y', 24000), 'UTF8'))" > /dev/null 2>&1 &
+SELECT pg_sleep(0.5);
+SET lock_timeout = '200ms';
+SELECT datalink_write_localfile('/tmp/test_datalink/file2.txt', convert_to('z', 'UTF8'));
+RESET lock_timeout;
+DO $$
+BEGIN
+    WHILE EXISTS (SELECT 1 FROM pg_stat_activity WHERE datname = current_database() AND pid <> pg_backend_pid() AND state = 'active') LOOP
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+END
+$$;
+UPDATE pg_datalink_bases SET maxbandwidth = 0 WHERE dirid = 1;
+SELECT length(content) AS written, left(content, 1) AS first
+	FROM convert_from(datalink_read_localfile('/tmp/test_datalink/file2.txt', 0, -1), 'UTF8') content;
+
+\echo --------------------------------------------------------------------------------
+\echo The lock is released once the writer is done
+\echo --------------------------------------------------------------------------------
+SELECT datalink_write_localfile('/tmp/test_datalink/file2.txt', convert_to('z', 'UTF8'));
+SELECT convert_from(datalink_read_localfile('/tmp/test_datalink/file2.txt', 0, -1), 'UTF8') AS content;
@@ -0,0 +1,67 @@
+------------------------------------------------------------------------------
+-- Invalidation of the object cache of small files, needs
+-- shared_preload_libraries = 'datalink'
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control, files are restored when unlinked
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_objcache.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+
+\echo --------------------------------------------------------------------------------
+\echo A file read again is served by the cache, without the 20 bytes per second
+\echo limit of the base directory that throttles the first read
+\echo --------------------------------------------------------------------------------
+UPDATE pg_datalink_bases SET maxbandwidth = 20 WHERE dirid = 1;
+SELECT rtrim(convert_from(datalink_read_localfile('/tmp/test_datalink/file2.txt', 0, -1), 'UTF8'), E'\n') AS content;
+SELECT clock_timestamp() AS start \gset
+SELECT rtrim(convert_from(datalink_read_localfile('/tmp/test_datalink/file2.txt', 0, -1), 'UTF8'), E'\n') AS cached;
+SELECT clock_timestamp() - :'start'::timestamptz < interval '1 second' AS not_throttled;
+UPDATE pg_datalink_bases SET maxbandwidth = 0 WHERE dirid = 1;
+
+\echo --------------------------------------------------------------------------------
+\echo A cached file written by the extension is read with its new content
+\echo --------------------------------------------------------------------------------
+SELECT datalink_write_localfile('/tmp/test_datalink/file2.txt', convert_to('new content of file2', 'UTF8'));
+SELECT rtrim(convert_from(datalink_read_localfile('/tmp/test_datalink/file2.txt', 0, -1), 'UTF8'), E'\n') AS content;
+
+\echo --------------------------------------------------------------------------------
+\echo A cached file modified in place, with the same size, is read with its new
+\echo content
+\echo --------------------------------------------------------------------------------
+SELECT rtrim(convert_from(datalink_read_localfile('/tmp/test_datalink/file3.txt', 0, -1), 'UTF8'), E'\n') AS content;
+\! sudo -u postgres sh -c 'tr a-z A-Z < /tmp/test_datalink/file3.txt > /tmp/file3.up && cat /tmp/file3.up > /tmp/test_datalink/file3.txt && rm /tmp/file3.up'
+SELECT rtrim(convert_from(datalink_read_localfile('/tmp/test_datalink/file3.txt', 0, -1), 'UTF8'), E'\n') AS content;
+
+\echo --------------------------------------------------------------------------------
+\echo A cached file renamed over, by another program or by the extension, is read
+\echo with the content of the file renamed
+\echo --------------------------------------------------------------------------------
+SELECT rtrim(convert_from(datalink_read_localfile('/tmp/test_datalink/file4.txt', 0, -1), 'UTF8'), E'\n') AS content;
+\! sudo -u postgres mv /tmp/test_datalink/file5.txt /tmp/test_datalink/file4.txt
+SELECT rtrim(convert_from(datalink_read_localfile('/tmp/test_datalink/file4.txt', 0, -1), 'UTF8'), E'\n') AS content;
+SELECT datalink_rename_localfile('/tmp/test_datalink/file3.txt', '/tmp/test_datalink/file4.txt');
+SELECT rtrim(convert_from(datalink_read_localfile('/tmp/test_datalink/file4.txt', 0, -1), 'UTF8'), E'\n') AS content;
+SELECT datalink_read_localfile('/tmp/test_datalink/file3.txt', 0, -1) IS NULL AS renamed;
+
+\echo --------------------------------------------------------------------------------
+\echo A cached file removed, by another program or by the extension, is not read
+\echo anymore
+\echo --------------------------------------------------------------------------------
+SELECT datalink_unlink_localfile('/tmp/test_datalink/file2.txt');
+SELECT datalink_read_localfile('/tmp/test_datalink/file2.txt', 0, -1) IS NULL AS removed;
+\! sudo -u postgres rm /tmp/test_datalink/file4.txt
+SELECT datalink_read_localfile('/tmp/test_datalink/file4.txt', 0, -1) IS NULL AS removed;
@@ -0,0 +1,53 @@
+------------------------------------------------------------------------------
+-- Remote datalink tests, the files of test/files/ must be served by a local
+-- HTTP server on port 8081 (see dl_test.sh)
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+\pset null <NULL>
+
+\echo --------------------------------------------------------------------------------
+\echo Test DLFILESIZE on a remote file
+\echo --------------------------------------------------------------------------------
+SELECT dlfilesize(dlvalue('http://localhost:8081/file2.txt'::uri));
+
+\echo --------------------------------------------------------------------------------
+\echo Test batched DLFILESIZE, the size of a missing file is NULL
+\echo --------------------------------------------------------------------------------
+SELECT dlfilesize(ARRAY[dlvalue('http://localhost:8081/file2.txt'::uri), dlvalue('http://localhost:8081/img1.png'::uri), dlvalue('http://localhost:8081/nofile.txt'::uri), NULL]);
+
+\echo --------------------------------------------------------------------------------
+\echo Test DLREADFILE on a remote file of a base without READ PERMISSION DB,
+\echo the file must not be fetched
+\echo --------------------------------------------------------------------------------
+DO $$
+BEGIN
+    PERFORM dlreadfile(dlvalue('http://localhost:8081/file2.txt'::uri), 'http://localhost:8081/file2.txt'::uri);
+EXCEPTION WHEN OTHERS THEN
+    RAISE NOTICE 'read refused: %', SQLERRM LIKE 'reading URL % is not authorized.';
+END;
+$$;
+
+\echo --------------------------------------------------------------------------------
+\echo The function fetching remote files is not granted to PUBLIC
+\echo --------------------------------------------------------------------------------
+SELECT has_function_privilege('public', 'datalink_read_remotefile(text)', 'EXECUTE');
+
+\echo --------------------------------------------------------------------------------
+\echo Test DLFILESIZE on a missing remote file, an error is raised
+\echo --------------------------------------------------------------------------------
+SELECT dlfilesize(dlvalue('http://localhost:8081/nofile.txt'::uri));
@@ -0,0 +1,63 @@
+------------------------------------------------------------------------------
+-- Backups of the linked files with hard links
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control, files are renamed with their token
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_snapshot.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+
+CREATE TABLE dl_snapshot (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+INSERT INTO dl_snapshot VALUES (1, dlvalue('file2.txt'::uri, 'public.dl_snapshot.efile'::text, 'First file'::text));
+INSERT INTO dl_snapshot VALUES (2, dlvalue('file3.txt'::uri, 'public.dl_snapshot.efile'::text, 'Second file'::text));
+
+\echo --------------------------------------------------------------------------------
+\echo A full backup hard links each linked file under its datalink path
+\echo --------------------------------------------------------------------------------
+SELECT * FROM dl_snapshot_create('backup1', false);
+\! sudo -u postgres ls /tmp/test_datalink/.dlsnapshot/backup1
+\! sudo -u postgres stat -c '%h %n' /tmp/test_datalink/.dlsnapshot/backup1/file2.txt
+
+\echo --------------------------------------------------------------------------------
+\echo An incremental backup refers to the links of the previous one for the files
+\echo that have not changed, a replaced file is linked again
+\echo --------------------------------------------------------------------------------
+SELECT * FROM dl_snapshot_create('backup2');
+\! sudo -u postgres sh -c 'cp /tmp/test_datalink/file5.txt /tmp/test_datalink/file3.new && mv /tmp/test_datalink/file3.new /tmp/test_datalink/*\;file3.txt'
+SELECT * FROM dl_snapshot_create('backup3');
+SELECT b.label, b.parent, f.path, f.snapshot, f.size
+	FROM pg_datalink_backups b JOIN pg_datalink_backup_files f USING (label)
+	ORDER BY b.label, f.path;
+
+\echo --------------------------------------------------------------------------------
+\echo The first backup keeps the content of the replaced file
+\echo --------------------------------------------------------------------------------
+\! sudo -u postgres cat /tmp/test_datalink/.dlsnapshot/backup1/file3.txt
+\! sudo -u postgres cat /tmp/test_datalink/.dlsnapshot/backup3/file3.txt
+
+\echo --------------------------------------------------------------------------------
+\echo Errors: the label is a directory name and can not be reused
+\echo --------------------------------------------------------------------------------
+SELECT * FROM dl_snapshot_create('../backup4');
+SELECT * FROM dl_snapshot_create('backup1');
+
+\echo --------------------------------------------------------------------------------
+\echo The files are only linked through dl_snapshot_create()
+\echo --------------------------------------------------------------------------------
+SELECT has_function_privilege('public', 'datalink_link_files(text[], text[], bigint[], bigint[], timestamp with time zone[], boolean[])', 'EXECUTE') AS link_files;
@@ -0,0 +1,70 @@
+------------------------------------------------------------------------------
+-- Tiered storage of the linked files
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control, files are renamed with their token
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_tier.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+
+CREATE TABLE dl_tier (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+INSERT INTO dl_tier VALUES (1, dlvalue('file2.txt'::uri, 'public.dl_tier.efile'::text, 'First file'::text));
+INSERT INTO dl_tier VALUES (2, dlvalue('file3.txt'::uri, 'public.dl_tier.efile'::text, 'Second file'::text));
+
+-- Files not accessed for one second go to the tier directory
+UPDATE pg_datalink_bases SET tierdir = '/tmp/test_datalink/tier', tierafter = '1 second' WHERE dirid = 1;
+SELECT pg_sleep(2);
+
+\echo --------------------------------------------------------------------------------
+\echo The cold files are moved to the tier directory, removed from the base
+\echo directory at commit
+\echo --------------------------------------------------------------------------------
+SELECT dl_tier_migrate();
+SELECT regexp_replace(path, '[0-9a-f-]{36};', '') AS path, regexp_replace(tierpath, '[0-9a-f-]{36};', '') AS tierpath, size, compressed
+	FROM pg_datalink_tiered ORDER BY 1;
+\! sudo -u postgres sh -c 'ls /tmp/test_datalink/*\;file*.txt 2>/dev/null | wc -l'
+\! sudo -u postgres sh -c 'ls /tmp/test_datalink/tier/*\;file*.txt | wc -l'
+
+\echo --------------------------------------------------------------------------------
+\echo A file is recalled by dl_tier_recall() or when it is accessed, the copy in
+\echo the tier directory is removed at commit
+\echo --------------------------------------------------------------------------------
+SELECT dl_tier_recall(efile) FROM dl_tier WHERE id = 1;
+SELECT left(convert_from(datalink_read_localfile(add_token_to_url(uri_get_path(dl_url_rebase((efile).dl_path, (efile).dl_base)), ((efile).dl_token)::text)), 'UTF8'), 14) AS content
+	FROM dl_tier WHERE id = 1;
+SELECT dlurlcomplete(efile) IS NOT NULL AS url FROM dl_tier WHERE id = 2;
+SELECT count(*) FROM pg_datalink_tiered;
+\! sudo -u postgres sh -c 'ls /tmp/test_datalink/*\;file*.txt | wc -l'
+\! sudo -u postgres sh -c 'ls /tmp/test_datalink/tier/*\;file*.txt 2>/dev/null | wc -l'
+
+\echo --------------------------------------------------------------------------------
+\echo A file recalled and not in the tier directory is left alone
+\echo --------------------------------------------------------------------------------
+SELECT dl_tier_recall(efile) FROM dl_tier WHERE id = 1;
+SELECT dl_tier_migrate();
+
+\echo --------------------------------------------------------------------------------
+\echo Errors
+\echo --------------------------------------------------------------------------------
+SELECT datalink_tier_copy('/tmp/test_datalink/file4.txt', '/tmp/test_datalink/tier/file4.txt', 'move');
+
+\echo --------------------------------------------------------------------------------
+\echo The files are only moved through dl_tier_migrate() and dl_tier_recall()
+\echo --------------------------------------------------------------------------------
+SELECT has_function_privilege('public', 'datalink_tier_copy(text, text, text)', 'EXECUTE') AS tier_copy;
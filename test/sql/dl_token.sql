@@ -0,0 +1,86 @@
+------------------------------------------------------------------------------
+-- Signed access tokens
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+ALTER SYSTEM SET datalink.dl_token_secret = 'regression secret';
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+
+\echo --------------------------------------------------------------------------------
+\echo A signed token is a uuid version 8 verified without token file
+\echo --------------------------------------------------------------------------------
+BEGIN;
+SELECT datalink_generate_token('R', '/tmp/test_datalink/file1.txt') AS token \gset
+SELECT substr(:'token', 15, 1) AS version;
+SELECT datalink_register_token(:'token', 'R', '/tmp/test_datalink/' || :'token' || ';file1.txt');
+\! ls /tmp/test_datalink/pg_dltoken/ | wc -l
+SELECT datalink_verify_token(:'token', false, '/tmp/test_datalink/file1.txt') = '/tmp/test_datalink/' || :'token' || ';file1.txt' AS valid;
+
+\echo --------------------------------------------------------------------------------
+\echo A tampered MAC, another path or another access mode are rejected
+\echo --------------------------------------------------------------------------------
+SET LOCAL client_min_messages = error;
+SELECT datalink_verify_token(overlay(:'token' PLACING CASE WHEN right(:'token', 1) = '0' THEN '1' ELSE '0' END FROM 36), false, '/tmp/test_datalink/file1.txt') IS NULL AS tampered_rejected;
+SELECT datalink_verify_token(:'token', false, '/tmp/test_datalink/file2.txt') IS NULL AS other_path_rejected;
+SELECT datalink_verify_token(:'token', true, '/tmp/test_datalink/file1.txt') IS NULL AS write_rejected;
+COMMIT;
+
+\echo --------------------------------------------------------------------------------
+\echo A token is rejected once its transaction has ended
+\echo --------------------------------------------------------------------------------
+SELECT datalink_verify_token(:'token', false, '/tmp/test_datalink/file1.txt') IS NULL AS ended_rejected;
+
+\echo --------------------------------------------------------------------------------
+\echo An expired token is rejected
+\echo --------------------------------------------------------------------------------
+ALTER SYSTEM SET datalink.dl_token_expiry = 1;
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+BEGIN;
+SELECT datalink_generate_token('R', '/tmp/test_datalink/file1.txt') AS token \gset
+SELECT pg_sleep(2.1);
+SET LOCAL client_min_messages = error;
+SELECT datalink_verify_token(:'token', false, '/tmp/test_datalink/file1.txt') IS NULL AS expired_rejected;
+COMMIT;
+ALTER SYSTEM RESET datalink.dl_token_expiry;
+
+\echo --------------------------------------------------------------------------------
+\echo Without secret tokens are random uuid registered in the token directory
+\echo --------------------------------------------------------------------------------
+ALTER SYSTEM RESET datalink.dl_token_secret;
+SELECT pg_reload_conf();
+SELECT pg_sleep(1);
+BEGIN;
+SELECT datalink_generate_token('R', '/tmp/test_datalink/file1.txt') AS token4 \gset
+SELECT substr(:'token4', 15, 1) AS version;
+SELECT datalink_register_token(:'token4', 'R', '/tmp/test_datalink/' || :'token4' || ';file1.txt');
+\! ls /tmp/test_datalink/pg_dltoken/ | wc -l
+SELECT datalink_verify_token(:'token4', false, '/tmp/test_datalink/file1.txt') = '/tmp/test_datalink/' || :'token4' || ';file1.txt' AS valid;
+COMMIT;
+
+-- A signed token has no token file to be verified with
+SET dl_test.token = :'token';
+DO $$
+BEGIN
+    PERFORM datalink_verify_token(current_setting('dl_test.token'), false, '/tmp/test_datalink/file1.txt');
+    RAISE NOTICE 'signed token accepted without secret';
+EXCEPTION WHEN others THEN
+    RAISE NOTICE 'signed token rejected without secret';
+END
+$$;
+\! ls /tmp/test_datalink/pg_dltoken/ | wc -l
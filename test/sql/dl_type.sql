@@ -0,0 +1,82 @@
+------------------------------------------------------------------------------
+-- Binary input/output and operator classes of the DATALINK type
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+CREATE TABLE dl_type (
+        id integer,
+        l datalink
+);
+INSERT INTO dl_type VALUES (1, dl_make(1, 'img1.png', 'A comment', 'dd9aec49-0c76-44b5-bd93-6ced58bb59b0', 'ec57428f-e37d-4fc8-9943-a165211cd810'));
+INSERT INTO dl_type VALUES (2, dl_make(1, 'img1.png', 'Another comment', NULL, NULL));
+INSERT INTO dl_type VALUES (3, dl_make(0, 'http://www.darold.net/index.html', NULL, NULL, NULL));
+INSERT INTO dl_type VALUES (4, dl_make(NULL, NULL, 'Just a comment', NULL, NULL));
+INSERT INTO dl_type VALUES (5, dl_make(2, 'dir/file.txt', 'A "quoted", comment', NULL, NULL));
+SELECT * FROM dl_type ORDER BY id;
+
+\echo --------------------------------------------------------------------------------
+\echo Binary representation: flags, base, tokens, then path and comment prefixed by
+\echo their length
+\echo --------------------------------------------------------------------------------
+SELECT id, encode(datalink_send(l), 'hex') FROM dl_type WHERE id IN (3, 4) ORDER BY id;
+
+\echo --------------------------------------------------------------------------------
+\echo Binary COPY round trip, all the fields must be kept
+\echo --------------------------------------------------------------------------------
+COPY dl_type TO '/tmp/test_datalink/dl_type.bin' WITH (FORMAT binary);
+CREATE TABLE dl_type_copy (LIKE dl_type);
+COPY dl_type_copy FROM '/tmp/test_datalink/dl_type.bin' WITH (FORMAT binary);
+SELECT a.id, a.l::text = b.l::text AS same_text,
+        (a.l).dl_token IS NOT DISTINCT FROM (b.l).dl_token AS same_token,
+        (a.l).dl_prev_token IS NOT DISTINCT FROM (b.l).dl_prev_token AS same_prev_token
+    FROM dl_type a JOIN dl_type_copy b USING (id) ORDER BY a.id;
+
+\echo --------------------------------------------------------------------------------
+\echo Datalinks are equal on base directory, path and comment, tokens are ignored
+\echo --------------------------------------------------------------------------------
+SELECT l = dl_make(1, 'img1.png', 'A comment', NULL, NULL) AS same_comment,
+        l = dl_make(1, 'img1.png', 'Other comment', NULL, NULL) AS other_comment,
+        l <> dl_make(1, 'img1.png', NULL, NULL, NULL) AS no_comment
+    FROM dl_type WHERE id = 1;
+
+\echo --------------------------------------------------------------------------------
+\echo Btree ordering: missing fields first, then base, path and comment
+\echo --------------------------------------------------------------------------------
+SELECT id FROM dl_type ORDER BY l, id;
+
+\echo --------------------------------------------------------------------------------
+\echo Hash join and hash aggregate
+\echo --------------------------------------------------------------------------------
+SET enable_mergejoin = off;
+SET enable_nestloop = off;
+SET enable_sort = off;
+SELECT count(*) FROM dl_type a JOIN dl_type_copy b ON (a.l = b.l);
+SELECT count(*) FROM (SELECT l FROM dl_type UNION SELECT l FROM dl_type_copy) u;
+RESET enable_mergejoin;
+RESET enable_nestloop;
+RESET enable_sort;
+
+\echo --------------------------------------------------------------------------------
+\echo Hash and btree indexes
+\echo --------------------------------------------------------------------------------
+SET enable_seqscan = off;
+CREATE INDEX dl_type_hash ON dl_type USING hash (l);
+SELECT id FROM dl_type WHERE l = dl_make(1, 'img1.png', 'Another comment', NULL, NULL);
+DROP INDEX dl_type_hash;
+CREATE INDEX dl_type_btree ON dl_type (l);
+SELECT id FROM dl_type WHERE l > dl_make(0, 'http://www.darold.net/index.html', NULL, NULL, NULL) ORDER BY l;
+RESET enable_seqscan;
@@ -0,0 +1,166 @@
+------------------------------------------------------------------------------
+-- Unlink of the datalinks by the triggers of the tables
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control, files are restored when unlinked
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_unlink.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+
+CREATE TABLE dl_unlink (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+INSERT INTO dl_unlink VALUES (1, dlvalue('file2.txt'::uri, 'public.dl_unlink.efile'::text, 'First file'::text));
+INSERT INTO dl_unlink VALUES (2, dlvalue('file3.txt'::uri, 'public.dl_unlink.efile'::text, 'Second file'::text));
+
+\echo --------------------------------------------------------------------------------
+\echo The linked files are renamed with their token
+\echo --------------------------------------------------------------------------------
+\! ls /tmp/test_datalink/ | grep -c '^file[23].txt$'
+
+\echo --------------------------------------------------------------------------------
+\echo A datalink replaced by another one is not unlinked, file2.txt keeps its token
+\echo --------------------------------------------------------------------------------
+UPDATE dl_unlink SET efile = dlvalue(efile, 'file4.txt'::uri, 'public.dl_unlink.efile'::text, 'Replaced'::text) WHERE id = 1;
+\! ls /tmp/test_datalink/ | grep -c '^file[24].txt$'
+
+\echo --------------------------------------------------------------------------------
+\echo A datalink set to NULL is unlinked, file3.txt is restored at commit
+\echo --------------------------------------------------------------------------------
+BEGIN;
+UPDATE dl_unlink SET efile = NULL WHERE id = 2;
+\! ls /tmp/test_datalink/ | grep -c '^file3.txt$'
+COMMIT;
+\! ls /tmp/test_datalink/ | grep -c '^file3.txt$'
+
+\echo --------------------------------------------------------------------------------
+\echo A rolled back DELETE leaves the file linked
+\echo --------------------------------------------------------------------------------
+BEGIN;
+DELETE FROM dl_unlink WHERE id = 1;
+ROLLBACK;
+\! ls /tmp/test_datalink/ | grep -c '^file4.txt$'
+
+\echo --------------------------------------------------------------------------------
+\echo A DELETE unlinks the datalinks of the deleted rows, file4.txt is restored
+\echo --------------------------------------------------------------------------------
+DELETE FROM dl_unlink WHERE id = 1;
+\! ls /tmp/test_datalink/ | grep -c '^file4.txt$'
+
+\echo --------------------------------------------------------------------------------
+\echo Partitioned table, the partitions get the unique index and the triggers
+\echo --------------------------------------------------------------------------------
+CREATE TABLE dl_part (
+        id bigint,
+        efile datalink
+) PARTITION BY RANGE (id);
+CREATE TABLE dl_part_1 PARTITION OF dl_part FOR VALUES FROM (1) TO (100);
+SELECT tgrelid::regclass, tgname FROM pg_trigger WHERE tgname LIKE 'dltrg%' AND tgrelid IN ('dl_part'::regclass, 'dl_part_1'::regclass) ORDER BY tgrelid, tgname;
+SELECT indrelid::regclass, indisunique FROM pg_index WHERE indrelid IN ('dl_part'::regclass, 'dl_part_1'::regclass);
+
+INSERT INTO dl_part VALUES (1, dlvalue('file5.txt'::uri, 'public.dl_unlink.efile'::text, 'Partitioned'::text));
+INSERT INTO dl_part VALUES (2, dlvalue('img1.png'::uri, 'public.dl_unlink.efile'::text, 'Partitioned'::text));
+INSERT INTO dl_part_1 VALUES (3, dlvalue('file3.txt'::uri, 'public.dl_unlink.efile'::text, 'Partition'::text));
+\! ls /tmp/test_datalink/ | grep -c '^\(file5.txt\|img1.png\|file3.txt\)$'
+
+\echo --------------------------------------------------------------------------------
+\echo A datalink set to NULL through the parent is unlinked, file5.txt is restored
+\echo --------------------------------------------------------------------------------
+UPDATE dl_part SET efile = NULL WHERE id = 1;
+\! ls /tmp/test_datalink/ | grep -c '^file5.txt$'
+
+\echo --------------------------------------------------------------------------------
+\echo A DELETE on the parent unlinks the datalinks of the partitions, img1.png is
+\echo restored
+\echo --------------------------------------------------------------------------------
+DELETE FROM dl_part WHERE id = 2;
+\! ls /tmp/test_datalink/ | grep -c '^img1.png$'
+
+\echo --------------------------------------------------------------------------------
+\echo A DELETE on the partition unlinks its datalinks, file3.txt is restored
+\echo --------------------------------------------------------------------------------
+DELETE FROM dl_part_1 WHERE id = 3;
+\! ls /tmp/test_datalink/ | grep -c '^file3.txt$'
+
+-- Wait for the unlink worker to empty the queue, returns the files left
+CREATE FUNCTION dl_wait_unlinks() RETURNS bigint AS $$
+DECLARE
+    v_count bigint;
+BEGIN
+    FOR i IN 1..100 LOOP
+        SELECT count(*) INTO v_count FROM pg_datalink_unlink_queue;
+        EXIT WHEN v_count = 0;
+        PERFORM pg_sleep(0.1);
+    END LOOP;
+    RETURN v_count;
+END
+$$ LANGUAGE plpgsql;
+
+\echo --------------------------------------------------------------------------------
+\echo The datalinks of a table can only be queued by the triggers
+\echo --------------------------------------------------------------------------------
+SELECT has_function_privilege('public', 'datalink_unlink_table(regclass, text)', 'EXECUTE');
+
+\echo --------------------------------------------------------------------------------
+\echo TRUNCATE unlinks the datalinks of the table, file3.txt is restored after commit
+\echo --------------------------------------------------------------------------------
+INSERT INTO dl_unlink VALUES (3, dlvalue('file3.txt'::uri, 'public.dl_unlink.efile'::text, 'Truncated'::text));
+\! ls /tmp/test_datalink/ | grep -c '^file3.txt$'
+TRUNCATE dl_unlink;
+SELECT dl_wait_unlinks();
+\! ls /tmp/test_datalink/ | grep -c '^file3.txt$'
+
+\echo --------------------------------------------------------------------------------
+\echo ALTER TABLE ... DROP COLUMN unlinks the datalinks of the column and drops its
+\echo triggers, file4.txt is restored
+\echo --------------------------------------------------------------------------------
+INSERT INTO dl_unlink VALUES (4, dlvalue('file4.txt'::uri, 'public.dl_unlink.efile'::text, 'Column dropped'::text));
+ALTER TABLE dl_unlink DROP COLUMN efile;
+SELECT dl_wait_unlinks();
+\! ls /tmp/test_datalink/ | grep -c '^file4.txt$'
+SELECT count(*) FROM pg_trigger WHERE tgrelid = 'dl_unlink'::regclass AND tgname LIKE 'dltrg%';
+DELETE FROM dl_unlink;
+
+\echo --------------------------------------------------------------------------------
+\echo DROP TABLE unlinks the datalinks of the partitions, file5.txt is restored
+\echo --------------------------------------------------------------------------------
+INSERT INTO dl_part VALUES (5, dlvalue('file5.txt'::uri, 'public.dl_unlink.efile'::text, 'Table dropped'::text));
+DROP TABLE dl_part;
+SELECT dl_wait_unlinks();
+\! ls /tmp/test_datalink/ | grep -c '^file5.txt$'
+
+\echo --------------------------------------------------------------------------------
+\echo DROP SCHEMA ... CASCADE unlinks the datalinks of its tables, img1.png is
+\echo restored
+\echo --------------------------------------------------------------------------------
+CREATE SCHEMA dl_schema;
+CREATE TABLE dl_schema.dl_tab (
+        id bigint,
+        efile datalink
+);
+INSERT INTO dl_schema.dl_tab VALUES (1, dlvalue('img1.png'::uri, 'public.dl_unlink.efile'::text, 'Schema dropped'::text));
+\! ls /tmp/test_datalink/ | grep -c '^img1.png$'
+DROP SCHEMA dl_schema CASCADE;
+SELECT dl_wait_unlinks();
+\! ls /tmp/test_datalink/ | grep -c '^img1.png$'
+
+\echo --------------------------------------------------------------------------------
+\echo The functions queuing and unlinking files are only reached through the
+\echo triggers and dl_process_unlinks()
+\echo --------------------------------------------------------------------------------
+SELECT has_function_privilege('public', 'datalink_queue_unlink(text[], text[], boolean)', 'EXECUTE') AS queue_unlink;
+SELECT has_function_privilege('public', 'datalink_bulk_unlink(text[], text[], boolean[])', 'EXECUTE') AS bulk_unlink;
@@ -0,0 +1,54 @@
+------------------------------------------------------------------------------
+-- Space used by the base directories and quotas, needs
+-- shared_preload_libraries = 'datalink'
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control holding only the files of the test
+\! sudo -u postgres sh -c 'mkdir /tmp/test_datalink/usage && cp /tmp/test_datalink/file2.txt /tmp/test_datalink/file3.txt /tmp/test_datalink/usage/'
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_usage.efile', 'file:///tmp/test_datalink/usage/', true, true, true, true, true, true, false, 'RESTORE');
+
+CREATE TABLE dl_usage (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+INSERT INTO dl_usage VALUES (1, dlvalue('file2.txt'::uri, 'public.dl_usage.efile'::text, 'First file'::text));
+INSERT INTO dl_usage VALUES (2, dlvalue('file3.txt'::uri, 'public.dl_usage.efile'::text, 'Second file'::text));
+
+\echo --------------------------------------------------------------------------------
+\echo The counters rebuilt from the filesystem count the linked files as live and
+\echo a .old file left behind as a copy
+\echo --------------------------------------------------------------------------------
+\! sudo -u postgres cp /tmp/test_datalink/file5.txt /tmp/test_datalink/usage/file5.txt.old
+SELECT dl_usage_rebuild();
+SELECT * FROM dl_usage();
+SELECT live_bytes, live_files, copy_bytes, copy_files, pending_bytes, pending_files FROM pg_datalink_usage WHERE dirid = 1;
+
+\echo --------------------------------------------------------------------------------
+\echo A copy over the number of files or the space allowed is refused
+\echo --------------------------------------------------------------------------------
+UPDATE pg_datalink_bases SET maxfiles = 3 WHERE dirid = 1;
+SELECT datalink_copy_localfile('/tmp/test_datalink/file4.txt', '/tmp/test_datalink/usage/file4.txt');
+UPDATE pg_datalink_bases SET maxfiles = 0, maxbytes = 150 WHERE dirid = 1;
+SELECT datalink_copy_localfile('/tmp/test_datalink/file4.txt', '/tmp/test_datalink/usage/file4.txt');
+
+\echo --------------------------------------------------------------------------------
+\echo Within the quota the copy is done and counted as pending until it is linked
+\echo --------------------------------------------------------------------------------
+UPDATE pg_datalink_bases SET maxbytes = 200 WHERE dirid = 1;
+SELECT datalink_copy_localfile('/tmp/test_datalink/file4.txt', '/tmp/test_datalink/usage/file4.txt');
+SELECT * FROM dl_usage('public.dl_usage.efile');
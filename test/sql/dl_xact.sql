@@ -0,0 +1,55 @@
+------------------------------------------------------------------------------
+-- Transaction scoped read tokens
+------------------------------------------------------------------------------
+\pset pager off
+
+DROP DATABASE IF EXISTS test_datalink;
+CREATE DATABASE test_datalink;
+
+\c test_datalink
+
+-- Create extension used to generate token
+CREATE EXTENSION "uuid-ossp";
+
+-- Create uri extension base type for datalink
+CREATE EXTENSION uri;
+
+-- Create datalink extension
+CREATE EXTENSION datalink;
+
+-- Base directory with full control and READ PERMISSION DB
+INSERT INTO public.pg_datalink_bases VALUES (1, 'public.dl_xact.efile', 'file:///tmp/test_datalink/', true, true, true, true, true, true, false, 'RESTORE');
+
+CREATE TABLE dl_xact (
+        id bigint PRIMARY KEY,
+        efile datalink
+);
+INSERT INTO dl_xact VALUES (1, dlvalue('file2.txt'::uri, 'public.dl_xact.efile'::text, 'First file'::text));
+INSERT INTO dl_xact VALUES (2, dlvalue('file3.txt'::uri, 'public.dl_xact.efile'::text, 'Second file'::text));
+
+\echo --------------------------------------------------------------------------------
+\echo The files handed out by a transaction are linked into one link directory
+\echo --------------------------------------------------------------------------------
+BEGIN;
+SET LOCAL datalink.dl_read_token_scope = 'transaction';
+SELECT id, regexp_replace(dlurlcomplete(efile), '[0-9a-f-]{36}', 'TOKEN') FROM dl_xact ORDER BY id;
+\! ls /tmp/test_datalink/.dlxact/*/ | wc -l
+COMMIT;
+
+\echo --------------------------------------------------------------------------------
+\echo The link directory and the empty .dlxact directory are removed at commit
+\echo --------------------------------------------------------------------------------
+\! ls -a /tmp/test_datalink/ | grep -c '^\.dlxact$'
+
+\echo --------------------------------------------------------------------------------
+\echo The link of a row fetched from a cursor exists as soon as the row is received
+\echo --------------------------------------------------------------------------------
+BEGIN;
+SET LOCAL datalink.dl_read_token_scope = 'transaction';
+DECLARE dl_cur CURSOR FOR SELECT id, regexp_replace(dlurlcomplete(efile), '[0-9a-f-]{36}', 'TOKEN') FROM dl_xact ORDER BY id;
+FETCH 1 FROM dl_cur;
+\! ls /tmp/test_datalink/.dlxact/*/ | wc -l
+FETCH 1 FROM dl_cur;
+\! ls /tmp/test_datalink/.dlxact/*/ | wc -l
+ROLLBACK;
+\! ls -a /tmp/test_datalink/ | grep -c '^\.dlxact$'
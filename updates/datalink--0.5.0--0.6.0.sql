@@ -0,0 +1,2920 @@
+-- Datalink extension for PostgreSQL
+-- Upgrade from version 0.5.0 to 0.6.0
+-- Author Gilles Darold (gilles@darold.net)
+-- Copyright (c) 2015-2019 Gilles Darold - All rights reserved.
+
+-- complain if script is sourced in psql, rather than via ALTER EXTENSION
+\echo Use "ALTER EXTENSION datalink UPDATE TO '0.6.0'" to load this file. \quit
+
+-- DATALINK is no more a composite type but a native type. The functions of
+-- version 0.5.0 are dropped with the triggers created on the tables with a
+-- datalink column, the composite type is renamed to keep the data until the
+-- columns are converted at the end of this script. The views and functions
+-- created on the datalink columns must be dropped before the upgrade.
+DROP EVENT TRIGGER datalink_event_trigger_ddl;
+
+DO $$
+DECLARE
+    r record;
+BEGIN
+    FOR r IN SELECT t.tgname, t.tgrelid::regclass AS tbl FROM pg_trigger t
+              WHERE t.tgfoid = 'dlunlink()'::regprocedure AND NOT t.tgisinternal
+    LOOP
+        EXECUTE format('DROP TRIGGER %I ON %s;', r.tgname, r.tbl);
+    END LOOP;
+END;
+$$;
+
+DROP FUNCTION add_datalink_trigger();
+DROP FUNCTION dlunlink();
+DROP FUNCTION datalink_copy_localfile(text, text);
+DROP FUNCTION datalink_unlink_localfile(uri);
+DROP FUNCTION datalink_read_localfile(text, bigint, bigint);
+DROP FUNCTION datalink_read_localfile(text);
+DROP FUNCTION datalink_write_localfile(text, bytea);
+DROP FUNCTION datalink_rename_localfile(text, text);
+DROP FUNCTION datalink_createlink_localfile(text, text);
+DROP FUNCTION datalink_relink_localfile(text, text);
+DROP FUNCTION datalink_register_token(text, text, text);
+DROP FUNCTION datalink_verify_token(text, boolean, text);
+DROP FUNCTION datalink_is_symlink(text);
+DROP FUNCTION datalink_symlink_target(text);
+DROP FUNCTION datalink_register_accesstoken(uri, text);
+DROP FUNCTION datalink_register_readtoken(text);
+DROP FUNCTION datalink_register_writetoken(text);
+DROP FUNCTION add_token_to_url(text, text);
+DROP FUNCTION remove_token_from_url(uri);
+DROP FUNCTION verify_token_from_uri(uri, boolean);
+DROP FUNCTION is_valid_token(uuid, boolean, text);
+DROP FUNCTION dl_url_rebase(uri, integer);
+DROP FUNCTION dl_directory_base(integer, text);
+DROP FUNCTION dl_directory_base(integer);
+DROP FUNCTION dl_directory_base(text);
+DROP FUNCTION dl_relative_path(uri, uri);
+DROP FUNCTION dl_default_linktype(uri);
+DROP FUNCTION dlcomment(datalink);
+DROP FUNCTION dlurlcompleteonly(datalink);
+DROP FUNCTION dlurlpathonly(datalink);
+DROP FUNCTION dlurlscheme(datalink);
+DROP FUNCTION dlurlserver(datalink);
+DROP FUNCTION dllinktype(datalink);
+DROP FUNCTION dlfilesize(datalink);
+DROP FUNCTION dlfilesizeexact(datalink);
+DROP FUNCTION dlvalue(datalink, uri, text, text);
+DROP FUNCTION dlvalue(datalink, uri, text);
+DROP FUNCTION dlvalue(datalink, uri);
+DROP FUNCTION dlvalue(datalink, text);
+DROP FUNCTION dlvalue(uri, text, text);
+DROP FUNCTION dlvalue(uri, text);
+DROP FUNCTION dlvalue(uri);
+DROP FUNCTION dlvalue(text);
+DROP FUNCTION dlnewcopy(datalink, uri, boolean);
+DROP FUNCTION dlpreviouscopy(datalink, uri, boolean);
+DROP FUNCTION dlurlcomplete(datalink);
+DROP FUNCTION dlurlcompletewrite(datalink);
+DROP FUNCTION dlurlpath(datalink);
+DROP FUNCTION dlurlpathwrite(datalink);
+DROP FUNCTION dlreadfile(datalink, uri);
+DROP FUNCTION dlwritefile(datalink, uri, bytea);
+DROP FUNCTION dlreplacecontent(datalink, uri, uri, text);
+DROP FUNCTION dlreplacecontent(datalink, uri, uri);
+DROP FUNCTION dlreplacecontent(uri, uri, text);
+DROP FUNCTION dlreplacecontent(uri, uri);
+
+ALTER TYPE datalink RENAME TO datalink_050;
+
+-- New options of the base directories
+ALTER TABLE pg_datalink_bases
+        -- Extension to the standard: I/O limits of the file functions in the
+        -- directory, shared by all backends when the extension is loaded with
+        -- shared_preload_libraries. Maximum number of bytes read or written
+        -- per second and maximum number of files opened per second, 0 means
+        -- no limit.
+        ADD COLUMN maxbandwidth bigint DEFAULT 0 CHECK (maxbandwidth >= 0),
+        ADD COLUMN maxiops integer DEFAULT 0 CHECK (maxiops >= 0),
+        -- Extension to the standard: tiered storage. The linked files that
+        -- have not been accessed for tierafter are moved by dl_tier_migrate()
+        -- to directory tierdir, compressed with zstd when tiercompress is
+        -- true. They are recalled when they are accessed again.
+        ADD COLUMN tierdir text DEFAULT NULL,
+        ADD COLUMN tierafter interval DEFAULT NULL CHECK (tierafter > '0'::interval),
+        ADD COLUMN tiercompress boolean DEFAULT false,
+        -- Extension to the standard: quotas of the directory, maximum number
+        -- of bytes and of files used by the linked files, their copies and
+        -- the copies for the write tokens, checked before a copy or a write
+        -- when the extension is loaded with shared_preload_libraries. 0
+        -- means no limit.
+        ADD COLUMN maxbytes bigint DEFAULT 0 CHECK (maxbytes >= 0),
+        ADD COLUMN maxfiles bigint DEFAULT 0 CHECK (maxfiles >= 0);
+
+-- Table used by dl_changes() to store the snapshot of the files of the base
+-- directories, changes are found by comparing it with the filesystem.
+CREATE TABLE pg_datalink_snapshots
+(
+	dirid integer, -- Id of the base directory
+	path text, -- Path of the file relative to the base directory
+	ino bigint NOT NULL,
+	size bigint NOT NULL,
+	mtime timestamp with time zone NOT NULL,
+	ctime timestamp with time zone NOT NULL,
+	PRIMARY KEY (dirid, path)
+);
+REVOKE ALL ON pg_datalink_snapshots FROM PUBLIC;
+
+-- Tables used by dl_snapshot_create() to store the backups of the linked
+-- files and their manifest. The hard link of a file is in subdirectory
+-- .dlsnapshot/<snapshot>/ of its base directory, an incremental backup
+-- refers to the link of a previous one for the files that have not changed.
+CREATE TABLE pg_datalink_backups
+(
+	label text PRIMARY KEY,
+	parent text REFERENCES pg_datalink_backups (label), -- Previous backup of an incremental one
+	created timestamp with time zone NOT NULL DEFAULT now()
+);
+CREATE TABLE pg_datalink_backup_files
+(
+	label text REFERENCES pg_datalink_backups (label) ON DELETE CASCADE,
+	dirid integer, -- Id of the base directory
+	path text, -- Path of the file relative to the base directory
+	snapshot text NOT NULL, -- Label of the backup holding the hard link
+	ino bigint NOT NULL,
+	size bigint NOT NULL,
+	mtime timestamp with time zone NOT NULL,
+	PRIMARY KEY (label, dirid, path)
+);
+REVOKE ALL ON pg_datalink_backups FROM PUBLIC;
+REVOKE ALL ON pg_datalink_backup_files FROM PUBLIC;
+SELECT pg_catalog.pg_extension_config_dump('pg_datalink_backups', '');
+SELECT pg_catalog.pg_extension_config_dump('pg_datalink_backup_files', '');
+
+-- Tables used for the tiered storage. pg_datalink_access holds the last
+-- access time and the number of reads of the files, by device and inode,
+-- flushed from shared memory by dl_access_flush(). pg_datalink_tiered holds
+-- the files moved to the tier directory of their base directory.
+CREATE TABLE pg_datalink_access
+(
+	dev bigint,
+	ino bigint,
+	last_access timestamp with time zone NOT NULL,
+	reads bigint NOT NULL,
+	PRIMARY KEY (dev, ino)
+);
+CREATE TABLE pg_datalink_tiered
+(
+	path text PRIMARY KEY, -- Path of the file in the base directory
+	dirid integer NOT NULL, -- Id of the base directory
+	tierpath text NOT NULL, -- Path of the file in the tier directory
+	size bigint NOT NULL, -- Size of the file before compression
+	compressed boolean NOT NULL,
+	migrated timestamp with time zone NOT NULL DEFAULT now()
+);
+REVOKE ALL ON pg_datalink_access FROM PUBLIC;
+GRANT SELECT ON pg_datalink_access TO PUBLIC;
+REVOKE ALL ON pg_datalink_tiered FROM PUBLIC;
+GRANT SELECT ON pg_datalink_tiered TO PUBLIC;
+SELECT pg_catalog.pg_extension_config_dump('pg_datalink_tiered', '');
+
+-- Queue of the files of the datalinks of the tables truncated or dropped,
+-- ON UNLINK RESTORE or DELETE is applied to them by dl_process_unlinks()
+-- in a background worker started when the transaction commits.
+CREATE TABLE pg_datalink_unlink_queue
+(
+	id bigserial PRIMARY KEY,
+	path text NOT NULL, -- Path of the datalink
+	token_path text, -- File renamed with its token, NULL when there is none
+	restore boolean NOT NULL, -- ON UNLINK RESTORE
+	queued timestamp with time zone NOT NULL DEFAULT now()
+);
+REVOKE ALL ON pg_datalink_unlink_queue FROM PUBLIC;
+
+-- Space and number of files used by the base directories with link control
+-- and write permission, by kind of file. The counters are kept in shared
+-- memory by the file functions and written here by dl_usage_flush().
+CREATE TABLE pg_datalink_usage
+(
+	dirid integer PRIMARY KEY, -- Id of the base directory
+	live_bytes bigint NOT NULL DEFAULT 0, -- Files referenced by the datalinks
+	live_files bigint NOT NULL DEFAULT 0,
+	copy_bytes bigint NOT NULL DEFAULT 0, -- Previous versions of the files
+	copy_files bigint NOT NULL DEFAULT 0,
+	pending_bytes bigint NOT NULL DEFAULT 0, -- Copies not validated or no more referenced
+	pending_files bigint NOT NULL DEFAULT 0,
+	updated timestamp with time zone NOT NULL DEFAULT now()
+);
+REVOKE ALL ON pg_datalink_usage FROM PUBLIC;
+GRANT SELECT ON pg_datalink_usage TO PUBLIC;
+
+-- When a base directory is inserted or updated verify that
+-- all options are compatible as per SQL/MED ISO definition
+CREATE OR REPLACE FUNCTION verify_datalink_options() RETURNS trigger AS $$
+DECLARE
+    v_directory record;
+    v_path text;
+    v_dstpath text;
+    v_ret boolean;
+BEGIN
+    -- With NO LINK CONTROL other options do not apply
+    -- so no further check and force default values
+    IF NOT NEW.linkcontrol THEN
+        NEW.integrity := false;
+        NEW.readperm := false;
+        NEW.writeperm := false;
+        NEW.writeblocked := false;
+        NEW.recovery := false;
+        NEW.onunlink := 'NONE';
+        RETURN NEW;
+    ELSE
+        IF NEW.onunlink = 'NONE' THEN
+            RAISE EXCEPTION 'With FILE LINK CONTROL either ON UNLINK RESTORE or ON UNLINK DELETE shall be specified.';
+        END IF;
+        -- Forced when FILE LINK CONTROL is specified
+        NEW.writeblocked := true;
+    END IF;
+    -- If INTEGRITY SELECTIVE is specified, then READ PERMISSION FS,
+    -- WRITE PERMISSION FS and RECOVERY NO shall be specified.
+    IF NOT NEW.integrity THEN
+        IF NEW.readperm OR NEW.writeperm OR NEW.recovery THEN
+            RAISE EXCEPTION 'If INTEGRITY SELECTIVE is specified, then READ PERMISSION FS, WRITE PERMISSION FS and RECOVERY NO shall be specified.';
+        END IF;
+    END IF;
+    -- If READ PERMISSION DB is specified, then either WRITE PERMISSION BLOCKED
+    -- or WRITE PERMISSION ADMIN shall be specified.
+    IF NEW.readperm THEN
+        IF NOT NEW.writeperm AND NOT NEW.writeblocked THEN
+            RAISE EXCEPTION 'If READ PERMISSION DB is specified, then either WRITE PERMISSION BLOCKED or WRITE PERMISSION ADMIN shall be specified.';
+        END IF;
+    END IF;
+    -- If WRITE PERMISSION ADMIN is specified, then READ PERMISSION DB shall be specified
+    IF NEW.writeperm AND NOT NEW.readperm THEN
+        RAISE EXCEPTION 'If WRITE PERMISSION ADMIN is specified, then READ PERMISSION DB shall be specified.';
+    END IF;
+    -- If either WRITE PERMISSION BLOCKED or WRITE PERMISSION ADMIN is specified,
+    -- then INTEGRITY ALL and <unlink option> shall be specified. In our case
+    -- unlink option is always set.
+    IF NEW.writeblocked OR NEW.writeperm THEN
+        IF NOT NEW.integrity OR NEW.onunlink = 'NONE' THEN
+            RAISE EXCEPTION 'If either WRITE PERMISSION BLOCKED or WRITE PERMISSION ADMIN is specified, then INTEGRITY ALL shall be specified and <unlink option> shall be specified.';
+        END IF;
+    END IF;
+    -- If WRITE PERMISSION FS is specified, then READ PERMISSION FS and RECOVERY NO
+    -- shall be specified and <unlink option> shall not be specified.
+    IF NOT NEW.writeperm THEN
+        IF NEW.readperm OR NEW.recovery OR NEW.onunlink != 'NONE' THEN
+            RAISE EXCEPTION 'If WRITE PERMISSION FS is specified, then READ PERMISSION FS and RECOVERY NO shall be specified and <unlink option> shall not be specified.';
+        END IF;
+    END IF;
+    -- If RECOVERY YES is specified, then either WRITE PERMISSION BLOCKED or
+    -- WRITE PERMISSION ADMIN shall be specified.
+    IF NEW.recovery THEN
+        IF NOT NEW.writeblocked OR NOT NEW.writeperm THEN
+            RAISE EXCEPTION 'If RECOVERY YES is specified, then either WRITE PERMISSION BLOCKED or WRITE PERMISSION ADMIN shall be specified.';
+        END IF;
+    END IF;
+    -- If UNLINK DELETE is specified, then READ PERMISSION DB and WRITE PERMISSION BLOCKED shall be specified.
+    IF NEW.onunlink = 'DELETE' THEN
+        IF NOT NEW.readperm OR NOT NEW.writeblocked THEN
+            RAISE EXCEPTION 'If UNLINK DELETE is specified, then READ PERMISSION DB and WRITE PERMISSION BLOCKED shall be specified.';
+        END IF;
+    END IF;
+    -- If UNLINK RESTORE is specified, then INTEGRITY ALL and WRITE PERMISSION BLOCKED shall be specified.
+    IF NEW.onunlink = 'RESTORE' THEN
+        IF NOT NEW.integrity OR NOT NEW.writeblocked THEN
+            RAISE EXCEPTION 'If UNLINK RESTORE is specified, then READ PERMISSION DB and WRITE PERMISSION BLOCKED shall be specified.';
+        END IF;
+    END IF;
+
+    RETURN NEW;
+END
+$$ LANGUAGE plpgsql;
+
+
+-- The DATALINK data type, a native type with the following fields:
+--        dl_base integer, -- Id of the base directory
+--        dl_path uri, -- Url of the external file relative to the base
+--        dl_comment text, -- A comment
+--        dl_token uuid, -- Current active token
+--        dl_prev_token uuid -- Previous active token
+-- Its text representation is the one of a record with these fields.
+CREATE TYPE datalink;
+CREATE FUNCTION datalink_in(cstring) RETURNS datalink AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_out(datalink) RETURNS cstring AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_recv(internal) RETURNS datalink AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_send(datalink) RETURNS bytea AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE TYPE datalink (
+        INPUT = datalink_in,
+        OUTPUT = datalink_out,
+        RECEIVE = datalink_recv,
+        SEND = datalink_send,
+        INTERNALLENGTH = VARIABLE,
+        ALIGNMENT = int4,
+        STORAGE = extended
+);
+
+REVOKE ALL ON TYPE datalink FROM PUBLIC;
+GRANT USAGE ON TYPE datalink TO PUBLIC;
+
+-- Constructor and accessors to the fields, they can be called with the
+-- field notation like ($1).dl_path
+CREATE FUNCTION dl_make(integer, text, text, uuid, uuid) RETURNS datalink AS 'MODULE_PATHNAME', 'datalink_make' LANGUAGE C IMMUTABLE;
+CREATE FUNCTION dl_base(datalink) RETURNS integer AS 'MODULE_PATHNAME', 'datalink_get_base' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION dl_path_text(datalink) RETURNS text AS 'MODULE_PATHNAME', 'datalink_get_path' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION dl_path(datalink) RETURNS uri AS $$
+    SELECT dl_path_text($1)::uri;
+$$ LANGUAGE SQL IMMUTABLE STRICT;
+CREATE FUNCTION dl_comment(datalink) RETURNS text AS 'MODULE_PATHNAME', 'datalink_get_comment' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION dl_token(datalink) RETURNS uuid AS 'MODULE_PATHNAME', 'datalink_get_token' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION dl_prev_token(datalink) RETURNS uuid AS 'MODULE_PATHNAME', 'datalink_get_prev_token' LANGUAGE C IMMUTABLE STRICT;
+
+-- Comparison operators, datalinks are compared on base directory, path and
+-- comment like the unique index of the datalink columns
+CREATE FUNCTION datalink_cmp(datalink, datalink) RETURNS integer AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_eq(datalink, datalink) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_ne(datalink, datalink) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_lt(datalink, datalink) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_le(datalink, datalink) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_gt(datalink, datalink) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_ge(datalink, datalink) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_hash(datalink) RETURNS integer AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+
+CREATE OPERATOR = (LEFTARG = datalink, RIGHTARG = datalink, PROCEDURE = datalink_eq,
+        COMMUTATOR = '=', NEGATOR = '<>', RESTRICT = eqsel, JOIN = eqjoinsel, HASHES, MERGES);
+CREATE OPERATOR <> (LEFTARG = datalink, RIGHTARG = datalink, PROCEDURE = datalink_ne,
+        COMMUTATOR = '<>', NEGATOR = '=', RESTRICT = neqsel, JOIN = neqjoinsel);
+CREATE OPERATOR < (LEFTARG = datalink, RIGHTARG = datalink, PROCEDURE = datalink_lt,
+        COMMUTATOR = '>', NEGATOR = '>=', RESTRICT = scalarltsel, JOIN = scalarltjoinsel);
+CREATE OPERATOR <= (LEFTARG = datalink, RIGHTARG = datalink, PROCEDURE = datalink_le,
+        COMMUTATOR = '>=', NEGATOR = '>', RESTRICT = scalarltsel, JOIN = scalarltjoinsel);
+CREATE OPERATOR > (LEFTARG = datalink, RIGHTARG = datalink, PROCEDURE = datalink_gt,
+        COMMUTATOR = '<', NEGATOR = '<=', RESTRICT = scalargtsel, JOIN = scalargtjoinsel);
+CREATE OPERATOR >= (LEFTARG = datalink, RIGHTARG = datalink, PROCEDURE = datalink_ge,
+        COMMUTATOR = '<=', NEGATOR = '<', RESTRICT = scalargtsel, JOIN = scalargtjoinsel);
+
+CREATE OPERATOR CLASS datalink_ops DEFAULT FOR TYPE datalink USING btree AS
+        OPERATOR 1 <,
+        OPERATOR 2 <=,
+        OPERATOR 3 =,
+        OPERATOR 4 >=,
+        OPERATOR 5 >,
+        FUNCTION 1 datalink_cmp(datalink, datalink);
+
+CREATE OPERATOR CLASS datalink_ops DEFAULT FOR TYPE datalink USING hash AS
+        OPERATOR 1 =,
+        FUNCTION 1 datalink_hash(datalink);
+
+-- Composite type with the fields of a datalink, this was the DATALINK type
+-- before it becomes a native type. Casts allow to migrate data stored with it.
+CREATE TYPE datalink_record AS
+(
+        dl_base integer,
+        dl_path uri,
+        dl_comment text,
+        dl_token uuid,
+        dl_prev_token uuid
+);
+CREATE FUNCTION datalink(datalink_record) RETURNS datalink AS $$
+    SELECT dl_make(($1).dl_base, ($1).dl_path::text, ($1).dl_comment, ($1).dl_token, ($1).dl_prev_token);
+$$ LANGUAGE SQL IMMUTABLE STRICT;
+CREATE FUNCTION datalink_record(datalink) RETURNS datalink_record AS $$
+    SELECT ROW(($1).dl_base, ($1).dl_path, ($1).dl_comment, ($1).dl_token, ($1).dl_prev_token)::datalink_record;
+$$ LANGUAGE SQL IMMUTABLE STRICT;
+CREATE CAST (datalink_record AS datalink) WITH FUNCTION datalink(datalink_record) AS ASSIGNMENT;
+CREATE CAST (datalink AS datalink_record) WITH FUNCTION datalink_record(datalink);
+
+----------------------------------------------------------------------------
+-- Add event trigger on CREATE TABLE to create index and triggers on table
+-- with datalink.
+----------------------------------------------------------------------------
+CREATE OR REPLACE FUNCTION add_datalink_trigger()
+  RETURNS event_trigger
+ LANGUAGE plpgsql
+  AS $$
+DECLARE
+  objtbl record;
+  obj record;
+BEGIN
+    FOR objtbl IN SELECT * FROM pg_event_trigger_ddl_commands()
+    LOOP
+        FOR obj IN SELECT a.atttypid,a.attname,t.typname,c.relkind,c.relispartition FROM pg_attribute a JOIN pg_type t ON (a.atttypid = t.oid) JOIN pg_class c ON (c.oid = a.attrelid) WHERE a.attrelid=objtbl.objid
+        LOOP
+            IF obj.typname = 'datalink' THEN
+                -- A datalink is unique by the indexed three columns. A unique
+                -- index of a partitioned table must hold the partition key,
+                -- each partition gets its own index instead.
+                IF obj.relkind <> 'p' THEN
+                    EXECUTE format('CREATE UNIQUE INDEX ON %s (((%s).dl_base), ((%s).dl_path), ((%s).dl_comment));', objtbl.object_identity, quote_ident(obj.attname), quote_ident(obj.attname), quote_ident(obj.attname));
+                END IF;
+                -- To be able to unlink a datalink set to NULL or to an empty
+                -- URL, add a row trigger. The one of a partitioned table is
+                -- cloned to its partitions.
+                IF NOT obj.relispartition THEN
+                    EXECUTE format('CREATE TRIGGER "dltrg_%s_upd" AFTER UPDATE ON %s FOR EACH ROW WHEN (OLD.%s IS NOT NULL AND (NEW.%s IS NULL OR (NEW.%s).dl_path = '''')) EXECUTE FUNCTION dlunlink_row(%L);', obj.attname, objtbl.object_identity, quote_ident(obj.attname), quote_ident(obj.attname), quote_ident(obj.attname), obj.attname);
+                END IF;
+                -- The datalinks of deleted rows are unlinked set-wise, a
+                -- statement on a partition fires the triggers of the
+                -- partition and one on the parent those of the parent.
+                EXECUTE format('CREATE TRIGGER "dltrg_%s_del" AFTER DELETE ON %s REFERENCING OLD TABLE AS dl_old FOR EACH STATEMENT EXECUTE FUNCTION dlunlink_stmt(%L);', obj.attname, objtbl.object_identity, obj.attname);
+                EXECUTE format('CREATE TRIGGER "dltrg_%s_trunc" BEFORE TRUNCATE ON %s FOR EACH STATEMENT EXECUTE FUNCTION dlunlink_truncate(%L);', obj.attname, objtbl.object_identity, obj.attname);
+            END IF;
+        END LOOP;
+    END LOOP;
+END;
+$$;
+
+CREATE EVENT TRIGGER datalink_event_trigger_ddl ON ddl_command_end
+   WHEN TAG IN ('CREATE TABLE')
+   EXECUTE FUNCTION add_datalink_trigger();
+--------------------------------------------------------------------
+-- Utility functions
+--------------------------------------------------------------------
+
+-- I/O Funtions
+CREATE FUNCTION datalink_copy_localfile(text, text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_unlink_localfile(uri) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_read_localfile(text, bigint, bigint) RETURNS bytea AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE;
+CREATE FUNCTION datalink_write_localfile(text, bytea) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_rename_localfile(text, text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_createlink_localfile(text, text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_relink_localfile(text, text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_register_token(text, text, text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_verify_token(text, boolean, text) RETURNS text AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_is_symlink(text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_symlink_target(text) RETURNS text AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_generate_token(text, text) RETURNS uuid AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_add_token(text, text) RETURNS text AS 'MODULE_PATHNAME' LANGUAGE C STABLE STRICT;
+CREATE FUNCTION datalink_xact_token() RETURNS text AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE;
+CREATE FUNCTION datalink_xact_link(text, text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_add_xact_link(text, text) RETURNS text AS 'MODULE_PATHNAME' LANGUAGE C IMMUTABLE STRICT;
+CREATE FUNCTION datalink_verify_xact_link(text, text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_migrate_layout(text, boolean, boolean) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_queue_unlink(text[], text[], boolean) RETURNS integer AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_unlink_table(regclass, text) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE;
+CREATE FUNCTION datalink_bulk_unlink(text[], text[], boolean[]) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_drop_table() RETURNS event_trigger AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION datalink_dropped_objects() RETURNS event_trigger AS 'MODULE_PATHNAME' LANGUAGE C;
+CREATE FUNCTION datalink_url_size(text[], boolean) RETURNS bigint[] AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_read_remotefile(text) RETURNS bytea AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_check_paths(text[], text[], bigint[]) RETURNS text[] AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_token_files(text) RETURNS text[] AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_scan_directory(text, text[], OUT path text, OUT ino bigint, OUT size bigint,
+        OUT mtime timestamp with time zone, OUT ctime timestamp with time zone)
+    RETURNS SETOF record AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_queue_copy(text, text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_wait_copy(text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_current_command() RETURNS text AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE;
+CREATE FUNCTION datalink_link_files(text[], text[], bigint[], bigint[], timestamp with time zone[], boolean[],
+        OUT n integer, OUT ino bigint, OUT size bigint, OUT mtime timestamp with time zone, OUT linked boolean)
+    RETURNS SETOF record AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_record_access(text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_access_flush(OUT dev bigint, OUT ino bigint, OUT last_access timestamp with time zone, OUT reads bigint)
+    RETURNS SETOF record AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE;
+CREATE FUNCTION datalink_file_stat(text, OUT dev bigint, OUT ino bigint, OUT size bigint, OUT mtime timestamp with time zone)
+    RETURNS record AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_tier_copy(text, text, text) RETURNS bigint AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_usage_move(text, text, text) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_usage_counters(boolean, OUT dirid integer, OUT live_bytes bigint, OUT live_files bigint,
+        OUT copy_bytes bigint, OUT copy_files bigint, OUT pending_bytes bigint, OUT pending_files bigint)
+    RETURNS SETOF record AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_usage_set(integer, bigint, bigint, bigint, bigint, bigint, bigint) RETURNS boolean AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE STRICT;
+CREATE FUNCTION datalink_copy_status(OUT pid integer, OUT src text, OUT dst text, OUT state text,
+        OUT bytes_total bigint, OUT bytes_done bigint, OUT queued_at timestamp with time zone, OUT error text)
+    RETURNS SETOF record AS 'MODULE_PATHNAME' LANGUAGE C VOLATILE;
+
+-- Asynchronous copies of files for the write tokens queued or in progress,
+-- see GUC datalink.dl_copy_workers.
+CREATE VIEW pg_datalink_copies AS SELECT * FROM datalink_copy_status();
+REVOKE ALL ON pg_datalink_copies FROM PUBLIC;
+GRANT SELECT ON pg_datalink_copies TO PUBLIC;
+
+-- Create SQL function used to create a token for reading
+CREATE FUNCTION datalink_register_accesstoken(uri, text) RETURNS boolean AS $$
+DECLARE
+    v_token uuid;
+    v_path text;
+    v_ret boolean;
+BEGIN
+    SELECT (regexp_match($1::text, '^.*\/([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+    IF v_token IS NULL THEN
+        SELECT (regexp_match($1::text, '^([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+        IF v_token IS NULL THEN
+            RAISE EXCEPTION 'can not found a token in url "%"', $1;
+        END IF;
+    END IF;
+    -- Get the path without token to register with the token and access mode
+    SELECT uri_get_path($1) INTO v_path;
+    SELECT datalink_register_token(v_token::text, $2, v_path) INTO v_ret;
+    IF NOT v_ret THEN
+        RAISE EXCEPTION 'can not register token!';
+    END IF;
+
+    RETURN v_ret;
+END
+$$ LANGUAGE plpgsql STRICT;
+
+-- Create SQL function used to create a token for reading
+CREATE FUNCTION datalink_register_readtoken(text) RETURNS boolean AS $$
+    SELECT datalink_register_accesstoken($1::uri, 'R'::text);
+$$ LANGUAGE SQL STRICT;
+
+-- Create SQL function used to create a token for writing
+CREATE FUNCTION datalink_register_writetoken(text) RETURNS boolean AS $$
+    SELECT datalink_register_accesstoken($1::uri, 'W'::text);
+$$ LANGUAGE SQL STRICT;
+
+-- Function to insert a Datalink token into an URL
+CREATE OR REPLACE FUNCTION add_token_to_url(vpath text, vtoken text) RETURNS text AS $$
+    -- Replace the last / with '/token;' or prefix the name with 'token;',
+    -- the fan-out subdirectories are inserted too with the hashed layout
+    SELECT datalink_add_token(vpath, vtoken);
+$$ LANGUAGE SQL STABLE STRICT;
+
+-- Function to remove the token part from the uri
+CREATE OR REPLACE FUNCTION remove_token_from_url(uri) RETURNS uri AS $$
+DECLARE
+    v_url uri;
+BEGIN
+    -- A link of a transaction scoped read token is dir/.dlxact/token/filename
+    IF $1::text ~ '\/\.dlxact\/[0-9a-f\-]{36}\/[^\/]+$' THEN
+        RETURN regexp_replace($1::text, '\/\.dlxact\/[0-9a-f\-]{36}\/([^\/]+)$', '/\1');
+    END IF;
+    -- Remove the fan-out subdirectories of the hashed layout if any
+    SELECT regexp_replace($1::text, '\/\.dl\/[0-9a-f]{2}\/[0-9a-f]{2}\/([0-9a-f\-]+;[^\/;]+)$', '/\1') INTO v_url;
+    SELECT regexp_replace(v_url, '^(.*\/)[0-9a-f\-]+;([^\/;]+)$', '\1\2') INTO v_url;
+    IF v_url IS NULL THEN
+        SELECT regexp_replace($1::text, '^[0-9a-f\-]+;([^\/;]+)$', '\1') INTO v_url;
+        IF v_url IS NULL THEN
+            RETURN $1;
+        END IF;
+    END IF;
+
+    RETURN v_url;
+END
+$$ LANGUAGE plpgsql STRICT;
+
+-- Function use to return the token from an url and validate it
+-- verify_token_from_uri(Uri-with-token, write-access)
+CREATE OR REPLACE FUNCTION verify_token_from_uri(uri, boolean) RETURNS uuid AS $$
+DECLARE
+    v_token text;
+    v_path text;
+    v_ret boolean;
+BEGIN
+    -- Links of a transaction scoped read token are named after the token
+    -- of the transaction and the token is bound to their link directory
+    SELECT (regexp_match($1::text, '\/\.dlxact\/([0-9a-f\-]{36})\/[^\/]+$'))[1] INTO v_token;
+    IF v_token IS NOT NULL THEN
+        IF $2 OR NOT datalink_verify_xact_link(v_token, uri_get_path($1)) THEN
+            RAISE EXCEPTION 'invalid token "%" to access file "%"', v_token, $1;
+        END IF;
+        RETURN v_token::uuid;
+    END IF;
+
+    SELECT (regexp_match($1::text, '^.*\/([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+    IF v_token IS NULL THEN
+        SELECT (regexp_match($1::text, '^([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+        IF v_token IS NULL THEN
+            RAISE EXCEPTION 'can not found a token in url "%"', $1;
+        END IF;
+    END IF;
+
+    -- Verify that the token length is a uuid v4
+    IF length(v_token) != 36 THEN
+        RAISE EXCEPTION 'invalid token length in url "%"', $1;
+    END IF;
+
+    -- Remove token from the uri and get the path
+    SELECT uri_get_path(remove_token_from_url($1)) INTO v_path;
+    -- Verify that we have a valid token to access to the file
+    SELECT is_valid_token(v_token::uuid, $2, v_path) INTO v_ret;
+    IF NOT v_ret THEN
+        RAISE EXCEPTION 'Invalid write token "%s" to access "%".', v_token, $1;
+    END IF;
+
+    RETURN v_token::uuid;
+END
+$$ LANGUAGE plpgsql VOLATILE STRICT;
+
+-- Verify that this is a valid token and that it has not expired
+-- Function is_valid_token(Token, For-writing, pathonly-without-token)
+CREATE OR REPLACE FUNCTION is_valid_token(uuid, boolean, text) RETURNS boolean AS $$
+DECLARE
+    v_path text;
+    v_path_wt text;
+BEGIN
+    -- When the token is valid and for the right access mode
+    -- the file path authorized with this token is returned
+    SELECT datalink_verify_token($1::text, $2, $3) INTO v_path;
+    IF v_path IS NULL THEN
+        RAISE EXCEPTION 'invalid token "%" to access file "%"', $1, $3;
+    ELSE
+        -- Verify that the file path requested for access
+        -- is the same as the one stored with the token
+        SELECT add_token_to_url($3, $1::text) INTO v_path_wt;
+        IF v_path_wt != v_path THEN
+            RAISE EXCEPTION 'Invalid path "%" for token "%", "%" <> "%"', $3, $1, v_path_wt, v_path;
+        END IF;
+    END IF;
+
+    RETURN true;
+END
+$$ LANGUAGE plpgsql VOLATILE STRICT;
+
+-- Function to read a local file and return its content as a bytea
+-- All file content will be stored in memory.
+CREATE OR REPLACE FUNCTION datalink_read_localfile(text) RETURNS bytea AS $$
+    SELECT datalink_read_localfile($1, 0, -1);
+$$ LANGUAGE SQL STRICT;
+
+-- Function to rebase an URL through the directory base
+CREATE FUNCTION dl_url_rebase(uri, integer) RETURNS uri AS $$
+    SELECT uri_rebase_url($1, base) FROM pg_datalink_bases WHERE dirid = $2;
+$$ LANGUAGE SQL STRICT;
+
+-- Function used to retrieve all base directory information for a datalink
+-- following its directory id or name
+-- dl_directory_base(directory-id, directory-name)
+CREATE OR REPLACE FUNCTION dl_directory_base(integer, text) RETURNS pg_datalink_bases AS $$
+DECLARE
+    v_directory pg_datalink_bases%rowtype;
+BEGIN
+    -- Both NULL parameters is not possible
+    IF $1 IS NULL AND $2 IS NULL THEN
+        RAISE EXCEPTION 'Datalink base directory NULL can not be found.';
+    END IF;
+
+    -- Extract directory information
+    IF $1 IS NOT NULL THEN
+        SELECT * INTO v_directory FROM pg_datalink_bases WHERE dirid = $1;
+        IF NOT FOUND THEN
+            RAISE EXCEPTION 'Datalink base directory with id "%" is not found.', $1;
+        END IF;
+    ELSE
+        SELECT * INTO v_directory FROM pg_datalink_bases WHERE dirname=$2;
+        IF NOT FOUND THEN
+            RAISE EXCEPTION 'Datalink base directory with name "%" is not found.', $2;
+        END IF;
+    END IF;
+    RETURN v_directory;
+END
+$$ LANGUAGE plpgsql;
+
+CREATE FUNCTION dl_directory_base(integer) RETURNS pg_datalink_bases AS $$
+    SELECT dl_directory_base($1, NULL);
+$$ LANGUAGE SQL STRICT;
+
+CREATE FUNCTION dl_directory_base(text) RETURNS pg_datalink_bases AS $$
+    SELECT dl_directory_base(NULL, $1);
+$$ LANGUAGE SQL STRICT;
+
+-- Function used to return a relative path from a base
+CREATE FUNCTION dl_relative_path(uri, uri) RETURNS text AS $$
+DECLARE
+    v_uri uri;
+    v_path text;
+    v_ret boolean;
+BEGIN
+    -- Start to rebase the uri
+    SELECT uri_rebase_url($1, $2) INTO v_uri;
+    -- Then get relative path
+    IF uri_get_scheme(v_uri) = 'file' THEN
+        SELECT uri_get_relative_path(v_uri, $2) INTO v_path;
+    ELSE
+        IF uri_get_host($2) != '' THEN
+            SELECT uri_get_relative_path(v_uri, $2) INTO v_path;
+        ELSE
+            RETURN $1;
+        END IF;
+    END IF;
+    -- In case we just have the base return the uri
+    IF v_path = '' OR v_path IS NULL THEN
+        RETURN v_uri;
+    END IF;
+
+    RETURN v_path;
+END
+$$ LANGUAGE plpgsql STRICT;
+
+
+---------------------------------------------------------------
+-- Datalink Standard ISO functions
+---------------------------------------------------------------
+
+-- The DLCOMMENT function returns the comment value from a DataLink value.
+-- DLCOMMENT(DataLink)
+CREATE FUNCTION dlcomment(datalink) RETURNS text AS $$
+    SELECT ($1).dl_comment;
+$$ LANGUAGE SQL STRICT;
+
+-- The DLURLCOMPLETEONLY function returns the complete URL
+-- value from a DataLink value.
+-- DLURLCOMPLETEONLY(DataLink)
+CREATE FUNCTION dlurlcompleteonly(datalink) RETURNS text AS $$
+    SELECT CASE WHEN ($1).dl_path = '' THEN '' ELSE dl_url_rebase(($1).dl_path, ($1).dl_base)::text END;
+$$ LANGUAGE SQL STRICT;
+
+-- The DLURLPATHONLY function returns the path and file name from a DataLink value
+-- DLURLPATHONLY(Datalink)
+CREATE FUNCTION dlurlpathonly(datalink) RETURNS text AS $$
+    SELECT CASE WHEN ($1).dl_path = '' THEN '' ELSE uri_get_path(dl_url_rebase(($1).dl_path, ($1).dl_base)) END;
+$$ LANGUAGE SQL STRICT;
+
+-- The DLURLSCHEME function returns the scheme from a Datalink value
+-- DLURLSCHEME(Datalink)
+CREATE OR REPLACE FUNCTION dlurlscheme(datalink) RETURNS text AS $$
+    SELECT CASE WHEN ($1).dl_path = '' THEN '' ELSE lower(uri_get_scheme(dl_url_rebase(($1).dl_path, ($1).dl_base))) END;
+$$ LANGUAGE SQL STRICT;
+
+-- The DLURLSERVER function returns the file server from a Datalink value
+-- DLURLSERVER(Datalink)
+CREATE FUNCTION dlurlserver(datalink) RETURNS text AS $$
+DECLARE
+    v_server  text;
+BEGIN
+    -- Return an error id the URI is not an URL
+    IF uri_get_scheme(($1).dl_path) = 'file' THEN
+        RAISE WARNING 'Function dlurlserver() can only be used with link type URL.';
+        RETURN NULL;
+    END IF;
+    -- Return a zero length string if the URI is empty
+    IF ($1).dl_path = '' THEN
+        RETURN '';
+    END IF;
+    -- Only URL can have server
+    IF uri_get_scheme(($1).dl_path) = '' OR uri_get_scheme(($1).dl_path) = 'file' THEN
+        RETURN NULL;
+    END IF;
+    SELECT lower(uri_get_host(dl_url_rebase(($1).dl_path, ($1).dl_base))) INTO v_server;
+    RETURN v_server;
+END
+$$ LANGUAGE plpgsql STRICT;
+
+-- The DLLINKTYPE function returns the linktype value from a DATALINK value (FILE or URL)
+-- DLLINKTYPE(Datalink)
+CREATE OR REPLACE FUNCTION dllinktype(datalink) RETURNS text AS $$
+    SELECT dirname FROM pg_datalink_bases WHERE dirid = ($1).dl_base;
+$$ LANGUAGE SQL STRICT;
+
+-- Function to get defaut directory to use following the URI
+CREATE OR REPLACE FUNCTION dl_default_linktype(uri) RETURNS text AS $$
+SELECT CASE WHEN uri_get_scheme($1) = '' OR uri_get_scheme($1) = 'file' THEN 'FILE' ELSE 'URL' END;
+$$ LANGUAGE SQL STRICT;
+
+-- The DLFILESIZE function returns the size of the file represented by a DataLink value.
+-- DLFILESIZE(DataLink)
+CREATE FUNCTION dlfilesize(datalink) RETURNS bigint AS $$
+DECLARE
+    v_uri uri;
+    v_size bigint;
+    v_scheme text;
+BEGIN
+    SELECT dl_url_rebase(($1).dl_path, ($1).dl_base) INTO v_uri;
+    SELECT uri_get_scheme(v_uri) INTO v_scheme;
+    IF v_scheme = '' OR v_scheme = 'file' THEN
+        SELECT uri_localpath_size(v_uri) INTO v_size;
+    ELSE
+        -- Remote files metadata are cached and the connections reused
+        SELECT (datalink_url_size(ARRAY[v_uri::text], true))[1] INTO v_size;
+    END IF;
+
+    RETURN v_size;
+END
+$$ LANGUAGE plpgsql STRICT;
+
+-- Batched version of DLFILESIZE, returns the sizes of the files of an array
+-- of datalinks in the same order. Remote files are requested concurrently.
+-- DLFILESIZE(DataLink[])
+CREATE FUNCTION dlfilesize(datalink[]) RETURNS bigint[] AS $$
+    SELECT datalink_url_size(array_agg(dl_url_rebase((d).dl_path, (d).dl_base)::text ORDER BY n), false)
+        FROM unnest($1) WITH ORDINALITY AS u(d, n);
+$$ LANGUAGE SQL STRICT;
+
+-- The DLFILESIZEEXACT function returns the size of the file represented by a DataLink value.
+-- DLFILESIZEEXACT(DataLink) 
+CREATE FUNCTION dlfilesizeexact(datalink) RETURNS bigint AS $$
+    SELECT dlfilesize($1);
+$$ LANGUAGE SQL STRICT;
+
+-- SQL/MED functions
+-- The DLVALUE function returns a DataLink value for UPDATE statement.
+-- As we can not obtain obtain the datalink impacted by the update in
+-- plpgsql this function received the mofified datalink at first argument.
+-- DLVALUE(datalink, data-location, directory-name, comment)
+CREATE FUNCTION dlvalue(datalink, uri, text, text) RETURNS datalink AS $$
+DECLARE
+    v_directory record;
+    v_base uri;
+    v_uri uri;
+    v_ret boolean;
+    v_comment text := $4;
+    v_dirname text := $3;
+    v_srcpath text;
+    v_dstpath text;
+    v_linked_url text;
+    v_datalink datalink;
+    v_token uuid;
+BEGIN
+    -- This function can only be used in an UPDATE statement, the query
+    -- text is only looked at when the command type is not known
+    IF coalesce(datalink_current_command() = 'INSERT',
+            regexp_match(current_query(), '[,\(]\s*dlvalue', 'i') IS NOT NULL) THEN
+        RAISE EXCEPTION 'Use of dlvalue(datalink, uri, text, text) in an insert statement is not authorized.';
+    END IF;
+
+    -- If data location is NULL returns NULL
+    IF $2 IS NULL THEN
+        RETURN NULL;
+    END IF;
+
+    -- Set comment
+    IF v_comment IS NULL AND $1 IS NOT NULL THEN
+        SELECT ($1).dl_comment INTO v_comment;
+    END IF;
+
+    -- If the datalink is null or the url is empty just proceed like an insert statement
+    -- Add the true value at end to notice dlvalue() for insert to not check the statement.
+    IF $1 IS NULL THEN
+
+        -- Set default directory as it can be NULL, set it to FILE if this is not a well defined URL
+        SELECT dl_default_linktype($2) INTO v_dirname;
+        IF v_dirname IS NULL THEN
+            RAISE EXCEPTION 'No default base directory found corresponding to this URL.';
+        END IF;
+    
+        -- Get options for this directory
+        SELECT * INTO v_directory FROM dl_directory_base(v_dirname);
+    
+        -- If the URL is an empty string return a datalink with an zero length uri
+        IF $2 = '' THEN
+            -- Construct the datalink that will be returned
+            SELECT dl_make(v_directory.dirid, '', v_comment, NULL::uuid, NULL::uuid) INTO v_datalink;
+            RETURN v_datalink;
+        END IF;
+    END IF;
+
+    -- Set directory from updated datalink as the parameter value can be NULL
+    IF v_dirname IS NULL THEN
+        -- Get directory name from updated datalink
+       SELECT * INTO v_directory FROM dl_directory_base(($1).dl_base);
+    END IF;
+
+    -- Get options for this directory
+    SELECT * INTO v_directory FROM dl_directory_base(v_dirname);
+
+    -- If the URL is an empty string return a datalink with an zero length uri
+    IF $2 = '' THEN
+        SELECT '' INTO v_uri;
+        -- Construct the datalink that will be returned
+        SELECT dl_make(v_directory.dirid, '', v_comment, NULL::uuid, NULL::uuid) INTO v_datalink;
+        RETURN v_datalink;
+    END IF;
+
+    -- With DLVALUE a token in URL is not used, shall be removed
+    SELECT remove_token_from_url($2) INTO v_uri;
+
+    -- Rebase URL following the directory base URL
+    SELECT base INTO v_base FROM pg_datalink_bases WHERE dirid = v_directory.dirid;
+    IF FOUND THEN
+        SELECT uri_get_str(uri_rebase_url(v_uri, v_base)) INTO v_uri;
+    ELSE
+        -- This should not happen as the base column has a NOT NULL constraint
+        RAISE EXCEPTION 'No base found for directory "%" when rebasing URI %', v_directory.dirid, $2;
+    END IF;
+
+    -- Check that the scheme is 'file' or 'http' otherwise throw an error
+    IF uri_get_scheme(v_uri) != 'file' AND uri_get_scheme(v_uri) != 'http' THEN
+        RAISE EXCEPTION 'Invalid uri "%" for datalink, only file:// or http:// schemes are supported', v_uri;
+    END IF;
+
+    -- Now check that the URI has the same directory base
+    IF regexp_matches(v_uri::text, '^'||v_base::text) IS NOT NULL THEN
+        SELECT uri_get_path(v_uri) INTO v_srcpath;
+        -- With NO LINK CONTROL just set new datalink value and return
+        IF NOT v_directory.linkcontrol THEN
+            SELECT dl_make(v_directory.dirid, dl_relative_path(v_uri, v_directory.base), v_comment, NULL::uuid, NULL::uuid) INTO v_datalink;
+            RETURN v_datalink;
+        END IF;
+        -- Check that we have write permission
+        IF v_directory.writeperm THEN
+            -- With FILE LINK CONTROL be sure that file exists on filesystem
+            IF NOT uri_path_exists(v_srcpath::uri) THEN
+                 RAISE EXCEPTION 'DataLink file "%" must exists on filesystem.', v_srcpath;
+            END IF;
+            -- If the file is a symlink get the target file and
+            -- extract the token from the file to save it
+            IF datalink_is_symlink(v_srcpath) THEN
+                SELECT datalink_symlink_target(v_srcpath) INTO v_dstpath;
+                -- Get the token from inside the target file path
+                SELECT (regexp_match(v_dstpath, '^.*\/([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+                IF v_token IS NULL THEN
+                    SELECT (regexp_match(v_dstpath, '^([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+                END IF;
+            ELSE
+                -- Get the token from inside the target file path
+                SELECT (regexp_match(v_dstpath, '^.*\/([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+                IF v_token IS NULL THEN
+                    SELECT (regexp_match(v_dstpath, '^([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+                END IF;
+            END IF;
+            -- With a new file without token genere one and rename the file with a token
+            IF v_token IS NULL THEN
+                -- Create a symlink with the token for reading to allow access to the target file
+                SELECT uuid_generate_v4() INTO v_token;
+                SELECT add_token_to_url(v_srcpath, v_token::text) INTO v_dstpath;
+                -- Rename the file with its token
+                SELECT datalink_rename_localfile(v_srcpath, v_dstpath) INTO v_ret;
+                IF NOT v_ret THEN
+                    RAISE EXCEPTION 'can not rename file "%" into "%"', v_srcpath, v_dstpath;
+                END IF;
+            END IF;
+            -- Construct the datalink that will be returned and move old token to dl_re_token column
+            SELECT dl_make(v_directory.dirid, dl_relative_path(v_uri, v_directory.base), v_comment, v_token, ($1).dl_token) INTO v_datalink;
+        ELSE
+            RAISE EXCEPTION 'No write permission to file "%"', v_uri;
+        END IF;
+    ELSE
+        RAISE EXCEPTION 'DataLink URL "%" does not match directory base "%"', v_uri, v_base;
+    END IF;
+
+    -- Store archive information if RECOVERY YES attribute is set
+    IF v_directory.recovery THEN
+	INSERT INTO pg_datalink_archives VALUES (v_directory.dirid, dl_url_rebase(v_uri, v_directory.dirid)) ON CONFLICT DO NOTHING;
+    END IF;
+
+    RETURN v_datalink;
+END
+$$ LANGUAGE plpgsql;
+
+--  Overload dlvalue function to allow no comment in parameters
+CREATE FUNCTION dlvalue(datalink, uri, text) RETURNS datalink AS $$
+    SELECT dlvalue($1, $2, $3, NULL::text);
+$$ LANGUAGE SQL;
+
+--  Overload dlvalue function to allow directory and no comment in parameters
+CREATE FUNCTION dlvalue(datalink, uri) RETURNS datalink AS $$
+    SELECT dlvalue($1, $2, NULL::text, NULL::text);
+$$ LANGUAGE SQL;
+
+--  Overload dlvalue function to create an empty Datalink just with a comment
+CREATE FUNCTION dlvalue(datalink, text) RETURNS datalink AS $$
+    SELECT dlvalue($1, ''::uri, NULL::text, $2);
+$$ LANGUAGE SQL;
+
+-- SQL/MED functions
+-- The DLVALUE function returns a DataLink value for INSERT statement. As it
+-- can only be used to insert new entry we do not need to register a token.
+-- DLVALUE(data-location, directory-name, comment)
+CREATE FUNCTION dlvalue(uri, text, text) RETURNS datalink AS $$
+DECLARE
+    v_directory record;
+    v_base uri;
+    v_uri uri;
+    v_comment text := $3;
+    v_dirname text := $2;
+    v_srcpath text;
+    v_dstpath text;
+    v_datalink datalink;
+    v_token uuid;
+    v_ret boolean;
+BEGIN
+    -- This function can only be used in an INSERT statement
+    IF coalesce(datalink_current_command() = 'UPDATE',
+            regexp_match(current_query(), '=\s*dlvalue', 'i') IS NOT NULL) THEN
+        RAISE EXCEPTION 'Use of dlvalue(uri, text, text) in an update statement is not authorized, use the dlvalue(datalink, uri, text, text) form instead.';
+    END IF;
+
+    -- If data location is NULL returns NULL
+    IF $1 IS NULL THEN
+        RETURN NULL;
+    END IF;
+
+    -- Set default directory as it can be NULL, set it to FILE if this is not a well defined URL
+    IF v_dirname IS NULL THEN
+        SELECT dl_default_linktype($1) INTO v_dirname;
+        IF v_dirname IS NULL THEN
+            RAISE EXCEPTION 'No directory found corresponding to this URI, this is not authorized.';
+        END IF;
+    END IF;
+
+    -- Get options for this directory
+    SELECT * INTO v_directory FROM dl_directory_base(v_dirname);
+
+    -- If the URL is an empty string return a datalink with an zero length uri
+    IF $1 = '' THEN
+        -- Construct the datalink that will be returned
+        SELECT dl_make(v_directory.dirid, '', v_comment, NULL::uuid, NULL::uuid) INTO v_datalink;
+    ELSE
+        -- Rebase URL following the directory base URL
+        SELECT uri_get_str(uri_rebase_url($1, v_directory.base)) INTO v_uri;
+
+	-- Check that the scheme is 'file' or 'http' otherwise throw an error
+	IF uri_get_scheme(v_uri) != 'file' AND uri_get_scheme(v_uri) != 'http' THEN
+	     RAISE EXCEPTION 'Invalid uri "%" for datalink, only file:// or http:// schemes are supported', v_uri;
+	END IF;
+
+        -- Now be sure that the URI has the same directory base to continue the work
+        IF regexp_matches(v_uri::text, '^'||v_directory.base::text) IS NOT NULL THEN
+            SELECT uri_get_path(v_uri) INTO v_srcpath;
+            -- With NO LINK CONTROL just set new datalink value and return
+            IF NOT v_directory.linkcontrol THEN
+                SELECT dl_make(v_directory.dirid, dl_relative_path(v_uri, v_directory.base), v_comment, NULL::uuid, NULL::uuid) INTO v_datalink;
+                RETURN v_datalink;
+            END IF;
+            -- Check that we have write permission
+            IF v_directory.writeperm THEN
+                -- With FILE LINK CONTROL be sure that file exists on filesystem
+                IF NOT uri_path_exists(v_srcpath::uri) THEN
+                     RAISE EXCEPTION 'DataLink file "%" must exists on filesystem.', v_srcpath;
+                END IF;
+                
+                -- If the file is a symlink get the target file and
+                -- extract the token from the file to save it
+                IF datalink_is_symlink(v_srcpath) THEN
+                    SELECT datalink_symlink_target(v_srcpath) INTO v_dstpath;
+                    -- Get the token from inside the target file path
+                    SELECT (regexp_match(v_dstpath, '^.*\/([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+                    IF v_token IS NULL THEN
+                        SELECT (regexp_match(v_dstpath, '^([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+                    END IF;
+                ELSE
+                    -- Get the token from inside the target file path
+                    SELECT (regexp_match(v_srcpath, '^.*\/([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+                    IF v_token IS NULL THEN
+                        SELECT (regexp_match(v_srcpath, '^([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_token;
+                    END IF;
+                    -- With a new file without token genere one and rename the file with a token
+                    IF v_token IS NULL AND v_directory.writetoken THEN
+                        -- Create a symlink with the token for reading to allow access to the target file
+                        SELECT uuid_generate_v4() INTO v_token;
+                        SELECT add_token_to_url(v_srcpath, (v_token)::text) INTO v_dstpath;
+                        -- Rename the file with its token
+                        SELECT datalink_rename_localfile(v_srcpath, v_dstpath) INTO v_ret;
+                        IF NOT v_ret THEN
+                            RAISE EXCEPTION 'can not rename file "%" into "%"', v_srcpath, v_dstpath;
+                        END IF;
+                    END IF;
+                END IF;
+                -- Remove token from url
+                SELECT remove_token_from_url(uri_get_path(v_uri)::uri) INTO v_uri;
+                -- Construct the datalink that will be returned we don't use token for insert
+                SELECT dl_make(v_directory.dirid, dl_relative_path(v_uri, v_directory.base), v_comment, v_token, NULL::uuid) INTO v_datalink;
+            ELSE
+                RAISE EXCEPTION 'No write permission to file "%"', v_uri;
+            END IF;
+        ELSE
+            RAISE EXCEPTION 'DataLink URL "%" does not match directory base "%"', v_uri, v_directory.base;
+        END IF;
+    END IF;
+
+    -- Store archive information if RECOVERY YES attribute is set
+    IF v_directory.recovery THEN
+	INSERT INTO pg_datalink_archives VALUES (v_directory.dirid, dl_url_rebase(v_uri, v_directory.dirid)) ON CONFLICT DO NOTHING;
+    END IF;
+
+    RETURN v_datalink;
+END
+$$ LANGUAGE plpgsql;
+
+--  Overload dlvalue function to allow no comment in parameters
+CREATE FUNCTION dlvalue(uri, text) RETURNS datalink AS $$
+    SELECT dlvalue($1, $2, NULL::text);
+$$ LANGUAGE SQL;
+
+--  Overload dlvalue function to allow directory and no comment in parameters
+CREATE FUNCTION dlvalue(uri) RETURNS datalink AS $$
+    SELECT dlvalue($1, NULL::text, NULL::text);
+$$ LANGUAGE SQL;
+
+--  Overload dlvalue function to create an empty Datalink just with a comment
+CREATE FUNCTION dlvalue(text) RETURNS datalink AS $$
+    SELECT dlvalue(''::uri, NULL::text, $1);
+$$ LANGUAGE SQL;
+
+
+-- The DLNEWCOPY function returns a Datalink value which has an attribute
+-- indicating that the referenced file has changed. The datalink value returned
+-- by DLNEWCOPY indicates to the SQL-server that the content of the file, referenced
+-- by that datalink, is different (i.e., the content has changed, but not the URL)
+-- from what was previously referenced by the datalink.
+-- As we can not obtain obtain the datalink impacted by the update in
+-- plpgsql this function received the mofified datalink at first argument.
+-- DLNEWCOPY(datalink, data-location, hasToken)
+CREATE OR REPLACE FUNCTION dlnewcopy(datalink, uri, boolean) RETURNS datalink AS $$
+DECLARE
+    v_directory record;
+    v_uri uri;
+    v_pathorig text;
+    v_ret boolean;
+    v_token uuid;
+    v_datalink datalink;
+BEGIN
+    -- dlnewcopy() can only be used in UPDATE statement
+    IF NOT coalesce(datalink_current_command() IN ('UPDATE', 'MERGE'),
+            regexp_match(current_query(), '=\s*dlnewcopy', 'i') IS NOT NULL) THEN
+        RAISE EXCEPTION 'Function dlnewcopy() can only be called in an UPDATE statement.';
+    END IF;
+
+    -- Return NULL is the datalink is NULL
+    IF $1 IS NULL THEN
+        RAISE EXCEPTION 'null argument passed to datalink constructor.';
+    END IF;
+    -- Return NULL is the data location is NULL
+    IF $2 IS NULL THEN
+        RAISE EXCEPTION 'null argument passed to data location.';
+    END IF;
+    -- The token indication can not be null
+    IF $3 IS NULL THEN
+        RAISE EXCEPTION 'null argument passed to token indication.';
+    END IF;
+
+    -- Get default base directory
+   SELECT * INTO v_directory FROM dl_directory_base(($1).dl_base);
+
+    -- With NO LINK CONTROL we have nothing to do here
+    IF NOT v_directory.linkcontrol THEN
+        RAISE EXCEPTION 'The Datalink has the NO LINK CONTROL, writing is not authorized.';
+    END IF;
+
+    -- If the URI has the token inside verify that it is well formed
+    IF $3 THEN
+        -- Get the token from inside the uri
+        SELECT verify_token_from_uri($2, true) INTO v_token;
+        -- and remove it from the uri
+        SELECT remove_token_from_url($2) INTO v_uri;
+    ELSE
+        -- When the datalink do not require a token for writing, the URL must have the '.new' suffix
+        IF NOT v_directory.writetoken THEN
+            SELECT (regexp_match($2::text, '^.*.new$'))[1] INTO v_uri;
+            IF v_uri IS NULL THEN
+                RAISE EXCEPTION 'when NOT REQUIRING TOKEN FOR UPDATE the new URL must have the ".new" suffix.';
+            END IF;
+        ELSE
+            -- A token is mandatory
+            RAISE EXCEPTION 'the Datalink has the REQUIRING TOKEN FOR UPDATE attribute, a token for writing is mandatory.';
+        END IF;
+    END IF;
+
+    -- Rebase the URL with the directory base
+    SELECT uri_get_str(uri_rebase_url(v_uri, v_directory.base)) INTO v_uri;
+
+    -- Verify that both old and new URI are the same without token
+    IF dlurlcompleteonly($1) != v_uri::text AND dlurlcompleteonly($1)||'.new' != v_uri::text THEN
+        IF v_directory.writetoken THEN
+            RAISE EXCEPTION 'URI are not the same "%s" to "%s"', dlurlcompleteonly($1), v_uri;
+        ELSE
+            RAISE EXCEPTION 'URI are not the same "%s" to "%s"', dlurlcompleteonly($1)||'.new', v_uri;
+        END IF;
+    END IF;
+
+    -- Check that we have write permission
+    IF v_directory.writeperm THEN
+        -- Get path of the original file without token to work on the symlink only
+        SELECT dlurlpathonly($1) INTO v_pathorig;
+
+        -- Get full filename on disk with the token of the new file
+        SELECT uri_get_str(uri_rebase_url($2, v_directory.base)) INTO v_uri;
+        -- The copy of the file for the write token may still be in progress
+        PERFORM datalink_wait_copy(uri_get_path(v_uri));
+
+        -- Verify that the new file exists it must have been
+        -- created by DLURLCOMPLETEWRITE or DLURLPATHWRITE
+        IF NOT uri_path_exists(v_uri) THEN
+            RAISE EXCEPTION 'Data location source file "%" must exists on filesystem.', v_uri;
+        END IF;
+
+        -- When no token is require just rename origin file with the .old extension
+        -- and rename new file by removing the .new extension to the original name.
+        IF NOT v_directory.writetoken THEN
+            -- Rename current file with the old suffix so that it can be restored using dlpreviouscopy
+            SELECT datalink_rename_localfile(v_pathorig, v_pathorig||'.old') INTO v_ret;
+            IF NOT v_ret THEN
+                RAISE EXCEPTION 'can not rename new file "%" into "%"', v_pathorig, v_pathorig||'.old';
+            END IF;
+            -- Rename new file with the .new suffix into the original name
+            SELECT datalink_rename_localfile(v_pathorig||'.new', v_pathorig) INTO v_ret;
+
+            -- Return the datalink without token
+            SELECT dl_make(($1).dl_base, dl_relative_path(($1).dl_path, v_directory.base), ($1).dl_comment, NULL::uuid, NULL::uuid) INTO v_datalink;
+        ELSE
+            -- The copy is now the linked file and the current one becomes the previous copy
+            PERFORM dl_usage_move(uri_get_path(v_uri), 'pending', 'live');
+            IF ($1).dl_token IS NOT NULL THEN
+                PERFORM dl_usage_move(uri_get_path(add_token_to_url(v_pathorig, (($1).dl_token)::text)::uri), 'live', 'copy');
+            END IF;
+            IF ($1).dl_prev_token IS NOT NULL THEN
+                PERFORM dl_usage_move(uri_get_path(add_token_to_url(v_pathorig, (($1).dl_prev_token)::text)::uri), 'copy', 'pending');
+            END IF;
+            -- Return the datalink with the new tokens
+            SELECT dl_make(($1).dl_base, dl_relative_path(($1).dl_path, v_directory.base), ($1).dl_comment, v_token, ($1).dl_token) INTO v_datalink;
+        END IF;
+    ELSE
+        -- No write permission
+        RAISE EXCEPTION 'No write permission on directory "%".', v_directory.dirname;
+    END IF;
+
+    -- Store archive information if RECOVERY YES attribute is set
+    IF v_directory.recovery THEN
+	INSERT INTO pg_datalink_archives VALUES (($1).dl_base, dl_url_rebase(($1).dl_path, ($1).dl_base)) ON CONFLICT DO NOTHING;
+    END IF;
+
+    RETURN v_datalink;
+END
+$$ LANGUAGE plpgsql;
+
+-- The DLPREVIOUSCOPY function returns a Datalink value which has an attribute
+-- indicating that the referenced file has changed.
+-- As we can not obtain obtain the datalink impacted by the update in
+-- plpgsql this function received the mofified datalink at first argument.
+-- DLPREVIOUSCOPY(datalink, data-location, hasToken)
+CREATE OR REPLACE FUNCTION dlpreviouscopy(datalink, uri, boolean) RETURNS datalink AS $$
+DECLARE
+    v_directory record;
+    v_uri uri;
+    v_path text;
+    v_pathorig text;
+    v_ret boolean;
+    v_datalink datalink;
+BEGIN
+    -- dlpreviouscopy() can only be used in UPDATE statement
+    IF NOT coalesce(datalink_current_command() IN ('UPDATE', 'MERGE'),
+            regexp_match(current_query(), '=\s*dlpreviouscopy', 'i') IS NOT NULL) THEN
+        RAISE EXCEPTION 'Function dlpreviouscopy() can only be called in an UPDATE statement.';
+    END IF;
+
+    -- Return NULL is the datalink is NULL
+    IF $1 IS NULL THEN
+        RAISE EXCEPTION 'null argument passed to datalink constructor.';
+    END IF;
+    -- Return NULL is the data location is NULL
+    IF $2 IS NULL THEN
+        RAISE EXCEPTION 'null argument passed to data location.';
+    END IF;
+    -- The token indication can not be null
+    IF $3 IS NULL THEN
+        RAISE EXCEPTION 'null argument passed to token indication.';
+    END IF;
+
+    -- Get default base directory
+   SELECT * INTO v_directory FROM dl_directory_base(($1).dl_base);
+
+    -- With NO LINK CONTROL we have nothing to do here
+    IF NOT v_directory.linkcontrol THEN
+        RAISE EXCEPTION 'The Datalink has the NO LINK CONTROL, writing is not authorized.';
+    END IF;
+
+    -- If the URI has the token inside verify that it is well formed and valid
+    IF $3 THEN
+        -- Get the token from inside the uri
+        PERFORM verify_token_from_uri($2, true);
+        -- and remove it from the uri
+        SELECT remove_token_from_url($2) INTO v_uri;
+        -- Raise an error if there is not previous token and no .old file exists
+        IF ($1).dl_prev_token IS NULL THEN
+            -- Verify that there is a .old file, if it exists this is the original file to be restored
+            IF NOT uri_path_exists((v_uri::text||'.old')::uri) THEN
+                RAISE EXCEPTION 'no previous datalink to restore.';
+            END IF;
+        END IF;
+    ELSE
+        -- When the datalink do not require a token for writing, the URL must have the '.new' suffix
+        IF NOT v_directory.writetoken THEN
+            SELECT (regexp_match($2::text, '^.*.old$'))[1] INTO v_uri;
+            IF v_uri IS NULL THEN
+                RAISE EXCEPTION 'when NOT REQUIRING TOKEN FOR UPDATE the previous URL must have the ".old" suffix.';
+            END IF;
+        ELSE
+            -- A token is mandatory
+            RAISE EXCEPTION 'the Datalink hes the REQUIRING TOKEN FOR UPDATE attribute, a token for writing is mandatory.';
+        END IF;
+    END IF;
+
+    -- Rebase the URL with the directory base
+    SELECT uri_get_str(uri_rebase_url(v_uri, v_directory.base)) INTO v_uri;
+
+    -- Verify that both old and new URI are the same without token
+    IF dlurlcompleteonly($1) != v_uri::text AND dlurlcompleteonly($1)||'.old' != v_uri::text THEN
+        IF v_directory.writetoken THEN
+            RAISE EXCEPTION 'URI are not the same "%s" to "%s, can not restore previous version"', dlurlcompleteonly($1), v_uri;
+        ELSE
+            RAISE EXCEPTION 'URI are not the same "%s" to "%s, can not restore previous version"', dlurlcompleteonly($1)||'.old', v_uri;
+        END IF;
+    END IF;
+
+    -- Check that we have write permission
+    IF v_directory.writeperm THEN
+
+        -- Get path of the original file without token to work on the symlink only
+        SELECT dlurlpathonly($1) INTO v_pathorig;
+
+        -- Get full filename on disk with the token of the new file
+        SELECT uri_get_str(uri_rebase_url($2, v_directory.base)) INTO v_uri;
+
+        -- Verify that the new file exists it must have been
+        -- created by DLURLCOMPLETEWRITE or DLURLPATHWRITE
+        IF NOT uri_path_exists(v_uri) THEN
+            RAISE EXCEPTION 'Data location source file "%" must exists on filesystem.', v_uri;
+        END IF;
+
+        -- When no token is require just rename file with the .old extension into
+        -- the original name after removing the original file.
+        IF NOT v_directory.writetoken THEN
+            -- Rename .old file into the original name
+            SELECT datalink_rename_localfile(v_pathorig||'.old', v_pathorig) INTO v_ret;
+            IF NOT v_ret THEN
+                RAISE EXCEPTION 'can not rename old file "%" into "%"', v_pathorig||'.old', v_pathorig;
+            END IF;
+
+            -- Return the datalink without token
+            SELECT dl_make(($1).dl_base, dl_relative_path(($1).dl_path, v_directory.base), ($1).dl_comment, NULL::uuid, NULL::uuid) INTO v_datalink;
+
+        ELSE
+
+            -- Set link target from the previous token or from the .old file if dl_prev_token is null
+            IF ($1).dl_prev_token IS NULL THEN
+                -- Set target to .old file
+                SELECT (v_pathorig||'.old') INTO v_path;
+            ELSE
+                -- Add old token to the url to relink to this file
+                SELECT add_token_to_url(v_pathorig, (($1).dl_prev_token)::text) INTO v_path;
+            END IF;
+
+            -- Verify that the path to previous file exists
+            IF NOT uri_path_exists(v_path::uri) THEN
+                RAISE EXCEPTION 'Data location of previous file "%" must exists on filesystem.', v_path;
+            END IF;
+            -- Recreate symlink to the previous linked file if this is not a first copy
+            IF ($1).dl_prev_token IS NOT NULL THEN
+                SELECT datalink_relink_localfile(uri_get_path(v_pathorig::uri), uri_get_path(v_path)) INTO v_ret;
+                IF NOT v_ret THEN
+                    RAISE EXCEPTION 'can not relink "%s" to "%s"', v_pathorig, v_path;
+                END IF;
+                PERFORM dl_usage_move(uri_get_path(v_path), 'copy', 'live');
+            ELSE
+                -- Override the link with the .old file
+                SELECT datalink_rename_localfile(v_path, v_pathorig) INTO v_ret;
+                IF NOT v_ret THEN
+                    RAISE EXCEPTION 'can not rename "%s" to "%s"', v_path, v_pathorig;
+                END IF;
+            END IF;
+
+	    -- Unlink the copy as it is no more referenced.
+            IF ($1).dl_token IS NOT NULL THEN
+		-- RAISE NOTICE 'removing copy file "%" after call to dlpreviouscopy()', v_uri;
+                SELECT datalink_unlink_localfile(v_uri::uri) INTO v_ret;
+            END IF;
+
+            -- Replace replace previous token by NULL and current token by previous one
+            SELECT dl_make(($1).dl_base, dl_relative_path(($1).dl_path, v_directory.base), ($1).dl_comment, ($1).dl_prev_token, NULL::uuid) INTO v_datalink;
+
+        END IF;
+
+    ELSE
+        -- No write permission
+        RAISE EXCEPTION 'No write permission on directory "%".', v_directory.dirname;
+    END IF;
+
+    RETURN v_datalink;
+END
+$$ LANGUAGE plpgsql;
+
+-- The DLURLCOMPLETE function returns the complete URL value from
+-- a DataLink value with a token for reading. 
+-- DLURLCOMPLETE(DataLink)
+CREATE FUNCTION dlurlcomplete(datalink) RETURNS text AS $$
+DECLARE
+    v_url text;
+    v_srcurl text;
+    v_dstpath text;
+    v_srcpath text;
+    v_token uuid := NULL;
+    v_directory record;
+    v_ret boolean;
+BEGIN
+    -- Return a zero length string if the URI is empty
+    IF ($1).dl_path = '' THEN
+        RETURN '';
+    END IF;
+
+    -- Get directory base information
+    SELECT * INTO v_directory FROM dl_directory_base(($1).dl_base);
+
+    -- Bring back the file if it has been moved to the tier directory
+    IF v_directory.tierdir IS NOT NULL THEN
+        PERFORM dl_tier_recall($1);
+    END IF;
+    -- Get the path to current file
+    SELECT uri_rebase_url(dlurlpathonly($1)::uri, v_directory.base) INTO v_srcurl;
+
+    -- Add a new token to the URL if we have READ PERMISSION DB.
+    -- If we get there the user has SELECT priviledge on the table.
+    IF v_directory.readperm THEN
+        -- Add the current datalink token to this path that will be use as symlink target
+        IF ($1).dl_token IS NOT NULL THEN
+            SELECT add_token_to_url(v_srcurl::text, (($1).dl_token)::text) INTO v_dstpath;
+        ELSE
+            v_dstpath := v_srcurl;
+        END IF;
+        -- We can not create symlink for a remote URL for the moment
+        IF uri_get_scheme(v_srcurl::uri) != 'file' THEN
+            RAISE EXCEPTION 'can not link remote URI "%"',  v_srcurl;
+        ELSE
+            -- Verify that the file exist
+            IF NOT uri_path_exists(v_dstpath::uri) THEN
+                RAISE EXCEPTION 'file "%" does not exists', v_dstpath;
+            END IF;
+        END IF;
+        -- The files handed out by the transaction can share one read token,
+        -- they are linked into the link directory named after it
+        IF current_setting('datalink.dl_read_token_scope', true) = 'transaction' THEN
+            SELECT datalink_xact_token()::uuid INTO v_token;
+            SELECT datalink_add_xact_link(v_srcurl, (v_token)::text) INTO v_url;
+            PERFORM datalink_xact_link(uri_get_path(v_url::uri), uri_get_path(v_dstpath::uri));
+            RETURN v_url;
+        END IF;
+        SELECT datalink_generate_token('R', uri_get_path(v_srcurl::uri)) INTO v_token;
+        SELECT add_token_to_url(v_srcurl, (v_token)::text) INTO v_url;
+        -- Store the token internally for later access validation, the
+        -- application will need this token in the url to access the file
+        SELECT datalink_register_readtoken(v_url) INTO v_ret;
+        IF NOT v_ret THEN
+            RAISE EXCEPTION 'can not register a token for URI "%"',  v_url;
+        END IF;
+        -- Create a symlink with the token for reading to allow access to the target file
+        SELECT datalink_createlink_localfile(uri_get_path(uri_rebase_url(v_url::uri, v_directory.base)), uri_get_path(v_dstpath::uri)) INTO v_ret;
+        IF NOT v_ret THEN
+            RAISE EXCEPTION 'can not create symlink "%" to "%"', uri_get_path(uri_rebase_url(v_url::uri, v_directory.base)), v_dstpath;
+        END IF;
+    ELSE
+        RETURN v_srcurl;
+    END IF;
+
+    RETURN v_url;
+END
+$$ LANGUAGE plpgsql STRICT;
+
+-- Function used by dlurlcompletewrite() to queue the copy of a file of a
+-- base directory with WRITE PERMISSION ADMIN into the file named with its
+-- write token, or with the '.new' suffix without WRITE TOKEN, that must not
+-- exist yet. datalink_queue_copy() is not granted to PUBLIC.
+CREATE FUNCTION dl_queue_copy(p_src text, p_dst text) RETURNS boolean AS $$
+DECLARE
+    v_file text;
+BEGIN
+    -- The source must be in a base directory where the files are written
+    IF NOT EXISTS (SELECT 1 FROM pg_datalink_bases
+                   WHERE linkcontrol AND writeperm AND uri_get_scheme(base) = 'file'
+                     AND left(p_src, length(uri_get_path(base))) = uri_get_path(base))
+    THEN
+        RAISE EXCEPTION 'file "%" is not in a base directory with WRITE PERMISSION ADMIN', p_src;
+    END IF;
+
+    -- The destination is the same file named with a new token or with the
+    -- '.new' suffix
+    v_file := remove_token_from_url(p_src::uri)::text;
+    IF p_dst <> v_file || '.new' THEN
+        IF p_dst = remove_token_from_url(p_dst::uri)::text
+           OR remove_token_from_url(p_dst::uri)::text <> v_file THEN
+            RAISE EXCEPTION 'invalid copy of file "%" into "%"', p_src, p_dst;
+        END IF;
+        IF uri_path_exists(p_dst::uri) THEN
+            RAISE EXCEPTION 'file "%" already exists', p_dst;
+        END IF;
+    END IF;
+
+    RETURN datalink_queue_copy(p_src, p_dst);
+END
+$$ LANGUAGE plpgsql VOLATILE STRICT SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+
+REVOKE ALL ON FUNCTION datalink_queue_copy(text, text) FROM PUBLIC;
+
+-- The DLURLCOMPLETEWRITE function returns the complete URL value from
+-- a DataLink value with a token for writing. The file is locked and
+-- copied with the token in its name, next work will be done on it.
+-- The file must be on a local filesystem, there is no remote implementation.
+-- DLURLCOMPLETEWRITE(DataLink)
+CREATE FUNCTION dlurlcompletewrite(datalink) RETURNS text AS $$
+DECLARE
+    v_srcurl text;
+    v_srcpath text;
+    v_dsturl text;
+    v_ret boolean;
+    v_token uuid;
+    v_directory record;
+BEGIN
+    -- Return a zero length string if the URI is empty
+    IF ($1).dl_path = '' THEN
+        RETURN '';
+    END IF;
+
+    -- Get directory base informtion
+    SELECT * INTO v_directory FROM dl_directory_base(($1).dl_base);
+
+    -- When the DB has no control to the file write is not possible
+    IF NOT v_directory.linkcontrol THEN
+        RAISE EXCEPTION 'Can not write with NO LINK CONTROL.';
+    END IF;
+
+    -- Bring back the file if it has been moved to the tier directory
+    IF v_directory.tierdir IS NOT NULL THEN
+        PERFORM dl_tier_recall($1);
+    END IF;
+
+    -- No write token is issued while dl_snapshot_create() is running
+    PERFORM pg_advisory_xact_lock_shared(hashtext('datalink_snapshot'));
+
+    -- Get the full URL of the file
+    SELECT uri_rebase_url(dlurlcompleteonly($1)::uri, v_directory.base) INTO v_srcurl;
+
+    -- If we have WRITE PERMISSION ADMIN
+    IF v_directory.writeperm THEN
+        -- Add the current datalink token to this path that will be use as symlink target
+        IF ($1).dl_token IS NOT NULL THEN
+            SELECT add_token_to_url(v_srcurl, (($1).dl_token)::text) INTO v_srcpath;
+        ELSE
+            v_srcpath := v_srcurl;
+        END IF;
+
+        -- Check that we can write to this file
+        IF uri_get_scheme(v_srcurl::uri) != 'file' THEN
+            RAISE EXCEPTION 'can not write to a remote URL "%"', v_srcurl;
+        END IF;
+        IF NOT uri_path_exists(v_srcpath::uri) THEN
+            RAISE EXCEPTION 'file "%" does not exists', v_srcpath;
+        END IF;
+
+        -- When the datalink do not require a token for writing, just return the URL with the '.new' suffix
+        IF NOT v_directory.writetoken THEN
+            SELECT v_srcurl||'.new' INTO v_dsturl;
+        ELSE
+            -- Get new token
+            SELECT datalink_generate_token('W', uri_get_path(v_srcurl::uri)) INTO v_token;
+            -- Get URL with a new token
+            SELECT add_token_to_url(v_srcurl, (v_token)::text) INTO v_dsturl;
+        END IF;
+
+        -- Now copy the file with locking the source file in non blocking mode during the copy,
+        -- it is done by a copy worker when datalink.dl_copy_workers is set
+        SELECT dl_queue_copy(uri_get_path(v_srcpath::uri), uri_get_path(v_dsturl::uri)) INTO v_ret;
+        IF NOT v_ret THEN
+            RAISE EXCEPTION 'Can not copy file % into %.', v_srcpath, v_dsturl;
+        END IF;
+
+        -- Store the token for later validation
+        IF v_directory.writetoken THEN
+            SELECT datalink_register_writetoken(v_dsturl) INTO v_ret;
+            IF NOT v_ret THEN
+                RAISE EXCEPTION 'can not register a token';
+            END IF;
+        END IF;
+    ELSE
+        -- Return the URL without token, WRITE PERMISSION option not ADMIN
+        RETURN v_srcurl;
+    END IF;
+
+    -- Return the new URL with the token
+    RETURN v_dsturl;
+END
+$$ LANGUAGE plpgsql STRICT;
+
+-- The DLURLPATH function returns the path and file name necessary to access
+-- a file from a DataLink value with a token for reading.
+-- DLURLPATH(Datalink)
+CREATE FUNCTION dlurlpath(datalink) RETURNS text AS $$
+DECLARE
+    v_srcurl uri;
+    v_path text;
+    v_srcpath text;
+    v_dstpath text;
+    v_token uuid;
+    v_directory record;
+    v_ret boolean;
+BEGIN
+    -- Return a zero length string if the URI is empty
+    IF ($1).dl_path = '' THEN
+        RETURN '';
+    END IF;
+
+    -- Get directory base informtion
+    SELECT * INTO v_directory FROM dl_directory_base(($1).dl_base);
+
+    -- Bring back the file if it has been moved to the tier directory
+    IF v_directory.tierdir IS NOT NULL THEN
+        PERFORM dl_tier_recall($1);
+    END IF;
+    -- Rebase the URL
+    SELECT uri_rebase_url(dlurlpathonly($1)::uri, v_directory.base) INTO v_srcurl;
+    -- Extract the path
+    SELECT uri_get_path(v_srcurl) INTO v_srcpath;
+
+    -- Add a new token to the URL if we have READ PERMISSION DB
+    IF v_directory.readperm THEN
+        -- Add the current datalink token to this path that will be use as symlink target
+        IF ($1).dl_token IS NOT NULL THEN
+            SELECT add_token_to_url(v_srcurl::text, (($1).dl_token)::text) INTO v_dstpath;
+        ELSE
+            v_dstpath := v_srcurl;
+        END IF;
+        -- We can not create symlink for a remote URL for the moment
+        IF uri_get_scheme(v_srcurl::uri) != 'file' THEN
+            RAISE EXCEPTION 'can not link remote URI "%"',  v_srcurl;
+        END IF;
+        -- Verify that the file exist
+        IF NOT uri_path_exists(v_dstpath::uri) THEN
+            RAISE EXCEPTION 'file "%" does not exists', v_dstpath;
+        END IF;
+
+        -- Share the read token of the transaction if required
+        IF current_setting('datalink.dl_read_token_scope', true) = 'transaction' THEN
+            SELECT datalink_xact_token()::uuid INTO v_token;
+            SELECT datalink_add_xact_link(v_srcpath, (v_token)::text) INTO v_path;
+            PERFORM datalink_xact_link(v_path, uri_get_path(v_dstpath::uri));
+            RETURN v_path;
+        END IF;
+        -- Get new token
+        SELECT datalink_generate_token('R', v_srcpath) INTO v_token;
+        -- Get path with a new token
+        SELECT add_token_to_url(v_srcpath, (v_token)::text) INTO v_path;
+        -- Store the token for later validation
+        SELECT datalink_register_readtoken(v_path) INTO v_ret;
+        IF NOT v_ret THEN
+            RAISE EXCEPTION 'can not register a token for URI "%"', v_path;
+        END IF;
+        -- Create a symlink with the token for reading
+        SELECT datalink_createlink_localfile(uri_get_path(v_path::uri), uri_get_path(v_dstpath::uri)) INTO v_ret;
+        IF NOT v_ret THEN
+            RAISE EXCEPTION 'can not create symlink "%" to "%"', v_path, v_dstpath;
+        END IF;
+    ELSE
+        RETURN v_srcpath;
+    END IF;
+
+    RETURN v_path;
+END
+$$ LANGUAGE plpgsql STRICT;
+
+-- The DLURLPATHWRITE function returns the full path to a linked file
+-- with a token for writing. The file is locked and copied with the
+-- token in its name, next work will be done on it.
+-- DLURLPATHWRITE(Datalink)
+CREATE FUNCTION dlurlpathwrite(datalink) RETURNS text AS $$
+DECLARE
+    v_srcurl text;
+    v_srcpath text;
+    v_dstpath text;
+    v_ret boolean;
+    v_token uuid;
+    v_directory record;
+BEGIN
+    -- Return a zero length string if the URI is empty
+    IF ($1).dl_path = '' THEN
+        RETURN '';
+    END IF;
+
+    -- Get directory base informtion
+    SELECT * INTO v_directory FROM dl_directory_base(($1).dl_base);
+
+    -- When the DB has no control to the file write is not possible
+    IF NOT v_directory.linkcontrol THEN
+        RAISE EXCEPTION 'Can not write with NO LINK CONTROL.';
+    END IF;
+
+    -- Bring back the file if it has been moved to the tier directory
+    IF v_directory.tierdir IS NOT NULL THEN
+        PERFORM dl_tier_recall($1);
+    END IF;
+
+    -- No write token is issued while dl_snapshot_create() is running
+    PERFORM pg_advisory_xact_lock_shared(hashtext('datalink_snapshot'));
+
+    -- Get the full URL of the file
+    SELECT uri_rebase_url(dlurlcompleteonly($1)::uri, v_directory.base) INTO v_srcurl;
+    -- and the path
+    SELECT uri_rebase_url(dlurlpathonly($1)::uri, v_directory.base) INTO v_dstpath;
+
+    -- Add a new token to the URL if we have WRITE PERMISSION ADMIN
+    IF v_directory.writeperm THEN
+        -- Add the current datalink token to this path that will be use as symlink target
+        IF ($1).dl_token IS NOT NULL THEN
+            SELECT add_token_to_url(v_dstpath::text, (($1).dl_token)::text) INTO v_srcpath;
+        END IF;
+        -- We can not create link for a remote URL for the moment
+        IF uri_get_scheme(v_srcurl::uri) != 'file' THEN
+            RAISE EXCEPTION 'can not link remote URI "%"',  v_srcurl;
+        END IF;
+        -- Verify that the file exist
+        IF NOT uri_path_exists(v_srcpath::uri) THEN
+            RAISE EXCEPTION 'file "%" does not exists', v_srcpath;
+        END IF;
+
+        -- When the datalink do not require a token for writing, just return the URL with the '.new' suffix
+        IF NOT v_directory.writetoken THEN
+            SELECT v_srcpath||'.new' INTO v_dstpath;
+        ELSE
+            -- Get new token
+            SELECT datalink_generate_token('W', uri_get_path(v_dstpath::uri)) INTO v_token;
+            -- Get URL with a new token
+            SELECT add_token_to_url(v_dstpath, (v_token)::text) INTO v_dstpath;
+        END IF;
+        -- Now copy the file with locking the source file in non blocking mode during the copy
+        SELECT datalink_copy_localfile(uri_get_path(v_srcpath::uri), uri_get_path(v_dstpath::uri)) INTO v_ret;
+        IF NOT v_ret THEN
+            RAISE EXCEPTION 'Can not copy file % into %.', uri_get_path(v_srcpath::uri), uri_get_path(v_dstpath::uri);
+        END IF;
+        -- Store the token for later validation
+        IF v_directory.writetoken THEN
+            SELECT datalink_register_writetoken(v_dstpath) INTO v_ret;
+            IF NOT v_ret THEN
+                RAISE EXCEPTION 'can not register a token';
+            END IF;
+        END IF;
+    END IF;
+
+    -- Return the new URL with or without the token
+    RETURN v_dstpath;
+END
+$$ LANGUAGE plpgsql STRICT;
+
+-- Function used to read the content of a remote http(s) datalink through
+-- the cache maintained by datalink_read_remotefile() in datalink_remote.c.
+-- Only the URLs under the base of a directory with READ PERMISSION DB can
+-- be fetched, datalink_read_remotefile() itself is not granted to PUBLIC.
+CREATE FUNCTION dl_read_remotefile(datalink) RETURNS bytea AS $$
+DECLARE
+    v_orig uri;
+    v_directory record;
+BEGIN
+    SELECT * INTO v_directory FROM dl_directory_base(($1).dl_base);
+    IF NOT v_directory.linkcontrol OR NOT v_directory.readperm THEN
+        RAISE EXCEPTION 'reading URL "%" is not authorized.', ($1).dl_path;
+    END IF;
+
+    SELECT dl_url_rebase(($1).dl_path, ($1).dl_base) INTO v_orig;
+    IF uri_get_scheme(v_orig) NOT IN ('http', 'https') THEN
+        RAISE EXCEPTION 'URL "%" is not a remote URL.', v_orig;
+    END IF;
+    IF position((v_directory.base)::text IN v_orig::text) <> 1 THEN
+        RAISE EXCEPTION 'URI "%" does not match directory base "%"', v_orig, v_directory.base;
+    END IF;
+
+    RETURN datalink_read_remotefile(v_orig::text);
+END
+$$ LANGUAGE plpgsql STRICT SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+
+REVOKE ALL ON FUNCTION datalink_read_remotefile(text) FROM PUBLIC;
+
+-- The DLREADFILE function returns a bytea representing the content
+-- of a DataLink file value.
+-- The linked file is shared locked when reading in the
+-- internal function read_binary_file() from datalink.c.
+-- Remote http(s) files are read by dl_read_remotefile().
+-- DLREADFILE(DataLink, Uri-with-token)
+CREATE FUNCTION dlreadfile(datalink, uri) RETURNS bytea AS $$
+DECLARE
+    v_uri uri;
+    v_orig uri;
+    v_path text;
+    v_content bytea;
+    v_token uuid;
+    v_directory record;
+BEGIN
+
+    -- Return NULL is the datalink has no URL
+    IF ($1).dl_path = '' THEN
+        RAISE EXCEPTION 'the datalink to read has no URL.';
+    END IF;
+
+    -- Get default base directory
+    SELECT * INTO v_directory FROM dl_directory_base(($1).dl_base);
+
+    -- With NO LINK CONTROL we have nothing to do here
+    IF NOT v_directory.linkcontrol OR NOT v_directory.readperm THEN
+        RAISE EXCEPTION 'reading URL "%" is not authorized.', ($1).dl_path;
+    END IF;
+
+    -- Bring back the file if it has been moved to the tier directory
+    IF v_directory.tierdir IS NOT NULL THEN
+        PERFORM dl_tier_recall($1);
+    END IF;
+
+    -- Remote files are read through the local content cache
+    SELECT dl_url_rebase(($1).dl_path, ($1).dl_base) INTO v_orig;
+    IF uri_get_scheme(v_orig) IN ('http', 'https') THEN
+        RETURN dl_read_remotefile($1);
+    END IF;
+
+    -- Rebase the URL with the directory base
+    SELECT uri_get_str(uri_rebase_url($2, v_directory.base)) INTO v_uri;
+
+    -- We must have a token inside the URL verify it
+    SELECT verify_token_from_uri(v_uri, false) INTO v_token;
+    IF v_token IS NULL THEN
+        RAISE EXCEPTION 'access denied to URI "%".', $2;
+    END IF;
+    -- Verify that we have the same directory base
+    IF regexp_matches(v_uri::text, '^'||(v_directory.base)::text) IS NULL THEN
+        RAISE EXCEPTION 'URI "%" does not match directory base "%"', v_uri, v_directory.base;
+    END IF;
+
+    -- Get the full path of the target file
+    SELECT uri_get_path(v_uri) INTO v_path;
+
+    -- Get the content of the file as a bytea
+    SELECT datalink_read_localfile(v_path, 0, -1) INTO v_content;
+
+    RETURN v_content;
+END
+$$ LANGUAGE plpgsql STRICT;
+
+-- The DLWRITEFILE function write a bytea to a linked file.
+-- The linked file is exclusively locked when writing in
+-- internal function datalink_write_localfile().
+-- DLRWRITEFILE(DataLink, Uri-with-token, Bytea)
+CREATE FUNCTION dlwritefile(datalink, uri, bytea) RETURNS boolean AS $$
+DECLARE
+    v_uri uri;
+    v_orig uri;
+    v_path text;
+    v_ret boolean;
+    v_token uuid;
+    v_directory record;
+BEGIN
+
+    -- Return NULL is the datalink has not URL
+    IF ($1).dl_path = '' THEN
+        RAISE EXCEPTION 'the datalink to write has no URL.';
+    END IF;
+
+    -- Get default base directory
+    SELECT * INTO v_directory FROM dl_directory_base(($1).dl_base);
+    -- With NO LINK CONTROL we have nothing to do here
+    IF NOT v_directory.linkcontrol OR NOT v_directory.writeperm THEN
+        RAISE EXCEPTION 'writing to URL "%" is not authorized.', ($1).dl_path;
+    END IF;
+
+    -- Rebase the URL with the directory base
+    SELECT uri_get_str(uri_rebase_url($2, v_directory.base)) INTO v_uri;
+
+    -- We must have a token inside the URL verify it
+    SELECT verify_token_from_uri(v_uri, true) INTO v_token;
+    IF v_token IS NULL THEN
+        RAISE EXCEPTION 'access denied to URI "%".', $2;
+    END IF;
+    -- Verify that we have the same directory base
+    IF regexp_matches(v_uri::text, '^'||(v_directory.base)::text) IS NULL THEN
+        RAISE EXCEPTION 'URI "%" does not match directory base "%"', v_uri, v_directory.base;
+    END IF;
+
+    -- Get the full path of the target file
+    SELECT uri_get_path(v_uri) INTO v_path;
+    -- The copy of the file for the write token may still be in progress
+    PERFORM datalink_wait_copy(v_path);
+    -- Write content to file
+    SELECT datalink_write_localfile(v_path, $3) INTO v_ret;
+
+    RETURN v_ret;
+END
+$$ LANGUAGE plpgsql;
+
+-- The DLREPLACECONTENT function returns a DATALINK value.
+-- Replacement files must reside in the same directory as the linked files.
+-- NOT SUPPORTED: Replacement file names must consist of the original file
+-- name plus a suffix string that can be a maximum of 20 characters.
+-- With this implementation can be any URL in the same base directory.
+-- As we can not obtain obtain the datalink impacted by the update in
+-- plpgsql this function received the mofified datalink at first argument.
+-- Should be DLREPLACECONTENT(data-location-target , data-location-source, comment)
+-- DLREPLACECONTENT(datalink-target, data-location-target, data-location-source, comment)
+CREATE OR REPLACE FUNCTION dlreplacecontent(datalink, uri, uri, text) RETURNS datalink AS $$
+DECLARE
+    v_directory record;
+    v_src uri;
+    v_dst uri;
+    v_uri uri;
+    v_srcpath text;
+    v_dstpath text;
+    v_datalink datalink;
+    v_comment text := $4;
+    v_token uuid;
+    v_oldtoken uuid;
+    v_ret boolean;
+BEGIN
+    -- Return NULL is the data location target is NULL
+    IF $2 IS NULL THEN
+        RETURN NULL;
+    END IF;
+
+    -- Extract directory information
+    IF ($1).dl_base IS NOT NULL THEN
+        -- Get directory base informtion
+       SELECT * INTO v_directory FROM dl_directory_base(($1).dl_base);
+    ELSE
+        -- Get default base directory
+        SELECT * INTO v_directory FROM dl_directory_base(((SELECT CASE WHEN uri_get_scheme($2) = '' OR uri_get_scheme($2) = 'file' THEN 'FILE' ELSE 'URL' END)::text));
+    END IF;
+
+    -- Rebase target url with the default datalink base.
+    SELECT uri_rebase_url($2, v_directory.base) INTO v_dst;
+
+    -- Rebase source url with the datalink base.
+    IF $3 IS NOT NULL OR $3 != '' THEN
+        SELECT uri_rebase_url($3, v_directory.base) INTO v_src;
+    END IF;
+
+    -- Set comment
+    IF $4 IS NULL AND $1 IS NOT NULL THEN
+        SELECT ($1).dl_comment INTO v_comment;
+    END IF;
+
+    -- Verify that we have the same URL in destination URI and in Datalink
+    IF ($1).dl_path != '' AND v_dst != uri_rebase_url(($1).dl_path, v_directory.base) THEN
+        RAISE EXCEPTION 'Destination URL "%" is not equal to Datalink URI "%"', v_dst, uri_rebase_url(($1).dl_path, v_directory.base);
+    END IF;
+
+    -- If data-location-source is NULL or an empty string or the same as
+    -- data-location-target this is the equivalent than calling DLVALUE.
+    IF $3 IS NULL OR $3 = '' OR v_src = v_dst THEN
+        SELECT dlvalue(''::uri, NULL::text, v_comment) INTO v_datalink;
+        RETURN v_datalink;
+    END IF;
+
+    -- With FILE LINK CONTROL verify that both files exists
+    IF v_directory.linkcontrol THEN
+        IF NOT uri_path_exists(v_src) THEN
+            RAISE EXCEPTION 'Data location source file "%" must exists on filesystem.', v_src;
+        END IF;
+        IF NOT uri_path_exists(v_dst) THEN
+            IF NOT uri_path_exists(add_token_to_url(v_dst::text, (($1).dl_token)::text)::uri) THEN
+                RAISE EXCEPTION 'Data location target file "%" must exists on filesystem.', v_dst;
+            END IF;
+        END IF;
+    END IF;
+
+    -- When the datalink do not require a token for writing, the URL must have the '.new' suffix
+    IF NOT v_directory.writetoken THEN
+        SELECT (regexp_match(v_src::text, '^.*.new$'))[1] INTO v_uri;
+        IF v_uri IS NULL THEN
+            RAISE EXCEPTION 'when NOT REQUIRING TOKEN FOR UPDATE the new URL must have the ".new" suffix.';
+        END IF;
+    ELSE
+        -- Get the token from inside the uri and verify that it is well formed
+        SELECT verify_token_from_uri(v_src, true) INTO v_token;
+        -- remove it from the uri
+        SELECT remove_token_from_url(v_src) INTO v_uri;
+    END IF;
+
+    -- Rebase the URL with the directory base
+    SELECT uri_get_str(uri_rebase_url(v_uri, v_directory.base)) INTO v_uri;
+
+    -- Verify that both old and new URI are the same without token
+    IF uri_get_str(v_dst) != v_uri::text AND uri_get_str(v_dst)||'.new' != v_uri::text THEN
+        IF v_directory.writetoken THEN
+            RAISE EXCEPTION 'URI are not the same "%s" to "%s"', uri_get_str(v_dst), v_uri;
+        ELSE
+            RAISE EXCEPTION 'URI are not the same "%s" to "%s"', uri_get_str(v_dst)||'.new', v_uri;
+        END IF;
+    END IF;
+
+    -- With NO LINK CONTROL we have nothing more to do, return the datalink
+    IF NOT v_directory.linkcontrol THEN
+        SELECT dl_make(v_directory.dirid, dl_relative_path(v_dst, v_directory.base), v_comment, NULL::uuid, NULL::uuid) INTO v_datalink;
+        RETURN v_datalink;
+    END IF;
+
+    -- Construct path to target file with the token
+    IF ($1).dl_token IS NOT NULL THEN
+        SELECT add_token_to_url(v_dst::text, (($1).dl_token)::text) INTO v_dst;
+    END IF;
+
+    -- Get the path of both URI
+    SELECT uri_get_path(v_uri) INTO v_srcpath;
+    SELECT uri_get_path(v_dst) INTO v_dstpath;
+    IF ($1).dl_token IS NULL THEN
+        -- Get token from the file to replace to be used as dl_prevtoken value if any
+        SELECT (regexp_match(v_dst::text, '^.*\/([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_oldtoken;
+        IF v_oldtoken IS NULL THEN
+            SELECT (regexp_match(v_dst::text, '^([0-9a-f\-]+);[^\/;]+$'))[1] INTO v_oldtoken;
+        END IF;
+    ELSE
+        v_oldtoken := ($1).dl_token;
+    END IF;
+
+    -- If writetoken is false rename old file with the .old suffix and file with .new suffix into the origin name
+    IF NOT v_directory.writetoken THEN
+        SELECT datalink_rename_localfile(v_dstpath, v_dstpath||'.old') INTO v_ret;
+        SELECT (regexp_match(v_srcpath, '^(.*).new$'))[1] INTO v_srcpath;
+        IF v_srcpath IS NULL THEN
+            RAISE EXCEPTION 'can not find valid source file for replacement in "%"', v_src;
+        END IF;
+        SELECT datalink_rename_localfile(v_srcpath||'.new', v_srcpath) INTO v_ret;
+        IF NOT v_ret THEN
+            RAISE EXCEPTION 'can not rename new file "%" into "%"', v_srcpath||'.new', v_dstpath;
+        END IF;
+        SELECT dl_make(v_directory.dirid, dl_relative_path(v_dst, v_directory.base), v_comment, v_token, v_oldtoken) INTO v_datalink;
+    ELSE
+        -- The copy is now the linked file and the current one becomes the previous copy
+        PERFORM dl_usage_move(v_srcpath, 'pending', 'live');
+        IF ($1).dl_token IS NOT NULL THEN
+            PERFORM dl_usage_move(v_dstpath, 'live', 'copy');
+        END IF;
+        IF ($1).dl_prev_token IS NOT NULL THEN
+            PERFORM dl_usage_move(uri_get_path(add_token_to_url(uri_get_str(remove_token_from_url(v_dst)), (($1).dl_prev_token)::text)::uri), 'copy', 'pending');
+        END IF;
+        -- When writetoken is enable we just have to set current token pointing to the new file
+        SELECT dl_make(v_directory.dirid, dl_relative_path(remove_token_from_url(v_dst), v_directory.base), v_comment, v_token, v_oldtoken) INTO v_datalink;
+    END IF;
+
+    -- Store archive information if RECOVERY YES attribute is set
+    IF v_directory.recovery THEN
+	INSERT INTO pg_datalink_archives VALUES (v_directory.dirid, dl_url_rebase(($1).dl_path, v_directory.dirid)) ON CONFLICT DO NOTHING;
+    END IF;
+
+    -- Return the datalink updated
+    RETURN v_datalink;
+END
+$$ LANGUAGE plpgsql;
+
+-- Overload DLREPLACECONTENT() function to allow call without comment
+CREATE OR REPLACE FUNCTION dlreplacecontent(datalink, uri, uri) RETURNS datalink AS $$
+        SELECT dlreplacecontent($1, $2, $3, NULL::text);
+$$ LANGUAGE SQL STRICT;
+
+-- Overload DLREPLACECONTENT() function to respect the standard, works only
+-- with default link type URL and FILE. With custom directories you must
+-- use the definition with a datalink as first parameter.
+-- DLREPLACECONTENT(data-location-target , data-location-source, comment)
+CREATE OR REPLACE FUNCTION dlreplacecontent(uri, uri, text) RETURNS datalink AS $$
+        SELECT dlreplacecontent(NULL, $1, $2, $3);
+$$ LANGUAGE SQL STRICT;
+
+CREATE OR REPLACE FUNCTION dlreplacecontent(uri, uri) RETURNS datalink AS $$
+        SELECT dlreplacecontent(NULL, $1, $2, NULL::text);
+$$ LANGUAGE SQL STRICT;
+
+-- When a datalink URI is set to zero length string or the datalink is set to NULL
+-- or the row is simply delete we must remove the link 
+CREATE OR REPLACE FUNCTION dlunlink() RETURNS trigger AS $$
+DECLARE
+    v_directory record;
+    v_path text;
+    v_dstpath text;
+    v_ret boolean;
+BEGIN
+    -- First be sure the the datalink values is not already unlinked if we come from an UPDATE statement
+    IF TG_OP = 'UPDATE' THEN
+        IF OLD.efile IS NULL OR (OLD.efile).dl_path = '' THEN
+            RETURN NEW;
+        END IF;
+    END IF;
+    -- Get directory base informtion
+    SELECT * INTO v_directory FROM dl_directory_base((OLD.efile).dl_base);
+    IF NOT FOUND THEN
+        -- If current Datalink is NULL then just delete or update the row
+        IF OLD.efile IS NULL THEN
+            IF TG_OP = 'UPDATE' THEN
+                RETURN NEW;
+            ELSE
+                RETURN OLD;
+            END IF;
+        END IF;
+        -- otherwise raise an nexception
+        RAISE EXCEPTION 'The default base directory for the Datalink URL is not found.';
+    END IF;
+    -- If we do not have the link control just get out of here
+    IF NOT v_directory.linkcontrol THEN
+        IF TG_OP = 'UPDATE' THEN
+            RETURN NEW;
+        ELSE
+            RETURN OLD;
+        END IF;
+    END IF;
+
+    -- Check that we have write permission
+    IF v_directory.writeperm THEN
+        SELECT uri_get_path(dl_url_rebase((OLD.efile).dl_path, (OLD.efile).dl_base)) INTO v_path;
+        IF NOT uri_path_exists(v_path::uri) THEN
+            RAISE EXCEPTION 'Data location source file "%" must exists on filesystem.', v_path;
+        END IF;
+        -- Construct path to target file 
+        IF (OLD.efile).dl_token IS NOT NULL THEN
+            SELECT add_token_to_url(v_path, ((OLD.efile).dl_token)::text) INTO v_dstpath;
+        END IF;
+        IF v_directory.onunlink = 'RESTORE' THEN
+            -- Then rename the file as the original one
+            SELECT datalink_rename_localfile(v_dstpath, v_path) INTO v_ret;
+            IF NOT v_ret THEN
+                RAISE EXCEPTION 'can not rename file "%" into "%"', v_dstpath, v_path;
+            END IF;
+            -- FIXME: Now restore the old file attribut
+        ELSE
+            -- Just delete the link
+            SELECT datalink_unlink_localfile(v_path::uri) INTO v_ret;
+        END IF;
+    END IF;
+
+    IF TG_OP = 'DELETE' THEN
+        RETURN OLD;
+    END IF;
+
+    RETURN NEW;
+END
+$$ LANGUAGE plpgsql;
+
+
+-- Statement level version of dlunlink() for the DELETE of the datalink
+-- column given as trigger argument. Files of the deleted rows are grouped by
+-- base directory and queued, they are restored or removed in sorted order
+-- when the transaction commits. Like dlunlink_row() it runs as the extension
+-- owner, the DELETE privilege has already been checked, and it is the only
+-- way for a user to reach datalink_queue_unlink().
+CREATE OR REPLACE FUNCTION dlunlink_stmt() RETURNS trigger AS $$
+DECLARE
+    v_col text := TG_ARGV[0];
+    v_unlinked text;
+    v_rec record;
+BEGIN
+    v_unlinked := format('SELECT (o.%1$I).dl_base AS dl_base, (o.%1$I).dl_path AS dl_path, (o.%1$I).dl_token AS dl_token FROM dl_old o
+            WHERE (o.%1$I).dl_path::text != ''''', v_col);
+
+    -- Only directories with link control and write permission are concerned
+    FOR v_rec IN EXECUTE format('SELECT b.onunlink = ''RESTORE'' AS restore,
+                array_agg(p.path) AS paths,
+                array_agg(CASE WHEN p.dl_token IS NOT NULL THEN add_token_to_url(p.path, p.dl_token::text) END) AS token_paths
+            FROM (SELECT u.dl_base, u.dl_token, uri_get_path(dl_url_rebase(u.dl_path, u.dl_base)) AS path FROM (%s) u) p
+            JOIN pg_datalink_bases b ON (b.dirid = p.dl_base)
+            WHERE b.linkcontrol AND b.writeperm
+            GROUP BY b.dirid, b.onunlink', v_unlinked)
+    LOOP
+        PERFORM datalink_queue_unlink(v_rec.paths, v_rec.token_paths, v_rec.restore);
+    END LOOP;
+
+    RETURN NULL;
+END
+$$ LANGUAGE plpgsql SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+
+-- Row level version of dlunlink() for an UPDATE setting the datalink column
+-- given as trigger argument to NULL or to an empty URL, the trigger is only
+-- fired for these rows. A datalink replaced by another one is not unlinked,
+-- dlnewcopy() and dlreplacecontent() keep the previous file. The file is
+-- queued like the ones of the deleted rows.
+CREATE OR REPLACE FUNCTION dlunlink_row() RETURNS trigger AS $$
+DECLARE
+    v_old datalink;
+    v_directory record;
+    v_path text;
+BEGIN
+    EXECUTE format('SELECT ($1).%I', TG_ARGV[0]) INTO v_old USING OLD;
+    IF v_old IS NULL OR (v_old).dl_path::text = '' THEN
+        RETURN NULL;
+    END IF;
+
+    -- Only directories with link control and write permission are concerned
+    SELECT * INTO v_directory FROM pg_datalink_bases WHERE dirid = (v_old).dl_base;
+    IF NOT FOUND OR NOT v_directory.linkcontrol OR NOT v_directory.writeperm THEN
+        RETURN NULL;
+    END IF;
+
+    v_path := uri_get_path(dl_url_rebase((v_old).dl_path, (v_old).dl_base));
+    PERFORM datalink_queue_unlink(ARRAY[v_path],
+            ARRAY[CASE WHEN (v_old).dl_token IS NOT NULL THEN add_token_to_url(v_path, (v_old).dl_token::text) END],
+            v_directory.onunlink = 'RESTORE');
+
+    RETURN NULL;
+END
+$$ LANGUAGE plpgsql SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+
+REVOKE ALL ON FUNCTION datalink_queue_unlink(text[], text[], boolean) FROM PUBLIC;
+
+-- TRUNCATE does not fire the DELETE triggers, the datalinks of the column
+-- given as trigger argument are queued set-wise before the table is
+-- truncated and unlinked by a background worker after commit. The
+-- privileges have been checked by TRUNCATE.
+CREATE OR REPLACE FUNCTION dlunlink_truncate() RETURNS trigger AS $$
+BEGIN
+    PERFORM datalink_unlink_table(TG_RELID, TG_ARGV[0]);
+
+    RETURN NULL;
+END
+$$ LANGUAGE plpgsql SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+REVOKE ALL ON FUNCTION datalink_unlink_table(regclass, text) FROM PUBLIC;
+
+-- The datalinks of the tables dropped by DROP TABLE, DROP SCHEMA or DROP
+-- OWNED and of their children, or of the datalink columns dropped by ALTER
+-- TABLE, are queued the same way before they are dropped.
+CREATE EVENT TRIGGER datalink_event_trigger_drop ON ddl_command_start
+   EXECUTE FUNCTION datalink_drop_table();
+
+-- Warn about the datalink columns dropped by other commands, such as DROP
+-- EXTENSION, whose files are left linked.
+CREATE EVENT TRIGGER datalink_event_trigger_dropped ON sql_drop
+   EXECUTE FUNCTION datalink_dropped_objects();
+
+-- Insert the files of the datalinks of a column of a table, or of all its
+-- datalink columns, into pg_datalink_unlink_queue. Only directories with
+-- link control and write permission are concerned. Called as superuser by
+-- datalink_unlink_table() once the privileges of the user have been checked.
+-- Returns the number of files queued.
+CREATE FUNCTION dl_queue_table_unlinks(p_table regclass, p_column text DEFAULT NULL) RETURNS bigint AS $$
+DECLARE
+    v_col name;
+    v_count bigint;
+    v_total bigint := 0;
+BEGIN
+    -- Same columns as the ones found by add_datalink_trigger()
+    FOR v_col IN SELECT a.attname FROM pg_attribute a
+        WHERE a.attrelid = p_table AND a.atttypid = 'datalink'::regtype
+        AND a.attnum > 0 AND NOT a.attisdropped
+        AND (p_column IS NULL OR a.attname = p_column)
+    LOOP
+        EXECUTE format('INSERT INTO pg_datalink_unlink_queue (path, token_path, restore)
+            SELECT p.path, CASE WHEN p.dl_token IS NOT NULL THEN add_token_to_url(p.path, p.dl_token::text) END,
+                b.onunlink = ''RESTORE''
+            FROM (SELECT (t.%1$I).dl_base AS dl_base, (t.%1$I).dl_token AS dl_token,
+                    uri_get_path(dl_url_rebase((t.%1$I).dl_path, (t.%1$I).dl_base)) AS path
+                FROM ONLY %2$s t WHERE (t.%1$I).dl_path::text != '''') p
+            JOIN pg_datalink_bases b ON (b.dirid = p.dl_base)
+            WHERE b.linkcontrol AND b.writeperm', v_col, p_table);
+        GET DIAGNOSTICS v_count = ROW_COUNT;
+        v_total := v_total + v_count;
+    END LOOP;
+
+    RETURN v_total;
+END
+$$ LANGUAGE plpgsql VOLATILE;
+REVOKE ALL ON FUNCTION dl_queue_table_unlinks(regclass, text) FROM PUBLIC;
+
+-- Restore or remove a batch of at most p_limit files queued by TRUNCATE or
+-- DROP TABLE, sorted by path. The batch is removed from the queue when the
+-- transaction commits, concurrent calls process different batches. Called
+-- by the unlink worker until the queue is empty, it can be called by hand
+-- when no worker could be started. Returns the number of files of the batch.
+CREATE FUNCTION dl_process_unlinks(p_limit integer DEFAULT 10000) RETURNS bigint AS $$
+DECLARE
+    v_batch record;
+BEGIN
+    WITH batch AS (
+        DELETE FROM pg_datalink_unlink_queue WHERE id IN (
+            SELECT id FROM pg_datalink_unlink_queue ORDER BY path LIMIT p_limit
+            FOR UPDATE SKIP LOCKED)
+        RETURNING path, token_path, restore
+    )
+    SELECT count(*) AS nfiles, array_agg(path ORDER BY path) AS paths,
+        array_agg(token_path ORDER BY path) AS token_paths,
+        array_agg(restore ORDER BY path) AS restores
+        INTO v_batch FROM batch;
+
+    IF v_batch.nfiles > 0 THEN
+        PERFORM datalink_bulk_unlink(v_batch.paths, v_batch.token_paths, v_batch.restores);
+    END IF;
+
+    RETURN v_batch.nfiles;
+END
+$$ LANGUAGE plpgsql VOLATILE SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+REVOKE ALL ON FUNCTION dl_process_unlinks(integer) FROM PUBLIC;
+REVOKE ALL ON FUNCTION datalink_bulk_unlink(text[], text[], boolean[]) FROM PUBLIC;
+
+-- Function used to move the token files and the files named with a token
+-- to the layout set with datalink.dl_token_layout after it has been changed.
+-- It must be run when no access token is in use, it blocks the issue of write
+-- tokens until it commits. Returns the number of files moved in the token
+-- directory and in the base directories with link control.
+CREATE FUNCTION dl_migrate_token_layout() RETURNS bigint AS $$
+DECLARE
+    v_hashed boolean;
+    v_count bigint := 0;
+    v_dir text;
+BEGIN
+    -- No write token is issued while the files are moved
+    PERFORM pg_advisory_xact_lock(hashtext('datalink_snapshot'));
+
+    SELECT current_setting('datalink.dl_token_layout') = 'hashed' INTO v_hashed;
+
+    -- Token files
+    v_count := v_count + datalink_migrate_layout(current_setting('datalink.dl_token_path'), v_hashed, true);
+
+    -- Files renamed with their token and symlinks of read tokens
+    FOR v_dir IN SELECT DISTINCT rtrim(uri_get_path(base), '/') FROM pg_datalink_bases
+                 WHERE linkcontrol AND uri_get_scheme(base) = 'file'
+    LOOP
+        v_count := v_count + datalink_migrate_layout(v_dir, v_hashed, false);
+    END LOOP;
+
+    RETURN v_count;
+END
+$$ LANGUAGE plpgsql VOLATILE SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+
+REVOKE ALL ON FUNCTION dl_migrate_token_layout() FROM PUBLIC;
+REVOKE ALL ON FUNCTION datalink_migrate_layout(text, boolean, boolean) FROM PUBLIC;
+
+-- Function used to audit the datalinks with FILE LINK CONTROL of a table.
+-- It returns the datalinks whose file is missing, is a dangling symlink or
+-- has changed of size since the last dl_changes() and, when the end of the
+-- table is reached, the copies named with a token that are no more
+-- referenced by any datalink of the database. The table is
+-- read by ranges of p_batch blocks from block p_start, p_blocks limits the
+-- number of blocks read by the call (NULL for all) so that a large table can
+-- be audited in several calls, the next one starting at p_start + p_blocks.
+-- p_naptime is the number of milliseconds to sleep between two batches.
+CREATE FUNCTION dl_audit(p_table regclass, p_start bigint DEFAULT 0, p_blocks bigint DEFAULT NULL,
+                p_batch integer DEFAULT 1000, p_naptime integer DEFAULT 0)
+        RETURNS TABLE (ctid tid, attname name, url text, problem text) AS $$
+DECLARE
+    v_cols name[];
+    v_col name;
+    v_nblocks bigint;
+    v_end bigint;
+    v_block bigint;
+    v_next bigint;
+    v_ctids tid[];
+    v_urls text[];
+    v_paths text[];
+    v_token_paths text[];
+    v_sizes bigint[];
+    v_dir text;
+    v_files text[];
+    v_rel record;
+BEGIN
+    IF p_batch < 1 OR p_start < 0 THEN
+        RAISE EXCEPTION 'invalid block range for the audit of table "%"', p_table;
+    END IF;
+
+    -- Same columns as the ones found by add_datalink_trigger()
+    SELECT array_agg(a.attname ORDER BY a.attnum) INTO v_cols FROM pg_attribute a
+        WHERE a.attrelid = p_table AND a.atttypid = 'datalink'::regtype
+        AND a.attnum > 0 AND NOT a.attisdropped;
+    IF v_cols IS NULL THEN
+        RAISE EXCEPTION 'table "%" has no datalink column', p_table;
+    END IF;
+
+    v_nblocks := pg_relation_size(p_table) / current_setting('block_size')::bigint;
+    v_end := CASE WHEN p_blocks IS NULL THEN v_nblocks ELSE least(p_start + p_blocks, v_nblocks) END;
+
+    -- Check the files of the datalinks, batch after batch
+    v_block := p_start;
+    WHILE v_block < v_end LOOP
+        v_next := least(v_block + p_batch, v_end);
+        FOREACH v_col IN ARRAY v_cols LOOP
+            -- The size of a file is expected to be the one recorded by the
+            -- last call of dl_changes(), if any.
+            EXECUTE format('SELECT array_agg(p.ctid), array_agg(p.url), array_agg(p.path),
+                    array_agg(k.token_path), array_agg(s.size)
+                FROM (SELECT t.ctid, u.url::text AS url, uri_get_path(u.url) AS path, (t.%1$I).dl_token AS dl_token,
+                        b.dirid, rtrim(uri_get_path(b.base), ''/'') AS basepath
+                    FROM %2$s t JOIN pg_datalink_bases b ON (b.dirid = (t.%1$I).dl_base)
+                    CROSS JOIN LATERAL dl_url_rebase((t.%1$I).dl_path, (t.%1$I).dl_base) u(url)
+                    WHERE t.ctid >= $1 AND t.ctid < $2 AND (t.%1$I).dl_path::text != ''''
+                    AND b.linkcontrol AND uri_get_scheme(b.base) = ''file'') p
+                CROSS JOIN LATERAL (SELECT CASE WHEN p.dl_token IS NOT NULL THEN add_token_to_url(p.path, p.dl_token::text) END) k(token_path)
+                LEFT JOIN pg_datalink_snapshots s ON (s.dirid = p.dirid
+                    AND s.path = substr(coalesce(k.token_path, p.path), length(p.basepath) + 2))', v_col, p_table)
+                INTO v_ctids, v_urls, v_paths, v_token_paths, v_sizes
+                USING format('(%s,0)', v_block)::tid, format('(%s,0)', v_next)::tid;
+
+            IF v_paths IS NOT NULL THEN
+                RETURN QUERY SELECT v_ctids[c.n], v_col, v_urls[c.n], c.problem
+                    FROM unnest(datalink_check_paths(v_paths, v_token_paths, v_sizes)) WITH ORDINALITY AS c(problem, n)
+                    WHERE c.problem IS NOT NULL;
+            END IF;
+        END LOOP;
+
+        v_block := v_next;
+        IF p_naptime > 0 AND v_block < v_end THEN
+            PERFORM pg_sleep(p_naptime / 1000.0);
+        END IF;
+    END LOOP;
+
+    IF v_end < v_nblocks THEN
+        RETURN;
+    END IF;
+
+    -- Copies named with a token that no datalink references
+    FOR v_dir IN SELECT DISTINCT rtrim(uri_get_path(base), '/') FROM pg_datalink_bases
+                 WHERE linkcontrol AND uri_get_scheme(base) = 'file'
+    LOOP
+        v_files := datalink_token_files(v_dir);
+        FOR v_rel IN SELECT a.attrelid::regclass AS relid, a.attname FROM pg_attribute a
+                     JOIN pg_class c ON (c.oid = a.attrelid)
+                     WHERE a.atttypid = 'datalink'::regtype AND c.relkind = 'r'
+                     AND a.attnum > 0 AND NOT a.attisdropped
+        LOOP
+            EXIT WHEN cardinality(v_files) = 0;
+            EXECUTE format('SELECT coalesce(array_agg(f.path), ''{}'') FROM unnest($1) f(path)
+                    WHERE NOT EXISTS (SELECT 1 FROM %1$s t WHERE (t.%2$I).dl_token = substr(regexp_replace(f.path, ''^.*/'', ''''), 1, 36)::uuid)
+                    AND NOT EXISTS (SELECT 1 FROM %1$s t WHERE (t.%2$I).dl_prev_token = substr(regexp_replace(f.path, ''^.*/'', ''''), 1, 36)::uuid)',
+                    v_rel.relid, v_rel.attname)
+                INTO v_files USING v_files;
+        END LOOP;
+
+        RETURN QUERY SELECT NULL::tid, NULL::name, 'file://' || f.path, 'orphan_copy'::text
+            FROM unnest(v_files) f(path);
+    END LOOP;
+END
+$$ LANGUAGE plpgsql VOLATILE;
+
+REVOKE ALL ON FUNCTION dl_audit(regclass, bigint, bigint, integer, integer) FROM PUBLIC;
+
+-- Function used to find the files of the base directories that have been
+-- created, modified, replaced or deleted since the previous call. Only the
+-- base directories with the file scheme are crawled, p_dirname limits the
+-- search to one of them. The snapshot of the files is updated with the
+-- changes found unless p_update is false. The first call reports all the
+-- files as created.
+CREATE FUNCTION dl_changes(p_dirname text DEFAULT NULL, p_update boolean DEFAULT true)
+        RETURNS TABLE (dirname text, url text, change text) AS $$
+DECLARE
+    v_dir record;
+    v_excluded text[];
+    v_paths text[];
+    v_changes text[];
+    v_inos bigint[];
+    v_sizes bigint[];
+    v_mtimes timestamptz[];
+    v_ctimes timestamptz[];
+BEGIN
+    -- Working directories of the extension are not part of the snapshots
+    v_excluded := ARRAY[current_setting('datalink.dl_token_path', true),
+                        current_setting('datalink.dl_remote_cache_directory', true)];
+
+    FOR v_dir IN SELECT b.dirid, b.dirname, coalesce(nullif(rtrim(uri_get_path(b.base), '/'), ''), '/') AS path
+                 FROM pg_datalink_bases b
+                 WHERE uri_get_scheme(b.base) = 'file' AND (p_dirname IS NULL OR b.dirname = p_dirname)
+    LOOP
+        SELECT array_agg(coalesce(f.path, s.path)),
+               array_agg(CASE WHEN s.path IS NULL THEN 'created'
+                              WHEN f.path IS NULL THEN 'deleted'
+                              WHEN f.ino != s.ino THEN 'replaced'
+                              ELSE 'modified' END),
+               array_agg(f.ino), array_agg(f.size), array_agg(f.mtime), array_agg(f.ctime)
+            INTO v_paths, v_changes, v_inos, v_sizes, v_mtimes, v_ctimes
+            FROM datalink_scan_directory(v_dir.path, v_excluded || (rtrim(v_dir.path, '/') || '/.dlsnapshot')) f
+            FULL JOIN (SELECT * FROM pg_datalink_snapshots WHERE dirid = v_dir.dirid) s ON (s.path = f.path)
+            WHERE (f.ino, f.size, f.mtime, f.ctime) IS DISTINCT FROM (s.ino, s.size, s.mtime, s.ctime);
+
+        CONTINUE WHEN v_paths IS NULL;
+
+        RETURN QUERY SELECT v_dir.dirname, 'file://' || rtrim(v_dir.path, '/') || '/' || c.path, c.change
+            FROM unnest(v_paths, v_changes) c(path, change);
+
+        IF p_update THEN
+            DELETE FROM pg_datalink_snapshots s USING unnest(v_paths, v_changes) c(path, change)
+                WHERE s.dirid = v_dir.dirid AND s.path = c.path AND c.change = 'deleted';
+            INSERT INTO pg_datalink_snapshots
+                SELECT v_dir.dirid, c.path, c.ino, c.size, c.mtime, c.ctime
+                FROM unnest(v_paths, v_changes, v_inos, v_sizes, v_mtimes, v_ctimes) c(path, change, ino, size, mtime, ctime)
+                WHERE c.change != 'deleted'
+                ON CONFLICT (dirid, path) DO UPDATE SET ino = EXCLUDED.ino, size = EXCLUDED.size,
+                    mtime = EXCLUDED.mtime, ctime = EXCLUDED.ctime;
+        END IF;
+    END LOOP;
+END
+$$ LANGUAGE plpgsql VOLATILE;
+
+-- Function used to find the datalinks whose file has changed since the
+-- previous call of dl_changes(). The copies renamed with their token are
+-- matched with the datalinks of the original path holding this token. The
+-- datalinks are found through the index on their base and path, the cost
+-- depends on the number of changes, not on the size of the tables.
+CREATE FUNCTION dl_changed_links(p_dirname text DEFAULT NULL, p_update boolean DEFAULT true)
+        RETURNS TABLE (relid regclass, attname name, ctid tid, url text, change text) AS $$
+DECLARE
+    v_dirids integer[];
+    v_urls text[];
+    v_links text[];
+    v_tokens uuid[];
+    v_changes text[];
+    v_rel record;
+BEGIN
+    SELECT array_agg(b.dirid), array_agg(c.url),
+           array_agg(regexp_replace(c.url, '(/\.dl/[0-9a-f]{2}/[0-9a-f]{2})?/[0-9a-f-]{36};([^/]*)$', '/\2')),
+           array_agg(substring(c.url from '/([0-9a-f-]{36});[^/]*$')::uuid),
+           array_agg(c.change)
+        INTO v_dirids, v_urls, v_links, v_tokens, v_changes
+        FROM dl_changes(p_dirname, p_update) c JOIN pg_datalink_bases b ON (b.dirname = c.dirname);
+    IF v_urls IS NULL THEN
+        RETURN;
+    END IF;
+
+    FOR v_rel IN SELECT a.attrelid::regclass AS relid, a.attname FROM pg_attribute a
+                 JOIN pg_class r ON (r.oid = a.attrelid)
+                 WHERE a.atttypid = 'datalink'::regtype AND r.relkind = 'r'
+                 AND a.attnum > 0 AND NOT a.attisdropped
+    LOOP
+        RETURN QUERY EXECUTE format('SELECT %1$L::regclass, %2$L::name, t.ctid, c.url, c.change
+                FROM unnest($1, $2, $3, $4, $5) c(dirid, url, link, token, change)
+                JOIN pg_datalink_bases b ON (b.dirid = c.dirid)
+                JOIN %1$s t ON ((t.%2$I).dl_base = c.dirid AND (t.%2$I).dl_path = dl_relative_path(c.link::uri, b.base)::uri)
+                WHERE c.token IS NULL OR c.token IN ((t.%2$I).dl_token, (t.%2$I).dl_prev_token)',
+                v_rel.relid, v_rel.attname)
+            USING v_dirids, v_urls, v_links, v_tokens, v_changes;
+    END LOOP;
+END
+$$ LANGUAGE plpgsql VOLATILE;
+
+REVOKE ALL ON FUNCTION dl_changes(text, boolean) FROM PUBLIC;
+REVOKE ALL ON FUNCTION dl_changed_links(text, boolean) FROM PUBLIC;
+
+-- Function used to take a consistent backup of the files linked by the
+-- datalinks with link control of the base directories with the file scheme.
+-- New write tokens wait for the end of the transaction. Each file is hard
+-- linked in subdirectory .dlsnapshot/<label>/ of its base directory by
+-- datalink.dl_io_threads threads and recorded in the manifest. A hard link
+-- shares the changes made in place to the file, so the files of the base
+-- directories with WRITE PERMISSION FS, that other programs may modify, are
+-- copied instead. With p_incremental the files unchanged since the previous
+-- backup are not linked again, their entry refers to the link of the
+-- previous backup. Returns the number of files of the backup and of links
+-- or copies created.
+CREATE FUNCTION dl_snapshot_create(p_label text, p_incremental boolean DEFAULT true,
+        OUT files bigint, OUT linked bigint) AS $$
+DECLARE
+    v_parent text;
+    v_query text;
+    v_dirids integer[];
+    v_paths text[];
+    v_srcs text[];
+    v_dsts text[];
+    v_snapshots text[];
+    v_inos bigint[];
+    v_sizes bigint[];
+    v_mtimes timestamptz[];
+    v_copies boolean[];
+BEGIN
+    -- The label is a directory name
+    IF p_label !~ '^[A-Za-z0-9_][A-Za-z0-9_.-]*$' THEN
+        RAISE EXCEPTION 'invalid backup label "%"', p_label;
+    END IF;
+
+    -- Wait for the transactions that have issued write tokens
+    PERFORM pg_advisory_xact_lock(hashtext('datalink_snapshot'));
+
+    IF p_incremental THEN
+        SELECT label INTO v_parent FROM pg_datalink_backups ORDER BY created DESC, label DESC LIMIT 1;
+    END IF;
+    INSERT INTO pg_datalink_backups (label, parent) VALUES (p_label, v_parent);
+
+    files := 0;
+    linked := 0;
+
+    -- Same columns as the ones found by add_datalink_trigger()
+    SELECT string_agg(format('SELECT (t.%2$I).dl_base AS dirid, (t.%2$I).dl_path AS dl_path, (t.%2$I).dl_token AS token FROM %1$s t',
+                             a.attrelid::regclass, a.attname), ' UNION ALL ')
+        INTO v_query
+        FROM pg_attribute a JOIN pg_class r ON (r.oid = a.attrelid)
+        WHERE a.atttypid = 'datalink'::regtype AND r.relkind = 'r'
+        AND a.attnum > 0 AND NOT a.attisdropped;
+    IF v_query IS NULL THEN
+        RETURN;
+    END IF;
+
+    -- The file of a datalink renamed with its token is the one to link
+    EXECUTE format('SELECT array_agg(l.dirid), array_agg(l.path),
+            array_agg(CASE WHEN l.token IS NOT NULL THEN add_token_to_url(l.fullpath, l.token::text) ELSE l.fullpath END),
+            array_agg(l.basepath || ''/.dlsnapshot/'' || $1 || ''/'' || ltrim(l.path, ''/'')),
+            array_agg(m.snapshot), array_agg(m.ino), array_agg(m.size), array_agg(m.mtime),
+            array_agg(l.copy)
+        FROM (SELECT DISTINCT ON (d.dirid, d.dl_path::text) d.dirid, d.dl_path::text AS path, d.token,
+                uri_get_path(dl_url_rebase(d.dl_path, d.dirid)) AS fullpath,
+                rtrim(uri_get_path(b.base), ''/'') AS basepath, NOT b.writeperm AS copy
+            FROM (%s) d JOIN pg_datalink_bases b ON (b.dirid = d.dirid)
+            WHERE d.dl_path::text != '''' AND b.linkcontrol AND uri_get_scheme(b.base) = ''file'') l
+        LEFT JOIN pg_datalink_backup_files m ON (m.label = $2 AND m.dirid = l.dirid AND m.path = l.path)', v_query)
+        INTO v_dirids, v_paths, v_srcs, v_dsts, v_snapshots, v_inos, v_sizes, v_mtimes, v_copies
+        USING p_label, v_parent;
+    IF v_srcs IS NULL THEN
+        RETURN;
+    END IF;
+
+    INSERT INTO pg_datalink_backup_files
+        SELECT p_label, v_dirids[f.n], v_paths[f.n],
+               CASE WHEN f.linked THEN p_label ELSE v_snapshots[f.n] END,
+               f.ino, f.size, f.mtime
+        FROM datalink_link_files(v_srcs, v_dsts, v_inos, v_sizes, v_mtimes, v_copies) f;
+    GET DIAGNOSTICS files = ROW_COUNT;
+    SELECT count(*) INTO linked FROM pg_datalink_backup_files WHERE label = p_label AND snapshot = p_label;
+END
+$$ LANGUAGE plpgsql VOLATILE SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+
+REVOKE ALL ON FUNCTION dl_snapshot_create(text, boolean) FROM PUBLIC;
+REVOKE ALL ON FUNCTION datalink_link_files(text[], text[], bigint[], bigint[], timestamp with time zone[], boolean[]) FROM PUBLIC;
+
+-- Function used to store the accesses to the files recorded in shared
+-- memory into table pg_datalink_access. Returns the number of files.
+CREATE FUNCTION dl_access_flush() RETURNS bigint AS $$
+    WITH f AS (
+        INSERT INTO pg_datalink_access AS a SELECT * FROM datalink_access_flush()
+        ON CONFLICT (dev, ino) DO UPDATE SET last_access = greatest(a.last_access, EXCLUDED.last_access),
+            reads = a.reads + EXCLUDED.reads
+        RETURNING 1
+    )
+    SELECT count(*) FROM f;
+$$ LANGUAGE sql VOLATILE;
+
+REVOKE ALL ON FUNCTION dl_access_flush() FROM PUBLIC;
+
+-- Function used to move the linked files that have not been accessed nor
+-- modified for the tierafter interval of their base directory to its tier
+-- directory, at most p_limit files per call. The accesses recorded in
+-- shared memory are flushed first. Like dl_snapshot_create() it waits for
+-- the transactions that have issued write tokens and blocks new ones until
+-- it commits, and each file is checked again just before it is copied. The
+-- files are removed from the base directory at commit. Returns the number
+-- of files moved.
+CREATE FUNCTION dl_tier_migrate(p_dirname text DEFAULT NULL, p_limit integer DEFAULT 1000) RETURNS bigint AS $$
+DECLARE
+    v_dir record;
+    v_file record;
+    v_query text;
+    v_tierpath text;
+    v_count bigint := 0;
+BEGIN
+    -- A file written through a write token would be removed at commit
+    PERFORM pg_advisory_xact_lock(hashtext('datalink_snapshot'));
+
+    PERFORM dl_access_flush();
+
+    -- Same columns as the ones found by add_datalink_trigger()
+    SELECT string_agg(format('SELECT (t.%2$I).dl_base AS dirid, (t.%2$I).dl_path AS dl_path, (t.%2$I).dl_token AS token FROM %1$s t',
+                             a.attrelid::regclass, a.attname), ' UNION ALL ')
+        INTO v_query
+        FROM pg_attribute a JOIN pg_class r ON (r.oid = a.attrelid)
+        WHERE a.atttypid = 'datalink'::regtype AND r.relkind = 'r'
+        AND a.attnum > 0 AND NOT a.attisdropped;
+    IF v_query IS NULL THEN
+        RETURN 0;
+    END IF;
+
+    FOR v_dir IN SELECT b.dirid, rtrim(uri_get_path(b.base), '/') AS path, rtrim(b.tierdir, '/') AS tierdir,
+                        b.tierafter, b.tiercompress
+                 FROM pg_datalink_bases b
+                 WHERE b.tierdir IS NOT NULL AND b.tierafter IS NOT NULL AND b.linkcontrol
+                 AND uri_get_scheme(b.base) = 'file' AND (p_dirname IS NULL OR b.dirname = p_dirname)
+    LOOP
+        EXIT WHEN v_count >= p_limit;
+
+        -- The file of a datalink renamed with its token is the one to move
+        FOR v_file IN EXECUTE format('SELECT f.path, s.ino, s.size, s.mtime
+                FROM (SELECT DISTINCT CASE WHEN d.token IS NOT NULL
+                            THEN add_token_to_url(uri_get_path(dl_url_rebase(d.dl_path, d.dirid)), d.token::text)
+                            ELSE uri_get_path(dl_url_rebase(d.dl_path, d.dirid)) END AS path
+                    FROM (%s) d WHERE d.dirid = $1 AND d.dl_path::text != '''') f
+                CROSS JOIN LATERAL datalink_file_stat(f.path) s
+                LEFT JOIN pg_datalink_access a ON (a.dev = s.dev AND a.ino = s.ino)
+                WHERE s.ino IS NOT NULL
+                AND NOT EXISTS (SELECT 1 FROM pg_datalink_tiered t WHERE t.path = f.path)
+                AND greatest(s.mtime, a.last_access) < now() - $2
+                LIMIT $3', v_query)
+            USING v_dir.dirid, v_dir.tierafter, p_limit - v_count
+        LOOP
+            -- Skip the file if it has been read or replaced since the query
+            PERFORM dl_access_flush();
+            PERFORM 1 FROM datalink_file_stat(v_file.path) s
+                LEFT JOIN pg_datalink_access a ON (a.dev = s.dev AND a.ino = s.ino)
+                WHERE s.ino = v_file.ino AND s.size = v_file.size AND s.mtime = v_file.mtime
+                AND greatest(s.mtime, a.last_access) < now() - v_dir.tierafter;
+            CONTINUE WHEN NOT FOUND;
+
+            v_tierpath := v_dir.tierdir || substr(v_file.path, length(v_dir.path) + 1)
+                          || CASE WHEN v_dir.tiercompress THEN '.zst' ELSE '' END;
+            PERFORM datalink_tier_copy(v_file.path, v_tierpath,
+                                       CASE WHEN v_dir.tiercompress THEN 'compress' ELSE 'copy' END);
+            INSERT INTO pg_datalink_tiered (path, dirid, tierpath, size, compressed)
+                VALUES (v_file.path, v_dir.dirid, v_tierpath, v_file.size, v_dir.tiercompress);
+            PERFORM datalink_queue_unlink(ARRAY[v_file.path], ARRAY[NULL::text], false);
+            v_count := v_count + 1;
+        END LOOP;
+    END LOOP;
+
+    RETURN v_count;
+END
+$$ LANGUAGE plpgsql VOLATILE;
+
+REVOKE ALL ON FUNCTION dl_tier_migrate(text, integer) FROM PUBLIC;
+REVOKE ALL ON FUNCTION datalink_tier_copy(text, text, text) FROM PUBLIC;
+
+-- Function used to bring back a linked file moved to the tier directory of
+-- its base directory before it is accessed, and to record the access. The
+-- copy in the tier directory is removed at commit. Returns true when the
+-- file has been recalled. It is called by the functions giving access to
+-- the file for users that can not modify pg_datalink_tiered, only files of
+-- a directory with FILE LINK CONTROL are recalled.
+CREATE FUNCTION dl_tier_recall(datalink) RETURNS boolean AS $$
+DECLARE
+    v_path text;
+    v_tiered record;
+    v_recalled boolean := false;
+BEGIN
+    IF NOT EXISTS (SELECT 1 FROM pg_datalink_bases
+                   WHERE dirid = ($1).dl_base AND linkcontrol AND tierdir IS NOT NULL) THEN
+        RETURN false;
+    END IF;
+
+    SELECT uri_get_path(dl_url_rebase(($1).dl_path, ($1).dl_base)) INTO v_path;
+    IF ($1).dl_token IS NOT NULL THEN
+        v_path := add_token_to_url(v_path, (($1).dl_token)::text);
+    END IF;
+
+    IF EXISTS (SELECT 1 FROM pg_datalink_tiered WHERE path = v_path) THEN
+        -- Concurrent recalls of the file wait for the first one
+        DELETE FROM pg_datalink_tiered WHERE path = v_path RETURNING * INTO v_tiered;
+        IF v_tiered.path IS NOT NULL THEN
+            PERFORM datalink_tier_copy(v_tiered.tierpath, v_path,
+                                       CASE WHEN v_tiered.compressed THEN 'decompress' ELSE 'copy' END);
+            PERFORM datalink_queue_unlink(ARRAY[v_tiered.tierpath], ARRAY[NULL::text], false);
+            v_recalled := true;
+        END IF;
+    END IF;
+    PERFORM datalink_record_access(v_path);
+
+    RETURN v_recalled;
+END
+$$ LANGUAGE plpgsql STRICT SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+
+-- Function used by the functions changing the file referenced by a
+-- datalink to move its size between the live, copy and pending counters of
+-- its base directory. The counters can only be changed through it and the
+-- file functions, datalink_usage_move() itself is not granted to PUBLIC.
+CREATE FUNCTION dl_usage_move(p_path text, p_from text, p_to text) RETURNS boolean AS $$
+    SELECT datalink_usage_move(p_path, p_from, p_to);
+$$ LANGUAGE SQL STRICT SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+
+REVOKE ALL ON FUNCTION datalink_usage_move(text, text, text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION datalink_usage_counters(boolean) FROM PUBLIC;
+REVOKE ALL ON FUNCTION datalink_usage_set(integer, bigint, bigint, bigint, bigint, bigint, bigint) FROM PUBLIC;
+
+-- Function used to write the space used by the base directories, counted
+-- in shared memory, to table pg_datalink_usage. It is called every
+-- datalink.dl_usage_flush_interval seconds by a background worker when
+-- there are changes. Returns the number of base directories written.
+CREATE FUNCTION dl_usage_flush() RETURNS integer AS $$
+DECLARE
+    v_count integer;
+BEGIN
+    INSERT INTO pg_datalink_usage AS u (dirid, live_bytes, live_files, copy_bytes, copy_files,
+            pending_bytes, pending_files, updated)
+        SELECT c.dirid, c.live_bytes, c.live_files, c.copy_bytes, c.copy_files,
+            c.pending_bytes, c.pending_files, now()
+        FROM datalink_usage_counters(true) c
+        JOIN pg_datalink_bases b ON (b.dirid = c.dirid)
+        ON CONFLICT (dirid) DO UPDATE SET live_bytes = EXCLUDED.live_bytes,
+            live_files = EXCLUDED.live_files, copy_bytes = EXCLUDED.copy_bytes,
+            copy_files = EXCLUDED.copy_files, pending_bytes = EXCLUDED.pending_bytes,
+            pending_files = EXCLUDED.pending_files, updated = EXCLUDED.updated;
+    GET DIAGNOSTICS v_count = ROW_COUNT;
+
+    -- Base directories dropped since
+    DELETE FROM pg_datalink_usage u
+        WHERE NOT EXISTS (SELECT 1 FROM pg_datalink_bases b WHERE b.dirid = u.dirid);
+
+    RETURN v_count;
+END
+$$ LANGUAGE plpgsql VOLATILE;
+
+REVOKE ALL ON FUNCTION dl_usage_flush() FROM PUBLIC;
+
+-- Function used to get the space and the number of files used by the base
+-- directories with link control and write permission, or by the one named
+-- p_dirname, with their quotas. The counters kept in shared memory are
+-- returned when they are, the last ones flushed otherwise. It runs as the
+-- owner of the extension, datalink_usage_counters() is not granted to PUBLIC.
+CREATE FUNCTION dl_usage(p_dirname text DEFAULT NULL)
+        RETURNS TABLE (dirname text, live_bytes bigint, live_files bigint, copy_bytes bigint,
+                       copy_files bigint, pending_bytes bigint, pending_files bigint,
+                       maxbytes bigint, maxfiles bigint) AS $$
+    SELECT b.dirname, coalesce(c.live_bytes, u.live_bytes, 0), coalesce(c.live_files, u.live_files, 0),
+        coalesce(c.copy_bytes, u.copy_bytes, 0), coalesce(c.copy_files, u.copy_files, 0),
+        coalesce(c.pending_bytes, u.pending_bytes, 0), coalesce(c.pending_files, u.pending_files, 0),
+        b.maxbytes, b.maxfiles
+    FROM pg_datalink_bases b
+    LEFT JOIN datalink_usage_counters(false) c ON (c.dirid = b.dirid)
+    LEFT JOIN pg_datalink_usage u ON (u.dirid = b.dirid)
+    WHERE b.linkcontrol AND b.writeperm AND uri_get_scheme(b.base) = 'file'
+    AND (p_dirname IS NULL OR b.dirname = p_dirname)
+    ORDER BY b.dirname;
+$$ LANGUAGE SQL VOLATILE SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+
+-- Function used to count again the space used by the base directories with
+-- link control and write permission, or by the one named p_dirname, from
+-- the filesystem, when the counters have drifted after a crash or changes
+-- done outside of the extension. Files named with the current token of a
+-- datalink and the other files without token are live, files named with
+-- the previous token of a datalink and .old files are copies, and the
+-- .new files and the other files named with a token are pending. Returns
+-- the number of base directories counted.
+CREATE FUNCTION dl_usage_rebuild(p_dirname text DEFAULT NULL) RETURNS integer AS $$
+DECLARE
+    v_dir record;
+    v_query text;
+    v_excluded text[];
+    v_usage record;
+    v_count integer := 0;
+BEGIN
+    -- Same columns as the ones found by add_datalink_trigger()
+    SELECT string_agg(format('SELECT (t.%2$I).dl_base AS dirid, (t.%2$I).dl_token AS token, (t.%2$I).dl_prev_token AS prev_token FROM %1$s t',
+                             a.attrelid::regclass, a.attname), ' UNION ALL ')
+        INTO v_query
+        FROM pg_attribute a JOIN pg_class r ON (r.oid = a.attrelid)
+        WHERE a.atttypid = 'datalink'::regtype AND r.relkind = 'r'
+        AND a.attnum > 0 AND NOT a.attisdropped;
+    IF v_query IS NULL THEN
+        v_query := 'SELECT NULL::integer AS dirid, NULL::uuid AS token, NULL::uuid AS prev_token WHERE false';
+    END IF;
+
+    -- Working directories of the extension are not counted
+    v_excluded := ARRAY[current_setting('datalink.dl_token_path', true),
+                        current_setting('datalink.dl_remote_cache_directory', true)];
+
+    FOR v_dir IN SELECT b.dirid, coalesce(nullif(rtrim(uri_get_path(b.base), '/'), ''), '/') AS path
+                 FROM pg_datalink_bases b
+                 WHERE b.linkcontrol AND b.writeperm AND uri_get_scheme(b.base) = 'file'
+                 AND (p_dirname IS NULL OR b.dirname = p_dirname)
+    LOOP
+        EXECUTE format('WITH k AS (
+                SELECT d.token, min(d.kind) AS kind FROM (
+                    SELECT token, 0 AS kind FROM (%1$s) d WHERE d.dirid = $1 AND d.token IS NOT NULL
+                    UNION ALL
+                    SELECT prev_token, 1 FROM (%1$s) d WHERE d.dirid = $1 AND d.prev_token IS NOT NULL) d
+                GROUP BY d.token
+            ), f AS (
+                SELECT f.size, CASE WHEN f.path ~ ''\.new$'' THEN 2
+                                    WHEN f.path ~ ''\.old$'' THEN 1
+                                    WHEN t.token IS NULL THEN 0
+                                    ELSE coalesce(k.kind, 2) END AS kind
+                FROM datalink_scan_directory($2, $3) f
+                CROSS JOIN LATERAL (SELECT substring(f.path from ''([0-9a-f\-]{36});[^/]+$'')::uuid AS token) t
+                LEFT JOIN k ON (k.token = t.token)
+            )
+            SELECT coalesce(sum(size) FILTER (WHERE kind = 0), 0)::bigint AS live_bytes,
+                count(*) FILTER (WHERE kind = 0) AS live_files,
+                coalesce(sum(size) FILTER (WHERE kind = 1), 0)::bigint AS copy_bytes,
+                count(*) FILTER (WHERE kind = 1) AS copy_files,
+                coalesce(sum(size) FILTER (WHERE kind = 2), 0)::bigint AS pending_bytes,
+                count(*) FILTER (WHERE kind = 2) AS pending_files
+            FROM f', v_query)
+            INTO v_usage
+            USING v_dir.dirid, v_dir.path, v_excluded || (rtrim(v_dir.path, '/') || '/.dlsnapshot');
+
+        PERFORM datalink_usage_set(v_dir.dirid, v_usage.live_bytes, v_usage.live_files,
+                                   v_usage.copy_bytes, v_usage.copy_files,
+                                   v_usage.pending_bytes, v_usage.pending_files);
+        INSERT INTO pg_datalink_usage (dirid, live_bytes, live_files, copy_bytes, copy_files,
+                pending_bytes, pending_files, updated)
+            VALUES (v_dir.dirid, v_usage.live_bytes, v_usage.live_files, v_usage.copy_bytes,
+                v_usage.copy_files, v_usage.pending_bytes, v_usage.pending_files, now())
+            ON CONFLICT (dirid) DO UPDATE SET live_bytes = EXCLUDED.live_bytes,
+                live_files = EXCLUDED.live_files, copy_bytes = EXCLUDED.copy_bytes,
+                copy_files = EXCLUDED.copy_files, pending_bytes = EXCLUDED.pending_bytes,
+                pending_files = EXCLUDED.pending_files, updated = EXCLUDED.updated;
+        v_count := v_count + 1;
+    END LOOP;
+
+    RETURN v_count;
+END
+$$ LANGUAGE plpgsql VOLATILE SECURITY DEFINER SET search_path = @extschema@, pg_temp;
+
+REVOKE ALL ON FUNCTION dl_usage_rebuild(text) FROM PUBLIC;
+
+-- Function used to export the files referenced by the datalinks returned by
+-- a query, the datalink must be its first column, as a tar archive. It is
+-- returned as chunks of bytea to concatenate, the function must be called
+-- in the target list so that the archive is streamed to the client:
+--     SELECT dl_export('SELECT efile FROM dl_example');
+-- The archive can be compressed with zstd when PostgreSQL is built with it.
+CREATE FUNCTION dl_export(text, text DEFAULT 'none') RETURNS SETOF bytea
+    AS 'MODULE_PATHNAME', 'datalink_export' LANGUAGE C VOLATILE STRICT;
+
+-- Same as dl_export() but the archive is written into a server file, returns
+-- the size of the archive.
+CREATE FUNCTION dl_export_to_file(text, text, text DEFAULT 'none') RETURNS bigint
+    AS 'MODULE_PATHNAME', 'datalink_export_file' LANGUAGE C VOLATILE STRICT;
+
+REVOKE ALL ON FUNCTION dl_export(text, text) FROM PUBLIC;
+REVOKE ALL ON FUNCTION dl_export_to_file(text, text, text) FROM PUBLIC;
+
+----------------------------------------------------------------------------
+-- Conversion of the datalink columns of version 0.5.0, the text representation
+-- of the composite type is the one of the native type. The unique indexes of
+-- the columns are rebuilt on the accessors to the fields, then the triggers
+-- are created like add_datalink_trigger() does. A partition or an inherited
+-- column is converted with its parent.
+----------------------------------------------------------------------------
+DO $$
+DECLARE
+    r record;
+BEGIN
+    FOR r IN SELECT a.attrelid::regclass AS tbl, a.attname FROM pg_attribute a
+              WHERE a.atttypid = 'datalink_050'::regtype AND a.attinhcount = 0 AND NOT a.attisdropped
+                AND EXISTS (SELECT 1 FROM pg_class c WHERE c.oid = a.attrelid AND c.relkind IN ('r', 'p'))
+    LOOP
+        EXECUTE format('ALTER TABLE %s ALTER COLUMN %I TYPE datalink USING %I::text::datalink;', r.tbl, r.attname, r.attname);
+    END LOOP;
+
+    FOR r IN SELECT a.attrelid::regclass AS tbl, a.attname, c.relispartition FROM pg_attribute a JOIN pg_class c ON (c.oid = a.attrelid)
+              WHERE a.atttypid = 'datalink'::regtype AND NOT a.attisdropped AND c.relkind IN ('r', 'p')
+    LOOP
+        IF NOT r.relispartition THEN
+            EXECUTE format('CREATE TRIGGER "dltrg_%s_upd" AFTER UPDATE ON %s FOR EACH ROW WHEN (OLD.%s IS NOT NULL AND (NEW.%s IS NULL OR (NEW.%s).dl_path = '''')) EXECUTE FUNCTION dlunlink_row(%L);', r.attname, r.tbl, quote_ident(r.attname), quote_ident(r.attname), quote_ident(r.attname), r.attname);
+        END IF;
+        EXECUTE format('CREATE TRIGGER "dltrg_%s_del" AFTER DELETE ON %s REFERENCING OLD TABLE AS dl_old FOR EACH STATEMENT EXECUTE FUNCTION dlunlink_stmt(%L);', r.attname, r.tbl, r.attname);
+        EXECUTE format('CREATE TRIGGER "dltrg_%s_trunc" BEFORE TRUNCATE ON %s FOR EACH STATEMENT EXECUTE FUNCTION dlunlink_truncate(%L);', r.attname, r.tbl, r.attname);
+    END LOOP;
+END;
+$$;
+
+DROP TYPE datalink_050;